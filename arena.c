@@ -0,0 +1,130 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+/*
+ * Per-thread bump allocator for what only lives as long as one operation:
+ * parsed paths and the nodes built around them, reply buffers and scratch
+ * space.  An operation takes a mark on entry and releases it on exit, which
+ * frees everything allocated since at once.  Chunks are kept across
+ * releases, and a chunk too small for a request is replaced by a bigger one,
+ * so after the first few operations a thread allocates nothing from the heap.
+ */
+
+static const size_t k_alignment = 16;
+static const size_t k_initial_chunk_size = 64 * 1024;
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+    _Alignas(16) char data[];
+};
+
+/* Chunks after current are unused; used counts the bytes taken from current. */
+typedef struct {
+    ArenaChunk *first;
+    ArenaChunk *current;
+    size_t used;
+} Arena;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+
+static void free_chunks(ArenaChunk *chunk) {
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+static void free_arena(void *arena_ptr) {
+    Arena *arena = arena_ptr;
+    free_chunks(arena->first);
+    free(arena);
+}
+
+static void create_arena_key(void) {
+    const bool key_created = pthread_key_create(&arena_key, free_arena) == 0;
+    assert(key_created);
+}
+
+static Arena *thread_arena(void) {
+    pthread_once(&arena_once, create_arena_key);
+    Arena *arena = pthread_getspecific(arena_key);
+    if (arena == NULL) {
+        arena = calloc(1, sizeof(Arena));
+        assert(arena != NULL);
+        const bool set_successful = pthread_setspecific(arena_key, arena) == 0;
+        assert(set_successful);
+    }
+    return arena;
+}
+
+static ArenaChunk *new_chunk(size_t size) {
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    assert(chunk != NULL);
+    chunk->next = NULL;
+    chunk->size = size;
+    return chunk;
+}
+
+ArenaMark arena_mark(void) {
+    const Arena *arena = thread_arena();
+    return (ArenaMark) {.chunk = arena->current, .used = arena->used};
+}
+
+/* Frees everything allocated on this thread since mark was taken. */
+void arena_release(ArenaMark mark) {
+    Arena *arena = thread_arena();
+    arena->current = mark.chunk != NULL ? mark.chunk : arena->first;
+    arena->used = mark.chunk != NULL ? mark.used : 0;
+}
+
+void *arena_alloc(size_t size) {
+    Arena *arena = thread_arena();
+    size = (size + k_alignment - 1) & ~(k_alignment - 1);
+
+    if (arena->current == NULL) {
+        if (arena->first == NULL)
+            arena->first = new_chunk(size > k_initial_chunk_size ? size : k_initial_chunk_size);
+        arena->current = arena->first;
+        arena->used = 0;
+    }
+    while (arena->used + size > arena->current->size) {
+        ArenaChunk *next = arena->current->next;
+        if (next == NULL || next->size < size) {
+            free_chunks(next);
+            const size_t doubled_size = 2 * arena->current->size;
+            next = new_chunk(size > doubled_size ? size : doubled_size);
+            arena->current->next = next;
+        }
+        arena->current = next;
+        arena->used = 0;
+    }
+
+    void *allocation = arena->current->data + arena->used;
+    arena->used += size;
+    return allocation;
+}
+
+char *arena_strdup(const char *string) {
+    const size_t size = strlen(string) + 1;
+    char *copy = arena_alloc(size);
+    memcpy(copy, string, size);
+    return copy;
+}
+
+/* Frees the calling thread's arena now rather than when the thread exits. */
+void free_thread_arena(void) {
+    pthread_once(&arena_once, create_arena_key);
+    Arena *arena = pthread_getspecific(arena_key);
+    if (arena != NULL) {
+        pthread_setspecific(arena_key, NULL);
+        free_arena(arena);
+    }
+}
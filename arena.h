@@ -0,0 +1,20 @@
+#ifndef NOSTRFS_ARENA
+#define NOSTRFS_ARENA
+
+#include <stddef.h>
+
+typedef struct ArenaChunk ArenaChunk;
+
+/* A position in the calling thread's arena, to release back to. */
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+ArenaMark arena_mark(void);
+void arena_release(ArenaMark mark);
+void *arena_alloc(size_t size);
+char *arena_strdup(const char *string);
+void free_thread_arena(void);
+
+#endif
@@ -0,0 +1,772 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <sqlite3.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "corpus.h"
+#include "db.h"
+#include "known_ids.h"
+#include "node.h"
+#include "path.h"
+#include "synthetic_file.h"
+
+/*
+ * Microbenchmarks for nostrfs internals that do not need a mounted
+ * filesystem.
+ *
+ *     nostrfs_bench route [iterations]
+ *
+ * compares the compiled routing automaton with the recursive parent-chain
+ * matcher it replaced, checking that both agree on every sample path.
+ *
+ *     nostrfs_bench ops <db file> [events] [iterations]
+ *
+ * runs scripted workloads through the node layer the FUSE handlers call:
+ * ls -l sweeps of /e, random event stats, lookups and getattrs of files
+ * already looked up, tag tree walks, whole-file content reads, probes for
+ * names that do not exist and a storm of stats from several threads at once.  It reports ops/s,
+ * p50/p99 latency and heap allocations per operation.  An empty or missing
+ * database is first filled with the given number of events (default 10000)
+ * of the corpus nostrfs-generate writes.
+ *
+ * Allocations are counted by wrapping malloc, calloc, realloc and strdup at
+ * link time (see build.sh), so they cover nostrfs code but not SQLite.  Each
+ * thread counts its own.
+ */
+
+extern SyntheticFile files[];
+
+#define ID "0f8a3c9e5b7d1f2a4c6e8b0d2f4a6c8e0b2d4f6a8c0e2b4d6f8a0c2e4b6d8f0a"
+#define PK "7e7e9c42a91bfef19fa929e5fda1b72e0ebc1a4c1141673e2794234d86addf4e"
+
+static const char *k_route_sample_paths[] = {
+    "/",
+    "/e",
+    "/p",
+    "/e/" ID,
+    "/e/" ID "/content",
+    "/e/" ID "/tags/p/0/1",
+    "/p/" PK,
+    "/p/" PK "/kind",
+    "/p/" PK "/e/" ID "/pubkey",
+    "/p/" PK "/e/" ID "/tags/e/3/0",
+    "/p/" PK "/desktop.ini",
+    NULL
+};
+
+static const long k_default_route_iterations = 200000;
+static const long k_default_bench_events = 10000;
+static const long k_default_ops_iterations = 2000;
+static const unsigned long k_bench_cache_entries = 65536;
+static const int k_num_warm_files = 256;
+static const int k_max_sampled_ids = 65536;
+static const size_t k_readdir_size = 4096;
+static const size_t k_read_size = 131072;
+static const off_t k_large_content_size = 65536;
+static const int k_storm_threads = 8;
+
+/* The matcher path_to_file used before routes were compiled. */
+
+static bool legacy_file_matches_path(const SyntheticFile *file, Path path) {
+    if (file->parents == NULL) {
+        return is_root_path(path);
+    }
+    bool has_expected_parent = false;
+    for (int i = 0; i < file->num_parents && has_expected_parent == false; i++) {
+        has_expected_parent = legacy_file_matches_path(file->parents[i], dirpath(path));
+    }
+    return
+        has_expected_parent &&
+        ((file->filename == NULL) ? true : (strcmp(path_filename(path), file->filename) == 0));
+}
+
+static const SyntheticFile *legacy_find_file(FileTag tag) {
+    for (int i = 0; files[i].type != NULL_FILE_TYPE; i++) {
+        if (files[i].tag == tag)
+            return &files[i];
+    }
+    return NULL;
+}
+
+static const SyntheticFile *legacy_path_to_file(Path path) {
+    for (int i = 0; files[i].type != NULL_FILE_TYPE; i++) {
+        if (legacy_file_matches_path(&files[i], path)) {
+            return &files[i];
+        }
+    }
+    return NULL;
+}
+
+static const char *legacy_filename_from_path(FileTag tag, Path path) {
+    const SyntheticFile *file = legacy_find_file(tag);
+    if (is_root_path(path)) {
+        return NULL;
+    }
+    if (legacy_file_matches_path(file, path)) {
+        return path_filename(path);
+    }
+    else {
+        return legacy_filename_from_path(tag, dirpath(path));
+    }
+}
+
+static const SyntheticFile *legacy_route(Path path, PathCaptures *captures) {
+    captures->event_id = legacy_filename_from_path(EVENT_DIR_TAG, path);
+    captures->pubkey = legacy_filename_from_path(PUBKEY_DIR_TAG, path);
+    captures->tag_key = legacy_filename_from_path(TAG_KEY_DIR_TAG, path);
+    captures->tag_index = legacy_filename_from_path(TAG_DIR_TAG, path);
+    captures->tag_value_index = legacy_filename_from_path(TAG_VALUE_FILE_TAG, path);
+    return legacy_path_to_file(path);
+}
+
+static double elapsed_ns(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static bool same_capture(const char *a, const char *b) {
+    return (a == NULL && b == NULL) || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static bool same_captures(const PathCaptures *a, const PathCaptures *b) {
+    return
+        same_capture(a->event_id, b->event_id) &&
+        same_capture(a->pubkey, b->pubkey) &&
+        same_capture(a->tag_key, b->tag_key) &&
+        same_capture(a->tag_index, b->tag_index) &&
+        same_capture(a->tag_value_index, b->tag_value_index);
+}
+
+static int bench_route(long iterations) {
+    link_files();
+
+    int num_disagreements = 0;
+    printf("%-14s %10s %10s %8s  %s\n", "", "legacy ns", "route ns", "speedup", "path");
+    for (int i = 0; k_route_sample_paths[i] != NULL; i++) {
+        Path *path = parse_path(k_route_sample_paths[i]);
+
+        PathCaptures legacy_captures, captures;
+        const SyntheticFile *legacy_file = legacy_route(*path, &legacy_captures);
+        const SyntheticFile *file = route_path(*path, &captures);
+        if (legacy_file == NULL)
+            legacy_file = file->type == NULL_FILE_TYPE ? file : NULL;
+        if (legacy_file != file || (file->type != NULL_FILE_TYPE && !same_captures(&legacy_captures, &captures))) {
+            fprintf(stderr, "Matchers disagree on %s\n", k_route_sample_paths[i]);
+            num_disagreements++;
+        }
+
+        struct timespec start, end;
+        volatile const void *sink;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long j = 0; j < iterations; j++) {
+            sink = legacy_route(*path, &legacy_captures);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double legacy_ns = elapsed_ns(start, end) / iterations;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long j = 0; j < iterations; j++) {
+            sink = route_path(*path, &captures);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        const double route_ns = elapsed_ns(start, end) / iterations;
+        (void) sink;
+
+        const char *sample_path = k_route_sample_paths[i];
+        const size_t sample_path_length = strlen(sample_path);
+        printf(
+            "%-14s %10.1f %10.1f %7.1fx  %s%s\n",
+            "route",
+            legacy_ns,
+            route_ns,
+            legacy_ns / route_ns,
+            sample_path_length > 40 ? "..." : "",
+            sample_path_length > 40 ? sample_path + sample_path_length - 40 : sample_path
+        );
+        free_path(path);
+    }
+    return num_disagreements == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Picks the events each workload visits, the same ones on every run. */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static _Thread_local unsigned long num_heap_allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+char *__real_strdup(const char *string);
+
+void *__wrap_malloc(size_t size) {
+    num_heap_allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    num_heap_allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    num_heap_allocations++;
+    return __real_realloc(pointer, size);
+}
+
+char *__wrap_strdup(const char *string) {
+    num_heap_allocations++;
+    return __real_strdup(string);
+}
+
+/* Latency samples of one operation within one workload. */
+typedef struct {
+    const char *workload;
+    const char *operation;
+    long num_samples;
+    long capacity;
+    double *samples_ns;
+    double total_ns;
+    unsigned long num_heap_allocations;
+} OpStats;
+
+typedef struct {
+    struct timespec time;
+    unsigned long num_heap_allocations;
+} OpStart;
+
+static struct timespec now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time;
+}
+
+static OpStart start_op(void) {
+    return (OpStart) {.time = now(), .num_heap_allocations = num_heap_allocations};
+}
+
+static void add_sample(OpStats *stats, double sample_ns) {
+    if (stats->num_samples == stats->capacity) {
+        stats->capacity = stats->capacity == 0 ? 1024 : stats->capacity * 2;
+        stats->samples_ns = realloc(stats->samples_ns, stats->capacity * sizeof(double));
+        if (stats->samples_ns == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    stats->samples_ns[stats->num_samples++] = sample_ns;
+    stats->total_ns += sample_ns;
+}
+
+static void record_op(OpStats *stats, OpStart start) {
+    const double sample_ns = elapsed_ns(start.time, now());
+    stats->num_heap_allocations += num_heap_allocations - start.num_heap_allocations;
+    add_sample(stats, sample_ns);
+}
+
+static int compare_samples(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static void print_op_stats(OpStats *stats) {
+    if (stats->num_samples == 0)
+        return;
+    qsort(stats->samples_ns, stats->num_samples, sizeof(double), compare_samples);
+    printf(
+        "%-12s %-12s %9ld %12.0f %10.1f %10.1f %10.2f\n",
+        stats->workload,
+        stats->operation,
+        stats->num_samples,
+        stats->num_samples / (stats->total_ns / 1e9),
+        stats->samples_ns[stats->num_samples / 2] / 1e3,
+        stats->samples_ns[stats->num_samples * 99 / 100] / 1e3,
+        (double) stats->num_heap_allocations / stats->num_samples
+    );
+    free(stats->samples_ns);
+    stats->samples_ns = NULL;
+}
+
+/*
+ * Stands in for the FUSE reply buffer of a readdir call, charging each entry
+ * what fuse_add_direntry or fuse_add_direntry_plus would.  Plus listings look
+ * up and stat every entry, as nostrfs_readdirplus does, and keep the nodes
+ * so that they can be forgotten once the sweep is done.
+ */
+typedef struct {
+    Node *node;
+    bool plus;
+    size_t used;
+    int num_entries;
+    int num_children;
+    int children_capacity;
+    Node **children;
+} DirReply;
+
+static int add_bench_entry(void *reply_ptr, const char *name, off_t next_offset) {
+    (void) next_offset;
+    DirReply *reply = reply_ptr;
+
+    const size_t entry_size = ((reply->plus ? 152 : 24) + strlen(name) + 7) & ~(size_t) 7;
+    if (reply->used + entry_size > k_readdir_size)
+        return 1;
+
+    if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+        struct stat st;
+        if (reply->plus) {
+            Node *child = lookup_node(reply->node, name);
+            if (child == NULL || node_stat(child, &st) != 0)
+                return 0;
+            if (reply->num_children == reply->children_capacity) {
+                reply->children_capacity = reply->children_capacity == 0 ? 256 : reply->children_capacity * 2;
+                reply->children = realloc(reply->children, reply->children_capacity * sizeof(Node *));
+                if (reply->children == NULL) {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            reply->children[reply->num_children++] = child;
+        }
+        else if (peek_child(reply->node, name, &st) != 0) {
+            return 0;
+        }
+    }
+    reply->used += entry_size;
+    reply->num_entries++;
+    return 0;
+}
+
+/* Lists a directory one reply buffer at a time, recording each readdir call. */
+static int bench_list_dir(Node *dir, bool plus, OpStats *stats, DirReply *ret_reply) {
+    memset(ret_reply, 0, sizeof(DirReply));
+    ret_reply->node = dir;
+    ret_reply->plus = plus;
+
+    NodeDirHandle *handle = open_node_dir();
+    off_t offset = 0;
+    int num_entries = 0;
+    do {
+        ret_reply->used = 0;
+        ret_reply->num_entries = 0;
+        const OpStart start = start_op();
+        if (read_node_dir(dir, handle, offset, ret_reply, add_bench_entry) != 0)
+            break;
+        record_op(stats, start);
+        offset += ret_reply->num_entries;
+        num_entries += ret_reply->num_entries;
+    } while (ret_reply->num_entries > 0);
+    close_node_dir(handle);
+    return num_entries;
+}
+
+static void forget_children(DirReply *reply) {
+    for (int i = 0; i < reply->num_children; i++) {
+        forget_node(reply->children[i]->ino, 1);
+    }
+    free(reply->children);
+    reply->children = NULL;
+    reply->num_children = 0;
+}
+
+static Node *bench_lookup(Node *parent, const char *name, OpStats *stats) {
+    struct stat st;
+    const OpStart start = start_op();
+    Node *node = lookup_node(parent, name);
+    if (node != NULL && node_stat(node, &st) != 0) {
+        forget_node(node->ino, 1);
+        node = NULL;
+    }
+    record_op(stats, start);
+    return node;
+}
+
+/* Opens a file and reads it to the end in k_read_size chunks, as cat would. */
+static void bench_read_file(Node *file, char *buffer, OpStats *open_stats, OpStats *read_stats) {
+    NodeFileHandle *handle;
+    OpStart start = start_op();
+    if (open_node_file(file, &handle) != 0)
+        return;
+    record_op(open_stats, start);
+
+    off_t offset = 0;
+    size_t length;
+    do {
+        start = start_op();
+        if (read_node_file(handle, offset, k_read_size, buffer, &length) != 0)
+            break;
+        record_op(read_stats, start);
+        offset += length;
+    } while (length == k_read_size);
+    close_node_file(handle);
+}
+
+/* Walks /e/<id>/tags down to every tag value and reads each. */
+static void bench_walk_tags(
+    Node *event_dir, char *buffer, OpStats *readdir_stats, OpStats *lookup_stats, OpStats *open_stats, OpStats *read_stats
+) {
+    Node *tags_dir = bench_lookup(event_dir, "tags", lookup_stats);
+    if (tags_dir == NULL)
+        return;
+
+    DirReply keys;
+    bench_list_dir(tags_dir, true, readdir_stats, &keys);
+    for (int i = 0; i < keys.num_children; i++) {
+        DirReply indices;
+        bench_list_dir(keys.children[i], true, readdir_stats, &indices);
+        for (int j = 0; j < indices.num_children; j++) {
+            DirReply values;
+            bench_list_dir(indices.children[j], true, readdir_stats, &values);
+            for (int k = 0; k < values.num_children; k++) {
+                bench_read_file(values.children[k], buffer, open_stats, read_stats);
+            }
+            forget_children(&values);
+        }
+        forget_children(&indices);
+    }
+    forget_children(&keys);
+    forget_node(tags_dir->ino, 1);
+}
+
+/* Collects the event ids of a plain /e listing. */
+typedef struct {
+    int num_ids;
+    char (*ids)[65];
+} IdSample;
+
+static int add_sampled_id(void *sample_ptr, const char *name, off_t next_offset) {
+    (void) next_offset;
+    IdSample *sample = sample_ptr;
+
+    if (sample->num_ids == k_max_sampled_ids)
+        return 1;
+    if (strlen(name) == 64)
+        memcpy(sample->ids[sample->num_ids++], name, 65);
+    return 0;
+}
+
+static void sample_event_ids(Node *events_dir, IdSample *ret_sample) {
+    ret_sample->num_ids = 0;
+    ret_sample->ids = malloc(k_max_sampled_ids * sizeof(*ret_sample->ids));
+    if (ret_sample->ids == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    NodeDirHandle *handle = open_node_dir();
+    read_node_dir(events_dir, handle, 0, ret_sample, add_sampled_id);
+    close_node_dir(handle);
+}
+
+static bool is_large_content(Node *events_dir, const char *id) {
+    Node *event_dir = lookup_node(events_dir, id);
+    if (event_dir == NULL)
+        return false;
+    struct stat st;
+    Node *content = lookup_node(event_dir, "content");
+    const bool is_large = content != NULL && node_stat(content, &st) == 0 && st.st_size > k_large_content_size;
+    if (content != NULL)
+        forget_node(content->ino, 1);
+    forget_node(event_dir->ino, 1);
+    return is_large;
+}
+
+enum { READDIRPLUS_OP, READDIR_OP, LOOKUP_OP, GETATTR_OP, OPEN_OP, READ_OP, NUM_OPS };
+
+static const char *k_op_names[NUM_OPS] = {"readdirplus", "readdir", "lookup", "getattr", "open", "read"};
+
+static void init_workload(OpStats *op_stats, const char *workload) {
+    memset(op_stats, 0, NUM_OPS * sizeof(OpStats));
+    for (int i = 0; i < NUM_OPS; i++) {
+        op_stats[i].workload = workload;
+        op_stats[i].operation = k_op_names[i];
+    }
+}
+
+static void print_workload(OpStats *op_stats) {
+    for (int i = 0; i < NUM_OPS; i++) {
+        print_op_stats(&op_stats[i]);
+    }
+}
+
+/* One thread of a stat storm: stats random event directories and their content files. */
+typedef struct {
+    Node *events_dir;
+    const IdSample *sample;
+    long iterations;
+    uint64_t state;
+    OpStats op_stats[NUM_OPS];
+} StormThread;
+
+static void *run_storm_thread(void *thread_ptr) {
+    StormThread *thread = thread_ptr;
+    init_workload(thread->op_stats, "storm");
+    for (long i = 0; i < thread->iterations; i++) {
+        const char *id = thread->sample->ids[next_random(&thread->state) % thread->sample->num_ids];
+        Node *event_dir = bench_lookup(thread->events_dir, id, &thread->op_stats[LOOKUP_OP]);
+        if (event_dir == NULL)
+            continue;
+        Node *content = bench_lookup(event_dir, "content", &thread->op_stats[LOOKUP_OP]);
+        if (content != NULL)
+            forget_node(content->ino, 1);
+        forget_node(event_dir->ino, 1);
+    }
+    free_thread_arena();
+    return NULL;
+}
+
+/*
+ * Stats from k_storm_threads threads at once, as parallel ls -l or find
+ * runs make, starting from cold attribute and event record caches.  Ops/s
+ * is over wall time, so it is the throughput of all threads together.
+ */
+static void bench_storm(Node *events_dir, const IdSample *sample, long iterations, OpStats *ret_op_stats) {
+    StormThread *threads = calloc(k_storm_threads, sizeof(StormThread));
+    pthread_t *thread_ids = malloc(k_storm_threads * sizeof(pthread_t));
+    if (threads == NULL || thread_ids == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    cache_clear();
+    forget_event_records();
+
+    const struct timespec start = now();
+    for (int i = 0; i < k_storm_threads; i++) {
+        threads[i] = (StormThread) {.events_dir = events_dir, .sample = sample, .iterations = iterations, .state = 3 + i};
+        if (pthread_create(&thread_ids[i], NULL, run_storm_thread, &threads[i]) != 0) {
+            fprintf(stderr, "Failed to start storm thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < k_storm_threads; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+    const double wall_ns = elapsed_ns(start, now());
+
+    init_workload(ret_op_stats, "storm");
+    for (int op = 0; op < NUM_OPS; op++) {
+        OpStats *stats = &ret_op_stats[op];
+        for (int i = 0; i < k_storm_threads; i++) {
+            const OpStats *thread_stats = &threads[i].op_stats[op];
+            for (long j = 0; j < thread_stats->num_samples; j++) {
+                add_sample(stats, thread_stats->samples_ns[j]);
+            }
+            stats->num_heap_allocations += thread_stats->num_heap_allocations;
+            free(thread_stats->samples_ns);
+        }
+        stats->total_ns = wall_ns;
+    }
+    free(thread_ids);
+    free(threads);
+}
+
+static int bench_ops(const char *db_file_path, long num_events, long iterations) {
+    sqlite3 *db;
+    if (sqlite3_open(db_file_path, &db) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open database file \"%s\": %s\n", db_file_path, sqlite3_errmsg(db));
+        return EXIT_FAILURE;
+    }
+    initialize_db(db_file_path);
+    if (latest_event_rowid() == 0) {
+        fprintf(stderr, "Generating %ld events in %s\n", num_events, db_file_path);
+        const CorpusOptions options = {.num_events = num_events, .num_authors = DEFAULT_CORPUS_AUTHORS, .seed = 1};
+        CorpusStats stats;
+        generate_corpus(db, &options, &stats);
+    }
+    sqlite3_close(db);
+    initialize_known_ids();
+    initialize_cache(k_bench_cache_entries);
+    link_files();
+    initialize_nodes();
+
+    Node *events_dir = lookup_node(get_node(ROOT_NODE_INO), "e");
+    IdSample sample;
+    sample_event_ids(events_dir, &sample);
+    if (sample.num_ids == 0) {
+        fprintf(stderr, "No events in %s\n", db_file_path);
+        return EXIT_FAILURE;
+    }
+    int *large_ids = malloc(sample.num_ids * sizeof(int));
+    int num_large_ids = 0;
+    if (large_ids == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < sample.num_ids; i++) {
+        if (is_large_content(events_dir, sample.ids[i]))
+            large_ids[num_large_ids++] = i;
+    }
+    char *buffer = malloc(k_read_size);
+    if (buffer == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-12s %-12s %9s %12s %10s %10s %10s\n", "workload", "op", "count", "ops/s", "p50 us", "p99 us", "allocs/op");
+    uint64_t state = 2;
+    OpStats op_stats[NUM_OPS];
+
+    /* The first sweep fills the listing cache; the rest are served from it. */
+    init_workload(op_stats, "ls -l /e");
+    for (int i = 0; i < 3; i++) {
+        DirReply reply;
+        bench_list_dir(events_dir, true, &op_stats[READDIRPLUS_OP], &reply);
+        forget_children(&reply);
+    }
+    print_workload(op_stats);
+
+    init_workload(op_stats, "stat");
+    for (long i = 0; i < iterations; i++) {
+        Node *event_dir = bench_lookup(events_dir, sample.ids[next_random(&state) % sample.num_ids], &op_stats[LOOKUP_OP]);
+        if (event_dir == NULL)
+            continue;
+        Node *content = bench_lookup(event_dir, "content", &op_stats[LOOKUP_OP]);
+        if (content != NULL)
+            forget_node(content->ino, 1);
+        forget_node(event_dir->ino, 1);
+    }
+    print_workload(op_stats);
+
+    /*
+     * Lookups and getattrs of files the kernel already holds, as most are
+     * in steady state.  These should make no heap allocations at all.
+     */
+    Node **warm_files = malloc(k_num_warm_files * sizeof(Node *));
+    int num_warm_files = 0;
+    if (warm_files == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < sample.num_ids && num_warm_files < k_num_warm_files; i++) {
+        Node *event_dir = lookup_node(events_dir, sample.ids[i]);
+        if (event_dir == NULL)
+            continue;
+        Node *content = lookup_node(event_dir, "content");
+        struct stat st;
+        if (content != NULL && node_stat(content, &st) == 0) {
+            warm_files[num_warm_files++] = content;
+            continue;
+        }
+        if (content != NULL)
+            forget_node(content->ino, 1);
+        forget_node(event_dir->ino, 1);
+    }
+    init_workload(op_stats, "warm");
+    for (long i = 0; i < iterations && num_warm_files > 0; i++) {
+        Node *content = warm_files[next_random(&state) % num_warm_files];
+        Node *event_dir = bench_lookup(events_dir, content->captures.event_id, &op_stats[LOOKUP_OP]);
+        Node *relooked = bench_lookup(event_dir, "content", &op_stats[LOOKUP_OP]);
+        forget_node(relooked->ino, 1);
+        forget_node(event_dir->ino, 1);
+
+        struct stat st;
+        const OpStart start = start_op();
+        node_stat(content, &st);
+        record_op(&op_stats[GETATTR_OP], start);
+    }
+    print_workload(op_stats);
+    for (int i = 0; i < num_warm_files; i++) {
+        Node *event_dir = lookup_node(events_dir, warm_files[i]->captures.event_id);
+        forget_node(warm_files[i]->ino, 1);
+        forget_node(event_dir->ino, 2);
+    }
+    free(warm_files);
+
+    init_workload(op_stats, "tags");
+    for (long i = 0; i < iterations; i++) {
+        Node *event_dir = lookup_node(events_dir, sample.ids[next_random(&state) % sample.num_ids]);
+        if (event_dir == NULL)
+            continue;
+        bench_walk_tags(event_dir, buffer, &op_stats[READDIRPLUS_OP], &op_stats[LOOKUP_OP], &op_stats[OPEN_OP], &op_stats[READ_OP]);
+        forget_node(event_dir->ino, 1);
+    }
+    print_workload(op_stats);
+
+    init_workload(op_stats, "large read");
+    for (long i = 0; i < iterations && num_large_ids > 0; i++) {
+        Node *event_dir = lookup_node(events_dir, sample.ids[large_ids[next_random(&state) % num_large_ids]]);
+        if (event_dir == NULL)
+            continue;
+        Node *content = bench_lookup(event_dir, "content", &op_stats[LOOKUP_OP]);
+        if (content != NULL) {
+            bench_read_file(content, buffer, &op_stats[OPEN_OP], &op_stats[READ_OP]);
+            forget_node(content->ino, 1);
+        }
+        forget_node(event_dir->ino, 1);
+    }
+    print_workload(op_stats);
+
+    /* What shells and file managers look for: none of these exist. */
+    init_workload(op_stats, "probe");
+    for (long i = 0; i < iterations; i++) {
+        char missing_id[65];
+        memcpy(missing_id, sample.ids[next_random(&state) % sample.num_ids], sizeof(missing_id));
+        missing_id[63] = missing_id[63] == '0' ? '1' : '0';
+        char uppercase_id[65];
+        memcpy(uppercase_id, missing_id, sizeof(uppercase_id));
+        uppercase_id[0] = 'A';
+        const char *names[] = {missing_id, uppercase_id, ".git", "desktop.ini"};
+        for (size_t j = 0; j < sizeof(names) / sizeof(names[0]); j++) {
+            Node *node = bench_lookup(events_dir, names[j], &op_stats[LOOKUP_OP]);
+            if (node != NULL)
+                forget_node(node->ino, 1);
+        }
+    }
+    print_workload(op_stats);
+
+    const EventRecordStats records_before = event_record_stats();
+    bench_storm(events_dir, &sample, iterations, op_stats);
+    print_workload(op_stats);
+    const EventRecordStats records = event_record_stats();
+    const unsigned long batches = records.batches - records_before.batches;
+    const unsigned long batched = records.batched - records_before.batched;
+    printf(
+        "%-12s %lu record misses, %lu shared, %lu fetched in %lu queries (mean batch %.2f)\n",
+        "storm",
+        records.misses - records_before.misses,
+        records.shared - records_before.shared,
+        batched,
+        batches,
+        batches > 0 ? (double) batched / batches : 0.0
+    );
+
+    free(buffer);
+    free(large_ids);
+    free(sample.ids);
+    forget_node(events_dir->ino, 1);
+    free_nodes();
+    free_cache();
+    free_known_ids();
+    close_db();
+    free_thread_arena();
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    const char *benchmark = argc > 1 ? argv[1] : "route";
+
+    if (strcmp(benchmark, "route") == 0) {
+        const long iterations = argc > 2 ? atol(argv[2]) : k_default_route_iterations;
+        return bench_route(iterations);
+    }
+    if (strcmp(benchmark, "ops") == 0 && argc > 2) {
+        const long num_events = argc > 3 ? atol(argv[3]) : k_default_bench_events;
+        const long iterations = argc > 4 ? atol(argv[4]) : k_default_ops_iterations;
+        return bench_ops(argv[2], num_events, iterations);
+    }
+
+    fprintf(stderr, "usage: %s route [iterations]\n", argv[0]);
+    fprintf(stderr, "       %s ops <db file> [events] [iterations]\n", argv[0]);
+    return EXIT_FAILURE;
+}
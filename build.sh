@@ -1,2 +1,10 @@
 #!/bin/bash
-gcc db.c path.c nostrFs.c synthetic_file.c -O0 -fsanitize=address -fsanitize=leak -fsanitize=undefined -Wall -Wextra -Wpedantic -Werror -D_FILE_OFFSET_BITS=64 -g -o nostrfs `pkg-config fuse --cflags --libs` -lsqlite3
\ No newline at end of file
+CFLAGS="-O0 -fsanitize=address -fsanitize=leak -fsanitize=undefined -Wall -Wextra -Wpedantic -Werror -D_FILE_OFFSET_BITS=64 -g"
+gcc arena.c cache.c db.c hex.c json.c known_ids.c node.c path.c snapshot.c nostrFs.c stats.c synthetic_file.c watch.c $CFLAGS -o nostrfs `pkg-config fuse3 libzstd --cflags --libs` -lsqlite3 -pthread
+gcc arena.c cache.c db.c event.c hex.c json.c known_ids.c node.c path.c snapshot.c snapshot_writer.c stats.c synthetic_file.c watch.c db.test.c $CFLAGS -o db_test `pkg-config libzstd --cflags --libs` -lsqlite3 -pthread
+gcc arena.c cache.c corpus.c db.c hex.c json.c known_ids.c node.c path.c snapshot.c stats.c synthetic_file.c bench.c -O2 -Wall -Wextra -Wpedantic -Werror -D_FILE_OFFSET_BITS=64 -g -o nostrfs_bench `pkg-config libzstd --cflags --libs` -lsqlite3 -pthread -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=strdup
+gcc arena.c cache.c db.c event.c hex.c json.c path.c snapshot.c stats.c synthetic_file.c import.c $CFLAGS -o nostrfs-import `pkg-config libsecp256k1 libcrypto libzstd --cflags --libs` -lsqlite3 -pthread
+gcc arena.c cache.c db.c hex.c json.c path.c snapshot.c stats.c synthetic_file.c compress.c $CFLAGS -o nostrfs-compress `pkg-config libzstd --cflags --libs` -lsqlite3 -pthread
+gcc arena.c cache.c db.c hex.c json.c path.c snapshot.c stats.c synthetic_file.c rekey.c $CFLAGS -o nostrfs-rekey `pkg-config libzstd --cflags --libs` -lsqlite3 -pthread
+gcc arena.c cache.c db.c hex.c json.c path.c snapshot.c snapshot_writer.c stats.c synthetic_file.c pack.c $CFLAGS -o nostrfs-pack `pkg-config libzstd --cflags --libs` -lsqlite3 -pthread
+gcc arena.c cache.c corpus.c db.c hex.c json.c path.c snapshot.c stats.c synthetic_file.c generate.c $CFLAGS -o nostrfs-generate `pkg-config libzstd --cflags --libs` -lsqlite3 -pthread
@@ -0,0 +1,377 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "arena.h"
+#include "cache.h"
+
+/*
+ * Bounded LRU cache of getattr results and directory listings, keyed by the
+ * canonical path of a node.  Events are immutable, so entries stay valid
+ * until the database gains new events; callers that ingest events invalidate
+ * the affected paths.  The cache is split into shards, each with its own lock
+ * and LRU list, so worker threads rarely contend.
+ */
+
+#define NUM_SHARDS 16
+
+static const int k_max_cached_dir_entries = 1024;
+
+typedef enum {
+    ATTR_ENTRY,
+    DIR_ENTRY
+} CacheEntryKind;
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry {
+    CacheEntry *hash_next;
+    CacheEntry *lru_prev;
+    CacheEntry *lru_next;
+    uint64_t hash;
+    CacheEntryKind kind;
+    struct stat st;
+    int num_names;
+    char *names;
+    char key[];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheEntry **buckets;
+    unsigned long num_buckets;
+    CacheEntry *lru_head;
+    CacheEntry *lru_tail;
+    unsigned long num_entries;
+    unsigned long max_entries;
+} CacheShard;
+
+struct DirListing {
+    void *buffer;
+    DirEntryFiller filler;
+    int num_names;
+    size_t names_length;
+    size_t names_capacity;
+    char *names;
+    bool overflowed;
+};
+
+static CacheShard shards[NUM_SHARDS];
+static bool cache_enabled = false;
+
+static atomic_ulong attr_hits;
+static atomic_ulong attr_misses;
+static atomic_ulong dir_hits;
+static atomic_ulong dir_misses;
+static atomic_ulong evictions;
+
+static uint64_t hash_key(const char *key, CacheEntryKind kind) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = key; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash ^ kind;
+}
+
+static CacheShard *shard_for_hash(uint64_t hash) {
+    return &shards[(hash >> 32) % NUM_SHARDS];
+}
+
+void initialize_cache(unsigned long max_entries) {
+    const unsigned long max_shard_entries = max_entries / NUM_SHARDS + 1;
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->num_buckets = max_shard_entries;
+        shard->buckets = calloc(shard->num_buckets, sizeof(CacheEntry *));
+        assert(shard->buckets != NULL);
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        shard->num_entries = 0;
+        shard->max_entries = max_shard_entries;
+    }
+    cache_enabled = max_entries > 0;
+}
+
+static void lru_unlink(CacheShard *shard, CacheEntry *entry) {
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_head = entry->lru_next;
+
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_tail = entry->lru_prev;
+}
+
+static void lru_push_front(CacheShard *shard, CacheEntry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL)
+        shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if (shard->lru_tail == NULL)
+        shard->lru_tail = entry;
+}
+
+static CacheEntry **find_slot(CacheShard *shard, const char *key, uint64_t hash, CacheEntryKind kind) {
+    CacheEntry **slot = &shard->buckets[hash % shard->num_buckets];
+    while (*slot != NULL) {
+        if ((*slot)->hash == hash && (*slot)->kind == kind && strcmp((*slot)->key, key) == 0)
+            break;
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+static void remove_entry(CacheShard *shard, CacheEntry **slot) {
+    CacheEntry *entry = *slot;
+    *slot = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->num_entries--;
+    free(entry->names);
+    free(entry);
+}
+
+static void evict_oldest(CacheShard *shard) {
+    CacheEntry *oldest = shard->lru_tail;
+    CacheEntry **slot = find_slot(shard, oldest->key, oldest->hash, oldest->kind);
+    assert(*slot == oldest);
+    remove_entry(shard, slot);
+    atomic_fetch_add(&evictions, 1);
+}
+
+/*
+ * Looks up an entry and marks it most recently used.  Returns with the shard
+ * locked when an entry is found so the caller can copy it out.
+ */
+static CacheEntry *lookup_locked(const char *key, CacheEntryKind kind, CacheShard **ret_shard) {
+    const uint64_t hash = hash_key(key, kind);
+    CacheShard *shard = shard_for_hash(hash);
+    pthread_mutex_lock(&shard->lock);
+
+    CacheEntry *entry = *find_slot(shard, key, hash, kind);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    lru_unlink(shard, entry);
+    lru_push_front(shard, entry);
+    *ret_shard = shard;
+    return entry;
+}
+
+static void insert(const char *key, CacheEntryKind kind, CacheEntry *new_entry) {
+    const uint64_t hash = hash_key(key, kind);
+    CacheShard *shard = shard_for_hash(hash);
+    new_entry->hash = hash;
+    new_entry->kind = kind;
+
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry **slot = find_slot(shard, key, hash, kind);
+    if (*slot != NULL)
+        remove_entry(shard, slot);
+    if (shard->num_entries >= shard->max_entries)
+        evict_oldest(shard);
+
+    slot = &shard->buckets[hash % shard->num_buckets];
+    new_entry->hash_next = *slot;
+    *slot = new_entry;
+    lru_push_front(shard, new_entry);
+    shard->num_entries++;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static CacheEntry *new_entry(const char *key) {
+    const size_t key_size = strlen(key) + 1;
+    CacheEntry *entry = calloc(1, sizeof(CacheEntry) + key_size);
+    assert(entry != NULL);
+    memcpy(entry->key, key, key_size);
+    return entry;
+}
+
+bool cache_get_attr(const char *path, struct stat *ret_st) {
+    if (!cache_enabled)
+        return false;
+
+    CacheShard *shard;
+    CacheEntry *entry = lookup_locked(path, ATTR_ENTRY, &shard);
+    if (entry == NULL) {
+        atomic_fetch_add(&attr_misses, 1);
+        return false;
+    }
+    *ret_st = entry->st;
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add(&attr_hits, 1);
+    return true;
+}
+
+void cache_put_attr(const char *path, const struct stat *st) {
+    if (!cache_enabled)
+        return;
+
+    CacheEntry *entry = new_entry(path);
+    entry->st = *st;
+    insert(path, ATTR_ENTRY, entry);
+}
+
+/*
+ * Continues a listing from the cache, starting after the entries the cursor
+ * has already passed.  The cursor advances exactly as a SQL-backed fill
+ * would, so a later call can fall back to the database if the entry is
+ * evicted in between.  The remaining names are copied out before filling,
+ * since a readdirplus filler looks up each child and so uses the cache.
+ */
+bool cache_fill_dir(const char *path, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (!cache_enabled)
+        return false;
+
+    CacheShard *shard;
+    CacheEntry *entry = lookup_locked(path, DIR_ENTRY, &shard);
+    if (entry == NULL) {
+        atomic_fetch_add(&dir_misses, 1);
+        return false;
+    }
+    const ArenaMark mark = arena_mark();
+    const char *name = entry->names;
+    int i;
+    for (i = 0; i < entry->num_names && i < cursor->position; i++) {
+        name += strlen(name) + 1;
+    }
+    const int num_names = entry->num_names - i;
+    const char *names_end = name;
+    for (int j = 0; j < num_names; j++) {
+        names_end += strlen(names_end) + 1;
+    }
+    char *names = arena_alloc(names_end - name + 1);
+    memcpy(names, name, names_end - name);
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add(&dir_hits, 1);
+
+    name = names;
+    for (i = 0; i < num_names; i++) {
+        if (filler(buffer, name) != 0)
+            break;
+        advance_dir_cursor(cursor, name);
+        name += strlen(name) + 1;
+    }
+    cursor->done = i == num_names;
+    arena_release(mark);
+    return true;
+}
+
+DirListing *start_dir_listing(void *buffer, DirEntryFiller filler) {
+    DirListing *listing = calloc(1, sizeof(DirListing));
+    assert(listing != NULL);
+    listing->buffer = buffer;
+    listing->filler = filler;
+    return listing;
+}
+
+/*
+ * A DirEntryFiller that forwards every entry to the real filler and keeps a
+ * copy of the names it accepted, up to a bound, so small listings can be
+ * cached once they have been read to the end.
+ */
+int record_dir_entry(void *listing_ptr, const char *name) {
+    DirListing *listing = listing_ptr;
+
+    const int fill_status = listing->filler(listing->buffer, name);
+    if (fill_status != 0 || !cache_enabled || listing->overflowed)
+        return fill_status;
+
+    const size_t name_size = strlen(name) + 1;
+    if (listing->num_names >= k_max_cached_dir_entries) {
+        listing->overflowed = true;
+    }
+    else {
+        if (listing->names_length + name_size > listing->names_capacity) {
+            listing->names_capacity = (listing->names_capacity + name_size) * 2;
+            listing->names = realloc(listing->names, listing->names_capacity);
+            assert(listing->names != NULL);
+        }
+        memcpy(listing->names + listing->names_length, name, name_size);
+        listing->names_length += name_size;
+        listing->num_names++;
+    }
+    return 0;
+}
+
+void set_dir_listing_target(DirListing *listing, void *buffer, DirEntryFiller filler) {
+    listing->buffer = buffer;
+    listing->filler = filler;
+}
+
+void finish_dir_listing(const char *path, DirListing *listing, bool cacheable) {
+    if (cache_enabled && cacheable && !listing->overflowed) {
+        CacheEntry *entry = new_entry(path);
+        entry->num_names = listing->num_names;
+        entry->names = listing->names;
+        listing->names = NULL;
+        insert(path, DIR_ENTRY, entry);
+    }
+    free(listing->names);
+    free(listing);
+}
+
+static void invalidate_kind(const char *path, CacheEntryKind kind) {
+    const uint64_t hash = hash_key(path, kind);
+    CacheShard *shard = shard_for_hash(hash);
+    pthread_mutex_lock(&shard->lock);
+    CacheEntry **slot = find_slot(shard, path, hash, kind);
+    if (*slot != NULL)
+        remove_entry(shard, slot);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void cache_invalidate(const char *path) {
+    if (!cache_enabled)
+        return;
+
+    invalidate_kind(path, ATTR_ENTRY);
+    invalidate_kind(path, DIR_ENTRY);
+}
+
+void cache_clear(void) {
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        CacheShard *shard = &shards[i];
+        pthread_mutex_lock(&shard->lock);
+        for (unsigned long j = 0; j < shard->num_buckets; j++) {
+            while (shard->buckets[j] != NULL)
+                remove_entry(shard, &shard->buckets[j]);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+void free_cache(void) {
+    cache_clear();
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        free(shards[i].buckets);
+        shards[i].buckets = NULL;
+        pthread_mutex_destroy(&shards[i].lock);
+    }
+    cache_enabled = false;
+}
+
+CacheStats cache_stats(void) {
+    CacheStats stats = {
+        .attr_hits = atomic_load(&attr_hits),
+        .attr_misses = atomic_load(&attr_misses),
+        .dir_hits = atomic_load(&dir_hits),
+        .dir_misses = atomic_load(&dir_misses),
+        .evictions = atomic_load(&evictions),
+        .num_entries = 0
+    };
+    for (int i = 0; i < NUM_SHARDS; i++) {
+        pthread_mutex_lock(&shards[i].lock);
+        stats.num_entries += shards[i].num_entries;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+    return stats;
+}
@@ -0,0 +1,36 @@
+#ifndef NOSTRFS_CACHE
+#define NOSTRFS_CACHE
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "synthetic_file.h"
+
+typedef struct {
+    unsigned long attr_hits;
+    unsigned long attr_misses;
+    unsigned long dir_hits;
+    unsigned long dir_misses;
+    unsigned long evictions;
+    unsigned long num_entries;
+} CacheStats;
+
+typedef struct DirListing DirListing;
+
+void initialize_cache(unsigned long max_entries);
+void free_cache(void);
+
+bool cache_get_attr(const char *path, struct stat *ret_st);
+void cache_put_attr(const char *path, const struct stat *st);
+
+bool cache_fill_dir(const char *path, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+DirListing *start_dir_listing(void *buffer, DirEntryFiller filler);
+int record_dir_entry(void *listing, const char *name);
+void set_dir_listing_target(DirListing *listing, void *buffer, DirEntryFiller filler);
+void finish_dir_listing(const char *path, DirListing *listing, bool cacheable);
+
+void cache_invalidate(const char *path);
+void cache_clear(void);
+CacheStats cache_stats(void);
+
+#endif
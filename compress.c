@@ -0,0 +1,263 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+#include <zstd.h>
+#include <zdict.h>
+
+#include "db.h"
+
+/*
+ * Compresses event content in place.
+ *
+ *     nostrfs-compress [-l level] [-s samples] <db file>
+ *
+ * trains a zstd dictionary on a random sample of the content still stored as
+ * plain text, then rewrites each of those rows as a frame compressed against
+ * it; nostrfs decompresses on read.  Short notes share most of their
+ * vocabulary, so the dictionary is what makes them compress at all.  Rows
+ * that would not get smaller are left as they are.  Content imported later
+ * is compressed by running the tool again, which trains a new dictionary.
+ */
+
+static const int k_default_level = 9;
+static const int k_default_num_samples = 100000;
+static const size_t k_dictionary_capacity = 112640;
+static const int k_rows_per_transaction = 10000;
+
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *select_rows;
+    sqlite3_stmt *update_row;
+    ZSTD_CCtx *compression;
+    ZSTD_CDict *dictionary;
+    int64_t dictionary_id;
+    unsigned long num_compressed;
+    unsigned long num_skipped;
+    unsigned long long plain_bytes;
+    unsigned long long compressed_bytes;
+} Compressor;
+
+static void compressor_exec(Compressor *compressor, const char *sql) {
+    char *errmsg = NULL;
+    if (sqlite3_exec(compressor->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        fprintf(stderr, "Error executing \"%s\": %s\n", sql, errmsg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void compressor_prepare(Compressor *compressor, const char *sql, sqlite3_stmt **ret_statement) {
+    if (sqlite3_prepare_v3(compressor->db, sql, -1, SQLITE_PREPARE_PERSISTENT, ret_statement, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Error preparing statement: \"%s\" error message: \"%s\"\n", sql, sqlite3_errmsg(compressor->db));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Trains a dictionary on up to num_samples plain-text contents and stores
+ * it.  Returns false when there are too few samples to train one.
+ */
+static bool train_dictionary(Compressor *compressor, int num_samples, int level) {
+    sqlite3_stmt *select_samples;
+    compressor_prepare(
+        compressor,
+        "SELECT content FROM nostrEvents WHERE content_zstd IS NULL AND content IS NOT NULL ORDER BY random() LIMIT ?;",
+        &select_samples
+    );
+    sqlite3_bind_int(select_samples, 1, num_samples);
+
+    char *samples = NULL;
+    size_t samples_size = 0;
+    size_t samples_capacity = 0;
+    size_t *sample_sizes = calloc(num_samples, sizeof(size_t));
+    assert(sample_sizes != NULL);
+    unsigned int num_read = 0;
+    while (sqlite3_step(select_samples) == SQLITE_ROW) {
+        const size_t size = sqlite3_column_bytes(select_samples, 0);
+        if (samples_size + size > samples_capacity) {
+            samples_capacity = (samples_size + size) * 2;
+            samples = realloc(samples, samples_capacity);
+            assert(samples != NULL);
+        }
+        memcpy(samples + samples_size, sqlite3_column_text(select_samples, 0), size);
+        samples_size += size;
+        sample_sizes[num_read++] = size;
+    }
+    sqlite3_finalize(select_samples);
+
+    char *dictionary = malloc(k_dictionary_capacity);
+    assert(dictionary != NULL);
+    const size_t dictionary_size = ZDICT_trainFromBuffer(dictionary, k_dictionary_capacity, samples, sample_sizes, num_read);
+    free(sample_sizes);
+    free(samples);
+    if (ZDICT_isError(dictionary_size)) {
+        fprintf(stderr, "Could not train a dictionary on %u samples: %s\n", num_read, ZDICT_getErrorName(dictionary_size));
+        free(dictionary);
+        return false;
+    }
+
+    sqlite3_stmt *insert_dictionary;
+    compressor_prepare(compressor, "INSERT INTO contentDictionaries (dictionary) VALUES (?);", &insert_dictionary);
+    sqlite3_bind_blob(insert_dictionary, 1, dictionary, dictionary_size, SQLITE_STATIC);
+    if (sqlite3_step(insert_dictionary) != SQLITE_DONE) {
+        fprintf(stderr, "Error storing dictionary: %s\n", sqlite3_errmsg(compressor->db));
+        exit(EXIT_FAILURE);
+    }
+    sqlite3_finalize(insert_dictionary);
+    compressor->dictionary_id = sqlite3_last_insert_rowid(compressor->db);
+
+    compressor->dictionary = ZSTD_createCDict(dictionary, dictionary_size, level);
+    assert(compressor->dictionary != NULL);
+    free(dictionary);
+    fprintf(stderr, "Trained a %zu byte dictionary on %u samples\n", dictionary_size, num_read);
+    return true;
+}
+
+static void compress_row(Compressor *compressor, int64_t rowid, const char *content, size_t size, char *buffer) {
+    const size_t compressed_size = ZSTD_compress_usingCDict(
+        compressor->compression, buffer, ZSTD_compressBound(size), content, size, compressor->dictionary
+    );
+    assert(!ZSTD_isError(compressed_size));
+    if (compressed_size >= size) {
+        compressor->num_skipped++;
+        return;
+    }
+
+    sqlite3_stmt *statement = compressor->update_row;
+    sqlite3_bind_blob(statement, 1, buffer, compressed_size, SQLITE_STATIC);
+    sqlite3_bind_int64(statement, 2, compressor->dictionary_id);
+    sqlite3_bind_int64(statement, 3, size);
+    sqlite3_bind_int64(statement, 4, rowid);
+    if (sqlite3_step(statement) != SQLITE_DONE) {
+        fprintf(stderr, "Error compressing row %lld: %s\n", (long long) rowid, sqlite3_errmsg(compressor->db));
+        exit(EXIT_FAILURE);
+    }
+    sqlite3_reset(statement);
+
+    compressor->num_compressed++;
+    compressor->plain_bytes += size;
+    compressor->compressed_bytes += compressed_size;
+}
+
+/*
+ * Compresses the plain-text rows after *last_rowid, up to one transaction's
+ * worth.  Rows are read before any is rewritten so the scan never sees its
+ * own updates.  Returns false once no rows are left.
+ */
+static bool compress_rows(Compressor *compressor, int64_t *last_rowid) {
+    typedef struct {
+        int64_t rowid;
+        char *content;
+        size_t size;
+    } Row;
+    Row *rows = calloc(k_rows_per_transaction, sizeof(Row));
+    assert(rows != NULL);
+
+    sqlite3_stmt *statement = compressor->select_rows;
+    sqlite3_bind_int64(statement, 1, *last_rowid);
+    sqlite3_bind_int(statement, 2, k_rows_per_transaction);
+    int num_rows = 0;
+    size_t max_size = 0;
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+        Row *row = &rows[num_rows++];
+        row->rowid = sqlite3_column_int64(statement, 0);
+        row->size = sqlite3_column_bytes(statement, 1);
+        row->content = malloc(row->size + 1);
+        assert(row->content != NULL);
+        memcpy(row->content, sqlite3_column_text(statement, 1), row->size + 1);
+        max_size = row->size > max_size ? row->size : max_size;
+    }
+    sqlite3_reset(statement);
+
+    char *buffer = malloc(ZSTD_compressBound(max_size));
+    assert(buffer != NULL);
+    compressor_exec(compressor, "BEGIN;");
+    for (int i = 0; i < num_rows; i++) {
+        compress_row(compressor, rows[i].rowid, rows[i].content, rows[i].size, buffer);
+        free(rows[i].content);
+        *last_rowid = rows[i].rowid;
+    }
+    compressor_exec(compressor, "COMMIT;");
+
+    free(buffer);
+    free(rows);
+    return num_rows == k_rows_per_transaction;
+}
+
+int main(int argc, char *argv[]) {
+    int level = k_default_level;
+    int num_samples = k_default_num_samples;
+    int option;
+    while ((option = getopt(argc, argv, "l:s:")) != -1) {
+        if (option == 'l') {
+            level = atoi(optarg);
+        }
+        else if (option == 's') {
+            num_samples = atoi(optarg);
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 1 != argc || num_samples < 1) {
+        fprintf(stderr, "usage: %s [-l level] [-s samples] <db file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *db_file_path = argv[optind];
+
+    Compressor compressor = {0};
+    if (sqlite3_open_v2(db_file_path, &compressor.db, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open database file \"%s\": %s\n", db_file_path, sqlite3_errmsg(compressor.db));
+        return EXIT_FAILURE;
+    }
+    initialize_db(db_file_path);
+    sqlite3_busy_timeout(compressor.db, 5000);
+    compressor_exec(&compressor, "PRAGMA synchronous = NORMAL;");
+
+    int exit_status = EXIT_FAILURE;
+    if (train_dictionary(&compressor, num_samples, level)) {
+        compressor_prepare(
+            &compressor,
+            "SELECT rowid, content FROM nostrEvents"
+            " WHERE rowid > ? AND content_zstd IS NULL AND content IS NOT NULL ORDER BY rowid LIMIT ?;",
+            &compressor.select_rows
+        );
+        compressor_prepare(
+            &compressor,
+            "UPDATE nostrEvents SET content = NULL, content_zstd = ?, content_dictionary = ?, content_size = ? WHERE rowid = ?;",
+            &compressor.update_row
+        );
+        compressor.compression = ZSTD_createCCtx();
+        assert(compressor.compression != NULL);
+
+        int64_t last_rowid = 0;
+        while (compress_rows(&compressor, &last_rowid))
+            ;
+        fprintf(
+            stderr,
+            "%lu compressed (%llu to %llu bytes), %lu left as text\n",
+            compressor.num_compressed,
+            compressor.plain_bytes,
+            compressor.compressed_bytes,
+            compressor.num_skipped
+        );
+        exit_status = EXIT_SUCCESS;
+
+        ZSTD_freeCCtx(compressor.compression);
+        ZSTD_freeCDict(compressor.dictionary);
+        sqlite3_finalize(compressor.update_row);
+        sqlite3_finalize(compressor.select_rows);
+    }
+
+    sqlite3_close(compressor.db);
+    close_db();
+    return exit_status;
+}
@@ -0,0 +1,455 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include <sqlite3.h>
+
+#include "corpus.h"
+#include "db.h"
+#include "json.h"
+
+/*
+ * Deterministic synthetic nostr events for scale testing.
+ *
+ * Every choice about event i is drawn from a generator seeded with the corpus
+ * seed and i, so the same options always produce the same database and the
+ * id and author of any earlier event can be recomputed from its index.
+ * Authors, reply targets and words follow power laws, the way a few accounts,
+ * recent notes and common words draw most of the traffic on a real relay.
+ * Ids and signatures are random, so the events do not verify.
+ */
+
+static const int k_events_per_transaction = 50000;
+static const long k_progress_interval = 1000000;
+static const int64_t k_first_created_at = 1672531200;
+static const int64_t k_corpus_duration_s = 2 * 365 * 86400;
+static const size_t k_max_content_size = 262144;
+static const uint64_t k_max_follows = 1000;
+static const uint64_t k_vocabulary_size = 50000;
+static const uint64_t k_id_salt = 0x6964;
+static const uint64_t k_pubkey_salt = 0x706b;
+static const uint64_t k_sig_salt = 0x736967;
+
+typedef struct {
+    int kind;
+    int weight;
+} KindWeight;
+
+static const KindWeight k_kind_weights[] = {
+    {1, 55}, {7, 22}, {6, 6}, {9735, 5}, {4, 4}, {0, 3}, {3, 2}, {30023, 2}, {5, 1}
+};
+
+static const char *k_words[] = {
+    "the", "gm", "nostr", "a", "to", "and", "is", "of", "i", "you", "it", "zap", "relay", "bitcoin", "this", "for",
+    "in", "on", "just", "good", "morning", "pv", "that", "with", "lightning", "sats", "are", "be", "have", "not",
+    "freedom", "what", "so", "we", "my", "like", "client", "note", "key", "plebs", "fiat", "node", "time", "people",
+    "coffee", "build", "open", "source", "protocol", "value", "world", "day", "love", "money", "price", "stack",
+    "censorship", "resistant", "decentralized", "signal", "meme", "today", "thread", "funny"
+};
+
+static const char *k_syllables[] = {
+    "ka", "lo", "mi", "ne", "ru", "sa", "to", "vi", "ba", "de", "fo", "gu", "hi", "ja", "ko", "pe"
+};
+
+static const char k_base64_alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *insert_event;
+    sqlite3_stmt *insert_tag;
+    const CorpusOptions *options;
+    uint32_t *roots;
+    char *content;
+    size_t content_length;
+    char id[65];
+    CorpusStats stats;
+} Generator;
+
+static uint64_t next_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static uint64_t seeded_state(uint64_t seed, uint64_t salt, uint64_t index) {
+    uint64_t state = seed ^ (salt << 40);
+    state ^= next_random(&state) + index;
+    next_random(&state);
+    return state;
+}
+
+/*
+ * Returns a value in [0, n) with probability roughly proportional to
+ * 1 / (value + 1): an exponent is picked uniformly, then a value within its
+ * power of two.
+ */
+static uint64_t power_law(uint64_t *state, uint64_t n) {
+    assert(n > 0);
+    int max_exponent = 0;
+    while ((n >> max_exponent) > 1) {
+        max_exponent++;
+    }
+    for (;;) {
+        const uint64_t low = (uint64_t) 1 << (next_random(state) % (max_exponent + 1));
+        const uint64_t value = low + next_random(state) % low;
+        if (value <= n)
+            return value - 1;
+    }
+}
+
+static void random_hex(uint64_t *state, size_t length, char *ret_hex) {
+    for (size_t i = 0; i < length; i += 16) {
+        snprintf(ret_hex + i, 17, "%016llx", (unsigned long long) next_random(state));
+    }
+}
+
+static void event_id(const Generator *generator, uint64_t index, char *ret_id) {
+    uint64_t state = seeded_state(generator->options->seed, k_id_salt, index);
+    random_hex(&state, 64, ret_id);
+}
+
+static void author_pubkey(const Generator *generator, uint64_t author, char *ret_pubkey) {
+    uint64_t state = seeded_state(generator->options->seed, k_pubkey_salt, author);
+    random_hex(&state, 64, ret_pubkey);
+}
+
+/* The author is the first draw of an event's generator, so it can be recomputed. */
+static uint64_t event_state(const Generator *generator, uint64_t index, uint64_t *ret_author) {
+    uint64_t state = seeded_state(generator->options->seed, 0, index);
+    *ret_author = power_law(&state, generator->options->num_authors);
+    return state;
+}
+
+static void event_author_pubkey(const Generator *generator, uint64_t index, char *ret_pubkey) {
+    uint64_t author;
+    event_state(generator, index, &author);
+    author_pubkey(generator, author, ret_pubkey);
+}
+
+static int pick_kind(uint64_t *state) {
+    int total_weight = 0;
+    for (size_t i = 0; i < sizeof(k_kind_weights) / sizeof(k_kind_weights[0]); i++) {
+        total_weight += k_kind_weights[i].weight;
+    }
+    int choice = next_random(state) % total_weight;
+    size_t i = 0;
+    while (choice >= k_kind_weights[i].weight) {
+        choice -= k_kind_weights[i++].weight;
+    }
+    return k_kind_weights[i].kind;
+}
+
+static void append_content(Generator *generator, const char *text, size_t length) {
+    if (generator->content_length + length > k_max_content_size)
+        length = k_max_content_size - generator->content_length;
+    memcpy(generator->content + generator->content_length, text, length);
+    generator->content_length += length;
+}
+
+/*
+ * Appends word number rank: the common words first, then made-up words
+ * spelled from rank's base-16 digits, so that the vocabulary is large enough
+ * for the search index and compression to behave as they would on real text.
+ */
+static void append_word(Generator *generator, uint64_t rank) {
+    const uint64_t num_words = sizeof(k_words) / sizeof(k_words[0]);
+    if (rank < num_words) {
+        append_content(generator, k_words[rank], strlen(k_words[rank]));
+        return;
+    }
+    for (uint64_t digits = rank; digits > 0; digits /= 16) {
+        append_content(generator, k_syllables[digits % 16], 2);
+    }
+}
+
+static void append_words(Generator *generator, uint64_t *state, size_t length) {
+    const size_t end = generator->content_length + length;
+    while (generator->content_length < end) {
+        append_word(generator, power_law(state, k_vocabulary_size));
+        append_content(generator, " ", 1);
+    }
+    generator->content_length = end < k_max_content_size ? end : k_max_content_size;
+}
+
+static void append_base64(Generator *generator, uint64_t *state, size_t length) {
+    for (size_t i = 0; i < length && generator->content_length < k_max_content_size; i++) {
+        generator->content[generator->content_length++] = k_base64_alphabet[next_random(state) % 64];
+    }
+}
+
+static void insert_tag(Generator *generator, const char *key, int tag_index, int value_index, const char *value) {
+    sqlite3_stmt *statement = generator->insert_tag;
+    sqlite3_bind_text(statement, 1, generator->id, 64, SQLITE_STATIC);
+    sqlite3_bind_text(statement, 2, key, -1, SQLITE_STATIC);
+    sqlite3_bind_int(statement, 3, tag_index);
+    sqlite3_bind_int(statement, 4, value_index);
+    sqlite3_bind_text(statement, 5, value, -1, SQLITE_STATIC);
+    if (sqlite3_step(statement) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to insert tag: %s\n", sqlite3_errmsg(generator->db));
+        exit(EXIT_FAILURE);
+    }
+    sqlite3_reset(statement);
+    generator->stats.num_tags++;
+}
+
+/* Adds ["e", <id of event index>, "", marker], leaving the marker out when it is NULL. */
+static void insert_event_tag(Generator *generator, int tag_index, uint64_t index, const char *marker) {
+    char id[65];
+    event_id(generator, index, id);
+    insert_tag(generator, "e", tag_index, 0, id);
+    if (marker != NULL) {
+        insert_tag(generator, "e", tag_index, 1, "");
+        insert_tag(generator, "e", tag_index, 2, marker);
+    }
+}
+
+static void insert_pubkey_tag(Generator *generator, int tag_index, const char *pubkey) {
+    insert_tag(generator, "p", tag_index, 0, pubkey);
+}
+
+/* Picks an earlier event, most often a recent one. */
+static uint64_t pick_target(uint64_t *state, uint64_t index) {
+    return index - 1 - power_law(state, index);
+}
+
+static void generate_note(Generator *generator, uint64_t *state, uint64_t index, int *tag_index) {
+    char pubkey[65];
+    generator->roots[index] = index;
+    if (index > 0 && next_random(state) % 10 < 4) {
+        const uint64_t parent = pick_target(state, index);
+        const uint64_t root = generator->roots[parent];
+        if (root != parent)
+            insert_event_tag(generator, (*tag_index)++, root, "root");
+        insert_event_tag(generator, (*tag_index)++, parent, "reply");
+        event_author_pubkey(generator, parent, pubkey);
+        insert_pubkey_tag(generator, (*tag_index)++, pubkey);
+        generator->roots[index] = root;
+    }
+    const int num_mentions = next_random(state) % 10 < 3 ? 1 + next_random(state) % 3 : 0;
+    for (int i = 0; i < num_mentions; i++) {
+        author_pubkey(generator, power_law(state, generator->options->num_authors), pubkey);
+        insert_pubkey_tag(generator, (*tag_index)++, pubkey);
+    }
+    if (next_random(state) % 10 == 0) {
+        const uint64_t num_words = sizeof(k_words) / sizeof(k_words[0]);
+        insert_tag(generator, "t", (*tag_index)++, 0, k_words[power_law(state, num_words)]);
+    }
+
+    /* Mostly short notes, with a tail running to a thousand characters. */
+    append_words(generator, state, 4 + power_law(state, 1000));
+}
+
+static void generate_event(Generator *generator, uint64_t index) {
+    uint64_t author;
+    uint64_t state = event_state(generator, index, &author);
+    char pubkey[65];
+    char sig[129];
+    author_pubkey(generator, author, pubkey);
+    event_id(generator, index, generator->id);
+    uint64_t sig_state = seeded_state(generator->options->seed, k_sig_salt, index);
+    random_hex(&sig_state, 128, sig);
+
+    const int kind = index == 0 ? 1 : pick_kind(&state);
+    generator->content_length = 0;
+    int tag_index = 0;
+    char target_pubkey[65];
+    switch (kind) {
+        case 1:
+            generate_note(generator, &state, index, &tag_index);
+            break;
+        case 7:
+        case 6:
+        case 9735:
+        case 5: {
+            const uint64_t target = pick_target(&state, index);
+            insert_event_tag(generator, tag_index++, target, NULL);
+            if (kind != 5) {
+                event_author_pubkey(generator, target, target_pubkey);
+                insert_pubkey_tag(generator, tag_index++, target_pubkey);
+            }
+            if (kind == 7) {
+                const char *reaction = next_random(&state) % 10 < 7 ? "+" : "\xf0\x9f\xa4\x99";
+                append_content(generator, reaction, strlen(reaction));
+            }
+            else if (kind == 9735) {
+                char bolt11[200] = "lnbc";
+                for (int i = 4; i < 190; i++) {
+                    bolt11[i] = k_base64_alphabet[26 + next_random(&state) % 36];
+                }
+                bolt11[190] = '\0';
+                insert_tag(generator, "bolt11", tag_index++, 0, bolt11);
+            }
+            break;
+        }
+        case 4:
+            author_pubkey(generator, power_law(&state, generator->options->num_authors), target_pubkey);
+            insert_pubkey_tag(generator, tag_index++, target_pubkey);
+            append_base64(generator, &state, 24 + 4 * power_law(&state, 500));
+            append_content(generator, "?iv=", 4);
+            append_base64(generator, &state, 24);
+            break;
+        case 0:
+            append_content(generator, "{\"name\":\"", 9);
+            append_content(generator, pubkey, 12);
+            append_content(generator, "\",\"about\":\"", 11);
+            append_words(generator, &state, power_law(&state, 300));
+            append_content(generator, "\"}", 2);
+            break;
+        case 3: {
+            const uint64_t num_follows = 1 + power_law(&state, k_max_follows);
+            for (uint64_t i = 0; i < num_follows; i++) {
+                author_pubkey(generator, power_law(&state, generator->options->num_authors), target_pubkey);
+                insert_pubkey_tag(generator, tag_index++, target_pubkey);
+            }
+            break;
+        }
+        case 30023: {
+            char identifier[17];
+            random_hex(&state, 16, identifier);
+            insert_tag(generator, "d", tag_index++, 0, identifier);
+            insert_tag(generator, "title", tag_index++, 0, k_words[next_random(&state) % 16]);
+            append_words(generator, &state, 2000 + power_law(&state, 120000));
+            break;
+        }
+        default:
+            assert(false);
+    }
+
+    sqlite3_stmt *statement = generator->insert_event;
+    sqlite3_bind_text(statement, 1, generator->id, 64, SQLITE_STATIC);
+    sqlite3_bind_text(statement, 2, pubkey, 64, SQLITE_STATIC);
+    sqlite3_bind_int64(
+        statement,
+        3,
+        k_first_created_at + (int64_t) (index * k_corpus_duration_s / generator->options->num_events) + next_random(&state) % 60
+    );
+    sqlite3_bind_int(statement, 4, kind);
+    sqlite3_bind_text(statement, 5, generator->content, generator->content_length, SQLITE_STATIC);
+    sqlite3_bind_text(statement, 6, sig, 128, SQLITE_STATIC);
+    if (sqlite3_step(statement) != SQLITE_DONE) {
+        fprintf(stderr, "Failed to insert event: %s\n", sqlite3_errmsg(generator->db));
+        exit(EXIT_FAILURE);
+    }
+    sqlite3_reset(statement);
+    generator->stats.num_events++;
+    generator->stats.content_bytes += generator->content_length;
+}
+
+static void generator_exec(Generator *generator, const char *sql) {
+    char *errmsg = NULL;
+    if (sqlite3_exec(generator->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        fprintf(stderr, "Error executing \"%s\": %s\n", sql, errmsg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void generator_prepare(Generator *generator, const char *sql, sqlite3_stmt **ret_statement) {
+    if (sqlite3_prepare_v3(generator->db, sql, -1, SQLITE_PREPARE_PERSISTENT, ret_statement, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Error preparing statement: \"%s\" error message: \"%s\"\n", sql, sqlite3_errmsg(generator->db));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Drops the indexes and search triggers of the still empty tables, saving
+ * the SQL that recreates them for recreate_deferred_indexes in the same
+ * transaction.  Sorting each index once after the load is several times
+ * faster than updating it row by row, and the search index is likewise
+ * filled in one pass.  It is filled from the rows stored as plain text, as
+ * the insert trigger would, rather than by an FTS 'rebuild', which would
+ * drop the tokens of compressed rows.
+ */
+static void defer_indexes(Generator *generator) {
+    sqlite3_stmt *statement;
+    generator_prepare(
+        generator,
+        "SELECT type, name, sql FROM sqlite_master"
+        " WHERE type IN ('index', 'trigger') AND tbl_name IN ('nostrEvents', 'tags') AND sql IS NOT NULL;",
+        &statement
+    );
+    Buffer recreate = {0};
+    Buffer drop = {0};
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+        const char *sql = (const char *) sqlite3_column_text(statement, 2);
+        buffer_append(&recreate, sql, strlen(sql));
+        buffer_append(&recreate, ";", 1);
+
+        char *drop_sql = sqlite3_mprintf("DROP %s \"%w\";", sqlite3_column_text(statement, 0), sqlite3_column_text(statement, 1));
+        assert(drop_sql != NULL);
+        buffer_append(&drop, drop_sql, strlen(drop_sql));
+        sqlite3_free(drop_sql);
+    }
+    sqlite3_finalize(statement);
+
+    const char k_fill_search[] =
+        "INSERT INTO nostrEvents_search(rowid, content) SELECT rowid, content FROM nostrEvents WHERE content_zstd IS NULL;";
+    buffer_append(&recreate, k_fill_search, sizeof(k_fill_search));
+    buffer_append_char(&drop, '\0');
+
+    generator_exec(generator, "BEGIN IMMEDIATE;");
+    generator_exec(generator, "CREATE TABLE deferredIndexes (sql TEXT NOT NULL);");
+    generator_prepare(generator, "INSERT INTO deferredIndexes (sql) VALUES (?);", &statement);
+    const bool saved =
+        sqlite3_bind_text(statement, 1, recreate.data, -1, SQLITE_STATIC) == SQLITE_OK && sqlite3_step(statement) == SQLITE_DONE;
+    assert(saved);
+    sqlite3_finalize(statement);
+    generator_exec(generator, drop.data);
+    generator_exec(generator, "COMMIT;");
+    free(drop.data);
+    free(recreate.data);
+}
+
+/*
+ * Inserts options->num_events events through db, which must already have the
+ * nostrfs schema and no events, in transactions of k_events_per_transaction.
+ */
+void generate_corpus(sqlite3 *db, const CorpusOptions *options, CorpusStats *ret_stats) {
+    assert(options->num_events > 0 && (uint64_t) options->num_events <= UINT32_MAX);
+    assert(options->num_authors > 0);
+
+    Generator generator = {.db = db, .options = options};
+    generator.roots = malloc(options->num_events * sizeof(uint32_t));
+    generator.content = malloc(k_max_content_size);
+    assert(generator.roots != NULL && generator.content != NULL);
+    generator_exec(&generator, "PRAGMA synchronous = OFF;");
+    generator_exec(&generator, "PRAGMA cache_size = -262144;");
+    generator_prepare(
+        &generator,
+        "INSERT INTO nostrEvents (id, pubkey, created_at, kind, content, sig) VALUES (?, ?, ?, ?, ?, ?);",
+        &generator.insert_event
+    );
+    generator_prepare(
+        &generator,
+        "INSERT INTO tags (id, key, tag_index, value_index, value) VALUES (?, ?, ?, ?, ?);",
+        &generator.insert_tag
+    );
+
+    defer_indexes(&generator);
+    generator_exec(&generator, "BEGIN;");
+    for (long i = 0; i < options->num_events; i++) {
+        generate_event(&generator, i);
+        if ((i + 1) % k_events_per_transaction == 0) {
+            generator_exec(&generator, "COMMIT;");
+            generator_exec(&generator, "BEGIN;");
+        }
+        if ((i + 1) % k_progress_interval == 0)
+            fprintf(stderr, "Generated %ld of %ld events\n", i + 1, options->num_events);
+    }
+    generator_exec(&generator, "COMMIT;");
+    fprintf(stderr, "Indexing %ld events\n", options->num_events);
+    recreate_deferred_indexes(db);
+    generator_exec(&generator, "PRAGMA synchronous = NORMAL;");
+
+    sqlite3_finalize(generator.insert_tag);
+    sqlite3_finalize(generator.insert_event);
+    free(generator.content);
+    free(generator.roots);
+    *ret_stats = generator.stats;
+}
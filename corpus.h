@@ -0,0 +1,24 @@
+#ifndef NOSTRFS_CORPUS
+#define NOSTRFS_CORPUS
+
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+#define DEFAULT_CORPUS_AUTHORS 100000
+
+typedef struct {
+    long num_events;
+    long num_authors;
+    uint64_t seed;
+} CorpusOptions;
+
+typedef struct {
+    long num_events;
+    long num_tags;
+    unsigned long long content_bytes;
+} CorpusStats;
+
+void generate_corpus(sqlite3 *db, const CorpusOptions *options, CorpusStats *ret_stats);
+
+#endif
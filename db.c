@@ -1,60 +1,489 @@
 
+#define _DEFAULT_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include <sqlite3.h>
+#include <zstd.h>
 
+#include "arena.h"
 #include "db.h"
+#include "hex.h"
+#include "json.h"
 #include "path.h"
+#include "snapshot.h"
+#include "stats.h"
 #include "synthetic_file.h"
 
 typedef struct {
     const char *template;
-    sqlite3_stmt *statement;
+    int index;
 } Query;
 
-sqlite3 *db;
+/*
+ * Each FUSE worker thread gets its own read-only connection and its own set
+ * of prepared statements, so concurrent requests never share a statement.
+ * Connections are opened lazily on first use and closed when the thread exits.
+ * start_ns holds when each statement was last handed out, for its statistics.
+ * statement_slots maps each statement back to its query index, open-addressed
+ * by the statement's address, so that resetting one does not search them all.
+ * data_version is the connection's PRAGMA data_version when it last checked
+ * the event records, at data_version_ns, and -1 before its first check.
+ */
+typedef struct {
+    sqlite3 *db;
+    ZSTD_DCtx *decompression;
+    uint64_t *start_ns;
+    int *statement_slots;
+    size_t num_statement_slots;
+    int64_t data_version;
+    uint64_t data_version_ns;
+    sqlite3_stmt *statements[];
+} Connection;
+
+#define NUM_CACHED_CONTENTS 64
+
+/* A recently decompressed content value, keyed by its event's rowid. */
+typedef struct {
+    int64_t rowid;
+    size_t size;
+    char *data;
+} CachedContent;
+
+typedef struct {
+    int64_t id;
+    ZSTD_DDict *dictionary;
+} ContentDictionary;
+
+#define NUM_CACHED_EVENTS 4096
+#define NUM_EVENT_RECORD_LOCKS 16
+#define MAX_BATCHED_RECORDS 32
+
+/*
+ * The fixed-size facts about an event that its timestamps, sizes, kind and
+ * pubkey files and data locations are served from.  Located sizes are -1
+ * when the value has no location: compressed content, JSON that was never
+ * stored, and binary pubkeys.  Records prefetched by a listing lack the
+ * sizes, which cost a read of the values themselves.  generation is the
+ * event_record_generation the record was read in.
+ */
+typedef struct {
+    char id[KEY_HEX_LENGTH + 1];
+    char pubkey[KEY_HEX_LENGTH + 1];
+    char kind[24];
+    int64_t rowid;
+    time_t created_at;
+    bool has_sizes;
+    off_t content_size;
+    off_t located_content_size;
+    off_t event_json_size;
+    off_t located_pubkey_size;
+    unsigned long generation;
+} EventRecord;
+
+typedef enum {
+    RECORD_PENDING,
+    RECORD_FETCHING,
+    RECORD_FETCHED
+} RecordFetchState;
+
+/* A thread waiting for a record, on the stack of the thread that asked. */
+typedef struct RecordFetch {
+    const char *event_id;
+    EventRecord *record;
+    bool found;
+    RecordFetchState state;
+    int num_sharers;
+    struct RecordFetch *next;
+} RecordFetch;
+
+static char *db_file_path;
+static pthread_key_t connection_key;
+static int num_queries;
+
+static const int k_busy_timeout_ms = 5000;
+static const int k_max_record_fetchers = 4;
+static const uint64_t k_data_version_interval_ns = 1000000;
+static unsigned int search_limit = DEFAULT_SEARCH_LIMIT;
+
+/*
+ * Event ids and pubkeys are stored either as the 64-digit hex text db.js
+ * writes or, once convert_keys has run, as 32-byte blobs, which halves every
+ * index on them.  Names cross into and out of SQL through statement_bind_key
+ * and column_text, so the rest of nostrfs only ever sees hex.  Blobs sort by
+ * their bytes just as hex sorts by its digits, and every blob sorts after
+ * every string, so listings keep their order and an empty string still
+ * starts a keyset listing from the beginning.
+ */
+static bool binary_keys = false;
 
-#define NEW_QUERY(template) {template, 0}
+static pthread_mutex_t content_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static CachedContent content_cache[NUM_CACHED_CONTENTS];
+static pthread_mutex_t event_record_locks[NUM_EVENT_RECORD_LOCKS];
+static EventRecord event_records[NUM_CACHED_EVENTS];
+static atomic_ulong event_record_generation;
+static atomic_ulong event_record_hits;
+static atomic_ulong event_record_misses;
+static pthread_mutex_t record_fetches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t record_fetches_changed = PTHREAD_COND_INITIALIZER;
+static RecordFetch *record_fetches;
+static int num_record_fetchers;
+static unsigned long num_record_batches;
+static unsigned long num_batched_records;
+static unsigned long num_shared_records;
+static pthread_mutex_t dictionaries_lock = PTHREAD_MUTEX_INITIALIZER;
+static ContentDictionary *dictionaries;
+static int num_dictionaries;
 
-static Query get_event_ids_query = NEW_QUERY("SELECT id FROM nostrEvents;");
-static Query get_event_query = NEW_QUERY("SELECT * FROM nostrEvents WHERE id = ?;");
+#define NEW_QUERY(template) {template, -1}
+
+/*
+ * Directory queries are keyset-paginated: their last parameter is the last
+ * key already listed, or NULL to start from the beginning, and results are
+ * ordered by that key so each readdir call can resume with an index seek.
+ */
+
+/*
+ * The columns of an EventRecord, in the order event_record_from_row reads
+ * them after the id.  Listings of event ids select the row columns too,
+ * from indexes that cover them, so that the lookups and getattrs that
+ * follow a listing are served without a query; only get_event_record_query
+ * and get_event_records_query compute the sizes.
+ */
+#define EVENT_ROW_COLUMNS "rowid, pubkey, created_at, kind"
+#define EVENT_SIZE_COLUMNS \
+    "coalesce(content_size, length(CAST(content AS BLOB)))," \
+    " CASE WHEN content_zstd IS NULL THEN coalesce(length(CAST(content AS BLOB)), 0) END," \
+    " length(CAST(event_json AS BLOB))," \
+    " CASE typeof(pubkey) WHEN 'text' THEN length(CAST(pubkey AS BLOB)) END"
+
+static Query get_event_ids_query = NEW_QUERY("SELECT id, " EVENT_ROW_COLUMNS " FROM nostrEvents WHERE id > coalesce(?, '') ORDER BY id;");
+static Query get_event_record_query = NEW_QUERY("SELECT id, " EVENT_ROW_COLUMNS ", " EVENT_SIZE_COLUMNS " FROM nostrEvents WHERE id = ?;");
+static Query get_event_records_query = NEW_QUERY(
+    "SELECT id, " EVENT_ROW_COLUMNS ", " EVENT_SIZE_COLUMNS " FROM nostrEvents WHERE id IN ("
+    "?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?,?);"
+);
+static Query get_event_query = NEW_QUERY(
+    "SELECT content, content_zstd, content_dictionary, content_size, rowid, pubkey, created_at, kind, sig FROM nostrEvents WHERE id = ?;"
+);
+static Query get_event_tags_query = NEW_QUERY("SELECT tag_index, key, value FROM tags WHERE id = ? ORDER BY tag_index, value_index;");
+static Query locate_event_json_query = NEW_QUERY("SELECT rowid, length(CAST(event_json AS BLOB)) FROM nostrEvents WHERE id = ? AND event_json IS NOT NULL;");
 static Query get_created_at_query = NEW_QUERY("SELECT created_at FROM nostrEvents WHERE id = ?;");
-static Query get_content_query = NEW_QUERY("SELECT content FROM nostrEvents WHERE id = ?;");
+static Query get_content_query = NEW_QUERY("SELECT content, content_zstd, content_dictionary, content_size, rowid FROM nostrEvents WHERE id = ?;");
 static Query get_event_kind_query = NEW_QUERY("SELECT kind FROM nostrEvents WHERE id = ?;");
 static Query get_event_pubkey_query = NEW_QUERY("SELECT pubkey FROM nostrEvents WHERE id = ?;");
-static Query get_unique_tag_keys_query = NEW_QUERY("SELECT DISTINCT key FROM tags WHERE id = ?;");
-static Query get_tag_indices_with_key_query = NEW_QUERY("SELECT DISTINCT tag_index FROM tags WHERE id = ? AND key = ?;");
-static Query get_tag_value_indices_query = NEW_QUERY("SELECT value_index FROM tags WHERE id = ? AND tag_index = ?;");
+static Query get_content_size_query = NEW_QUERY("SELECT coalesce(content_size, length(CAST(content AS BLOB))) FROM nostrEvents WHERE id = ?;");
+static Query get_event_kind_size_query = NEW_QUERY("SELECT length(CAST(kind AS BLOB)) FROM nostrEvents WHERE id = ?;");
+static Query get_event_pubkey_size_query = NEW_QUERY(
+    "SELECT CASE typeof(pubkey) WHEN 'blob' THEN 2 * length(pubkey) ELSE length(CAST(pubkey AS BLOB)) END FROM nostrEvents WHERE id = ?;"
+);
+static Query locate_content_query = NEW_QUERY("SELECT rowid, length(CAST(content AS BLOB)) FROM nostrEvents WHERE id = ? AND content_zstd IS NULL;");
+static Query get_content_dictionary_query = NEW_QUERY("SELECT dictionary FROM contentDictionaries WHERE id = ?;");
+static Query locate_event_pubkey_query = NEW_QUERY(
+    "SELECT rowid, length(CAST(pubkey AS BLOB)) FROM nostrEvents WHERE id = ? AND typeof(pubkey) = 'text';"
+);
+static Query get_unique_tag_keys_query = NEW_QUERY("SELECT DISTINCT key FROM tags WHERE id = ? AND key > coalesce(?, '') ORDER BY key;");
+static Query get_tag_indices_with_key_query = NEW_QUERY("SELECT DISTINCT tag_index FROM tags WHERE id = ? AND key = ? AND tag_index > coalesce(?, -1) ORDER BY tag_index;");
+static Query get_tag_value_indices_query = NEW_QUERY("SELECT value_index FROM tags WHERE id = ? AND tag_index = ? AND value_index > coalesce(?, -1) ORDER BY value_index;");
 static Query get_tag_value_query = NEW_QUERY("SELECT value FROM tags WHERE id = ? AND tag_index = ? AND value_index = ?;");
+static Query get_tag_value_size_query = NEW_QUERY("SELECT length(CAST(value AS BLOB)) FROM tags WHERE id = ? AND tag_index = ? AND value_index = ?;");
+static Query locate_tag_value_query = NEW_QUERY("SELECT rowid, length(CAST(value AS BLOB)) FROM tags WHERE id = ? AND tag_index = ? AND value_index = ?;");
+
+static Query get_pubkeys_query = NEW_QUERY("SELECT DISTINCT pubkey FROM nostrEvents WHERE pubkey > coalesce(?, '') ORDER BY pubkey;");
+static Query get_pubkey_event_ids_query = NEW_QUERY(
+    "SELECT id, " EVENT_ROW_COLUMNS " FROM nostrEvents WHERE pubkey = ? AND id > coalesce(?, '') ORDER BY id;"
+);
+static Query get_pubkey_event_kinds_query = NEW_QUERY("SELECT DISTINCT kind FROM nostrEvents WHERE pubkey = ? AND kind > coalesce(?, -1) ORDER BY kind;");
+static Query get_pubkey_kind_events_query = NEW_QUERY(
+    "SELECT id FROM nostrEvents"
+    " WHERE pubkey = ?1 AND kind = ?2"
+    " AND (created_at, id) < (coalesce((SELECT created_at FROM nostrEvents WHERE id = ?3), 9223372036854775807), coalesce(?3, ''))"
+    " ORDER BY created_at DESC, id DESC;"
+);
 
-static Query get_pubkeys_query = NEW_QUERY("SELECT DISTINCT pubkey FROM nostrEvents;");
-static Query get_pubkey_event_ids_query = NEW_QUERY("SELECT id FROM nostrEvents WHERE pubkey = ?;");
-static Query get_pubkey_event_kinds_query = NEW_QUERY("SELECT DISTINCT kind FROM nostrEvents WHERE pubkey = ?;");
-static Query get_pubkey_kind_events_query = NEW_QUERY("SELECT id FROM nostrEvents WHERE pubkey = ? AND kind = ?;");
+static Query get_first_event_time_query = NEW_QUERY("SELECT min(created_at) FROM nostrEvents WHERE created_at >= ? AND created_at < ?;");
+static Query get_time_event_ids_query = NEW_QUERY(
+    "SELECT id FROM nostrEvents"
+    " WHERE (created_at, id) > (coalesce((SELECT created_at FROM nostrEvents WHERE id = ?3), ?1), coalesce(?3, ''))"
+    " AND created_at < ?2"
+    " ORDER BY created_at, id;"
+);
+
+static Query get_indexed_tag_keys_query = NEW_QUERY("SELECT min(key) FROM tags WHERE key > ? AND value_index = 0;");
+static Query get_indexed_tag_values_query = NEW_QUERY("SELECT min(value) FROM tags WHERE key = ? AND value > ? AND value_index = 0;");
+static Query get_tagged_event_ids_query = NEW_QUERY(
+    "SELECT DISTINCT id FROM tags WHERE key = ? AND value = ? AND value_index = 0 AND id > coalesce(?, '') ORDER BY id;"
+);
+static Query get_event_indexed_tags_query = NEW_QUERY("SELECT key, value FROM tags WHERE id = ? AND value_index = 0;");
+
+static Query search_event_ids_query = NEW_QUERY(
+    "SELECT nostrEvents.id FROM nostrEvents_search JOIN nostrEvents ON nostrEvents.rowid = nostrEvents_search.rowid"
+    " WHERE nostrEvents_search MATCH ?1"
+    " ORDER BY nostrEvents_search.rank LIMIT ?2 OFFSET ?3;"
+);
+
+static Query get_data_version_query = NEW_QUERY("PRAGMA data_version;");
+static Query get_latest_event_rowid_query = NEW_QUERY("SELECT coalesce(max(rowid), 0) FROM nostrEvents;");
+static Query get_new_events_query = NEW_QUERY("SELECT rowid, id, pubkey, kind, created_at FROM nostrEvents WHERE rowid > ? ORDER BY rowid LIMIT ?;");
 
 static Query *all_queries[] = {
     &get_event_ids_query,
+    &get_event_record_query,
+    &get_event_records_query,
     &get_event_query,
+    &get_event_tags_query,
+    &locate_event_json_query,
     &get_created_at_query,
     &get_content_query,
     &get_event_kind_query,
     &get_event_pubkey_query,
+    &get_content_size_query,
+    &get_event_kind_size_query,
+    &get_event_pubkey_size_query,
+    &locate_content_query,
+    &get_content_dictionary_query,
+    &locate_event_pubkey_query,
     &get_unique_tag_keys_query,
     &get_tag_indices_with_key_query,
     &get_tag_value_indices_query,
     &get_tag_value_query,
+    &get_tag_value_size_query,
+    &locate_tag_value_query,
     &get_pubkeys_query,
     &get_pubkey_event_ids_query,
     &get_pubkey_event_kinds_query,
     &get_pubkey_kind_events_query,
+    &get_first_event_time_query,
+    &get_time_event_ids_query,
+    &get_indexed_tag_keys_query,
+    &get_indexed_tag_values_query,
+    &get_tagged_event_ids_query,
+    &get_event_indexed_tags_query,
+    &search_event_ids_query,
+    &get_data_version_query,
+    &get_latest_event_rowid_query,
+    &get_new_events_query,
+    NULL
+};
+
+/*
+ * Schema migrations, applied in order by initialize_db.  The database's
+ * user_version records how many have run, so each one runs exactly once.
+ * Append new steps; never edit a step that has shipped.
+ */
+static const char *k_migrations[] = {
+    "CREATE TABLE IF NOT EXISTS nostrEvents ("
+    "  id TEXT PRIMARY KEY, pubkey TEXT, created_at INTEGER, kind INTEGER, content TEXT, sig TEXT"
+    ");"
+    "CREATE TABLE IF NOT EXISTS tags ("
+    "  id TEXT, key TEXT, tag_index INTEGER, value_index INTEGER, value TEXT,"
+    "  FOREIGN KEY(id) REFERENCES nostrEvents(id)"
+    ");"
+    "CREATE INDEX IF NOT EXISTS nostrEvents_pubkey_id ON nostrEvents(pubkey, id);"
+    "CREATE INDEX IF NOT EXISTS nostrEvents_pubkey_kind ON nostrEvents(pubkey, kind, id);"
+    "CREATE INDEX IF NOT EXISTS tags_id_key ON tags(id, key, tag_index);"
+    "CREATE INDEX IF NOT EXISTS tags_id_tag_index ON tags(id, tag_index, value_index);",
+
+    "CREATE INDEX IF NOT EXISTS nostrEvents_created_at ON nostrEvents(created_at, id);",
+
+    "CREATE INDEX IF NOT EXISTS nostrEvents_pubkey_kind_created_at ON nostrEvents(pubkey, kind, created_at, id);"
+    "DROP INDEX IF EXISTS nostrEvents_pubkey_kind;",
+
+    "CREATE INDEX IF NOT EXISTS tags_key_value ON tags(key, value, id) WHERE value_index = 0;",
+
+    "CREATE VIRTUAL TABLE IF NOT EXISTS nostrEvents_search USING fts5("
+    "  content, content = 'nostrEvents', content_rowid = 'rowid'"
+    ");"
+    "CREATE TRIGGER IF NOT EXISTS nostrEvents_search_insert AFTER INSERT ON nostrEvents BEGIN"
+    "  INSERT INTO nostrEvents_search(rowid, content) VALUES (new.rowid, new.content);"
+    " END;"
+    "CREATE TRIGGER IF NOT EXISTS nostrEvents_search_delete AFTER DELETE ON nostrEvents BEGIN"
+    "  INSERT INTO nostrEvents_search(nostrEvents_search, rowid, content) VALUES ('delete', old.rowid, old.content);"
+    " END;"
+    "CREATE TRIGGER IF NOT EXISTS nostrEvents_search_update AFTER UPDATE OF content ON nostrEvents BEGIN"
+    "  INSERT INTO nostrEvents_search(nostrEvents_search, rowid, content) VALUES ('delete', old.rowid, old.content);"
+    "  INSERT INTO nostrEvents_search(rowid, content) VALUES (new.rowid, new.content);"
+    " END;"
+    "INSERT INTO nostrEvents_search(nostrEvents_search) VALUES ('rebuild');",
+
+    /*
+     * Compressed content: content is NULL and content_zstd holds the zstd
+     * frame, compressed against content_dictionary when that is set, with
+     * the uncompressed length in content_size.  Compressing a row leaves its
+     * text unchanged, so the search index keeps the row's tokens; search
+     * triggers only act on rows stored as plain text, since SQL cannot
+     * decompress the text that an FTS 'delete' needs.  Deleting a compressed
+     * row therefore leaves its tokens behind, and search hides them by
+     * joining nostrEvents; events are immutable, so compressed content is
+     * never updated.  An FTS 'rebuild' reads only plain text and would drop
+     * the tokens of every compressed row, so nothing may run one once rows
+     * are compressed.
+     */
+    "CREATE TABLE IF NOT EXISTS contentDictionaries (id INTEGER PRIMARY KEY, dictionary BLOB NOT NULL);"
+    "ALTER TABLE nostrEvents ADD COLUMN content_zstd BLOB;"
+    "ALTER TABLE nostrEvents ADD COLUMN content_dictionary INTEGER REFERENCES contentDictionaries(id);"
+    "ALTER TABLE nostrEvents ADD COLUMN content_size INTEGER;"
+    "DROP TRIGGER IF EXISTS nostrEvents_search_insert;"
+    "DROP TRIGGER IF EXISTS nostrEvents_search_delete;"
+    "DROP TRIGGER IF EXISTS nostrEvents_search_update;"
+    "CREATE TRIGGER nostrEvents_search_insert AFTER INSERT ON nostrEvents WHEN new.content_zstd IS NULL BEGIN"
+    "  INSERT INTO nostrEvents_search(rowid, content) VALUES (new.rowid, new.content);"
+    " END;"
+    "CREATE TRIGGER nostrEvents_search_delete AFTER DELETE ON nostrEvents WHEN old.content_zstd IS NULL BEGIN"
+    "  INSERT INTO nostrEvents_search(nostrEvents_search, rowid, content) VALUES ('delete', old.rowid, old.content);"
+    " END;"
+    "CREATE TRIGGER nostrEvents_search_update AFTER UPDATE OF content ON nostrEvents"
+    " WHEN old.content_zstd IS NULL AND new.content_zstd IS NULL BEGIN"
+    "  INSERT INTO nostrEvents_search(nostrEvents_search, rowid, content) VALUES ('delete', old.rowid, old.content);"
+    "  INSERT INTO nostrEvents_search(rowid, content) VALUES (new.rowid, new.content);"
+    " END;",
+
+    "ALTER TABLE nostrEvents ADD COLUMN event_json TEXT;",
+
+    /* Cover the row columns of an event record, so listings prefetch records without reading rows. */
+    "CREATE INDEX IF NOT EXISTS nostrEvents_id_record ON nostrEvents(id, created_at, kind, pubkey);"
+    "CREATE INDEX IF NOT EXISTS nostrEvents_pubkey_id_record ON nostrEvents(pubkey, id, created_at, kind);"
+    "DROP INDEX IF EXISTS nostrEvents_pubkey_id;",
     NULL
 };
 
 static int get_file_data(sqlite3_stmt *statement, char **ret_file_data);
+static int get_content_data(sqlite3_stmt *statement, char **ret_file_data);
+static int get_row_content(sqlite3_stmt *statement, char **ret_content);
+static int get_file_size(sqlite3_stmt *statement, off_t *ret_size);
+static int get_data_location(sqlite3_stmt *statement, const char *table, const char *column, DataLocation *ret_location);
+static int step_dir(DirCursor *cursor, void *buffer, DirEntryFiller filler, sqlite3_stmt *statement, bool lists_events);
+static int64_t query_integer(const Query *query);
+
+static void prepare_query(sqlite3 *db, Query *query, sqlite3_stmt **ret_statement) {
+    if (sqlite3_prepare_v3(
+        db, 
+        query->template, 
+        -1,
+        SQLITE_PREPARE_PERSISTENT,
+        ret_statement, 
+        NULL
+    ) != SQLITE_OK) {
+        fprintf(
+            stderr,
+            "Error preparing statement: \"%s\" error message: \"%s\"\n",
+            query->template,
+            sqlite3_errmsg(db)
+        );
+        exit(1);
+    }
+}
+
+static sqlite3 *open_db(int flags) {
+    sqlite3 *db;
+    if (sqlite3_open_v2(db_file_path, &db, flags | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open database file \"%s\": %s\n", db_file_path, sqlite3_errmsg(db));
+        exit(EXIT_FAILURE);
+    }
+    sqlite3_extended_result_codes(db, 1);
+    sqlite3_busy_timeout(db, k_busy_timeout_ms);
+    return db;
+}
+
+static size_t statement_slot(const Connection *connection, const sqlite3_stmt *statement) {
+    const uint64_t hash = (uint64_t) (uintptr_t) statement * 0x9e3779b97f4a7c15ULL;
+    return (hash >> 32) & (connection->num_statement_slots - 1);
+}
+
+/* The query index of a statement of this connection, or -1 for any other statement. */
+static int statement_query_index(const Connection *connection, const sqlite3_stmt *statement) {
+    for (size_t slot = statement_slot(connection, statement);; slot = (slot + 1) & (connection->num_statement_slots - 1)) {
+        const int index = connection->statement_slots[slot];
+        if (index < 0 || connection->statements[index] == statement)
+            return index;
+    }
+}
+
+static Connection *open_connection(void) {
+    Connection *connection = malloc(sizeof(Connection) + sizeof(sqlite3_stmt *) * num_queries);
+    assert(connection != NULL);
+
+    connection->db = open_db(SQLITE_OPEN_READONLY);
+    connection->decompression = ZSTD_createDCtx();
+    assert(connection->decompression != NULL);
+    connection->start_ns = calloc(num_queries, sizeof(uint64_t));
+    assert(connection->start_ns != NULL);
+    connection->data_version = -1;
+    for (int i = 0; all_queries[i] != NULL; i++) {
+        prepare_query(connection->db, all_queries[i], &connection->statements[all_queries[i]->index]);
+    }
+
+    connection->num_statement_slots = 1;
+    while (connection->num_statement_slots < 2 * (size_t) num_queries)
+        connection->num_statement_slots *= 2;
+    connection->statement_slots = malloc(connection->num_statement_slots * sizeof(int));
+    assert(connection->statement_slots != NULL);
+    for (size_t slot = 0; slot < connection->num_statement_slots; slot++) {
+        connection->statement_slots[slot] = -1;
+    }
+    for (int i = 0; i < num_queries; i++) {
+        size_t slot = statement_slot(connection, connection->statements[i]);
+        while (connection->statement_slots[slot] >= 0)
+            slot = (slot + 1) & (connection->num_statement_slots - 1);
+        connection->statement_slots[slot] = i;
+    }
+    return connection;
+}
+
+static void close_connection(void *connection_ptr) {
+    Connection *connection = connection_ptr;
+    for (int i = 0; i < num_queries; i++) {
+        sqlite3_finalize(connection->statements[i]);
+    }
+    sqlite3_close(connection->db);
+    ZSTD_freeDCtx(connection->decompression);
+    free(connection->start_ns);
+    free(connection->statement_slots);
+    free(connection);
+}
+
+static Connection *thread_connection(void) {
+    Connection *connection = pthread_getspecific(connection_key);
+    if (connection == NULL) {
+        connection = open_connection();
+        const bool set_successful = pthread_setspecific(connection_key, connection) == 0;
+        assert(set_successful);
+    }
+    return connection;
+}
+
+static sqlite3_stmt *query_statement(const Query *query) {
+    assert(query->index >= 0 && query->index < num_queries);
+    Connection *connection = thread_connection();
+    connection->start_ns[query->index] = stats_clock_ns();
+    return connection->statements[query->index];
+}
+
+/* Ends a run of a statement from query_statement, recording how long it took and what it did. */
+static int reset_statement(sqlite3_stmt *statement) {
+    Connection *connection = thread_connection();
+    const int index = statement_query_index(connection, statement);
+    if (index >= 0) {
+        const StatementCounters counters = {
+            .full_scan_steps = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1),
+            .sorts = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_SORT, 1),
+            .vm_steps = sqlite3_stmt_status(statement, SQLITE_STMTSTATUS_VM_STEP, 1)
+        };
+        record_query(index, connection->start_ns[index], &counters);
+    }
+    return sqlite3_reset(statement);
+}
+
+static const char *statement_errmsg(sqlite3_stmt *statement) {
+    return sqlite3_errmsg(sqlite3_db_handle(statement));
+}
 
 static void statement_bind_text(sqlite3_stmt *statement, int index, const char *text) {
     assert(statement != NULL);
@@ -63,195 +492,1781 @@ static void statement_bind_text(sqlite3_stmt *statement, int index, const char *
     assert(binding_successful);
 }
 
-static void statement_bind_number(sqlite3_stmt *statement, int index, char *number) {
+static void statement_bind_number(sqlite3_stmt *statement, int index, const char *number) {
     assert(statement != NULL);
     assert(number != NULL);
     const bool binding_successful = sqlite3_bind_int(statement, index, atoi(number)) == SQLITE_OK;
     assert(binding_successful);
 }
 
-static void statement_bind_id(sqlite3_stmt *query, Path path) {
-    statement_bind_text(query, 1, event_id_from_path(path));
+/*
+ * Binds an event id or pubkey in the database's key format.  With binary
+ * keys, a name that is not a hex id is bound as text, which no key equals.
+ */
+void statement_bind_key(sqlite3_stmt *statement, int index, const char *hex) {
+    assert(statement != NULL);
+    assert(hex != NULL);
+    unsigned char key[KEY_SIZE];
+    const bool binding_successful = (binary_keys && hex_to_key(hex, key) ?
+        sqlite3_bind_blob(statement, index, key, KEY_SIZE, SQLITE_TRANSIENT) :
+        sqlite3_bind_text(statement, index, hex, -1, SQLITE_TRANSIENT)
+    ) == SQLITE_OK;
+    assert(binding_successful);
+}
+
+static void statement_bind_id(sqlite3_stmt *query, const PathCaptures *captures) {
+    statement_bind_key(query, 1, captures->event_id);
+}
+
+/* Returns a column as text, spelling a binary key as hex in ret_hex. */
+static const char *column_text(sqlite3_stmt *statement, int column, char ret_hex[KEY_HEX_LENGTH + 1]) {
+    if (sqlite3_column_type(statement, column) == SQLITE_BLOB && sqlite3_column_bytes(statement, column) == KEY_SIZE) {
+        key_to_hex(sqlite3_column_blob(statement, column), ret_hex);
+        return ret_hex;
+    }
+    return (const char *) sqlite3_column_text(statement, column);
+}
+
+/*
+ * Viewing an event stats its directory and then stats and opens several of
+ * its files, each of which would otherwise run its own single-column query
+ * on the same row.  The first touch of an event, or a listing that names it,
+ * fetches every fixed-size fact about it at once into a direct-mapped table,
+ * and the rest of the view is served from there.  Any commit may rewrite
+ * rows, e.g. nostrfs-compress moving content out of its location.  Each
+ * record is stamped with the generation current before the query that read
+ * it, and forgetting starts a new generation, so a record read before a
+ * commit can neither be served nor kept after it.  Since the watcher only
+ * runs on live mounts, every thread also checks its own connection's
+ * data_version before using the records, at most once a millisecond: the
+ * check costs a read transaction, more than the hit it guards.
+ */
+
+static size_t event_record_slot(const char *event_id) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *c = event_id; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash % NUM_CACHED_EVENTS;
+}
+
+static pthread_mutex_t *event_record_lock(size_t slot) {
+    return &event_record_locks[slot % NUM_EVENT_RECORD_LOCKS];
+}
+
+static off_t column_located_size(sqlite3_stmt *statement, int column) {
+    return sqlite3_column_type(statement, column) == SQLITE_NULL ? -1 : sqlite3_column_int64(statement, column);
+}
+
+/*
+ * Reads the record columns that follow the id in the current row, with the
+ * sizes when the statement selects them.  Returns false for values too long
+ * to keep, which are then served by their own queries.
+ */
+static bool event_record_from_row(sqlite3_stmt *statement, const char *event_id, EventRecord *ret_record) {
+    char pubkey_hex[KEY_HEX_LENGTH + 1];
+    const char *pubkey = column_text(statement, 2, pubkey_hex);
+    const char *kind = (const char *) sqlite3_column_text(statement, 4);
+    if (pubkey == NULL || kind == NULL || strlen(event_id) > KEY_HEX_LENGTH || strlen(pubkey) > KEY_HEX_LENGTH || strlen(kind) >= sizeof(ret_record->kind))
+        return false;
+
+    strcpy(ret_record->id, event_id);
+    strcpy(ret_record->pubkey, pubkey);
+    strcpy(ret_record->kind, kind);
+    ret_record->rowid = sqlite3_column_int64(statement, 1);
+    ret_record->created_at = sqlite3_column_int64(statement, 3);
+    ret_record->has_sizes = sqlite3_column_count(statement) > 5;
+    if (!ret_record->has_sizes)
+        return true;
+    ret_record->content_size = sqlite3_column_int64(statement, 5);
+    ret_record->located_content_size = column_located_size(statement, 6);
+    ret_record->event_json_size = column_located_size(statement, 7);
+    ret_record->located_pubkey_size = column_located_size(statement, 8);
+    return true;
+}
+
+/*
+ * Forgets every record when this thread's connection has seen a commit
+ * since it last looked, if it is due to look, and returns the generation a query run next on it
+ * may stamp its records with.
+ */
+static unsigned long current_record_generation(void) {
+    Connection *connection = thread_connection();
+    const uint64_t now_ns = stats_clock_ns();
+    if (connection->data_version < 0 || now_ns - connection->data_version_ns >= k_data_version_interval_ns) {
+        const int64_t version = query_integer(&get_data_version_query);
+        if (version != connection->data_version) {
+            connection->data_version = version;
+            forget_event_records();
+        }
+        connection->data_version_ns = now_ns;
+    }
+    return atomic_load(&event_record_generation);
+}
+
+/*
+ * Keeps a record read in the current generation, unless it would replace the
+ * same event's record and lose its sizes.
+ */
+static void remember_event_record(const EventRecord *record) {
+    const size_t slot = event_record_slot(record->id);
+    pthread_mutex_lock(event_record_lock(slot));
+    const bool current = record->generation == atomic_load(&event_record_generation);
+    const bool replaces_sizes =
+        event_records[slot].generation == record->generation && strcmp(event_records[slot].id, record->id) == 0 && !record->has_sizes;
+    if (current && !replaces_sizes)
+        event_records[slot] = *record;
+    pthread_mutex_unlock(event_record_lock(slot));
+}
+
+/* Keeps the record of the event in the current row of an event id listing. */
+static void remember_listed_event(sqlite3_stmt *statement, const char *event_id, unsigned long generation) {
+    EventRecord record;
+    if (event_record_from_row(statement, event_id, &record)) {
+        record.generation = generation;
+        remember_event_record(&record);
+    }
+}
+
+/*
+ * Several ls -l or find runs at once, or readers opening the same files,
+ * miss on many records together.  Misses queue up here and at
+ * most k_max_record_fetchers threads at a time take every queued request,
+ * up to MAX_BATCHED_RECORDS, and answer them with one query.  A request for
+ * an event already queued or being fetched waits for that fetch instead.
+ * There is no window to wait out: a miss with a fetcher free is fetched at
+ * once, and batches form only while the fetchers are busy.
+ */
+
+/*
+ * Runs one query for a batch taken off the queue and hands out the records.
+ * Building the IN list costs about as much as a lookup, so a batch of one
+ * runs the single-row query.
+ */
+static void fetch_record_batch(RecordFetch **batch, int batch_size) {
+    const unsigned long generation = current_record_generation();
+    sqlite3_stmt *statement = query_statement(batch_size == 1 ? &get_event_record_query : &get_event_records_query);
+    assert(batch_size <= sqlite3_bind_parameter_count(statement));
+    for (int i = 0; i < sqlite3_bind_parameter_count(statement); i++) {
+        if (i < batch_size)
+            statement_bind_key(statement, i + 1, batch[i]->event_id);
+        else
+            sqlite3_bind_null(statement, i + 1);
+    }
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+        char id_hex[KEY_HEX_LENGTH + 1];
+        const char *id = column_text(statement, 0, id_hex);
+        for (int i = 0; id != NULL && i < batch_size; i++) {
+            if (!batch[i]->found && strcmp(batch[i]->event_id, id) == 0) {
+                batch[i]->found = event_record_from_row(statement, batch[i]->event_id, batch[i]->record);
+                if (batch[i]->found) {
+                    batch[i]->record->generation = generation;
+                    remember_event_record(batch[i]->record);
+                }
+            }
+        }
+    }
+    reset_statement(statement);
+}
+
+static bool fetch_event_record(const char *event_id, EventRecord *ret_record) {
+    pthread_mutex_lock(&record_fetches_lock);
+    for (RecordFetch *fetch = record_fetches; fetch != NULL; fetch = fetch->next) {
+        if (strcmp(fetch->event_id, event_id) == 0) {
+            fetch->num_sharers++;
+            num_shared_records++;
+            while (fetch->state != RECORD_FETCHED)
+                pthread_cond_wait(&record_fetches_changed, &record_fetches_lock);
+            const bool found = fetch->found;
+            if (found)
+                *ret_record = *fetch->record;
+            fetch->num_sharers--;
+            pthread_cond_broadcast(&record_fetches_changed);
+            pthread_mutex_unlock(&record_fetches_lock);
+            return found;
+        }
+    }
+
+    RecordFetch request = {event_id, ret_record, false, RECORD_PENDING, 0, NULL};
+    RecordFetch **tail = &record_fetches;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = &request;
+
+    while (request.state != RECORD_FETCHED) {
+        if (request.state == RECORD_PENDING && num_record_fetchers < k_max_record_fetchers) {
+            RecordFetch *batch[MAX_BATCHED_RECORDS] = {&request};
+            int batch_size = 1;
+            request.state = RECORD_FETCHING;
+            for (RecordFetch *fetch = record_fetches; fetch != NULL && batch_size < MAX_BATCHED_RECORDS; fetch = fetch->next) {
+                if (fetch->state == RECORD_PENDING) {
+                    fetch->state = RECORD_FETCHING;
+                    batch[batch_size++] = fetch;
+                }
+            }
+            num_record_fetchers++;
+            num_record_batches++;
+            num_batched_records += batch_size;
+            pthread_mutex_unlock(&record_fetches_lock);
+
+            fetch_record_batch(batch, batch_size);
+
+            pthread_mutex_lock(&record_fetches_lock);
+            for (int i = 0; i < batch_size; i++) {
+                batch[i]->state = RECORD_FETCHED;
+            }
+            num_record_fetchers--;
+            pthread_cond_broadcast(&record_fetches_changed);
+        }
+        else {
+            pthread_cond_wait(&record_fetches_changed, &record_fetches_lock);
+        }
+    }
+
+    while (request.num_sharers > 0)
+        pthread_cond_wait(&record_fetches_changed, &record_fetches_lock);
+    RecordFetch **link = &record_fetches;
+    while (*link != &request)
+        link = &(*link)->next;
+    *link = request.next;
+    pthread_mutex_unlock(&record_fetches_lock);
+    return request.found;
+}
+
+/*
+ * Copies out the record of an event, fetching it on a miss or when sizes
+ * are needed and the record lacks them.  Returns false when there is no
+ * record to serve from, in which case the caller runs its own query and
+ * reports what that finds.
+ */
+static bool get_event_record(const char *event_id, bool needs_sizes, EventRecord *ret_record) {
+    const unsigned long generation = current_record_generation();
+    const size_t slot = event_record_slot(event_id);
+    pthread_mutex_lock(event_record_lock(slot));
+    const bool hit =
+        event_id[0] != '\0' && event_records[slot].generation == generation && strcmp(event_records[slot].id, event_id) == 0 &&
+        (event_records[slot].has_sizes || !needs_sizes);
+    if (hit)
+        *ret_record = event_records[slot];
+    pthread_mutex_unlock(event_record_lock(slot));
+    if (hit) {
+        atomic_fetch_add(&event_record_hits, 1);
+        return true;
+    }
+    atomic_fetch_add(&event_record_misses, 1);
+    return fetch_event_record(event_id, ret_record);
+}
+
+/* Starts a new generation, which no record kept so far belongs to. */
+void forget_event_records(void) {
+    atomic_fetch_add(&event_record_generation, 1);
+}
+
+EventRecordStats event_record_stats(void) {
+    pthread_mutex_lock(&record_fetches_lock);
+    const EventRecordStats stats = {
+        .hits = atomic_load(&event_record_hits),
+        .misses = atomic_load(&event_record_misses),
+        .batches = num_record_batches,
+        .batched = num_batched_records,
+        .shared = num_shared_records
+    };
+    pthread_mutex_unlock(&record_fetches_lock);
+    return stats;
+}
+
+static void record_location(const EventRecord *record, const char *column, off_t size, DataLocation *ret_location) {
+    ret_location->table = "nostrEvents";
+    ret_location->column = column;
+    ret_location->rowid = record->rowid;
+    ret_location->size = size;
 }
 
-long event_creation_time(const char *event_id) {
-    statement_bind_text(get_created_at_query.statement, 1, event_id);
-    long time;
-    int step_status = sqlite3_step(get_created_at_query.statement);
+int event_creation_time(const char *event_id, time_t *ret_time) {
+    if (snapshot_is_open())
+        return snapshot_event_creation_time(event_id, ret_time);
+
+    EventRecord record;
+    if (get_event_record(event_id, false, &record)) {
+        *ret_time = record.created_at;
+        return 0;
+    }
+
+    sqlite3_stmt *statement = query_statement(&get_created_at_query);
+    statement_bind_key(statement, 1, event_id);
+    int readstatus;
+    int step_status = sqlite3_step(statement);
     if (step_status == SQLITE_ROW) {
-        time = sqlite3_column_int64(get_created_at_query.statement, 0);
+        *ret_time = sqlite3_column_int64(statement, 0);
+        readstatus = 0;
     }
     else if (step_status == SQLITE_DONE) {
-        time = ENOENT;
+        readstatus = ENOENT;
     }
     else {
-        fprintf(stderr, "Could not query event creation time: %s", sqlite3_errmsg(db));
+        fprintf(stderr, "Could not query event creation time: %s", statement_errmsg(statement));
         exit(1);
     }
-    sqlite3_reset(get_created_at_query.statement);
-    return time;
+    reset_statement(statement);
+    return readstatus;
 }
 
-void prepare_query(Query *query) {
-    if (sqlite3_prepare_v2(
-        db, 
-        query->template, 
-        -1,
-        &query->statement, 
-        NULL
-    ) != SQLITE_OK) {
-        fprintf(
-            stderr,
-            "Error preparing statement: \"%s\" error message: \"%s\"\n",
-            query->template,
-            sqlite3_errmsg(db)
-        );
-        exit(1);
+static int64_t query_integer(const Query *query) {
+    sqlite3_stmt *statement = query_statement(query);
+    if (sqlite3_step(statement) != SQLITE_ROW) {
+        fprintf(stderr, "Error running \"%s\": %s\n", query->template, statement_errmsg(statement));
+        exit(EXIT_FAILURE);
+    }
+    const int64_t value = sqlite3_column_int64(statement, 0);
+    reset_statement(statement);
+    return value;
+}
+
+/*
+ * Changes whenever another connection commits to the database.  The value
+ * is only comparable with earlier values read on the same thread.  A
+ * snapshot never changes.
+ */
+int64_t database_version(void) {
+    return snapshot_is_open() ? 0 : query_integer(&get_data_version_query);
+}
+
+int64_t latest_event_rowid(void) {
+    return snapshot_is_open() ? snapshot_num_events() : query_integer(&get_latest_event_rowid_query);
+}
+
+/*
+ * Passes up to max_events events inserted after *watermark to handler, in
+ * insertion order, and advances the watermark past them.  Returns how many
+ * events were passed.
+ */
+int read_new_events(int64_t *watermark, int max_events, NewEventHandler handler, void *arg) {
+    if (snapshot_is_open())
+        return 0;
+
+    sqlite3_stmt *statement = query_statement(&get_new_events_query);
+    sqlite3_bind_int64(statement, 1, *watermark);
+    sqlite3_bind_int(statement, 2, max_events);
+
+    int num_events = 0;
+    int stepstatus;
+    while ((stepstatus = sqlite3_step(statement)) == SQLITE_ROW) {
+        *watermark = sqlite3_column_int64(statement, 0);
+        char id[KEY_HEX_LENGTH + 1], pubkey[KEY_HEX_LENGTH + 1];
+        const NewEvent event = {
+            .id = column_text(statement, 1, id),
+            .pubkey = column_text(statement, 2, pubkey),
+            .kind = sqlite3_column_int64(statement, 3),
+            .created_at = sqlite3_column_int64(statement, 4)
+        };
+        if (event.id != NULL && event.pubkey != NULL)
+            handler(&event, arg);
+        num_events++;
     }
+    if (stepstatus != SQLITE_DONE)
+        fprintf(stderr, "Error reading new events: %s\n", statement_errmsg(statement));
+    reset_statement(statement);
+    return num_events;
 }
 
-static int fill_dir(void *buffer, fuse_fill_dir_t filler, sqlite3_stmt *statement) {
+/* Passes the single-letter tags of an event, by first value, to handler. */
+void read_indexed_tags(const char *event_id, IndexedTagHandler handler, void *arg) {
+    if (snapshot_is_open()) {
+        snapshot_read_indexed_tags(event_id, handler, arg);
+        return;
+    }
+
+    sqlite3_stmt *statement = query_statement(&get_event_indexed_tags_query);
+    statement_bind_key(statement, 1, event_id);
+
+    int stepstatus;
+    while ((stepstatus = sqlite3_step(statement)) == SQLITE_ROW) {
+        const char *key = (const char *) sqlite3_column_text(statement, 0);
+        const char *value = (const char *) sqlite3_column_text(statement, 1);
+        if (key != NULL && value != NULL && strlen(key) == 1)
+            handler(key, value, arg);
+    }
+    if (stepstatus != SQLITE_DONE)
+        fprintf(stderr, "Error reading event tags: %s\n", statement_errmsg(statement));
+    reset_statement(statement);
+}
+
+static int fill_dir(
+    DirCursor *cursor,
+    int last_key_index,
+    void *buffer,
+    DirEntryFiller filler,
+    sqlite3_stmt *statement
+) {
+    const bool binding_successful = (cursor->last_key == NULL ?
+        sqlite3_bind_null(statement, last_key_index) :
+        sqlite3_bind_text(statement, last_key_index, cursor->last_key, -1, SQLITE_TRANSIENT)
+    ) == SQLITE_OK;
+    assert(binding_successful);
+
+    return step_dir(cursor, buffer, filler, statement, false);
+}
+
+static void bind_last_key(DirCursor *cursor, int last_key_index, sqlite3_stmt *statement) {
+    if (cursor->last_key == NULL) {
+        const bool binding_successful = sqlite3_bind_null(statement, last_key_index) == SQLITE_OK;
+        assert(binding_successful);
+    }
+    else {
+        statement_bind_key(statement, last_key_index, cursor->last_key);
+    }
+}
+
+/* Like fill_dir, for listings keyed by event id or pubkey. */
+static int fill_key_dir(
+    DirCursor *cursor,
+    int last_key_index,
+    void *buffer,
+    DirEntryFiller filler,
+    sqlite3_stmt *statement
+) {
+    bind_last_key(cursor, last_key_index, statement);
+    return step_dir(cursor, buffer, filler, statement, false);
+}
+
+/* Like fill_key_dir, for listings that select EVENT_ROW_COLUMNS after each id. */
+static int fill_event_dir(
+    DirCursor *cursor,
+    int last_key_index,
+    void *buffer,
+    DirEntryFiller filler,
+    sqlite3_stmt *statement
+) {
+    bind_last_key(cursor, last_key_index, statement);
+    return step_dir(cursor, buffer, filler, statement, true);
+}
+
+/*
+ * Lists the first column of every row of an already bound statement,
+ * keeping the record of each event listed when lists_events is set.
+ */
+static int step_dir(DirCursor *cursor, void *buffer, DirEntryFiller filler, sqlite3_stmt *statement, bool lists_events) {
+    const unsigned long generation = lists_events ? current_record_generation() : 0;
     int stepstatus;
     while ((stepstatus = sqlite3_step(statement)) == SQLITE_ROW) {
-        const char *event_id;
-        event_id = (const char *) sqlite3_column_text(statement, 0);
-        filler(buffer, event_id, NULL, 0);
+        char hex[KEY_HEX_LENGTH + 1];
+        const char *name = column_text(statement, 0, hex);
+        if (lists_events)
+            remember_listed_event(statement, name, generation);
+        if (filler(buffer, name) != 0)
+            break;
+        advance_dir_cursor(cursor, name);
     }
 
     int fill_dir_status;
-    if (stepstatus != SQLITE_DONE) {
+    if (stepstatus != SQLITE_DONE && stepstatus != SQLITE_ROW) {
         fprintf(
             stderr, 
             "Error reading directory: error code %d: error message: %s", 
-            sqlite3_extended_errcode(db), 
-            sqlite3_errmsg(db)
+            sqlite3_extended_errcode(sqlite3_db_handle(statement)), 
+            statement_errmsg(statement)
         );
         fill_dir_status = -EINVAL;
     }
     else {
+        cursor->done = stepstatus == SQLITE_DONE;
         fill_dir_status = 0;
     }
 
-    const bool reset_successful = sqlite3_reset(statement) == SQLITE_OK;
+    const bool reset_successful = reset_statement(statement) == SQLITE_OK;
     assert(reset_successful);
 
     return fill_dir_status;
 }
 
-int fill_events_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    (void) path;
+int fill_events_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    (void) captures;
 
-    return fill_dir(buffer, filler, get_event_ids_query.statement);
+    if (snapshot_is_open())
+        return snapshot_fill_events_dir(cursor, buffer, filler);
+    return fill_event_dir(cursor, 1, buffer, filler, query_statement(&get_event_ids_query));
 }
 
-int fill_tags_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    sqlite3_stmt *statement = get_unique_tag_keys_query.statement;
-    statement_bind_text(statement, 1, event_id_from_path(path));
+int fill_tags_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (snapshot_is_open())
+        return snapshot_fill_tags_dir(captures->event_id, cursor, buffer, filler);
+
+    sqlite3_stmt *statement = query_statement(&get_unique_tag_keys_query);
+    statement_bind_key(statement, 1, captures->event_id);
 
-    return fill_dir(buffer, filler, statement);
+    return fill_dir(cursor, 2, buffer, filler, statement);
 }
 
-int fill_tag_key_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    sqlite3_stmt *statement = get_tag_indices_with_key_query.statement;
-    statement_bind_text(statement, 1, event_id_from_path(path));
-    statement_bind_text(statement, 2, tag_key_from_path(path));
+int fill_tag_key_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (snapshot_is_open())
+        return snapshot_fill_tag_key_dir(captures->event_id, captures->tag_key, cursor, buffer, filler);
 
-    return fill_dir(buffer, filler, statement);
+    sqlite3_stmt *statement = query_statement(&get_tag_indices_with_key_query);
+    statement_bind_key(statement, 1, captures->event_id);
+    statement_bind_text(statement, 2, captures->tag_key);
+
+    return fill_dir(cursor, 3, buffer, filler, statement);
 }
 
-int fill_tag_values_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    sqlite3_stmt *statement = get_tag_value_indices_query.statement;
-    statement_bind_text(statement, 1, event_id_from_path(path));
-    statement_bind_number(statement, 2, tag_index_from_path(path));
+int fill_tag_values_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (snapshot_is_open())
+        return snapshot_fill_tag_values_dir(captures->event_id, captures->tag_index, cursor, buffer, filler);
+
+    sqlite3_stmt *statement = query_statement(&get_tag_value_indices_query);
+    statement_bind_key(statement, 1, captures->event_id);
+    statement_bind_number(statement, 2, captures->tag_index);
 
-    return fill_dir(buffer, filler, statement);
+    return fill_dir(cursor, 3, buffer, filler, statement);
 }
 
-int fill_pubkeys_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    (void) path;
+int fill_pubkeys_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    (void) captures;
 
-    sqlite3_stmt *statement = get_pubkeys_query.statement;
-    return fill_dir(buffer, filler, statement);
+    if (snapshot_is_open())
+        return snapshot_fill_pubkeys_dir(cursor, buffer, filler);
+    sqlite3_stmt *statement = query_statement(&get_pubkeys_query);
+    return fill_key_dir(cursor, 1, buffer, filler, statement);
 }
 
-int fill_pubkey_events_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    sqlite3_stmt *statement = get_pubkey_event_ids_query.statement;
-    statement_bind_text(statement, 1, pubkey_from_path(path));
+int fill_pubkey_events_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (snapshot_is_open())
+        return snapshot_fill_pubkey_events_dir(captures->pubkey, cursor, buffer, filler);
 
-    return fill_dir(buffer, filler, statement);
+    sqlite3_stmt *statement = query_statement(&get_pubkey_event_ids_query);
+    statement_bind_key(statement, 1, captures->pubkey);
+
+    return fill_event_dir(cursor, 2, buffer, filler, statement);
 }
 
-int fill_pubkey_kinds_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    sqlite3_stmt *statement = get_pubkey_event_kinds_query.statement;
-    statement_bind_text(statement, 1, pubkey_from_path(path));
+int fill_pubkey_kinds_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (snapshot_is_open())
+        return snapshot_fill_pubkey_kinds_dir(captures->pubkey, cursor, buffer, filler);
+
+    sqlite3_stmt *statement = query_statement(&get_pubkey_event_kinds_query);
+    statement_bind_key(statement, 1, captures->pubkey);
 
-    return fill_dir(buffer, filler, statement);
+    return fill_dir(cursor, 2, buffer, filler, statement);
 }
 
-int get_tag_value(Path path, char **ret_file_data) {
-    sqlite3_stmt *statement = get_tag_value_query.statement;
+/*
+ * The time tree /t/YYYY/MM/DD/HH buckets events by UTC creation time.  Each
+ * directory is a time range; its children are the sub-ranges that contain
+ * at least one event, found by seeking the created_at index to the first
+ * event at or after the end of the previous child.  Listing a bucket costs
+ * one seek per child rather than a scan of the events inside it.
+ */
 
-    statement_bind_text(statement, 1, event_id_from_path(path));
-    statement_bind_number(statement, 2, tag_index_from_path(path));
-    statement_bind_number(statement, 3, tag_value_index_from_path(path));
+enum {
+    YEAR_BUCKET,
+    MONTH_BUCKET,
+    DAY_BUCKET,
+    HOUR_BUCKET,
+    NUM_BUCKET_LEVELS
+};
 
-    return get_file_data(statement, ret_file_data);
+static const int k_bucket_digits[NUM_BUCKET_LEVELS] = {4, 2, 2, 2};
+static const int k_bucket_min[NUM_BUCKET_LEVELS] = {1970, 1, 1, 0};
+static const int k_bucket_max[NUM_BUCKET_LEVELS] = {9999, 12, 31, 23};
+
+static int get_bucket_field(const struct tm *tm, int level) {
+    switch (level) {
+        case YEAR_BUCKET: return tm->tm_year + 1900;
+        case MONTH_BUCKET: return tm->tm_mon + 1;
+        case DAY_BUCKET: return tm->tm_mday;
+        case HOUR_BUCKET: return tm->tm_hour;
+        default: assert(false); return 0;
+    }
 }
 
-int get_event_content_data(Path path, char **ret_file_data) {
-    sqlite3_stmt *statement = get_content_query.statement;
-    statement_bind_id(statement, path);
-    return get_file_data(statement, ret_file_data);
+static void set_bucket_field(struct tm *tm, int level, int value) {
+    switch (level) {
+        case YEAR_BUCKET: tm->tm_year = value - 1900; break;
+        case MONTH_BUCKET: tm->tm_mon = value - 1; break;
+        case DAY_BUCKET: tm->tm_mday = value; break;
+        case HOUR_BUCKET: tm->tm_hour = value; break;
+        default: assert(false);
+    }
 }
 
-int get_event_kind_data(Path path, char **ret_file_data) {
-    sqlite3_stmt *statement = get_event_kind_query.statement;
-    statement_bind_id(statement, path);
-    return get_file_data(statement, ret_file_data);
+static void bucket_epoch(struct tm *ret_tm) {
+    memset(ret_tm, 0, sizeof(struct tm));
+    ret_tm->tm_year = 70;
+    ret_tm->tm_mday = 1;
 }
 
-int get_event_pubkey_data(Path path, char **ret_file_data) {
-    sqlite3_stmt *statement = get_event_pubkey_query.statement;
-    statement_bind_id(statement, path);
-    return get_file_data(statement, ret_file_data);
+/*
+ * Parses the first depth bucket names into the start of that bucket.  Only
+ * canonical, zero-padded names of real dates are accepted, so each bucket
+ * has exactly one path.
+ */
+static bool parse_bucket(const char *names[], int depth, struct tm *ret_tm) {
+    bucket_epoch(ret_tm);
+    for (int level = 0; level < depth; level++) {
+        const char *name = names[level];
+        if (name == NULL || (int) strlen(name) != k_bucket_digits[level])
+            return false;
+        int value = 0;
+        for (const char *c = name; *c != '\0'; c++) {
+            if (*c < '0' || *c > '9')
+                return false;
+            value = value * 10 + (*c - '0');
+        }
+        if (value < k_bucket_min[level] || value > k_bucket_max[level])
+            return false;
+        set_bucket_field(ret_tm, level, value);
+    }
+
+    struct tm normalized = *ret_tm;
+    timegm(&normalized);
+    return normalized.tm_mday == ret_tm->tm_mday;
 }
 
-static int get_file_data(sqlite3_stmt *statement, char **ret_file_data) {
-    assert(statement != NULL);
+/* The start of the bucket after the one containing tm at the given level. */
+static time_t next_bucket_start(const struct tm *tm, int level) {
+    struct tm next;
+    bucket_epoch(&next);
+    for (int i = 0; i <= level; i++) {
+        set_bucket_field(&next, i, get_bucket_field(tm, i));
+    }
+    set_bucket_field(&next, level, get_bucket_field(tm, level) + 1);
+    return timegm(&next);
+}
 
-    int stepstatus = sqlite3_step(statement);
-    int readstatus;
-    if (stepstatus == SQLITE_ROW) {
-        const char *file_data = (const char *) sqlite3_column_text(statement, 0);
-        size_t data_length = strlen(file_data);
-        *ret_file_data = calloc(data_length + 1, sizeof(char));
-        assert(*ret_file_data != NULL);
-        strcpy(*ret_file_data, file_data);
-        readstatus = 0;
+static bool first_event_time(time_t start, time_t end, time_t *ret_time) {
+    if (snapshot_is_open())
+        return snapshot_first_event_time(start, end, ret_time);
+
+    sqlite3_stmt *statement = query_statement(&get_first_event_time_query);
+    sqlite3_bind_int64(statement, 1, start);
+    sqlite3_bind_int64(statement, 2, end);
+
+    bool found = false;
+    const int stepstatus = sqlite3_step(statement);
+    if (stepstatus == SQLITE_ROW && sqlite3_column_type(statement, 0) != SQLITE_NULL) {
+        *ret_time = sqlite3_column_int64(statement, 0);
+        found = true;
     }
-    else if (stepstatus == SQLITE_DONE) {
-        readstatus = ENOENT;
+    else if (stepstatus != SQLITE_ROW) {
+        fprintf(stderr, "Error reading time bucket: %s\n", statement_errmsg(statement));
+    }
+    reset_statement(statement);
+    return found;
+}
+
+/* Lists the non-empty child buckets of the bucket named by the first depth captures. */
+static int fill_time_buckets(const PathCaptures *captures, int depth, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    const char *names[NUM_BUCKET_LEVELS] = {captures->year, captures->month, captures->day, captures->hour};
+
+    struct tm bucket;
+    if (!parse_bucket(names, depth, &bucket)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    time_t end;
+    if (depth == 0) {
+        struct tm last_year;
+        bucket_epoch(&last_year);
+        set_bucket_field(&last_year, YEAR_BUCKET, k_bucket_max[YEAR_BUCKET]);
+        end = next_bucket_start(&last_year, YEAR_BUCKET);
     }
     else {
-        fprintf(stderr, "Error opening event file: %s", sqlite3_errmsg(db));
-        readstatus = EINVAL;
+        end = next_bucket_start(&bucket, depth - 1);
     }
-    const bool reset_successful = sqlite3_reset(statement) == SQLITE_OK;
-    assert(reset_successful);
-    return readstatus;
-}
 
+    time_t next = timegm(&bucket);
+    if (cursor->last_key != NULL) {
+        struct tm last_child;
+        names[depth] = cursor->last_key;
+        const bool last_child_parsed = parse_bucket(names, depth + 1, &last_child);
+        assert(last_child_parsed);
+        next = next_bucket_start(&last_child, depth);
+    }
 
-void initialize_db(char *db_file_path) {
-    if (sqlite3_open(db_file_path, &db) != SQLITE_OK) {
-        fprintf(stderr, "Failed to open database file \"%s\": %s\n", db_file_path, sqlite3_errmsg(db));
-        exit(EXIT_FAILURE);
+    time_t created_at;
+    while (next < end && first_event_time(next, end, &created_at)) {
+        struct tm child;
+        gmtime_r(&created_at, &child);
+
+        char name[8];
+        snprintf(name, sizeof(name), "%0*d", k_bucket_digits[depth], get_bucket_field(&child, depth));
+        if (filler(buffer, name) != 0)
+            return 0;
+        advance_dir_cursor(cursor, name);
+        next = next_bucket_start(&child, depth);
     }
+    cursor->done = true;
+    return 0;
+}
 
-    sqlite3_extended_result_codes(db, 1);
+int fill_time_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    return fill_time_buckets(captures, 0, cursor, buffer, filler);
+}
 
-    for (int i = 0; all_queries[i] != NULL; i++) {
-        prepare_query(all_queries[i]);
+int fill_time_year_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    return fill_time_buckets(captures, 1, cursor, buffer, filler);
+}
+
+int fill_time_month_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    return fill_time_buckets(captures, 2, cursor, buffer, filler);
+}
+
+int fill_time_day_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    return fill_time_buckets(captures, 3, cursor, buffer, filler);
+}
+
+/* Lists the events of one hour in creation order. */
+int fill_time_hour_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    const char *names[NUM_BUCKET_LEVELS] = {captures->year, captures->month, captures->day, captures->hour};
+
+    struct tm hour;
+    if (!parse_bucket(names, NUM_BUCKET_LEVELS, &hour)) {
+        cursor->done = true;
+        return 0;
     }
 
+    if (snapshot_is_open())
+        return snapshot_fill_time_range(timegm(&hour), next_bucket_start(&hour, HOUR_BUCKET), cursor, buffer, filler);
+
+    sqlite3_stmt *statement = query_statement(&get_time_event_ids_query);
+    sqlite3_bind_int64(statement, 1, timegm(&hour));
+    sqlite3_bind_int64(statement, 2, next_bucket_start(&hour, HOUR_BUCKET));
+
+    return fill_key_dir(cursor, 3, buffer, filler, statement);
+}
+
+/* Writes the directory path of the hour bucket containing created_at. */
+void time_bucket_path(time_t created_at, char *ret_path, size_t size) {
+    struct tm tm;
+    gmtime_r(&created_at, &tm);
+    snprintf(
+        ret_path,
+        size,
+        "/t/%04d/%02d/%02d/%02d",
+        get_bucket_field(&tm, YEAR_BUCKET),
+        get_bucket_field(&tm, MONTH_BUCKET),
+        get_bucket_field(&tm, DAY_BUCKET),
+        get_bucket_field(&tm, HOUR_BUCKET)
+    );
+}
+
+/* Lists one author's events of one kind, newest first. */
+int fill_pubkey_kind_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (snapshot_is_open())
+        return snapshot_fill_pubkey_kind_dir(captures->pubkey, captures->kind, cursor, buffer, filler);
+
+    sqlite3_stmt *statement = query_statement(&get_pubkey_kind_events_query);
+    statement_bind_key(statement, 1, captures->pubkey);
+    statement_bind_number(statement, 2, captures->kind);
+
+    return fill_key_dir(cursor, 3, buffer, filler, statement);
+}
+
+/*
+ * The reverse tag index /tag/<key>/<value> lists the events whose
+ * single-letter tag <key> has <value> as its first value, the tags NIP-01
+ * makes queryable.  A partial index on tags(key, value, id) serves every
+ * level, so finding the replies to an event or the mentions of a pubkey is
+ * one seek.
+ */
+
+static bool is_valid_filename(const char *name) {
+    return
+        name[0] != '\0' &&
+        strcmp(name, ".") != 0 &&
+        strcmp(name, "..") != 0 &&
+        strchr(name, '/') == NULL &&
+        strlen(name) <= 255;
+}
+
+static bool is_indexed_tag_key(const char *key) {
+    return strlen(key) == 1 && is_valid_filename(key);
+}
+
+/*
+ * Lists the distinct values of an indexed column with one seek per value:
+ * query selects the smallest value after its last-key parameter, and its
+ * other parameters are already bound.
+ * Values that cannot be filenames are stepped over without being listed.
+ */
+static int fill_distinct_dir(
+    DirCursor *cursor,
+    int last_key_index,
+    void *buffer,
+    DirEntryFiller filler,
+    const Query *query,
+    bool (* is_listed)(const char *name)
+) {
+    char *seek_key = strdup(cursor->last_key != NULL ? cursor->last_key : "");
+    assert(seek_key != NULL);
+
+    int fill_dir_status = 0;
+    while (true) {
+        sqlite3_stmt *statement = query_statement(query);
+        statement_bind_text(statement, last_key_index, seek_key);
+        const int stepstatus = sqlite3_step(statement);
+        char *name = NULL;
+        if (stepstatus == SQLITE_ROW && sqlite3_column_type(statement, 0) != SQLITE_NULL) {
+            name = strdup((const char *) sqlite3_column_text(statement, 0));
+            assert(name != NULL);
+        }
+        else if (stepstatus == SQLITE_ROW) {
+            cursor->done = true;
+        }
+        else {
+            fprintf(stderr, "Error reading directory: %s\n", statement_errmsg(statement));
+            fill_dir_status = -EINVAL;
+        }
+        reset_statement(statement);
+        if (name == NULL)
+            break;
+
+        if (is_listed(name)) {
+            if (filler(buffer, name) != 0) {
+                free(name);
+                break;
+            }
+            advance_dir_cursor(cursor, name);
+        }
+        free(seek_key);
+        seek_key = name;
+    }
+    free(seek_key);
+    return fill_dir_status;
+}
+
+int fill_tag_index_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    (void) captures;
+
+    if (snapshot_is_open())
+        return snapshot_fill_indexed_tags(NULL, cursor, buffer, filler, is_indexed_tag_key);
+    return fill_distinct_dir(cursor, 1, buffer, filler, &get_indexed_tag_keys_query, is_indexed_tag_key);
+}
+
+int fill_tag_index_key_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (!is_indexed_tag_key(captures->indexed_key)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    if (snapshot_is_open())
+        return snapshot_fill_indexed_tags(captures->indexed_key, cursor, buffer, filler, is_valid_filename);
+
+    statement_bind_text(query_statement(&get_indexed_tag_values_query), 1, captures->indexed_key);
+
+    return fill_distinct_dir(cursor, 2, buffer, filler, &get_indexed_tag_values_query, is_valid_filename);
+}
+
+int fill_tag_index_value_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    if (!is_indexed_tag_key(captures->indexed_key)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    if (snapshot_is_open())
+        return snapshot_fill_tagged_events(captures->indexed_key, captures->indexed_value, cursor, buffer, filler);
+
+    sqlite3_stmt *statement = query_statement(&get_tagged_event_ids_query);
+    statement_bind_text(statement, 1, captures->indexed_key);
+    statement_bind_text(statement, 2, captures->indexed_value);
+
+    return fill_key_dir(cursor, 3, buffer, filler, statement);
+}
+
+/*
+ * /search/<query> lists the events whose content contains every word of
+ * <query>, best bm25 match first, served by the FTS5 index that triggers
+ * keep in step with nostrEvents.  Ranked results have no stable key to
+ * resume after, so listings page by position and stop at the search limit.
+ * Snapshots carry no full-text index, so searching one lists nothing.
+ */
+
+void set_search_limit(unsigned int limit) {
+    search_limit = limit;
+}
+
+/*
+ * Quotes each whitespace-separated word of name as an FTS5 string, so that
+ * punctuation in a directory name is searched for rather than parsed as
+ * query syntax.  Returns NULL when name has no words.
+ */
+static char *search_terms_query(const char *name) {
+    char *query = malloc(strlen(name) * 4 + 1);
+    assert(query != NULL);
+
+    char *end = query;
+    const char *c = name;
+    while (*c != '\0') {
+        if (*c == ' ' || *c == '\t') {
+            c++;
+            continue;
+        }
+        if (end != query)
+            *end++ = ' ';
+        *end++ = '"';
+        for (; *c != '\0' && *c != ' ' && *c != '\t'; c++) {
+            if (*c == '"')
+                *end++ = '"';
+            *end++ = *c;
+        }
+        *end++ = '"';
+    }
+    *end = '\0';
+
+    if (end == query) {
+        free(query);
+        return NULL;
+    }
+    return query;
+}
+
+int fill_search_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    char *terms = snapshot_is_open() ? NULL : search_terms_query(captures->search_query);
+    if (terms == NULL || cursor->position >= (long) search_limit) {
+        free(terms);
+        cursor->done = true;
+        return 0;
+    }
+
+    sqlite3_stmt *statement = query_statement(&search_event_ids_query);
+    statement_bind_text(statement, 1, terms);
+    sqlite3_bind_int64(statement, 2, search_limit - cursor->position);
+    sqlite3_bind_int64(statement, 3, cursor->position);
+
+    const int fill_status = step_dir(cursor, buffer, filler, statement, false);
+    free(terms);
+    return fill_status;
+}
+
+/* Copies the whole of a located value into a new string. */
+static int get_located_data(const DataLocation *location, char **ret_file_data) {
+    size_t length;
+    *ret_file_data = malloc(location->size + 1);
+    assert(*ret_file_data != NULL);
+    const int readstatus = read_data_location(location, 0, location->size, *ret_file_data, &length);
+    (*ret_file_data)[length] = '\0';
+    if (readstatus != 0) {
+        free(*ret_file_data);
+        *ret_file_data = NULL;
+    }
+    return readstatus;
+}
+
+/* Snapshot files are all located values, so their data and sizes come from locate. */
+static int get_snapshot_data(DataLocator locate, const PathCaptures *captures, char **ret_file_data) {
+    DataLocation location;
+    const int locate_status = locate(captures, &location);
+    return locate_status != 0 ? locate_status : get_located_data(&location, ret_file_data);
+}
+
+static int get_snapshot_size(DataLocator locate, const PathCaptures *captures, off_t *ret_size) {
+    DataLocation location;
+    const int locate_status = locate(captures, &location);
+    if (locate_status == 0)
+        *ret_size = location.size;
+    return locate_status;
+}
+
+/* Spells a snapshot event's kind the way SQLite spells an integer column. */
+static int snapshot_kind_text(const char *event_id, char *ret_text) {
+    int64_t kind;
+    const int readstatus = snapshot_event_kind(event_id, &kind);
+    if (readstatus == 0)
+        snprintf(ret_text, KEY_HEX_LENGTH + 1, "%lld", (long long) kind);
+    return readstatus;
+}
+
+/* Serves a short snapshot file that get_text writes into a key-sized buffer. */
+static int get_snapshot_text(int (* get_text)(const char *event_id, char *ret_text), const char *event_id, char **ret_file_data) {
+    char text[KEY_HEX_LENGTH + 1];
+    const int readstatus = get_text(event_id, text);
+    if (readstatus == 0) {
+        *ret_file_data = strdup(text);
+        assert(*ret_file_data != NULL);
+    }
+    return readstatus;
+}
+
+static int get_snapshot_text_size(int (* get_text)(const char *event_id, char *ret_text), const char *event_id, off_t *ret_size) {
+    char text[KEY_HEX_LENGTH + 1];
+    const int readstatus = get_text(event_id, text);
+    if (readstatus == 0)
+        *ret_size = strlen(text);
+    return readstatus;
+}
+
+int get_tag_value(const PathCaptures *captures, char **ret_file_data) {
+    if (snapshot_is_open())
+        return get_snapshot_data(locate_tag_value, captures, ret_file_data);
+
+    sqlite3_stmt *statement = query_statement(&get_tag_value_query);
+
+    statement_bind_key(statement, 1, captures->event_id);
+    statement_bind_number(statement, 2, captures->tag_index);
+    statement_bind_number(statement, 3, captures->tag_value_index);
+
+    return get_file_data(statement, ret_file_data);
+}
+
+int get_tag_value_size(const PathCaptures *captures, off_t *ret_size) {
+    if (snapshot_is_open())
+        return get_snapshot_size(locate_tag_value, captures, ret_size);
+
+    sqlite3_stmt *statement = query_statement(&get_tag_value_size_query);
+
+    statement_bind_key(statement, 1, captures->event_id);
+    statement_bind_number(statement, 2, captures->tag_index);
+    statement_bind_number(statement, 3, captures->tag_value_index);
+
+    return get_file_size(statement, ret_size);
+}
+
+int get_event_content_data(const PathCaptures *captures, char **ret_file_data) {
+    if (snapshot_is_open())
+        return get_snapshot_data(locate_event_content, captures, ret_file_data);
+    sqlite3_stmt *statement = query_statement(&get_content_query);
+    statement_bind_id(statement, captures);
+    return get_content_data(statement, ret_file_data);
+}
+
+int get_event_kind_data(const PathCaptures *captures, char **ret_file_data) {
+    if (snapshot_is_open())
+        return get_snapshot_text(snapshot_kind_text, captures->event_id, ret_file_data);
+    EventRecord record;
+    if (get_event_record(captures->event_id, false, &record)) {
+        *ret_file_data = strdup(record.kind);
+        assert(*ret_file_data != NULL);
+        return 0;
+    }
+    sqlite3_stmt *statement = query_statement(&get_event_kind_query);
+    statement_bind_id(statement, captures);
+    return get_file_data(statement, ret_file_data);
+}
+
+int get_event_pubkey_data(const PathCaptures *captures, char **ret_file_data) {
+    if (snapshot_is_open())
+        return get_snapshot_text(snapshot_event_pubkey, captures->event_id, ret_file_data);
+    EventRecord record;
+    if (get_event_record(captures->event_id, false, &record)) {
+        *ret_file_data = strdup(record.pubkey);
+        assert(*ret_file_data != NULL);
+        return 0;
+    }
+    sqlite3_stmt *statement = query_statement(&get_event_pubkey_query);
+    statement_bind_id(statement, captures);
+    return get_file_data(statement, ret_file_data);
+}
+
+int get_event_content_size(const PathCaptures *captures, off_t *ret_size) {
+    if (snapshot_is_open())
+        return get_snapshot_size(locate_event_content, captures, ret_size);
+    EventRecord record;
+    if (get_event_record(captures->event_id, true, &record)) {
+        *ret_size = record.content_size;
+        return 0;
+    }
+    sqlite3_stmt *statement = query_statement(&get_content_size_query);
+    statement_bind_id(statement, captures);
+    return get_file_size(statement, ret_size);
+}
+
+int get_event_kind_size(const PathCaptures *captures, off_t *ret_size) {
+    if (snapshot_is_open())
+        return get_snapshot_text_size(snapshot_kind_text, captures->event_id, ret_size);
+    EventRecord record;
+    if (get_event_record(captures->event_id, false, &record)) {
+        *ret_size = strlen(record.kind);
+        return 0;
+    }
+    sqlite3_stmt *statement = query_statement(&get_event_kind_size_query);
+    statement_bind_id(statement, captures);
+    return get_file_size(statement, ret_size);
+}
+
+int get_event_pubkey_size(const PathCaptures *captures, off_t *ret_size) {
+    if (snapshot_is_open())
+        return get_snapshot_text_size(snapshot_event_pubkey, captures->event_id, ret_size);
+    EventRecord record;
+    if (get_event_record(captures->event_id, false, &record)) {
+        *ret_size = strlen(record.pubkey);
+        return 0;
+    }
+    sqlite3_stmt *statement = query_statement(&get_event_pubkey_size_query);
+    statement_bind_id(statement, captures);
+    return get_file_size(statement, ret_size);
+}
+
+static void append_column_string(Buffer *json, sqlite3_stmt *statement, int column) {
+    char hex[KEY_HEX_LENGTH + 1];
+    const char *value = column_text(statement, column, hex);
+    const size_t length = value == hex ? KEY_HEX_LENGTH : (size_t) sqlite3_column_bytes(statement, column);
+    buffer_append_json_string(json, value != NULL ? value : "", length);
+}
+
+/* Appends the tags array of an event, one array of key and values per tag. */
+static int append_event_tags(const char *event_id, Buffer *json) {
+    sqlite3_stmt *statement = query_statement(&get_event_tags_query);
+    statement_bind_key(statement, 1, event_id);
+
+    buffer_append_char(json, '[');
+    int64_t tag_index = -1;
+    int stepstatus;
+    while ((stepstatus = sqlite3_step(statement)) == SQLITE_ROW) {
+        const int64_t row_tag_index = sqlite3_column_int64(statement, 0);
+        if (row_tag_index != tag_index) {
+            if (tag_index >= 0)
+                BUFFER_APPEND_LITERAL(json, "],");
+            buffer_append_char(json, '[');
+            append_column_string(json, statement, 1);
+            tag_index = row_tag_index;
+        }
+        buffer_append_char(json, ',');
+        append_column_string(json, statement, 2);
+    }
+    if (tag_index >= 0)
+        buffer_append_char(json, ']');
+    buffer_append_char(json, ']');
+
+    int readstatus = 0;
+    if (stepstatus != SQLITE_DONE) {
+        fprintf(stderr, "Error reading event tags: %s\n", statement_errmsg(statement));
+        readstatus = EINVAL;
+    }
+    reset_statement(statement);
+    return readstatus;
+}
+
+/*
+ * Renders an event as its NIP-01 JSON object from one row fetch and one
+ * ordered scan of its tags.  Tags without values are not stored, so they
+ * cannot be rendered; events imported with their JSON keep them.
+ */
+static int render_event_json(const char *event_id, Buffer *ret_json) {
+    sqlite3_stmt *statement = query_statement(&get_event_query);
+    statement_bind_key(statement, 1, event_id);
+
+    const int stepstatus = sqlite3_step(statement);
+    char *content = NULL;
+    int readstatus;
+    if (stepstatus == SQLITE_ROW) {
+        readstatus = get_row_content(statement, &content);
+    }
+    else if (stepstatus == SQLITE_DONE) {
+        readstatus = ENOENT;
+    }
+    else {
+        fprintf(stderr, "Error reading event: %s\n", statement_errmsg(statement));
+        readstatus = EINVAL;
+    }
+
+    if (readstatus == 0) {
+        char numbers[96];
+        BUFFER_APPEND_LITERAL(ret_json, "{\"id\":");
+        buffer_append_json_string(ret_json, event_id, strlen(event_id));
+        BUFFER_APPEND_LITERAL(ret_json, ",\"pubkey\":");
+        append_column_string(ret_json, statement, 5);
+        const int numbers_length = snprintf(
+            numbers,
+            sizeof(numbers),
+            ",\"created_at\":%lld,\"kind\":%lld,\"tags\":",
+            (long long) sqlite3_column_int64(statement, 6),
+            (long long) sqlite3_column_int64(statement, 7)
+        );
+        buffer_append(ret_json, numbers, numbers_length);
+        readstatus = append_event_tags(event_id, ret_json);
+        BUFFER_APPEND_LITERAL(ret_json, ",\"content\":");
+        buffer_append_json_string(ret_json, content, strlen(content));
+        BUFFER_APPEND_LITERAL(ret_json, ",\"sig\":");
+        append_column_string(ret_json, statement, 8);
+        buffer_append_char(ret_json, '}');
+    }
+    free(content);
+    reset_statement(statement);
+    return readstatus;
+}
+
+int get_event_json_data(const PathCaptures *captures, char **ret_file_data) {
+    DataLocation location;
+    if (locate_event_json(captures, &location) == 0)
+        return get_located_data(&location, ret_file_data);
+    if (snapshot_is_open())
+        return ENOENT;
+
+    Buffer json = {0};
+    const int readstatus = render_event_json(captures->event_id, &json);
+    if (readstatus != 0) {
+        free(json.data);
+        return readstatus;
+    }
+    buffer_append_char(&json, '\0');
+    *ret_file_data = json.data;
+    return 0;
+}
+
+int get_event_json_size(const PathCaptures *captures, off_t *ret_size) {
+    DataLocation location;
+    if (locate_event_json(captures, &location) == 0) {
+        *ret_size = location.size;
+        return 0;
+    }
+    if (snapshot_is_open())
+        return ENOENT;
+
+    const ArenaMark mark = arena_mark();
+    Buffer json = {.in_arena = true};
+    const int readstatus = render_event_json(captures->event_id, &json);
+    if (readstatus == 0)
+        *ret_size = json.length;
+    arena_release(mark);
+    return readstatus;
+}
+
+/* Events imported with nostrfs-import -J keep the JSON they were published as. */
+int locate_event_json(const PathCaptures *captures, DataLocation *ret_location) {
+    if (snapshot_is_open())
+        return snapshot_locate_event_json(captures->event_id, ret_location);
+
+    EventRecord record;
+    if (get_event_record(captures->event_id, true, &record)) {
+        if (record.event_json_size < 0)
+            return ENOENT;
+        record_location(&record, "event_json", record.event_json_size, ret_location);
+        return 0;
+    }
+    sqlite3_stmt *statement = query_statement(&locate_event_json_query);
+    statement_bind_id(statement, captures);
+    return get_data_location(statement, "nostrEvents", "event_json", ret_location);
+}
+
+int locate_event_content(const PathCaptures *captures, DataLocation *ret_location) {
+    if (snapshot_is_open())
+        return snapshot_locate_content(captures->event_id, ret_location);
+
+    EventRecord record;
+    if (get_event_record(captures->event_id, true, &record)) {
+        if (record.located_content_size < 0)
+            return ENOENT;
+        record_location(&record, "content", record.located_content_size, ret_location);
+        return 0;
+    }
+    sqlite3_stmt *statement = query_statement(&locate_content_query);
+    statement_bind_id(statement, captures);
+    return get_data_location(statement, "nostrEvents", "content", ret_location);
+}
+
+/* A snapshot stores pubkeys as binary keys, so its pubkey files are served by fetch. */
+int locate_event_pubkey(const PathCaptures *captures, DataLocation *ret_location) {
+    if (snapshot_is_open())
+        return ENOENT;
+
+    EventRecord record;
+    if (get_event_record(captures->event_id, true, &record)) {
+        if (record.located_pubkey_size < 0)
+            return ENOENT;
+        record_location(&record, "pubkey", record.located_pubkey_size, ret_location);
+        return 0;
+    }
+
+    sqlite3_stmt *statement = query_statement(&locate_event_pubkey_query);
+    statement_bind_id(statement, captures);
+    return get_data_location(statement, "nostrEvents", "pubkey", ret_location);
+}
+
+int locate_tag_value(const PathCaptures *captures, DataLocation *ret_location) {
+    if (snapshot_is_open())
+        return snapshot_locate_tag_value(captures->event_id, captures->tag_index, captures->tag_value_index, ret_location);
+
+    sqlite3_stmt *statement = query_statement(&locate_tag_value_query);
+
+    statement_bind_key(statement, 1, captures->event_id);
+    statement_bind_number(statement, 2, captures->tag_index);
+    statement_bind_number(statement, 3, captures->tag_value_index);
+
+    return get_data_location(statement, "tags", "value", ret_location);
+}
+
+/*
+ * Reads one slice of a located value.  The blob handle is opened on the
+ * calling thread's connection and closed again straight away: an open handle
+ * would pin that connection's read transaction between requests, and the
+ * next read of the same file may arrive on another thread anyway.
+ */
+int read_data_location(
+    const DataLocation *location, off_t offset, size_t size, char *ret_buffer, size_t *ret_length
+) {
+    if (snapshot_is_open())
+        return snapshot_read(location, offset, size, ret_buffer, ret_length);
+
+    *ret_length = 0;
+    if (offset >= location->size || size == 0)
+        return 0;
+
+    sqlite3 *db = thread_connection()->db;
+    sqlite3_blob *blob;
+    if (sqlite3_blob_open(db, "main", location->table, location->column, location->rowid, 0, &blob) != SQLITE_OK) {
+        fprintf(stderr, "Error opening %s.%s row %lld: %s\n", location->table, location->column, (long long) location->rowid, sqlite3_errmsg(db));
+        sqlite3_blob_close(blob);
+        return EIO;
+    }
+
+    const off_t blob_size = sqlite3_blob_bytes(blob);
+    int read_status = 0;
+    if (offset < blob_size) {
+        const size_t length = (size_t) (blob_size - offset) < size ? (size_t) (blob_size - offset) : size;
+        if (sqlite3_blob_read(blob, ret_buffer, length, offset) == SQLITE_OK) {
+            *ret_length = length;
+        }
+        else {
+            fprintf(stderr, "Error reading %s.%s row %lld: %s\n", location->table, location->column, (long long) location->rowid, sqlite3_errmsg(db));
+            read_status = EIO;
+        }
+    }
+    sqlite3_blob_close(blob);
+    return read_status;
+}
+
+static int get_file_data(sqlite3_stmt *statement, char **ret_file_data) {
+    assert(statement != NULL);
+
+    int stepstatus = sqlite3_step(statement);
+    int readstatus;
+    if (stepstatus == SQLITE_ROW) {
+        char hex[KEY_HEX_LENGTH + 1];
+        const char *file_data = column_text(statement, 0, hex);
+        size_t data_length = strlen(file_data);
+        *ret_file_data = calloc(data_length + 1, sizeof(char));
+        assert(*ret_file_data != NULL);
+        strcpy(*ret_file_data, file_data);
+        readstatus = 0;
+    }
+    else if (stepstatus == SQLITE_DONE) {
+        readstatus = ENOENT;
+    }
+    else {
+        fprintf(stderr, "Error opening event file: %s", statement_errmsg(statement));
+        readstatus = EINVAL;
+    }
+    const bool reset_successful = reset_statement(statement) == SQLITE_OK;
+    assert(reset_successful);
+    return readstatus;
+}
+
+/* Returns the decompression dictionary with the given id, loading it on first use. */
+static ZSTD_DDict *content_dictionary(int64_t id) {
+    pthread_mutex_lock(&dictionaries_lock);
+    ZSTD_DDict *dictionary = NULL;
+    for (int i = 0; i < num_dictionaries && dictionary == NULL; i++) {
+        if (dictionaries[i].id == id)
+            dictionary = dictionaries[i].dictionary;
+    }
+
+    if (dictionary == NULL) {
+        sqlite3_stmt *statement = query_statement(&get_content_dictionary_query);
+        sqlite3_bind_int64(statement, 1, id);
+        if (sqlite3_step(statement) == SQLITE_ROW) {
+            dictionary = ZSTD_createDDict(sqlite3_column_blob(statement, 0), sqlite3_column_bytes(statement, 0));
+        }
+        if (dictionary != NULL) {
+            dictionaries = realloc(dictionaries, (num_dictionaries + 1) * sizeof(ContentDictionary));
+            assert(dictionaries != NULL);
+            dictionaries[num_dictionaries++] = (ContentDictionary) {.id = id, .dictionary = dictionary};
+        }
+        else {
+            fprintf(stderr, "Could not load content dictionary %lld: %s\n", (long long) id, statement_errmsg(statement));
+        }
+        reset_statement(statement);
+    }
+    pthread_mutex_unlock(&dictionaries_lock);
+    return dictionary;
+}
+
+static char *cached_content(int64_t rowid) {
+    CachedContent *entry = &content_cache[(uint64_t) rowid % NUM_CACHED_CONTENTS];
+    char *data = NULL;
+    pthread_mutex_lock(&content_cache_lock);
+    if (entry->data != NULL && entry->rowid == rowid) {
+        data = malloc(entry->size + 1);
+        assert(data != NULL);
+        memcpy(data, entry->data, entry->size + 1);
+    }
+    pthread_mutex_unlock(&content_cache_lock);
+    return data;
+}
+
+static void cache_content(int64_t rowid, const char *data, size_t size) {
+    char *copy = malloc(size + 1);
+    assert(copy != NULL);
+    memcpy(copy, data, size + 1);
+
+    CachedContent *entry = &content_cache[(uint64_t) rowid % NUM_CACHED_CONTENTS];
+    pthread_mutex_lock(&content_cache_lock);
+    char *evicted = entry->data;
+    *entry = (CachedContent) {.rowid = rowid, .size = size, .data = copy};
+    pthread_mutex_unlock(&content_cache_lock);
+    free(evicted);
+}
+
+/*
+ * Decompresses the content of the current row of get_content_query.  The
+ * last few values decompressed stay cached, since a file is typically
+ * reopened and read again soon after, e.g. by grep after ls -l.
+ */
+static int decompress_content(sqlite3_stmt *statement, char **ret_file_data) {
+    const int64_t rowid = sqlite3_column_int64(statement, 4);
+    *ret_file_data = cached_content(rowid);
+    if (*ret_file_data != NULL)
+        return 0;
+
+    ZSTD_DDict *dictionary = NULL;
+    if (sqlite3_column_type(statement, 2) != SQLITE_NULL) {
+        dictionary = content_dictionary(sqlite3_column_int64(statement, 2));
+        if (dictionary == NULL)
+            return EIO;
+    }
+
+    const size_t size = sqlite3_column_int64(statement, 3);
+    const void *compressed = sqlite3_column_blob(statement, 1);
+    const size_t compressed_size = sqlite3_column_bytes(statement, 1);
+    char *data = malloc(size + 1);
+    assert(data != NULL);
+
+    ZSTD_DCtx *decompression = thread_connection()->decompression;
+    const size_t decompressed_size = dictionary != NULL ?
+        ZSTD_decompress_usingDDict(decompression, data, size, compressed, compressed_size, dictionary) :
+        ZSTD_decompressDCtx(decompression, data, size, compressed, compressed_size);
+    if (ZSTD_isError(decompressed_size) || decompressed_size != size) {
+        fprintf(
+            stderr,
+            "Error decompressing content of row %lld: %s\n",
+            (long long) rowid,
+            ZSTD_isError(decompressed_size) ? ZSTD_getErrorName(decompressed_size) : "size mismatch"
+        );
+        free(data);
+        return EIO;
+    }
+    data[size] = '\0';
+
+    cache_content(rowid, data, size);
+    *ret_file_data = data;
+    return 0;
+}
+
+/*
+ * Copies out the content of the current row of a statement whose first
+ * columns are those of get_content_query.
+ */
+static int get_row_content(sqlite3_stmt *statement, char **ret_content) {
+    if (sqlite3_column_type(statement, 1) != SQLITE_NULL)
+        return decompress_content(statement, ret_content);
+
+    const char *content = (const char *) sqlite3_column_text(statement, 0);
+    *ret_content = strdup(content != NULL ? content : "");
+    assert(*ret_content != NULL);
+    return 0;
+}
+
+static int get_content_data(sqlite3_stmt *statement, char **ret_file_data) {
+    assert(statement != NULL);
+
+    int stepstatus = sqlite3_step(statement);
+    int readstatus;
+    if (stepstatus == SQLITE_ROW) {
+        readstatus = get_row_content(statement, ret_file_data);
+    }
+    else if (stepstatus == SQLITE_DONE) {
+        readstatus = ENOENT;
+    }
+    else {
+        fprintf(stderr, "Error opening event content: %s\n", statement_errmsg(statement));
+        readstatus = EINVAL;
+    }
+    const bool reset_successful = reset_statement(statement) == SQLITE_OK;
+    assert(reset_successful);
+    return readstatus;
+}
+
+/*
+ * Size queries compute the byte length inside SQLite so no payload is copied
+ * out of the database.  A NULL column has no length and reads as empty.
+ */
+static int get_file_size(sqlite3_stmt *statement, off_t *ret_size) {
+    assert(statement != NULL);
+
+    int stepstatus = sqlite3_step(statement);
+    int readstatus;
+    if (stepstatus == SQLITE_ROW) {
+        *ret_size = sqlite3_column_int64(statement, 0);
+        readstatus = 0;
+    }
+    else if (stepstatus == SQLITE_DONE) {
+        readstatus = ENOENT;
+    }
+    else {
+        fprintf(stderr, "Error reading event file size: %s\n", statement_errmsg(statement));
+        readstatus = EINVAL;
+    }
+    const bool reset_successful = reset_statement(statement) == SQLITE_OK;
+    assert(reset_successful);
+    return readstatus;
+}
+
+static int get_data_location(sqlite3_stmt *statement, const char *table, const char *column, DataLocation *ret_location) {
+    assert(statement != NULL);
+
+    int stepstatus = sqlite3_step(statement);
+    int readstatus;
+    if (stepstatus == SQLITE_ROW) {
+        ret_location->table = table;
+        ret_location->column = column;
+        ret_location->rowid = sqlite3_column_int64(statement, 0);
+        ret_location->size = sqlite3_column_int64(statement, 1);
+        readstatus = 0;
+    }
+    else if (stepstatus == SQLITE_DONE) {
+        readstatus = ENOENT;
+    }
+    else {
+        fprintf(stderr, "Error locating event file: %s\n", statement_errmsg(statement));
+        readstatus = EINVAL;
+    }
+    const bool reset_successful = reset_statement(statement) == SQLITE_OK;
+    assert(reset_successful);
+    return readstatus;
+}
+
+static int schema_version(sqlite3 *db) {
+    sqlite3_stmt *statement;
+    Query version_query = NEW_QUERY("PRAGMA user_version;");
+    prepare_query(db, &version_query, &statement);
+    const bool step_successful = sqlite3_step(statement) == SQLITE_ROW;
+    assert(step_successful);
+    const int version = sqlite3_column_int(statement, 0);
+    sqlite3_finalize(statement);
+    return version;
+}
+
+static void exec_or_exit(sqlite3 *db, const char *sql, const char *description) {
+    char *errmsg = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to %s: %s\n", description, errmsg);
+        sqlite3_free(errmsg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void migrate_schema(sqlite3 *db) {
+    int num_migrations = 0;
+    while (k_migrations[num_migrations] != NULL)
+        num_migrations++;
+
+    exec_or_exit(db, "BEGIN IMMEDIATE;", "start schema migration");
+    const int version = schema_version(db);
+    if (version > num_migrations) {
+        fprintf(stderr, "Database schema version %d is newer than this nostrfs (%d)\n", version, num_migrations);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = version; i < num_migrations; i++) {
+        exec_or_exit(db, k_migrations[i], "migrate schema");
+    }
+    char set_version[64];
+    snprintf(set_version, sizeof(set_version), "PRAGMA user_version = %d;", num_migrations);
+    exec_or_exit(db, set_version, "record schema version");
+    exec_or_exit(db, "COMMIT;", "commit schema migration");
+}
+
+/*
+ * A bulk load may drop the indexes and triggers of the empty tables and
+ * recreate them once it is done (see defer_indexes in corpus.c).  It first
+ * saves the SQL that recreates them in deferredIndexes, in the transaction
+ * that drops them, so a load that is killed or fails midway leaves a
+ * schema that the next initialize_db, or the load itself when it finishes,
+ * completes here.
+ */
+void recreate_deferred_indexes(sqlite3 *db) {
+    exec_or_exit(db, "BEGIN IMMEDIATE;", "start recreating deferred indexes");
+    sqlite3_stmt *statement;
+    Query deferred_query = NEW_QUERY("SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'deferredIndexes';");
+    prepare_query(db, &deferred_query, &statement);
+    const bool has_deferred = sqlite3_step(statement) == SQLITE_ROW;
+    sqlite3_finalize(statement);
+    if (has_deferred) {
+        Query recreate_query = NEW_QUERY("SELECT sql FROM deferredIndexes ORDER BY rowid;");
+        prepare_query(db, &recreate_query, &statement);
+        while (sqlite3_step(statement) == SQLITE_ROW) {
+            exec_or_exit(db, (const char *) sqlite3_column_text(statement, 0), "recreate deferred indexes");
+        }
+        sqlite3_finalize(statement);
+        exec_or_exit(db, "DROP TABLE deferredIndexes;", "drop deferred indexes");
+    }
+    exec_or_exit(db, "COMMIT;", "commit deferred indexes");
+}
+
+/* Whether the database stores keys as blobs, judged by its first event. */
+static bool stores_binary_keys(sqlite3 *db) {
+    sqlite3_stmt *statement;
+    Query key_format_query = NEW_QUERY("SELECT typeof(id) = 'blob' FROM nostrEvents ORDER BY rowid LIMIT 1;");
+    prepare_query(db, &key_format_query, &statement);
+    const bool is_binary = sqlite3_step(statement) == SQLITE_ROW && sqlite3_column_int(statement, 0) != 0;
+    sqlite3_finalize(statement);
+    return is_binary;
+}
+
+/* Converts a hex id to a 32-byte blob, leaving any other value as it is. */
+static void key_blob_function(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void) argc;
+    unsigned char key[KEY_SIZE];
+    if (sqlite3_value_type(argv[0]) == SQLITE_TEXT && hex_to_key((const char *) sqlite3_value_text(argv[0]), key))
+        sqlite3_result_blob(context, key, KEY_SIZE, SQLITE_TRANSIENT);
+    else
+        sqlite3_result_value(context, argv[0]);
+}
+
+/* Converts a 32-byte blob to a hex id, leaving any other value as it is. */
+static void key_text_function(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    (void) argc;
+    char hex[KEY_HEX_LENGTH + 1];
+    if (sqlite3_value_type(argv[0]) == SQLITE_BLOB && sqlite3_value_bytes(argv[0]) == KEY_SIZE) {
+        key_to_hex(sqlite3_value_blob(argv[0]), hex);
+        sqlite3_result_text(context, hex, KEY_HEX_LENGTH, SQLITE_TRANSIENT);
+    }
+    else {
+        sqlite3_result_value(context, argv[0]);
+    }
+}
+
+/*
+ * Rewrites every event id and pubkey as a 32-byte blob when binary is set,
+ * or back as the hex text db.js writes when it is not, then vacuums so the
+ * indexes are rebuilt at their new size.  Values that are not well-formed
+ * keys are left as they are.  Nothing may be mounted on the database
+ * meanwhile, and writers that bind hex text, like db.js, must not write to
+ * it once it has binary keys.
+ */
+void convert_keys(bool binary) {
+    if (snapshot_is_open()) {
+        fprintf(stderr, "Snapshots are read-only and always store binary keys\n");
+        exit(EXIT_FAILURE);
+    }
+    sqlite3 *db = open_db(SQLITE_OPEN_READWRITE);
+    const bool function_created = sqlite3_create_function(
+        db, "convert_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, binary ? key_blob_function : key_text_function, NULL, NULL
+    ) == SQLITE_OK;
+    assert(function_created);
+
+    exec_or_exit(db, "BEGIN IMMEDIATE;", "start key conversion");
+    exec_or_exit(db, "UPDATE nostrEvents SET id = convert_key(id), pubkey = convert_key(pubkey);", "convert event keys");
+    exec_or_exit(db, "UPDATE tags SET id = convert_key(id);", "convert tag keys");
+    exec_or_exit(db, "COMMIT;", "commit key conversion");
+    exec_or_exit(db, "VACUUM;", "vacuum converted database");
+    forget_event_records();
+    binary_keys = stores_binary_keys(db);
+    sqlite3_close(db);
+}
+
+bool uses_binary_keys(void) {
+    return binary_keys || snapshot_is_open();
+}
+
+/*
+ * Every query is served from an index.  A full scan or a temporary sort
+ * would make readdir and lookup cost proportional to the whole table, so
+ * refuse to mount when the planner picks one.  Full-text matches are
+ * answered by the FTS5 index through its virtual table.
+ */
+static void check_query_plans(sqlite3 *db) {
+    for (int i = 0; all_queries[i] != NULL; i++) {
+        char explain[1024];
+        const int explain_length = snprintf(explain, sizeof(explain), "EXPLAIN QUERY PLAN %s", all_queries[i]->template);
+        assert(explain_length < (int) sizeof(explain));
+
+        sqlite3_stmt *statement;
+        Query explain_query = NEW_QUERY(explain);
+        prepare_query(db, &explain_query, &statement);
+        while (sqlite3_step(statement) == SQLITE_ROW) {
+            const char *detail = (const char *) sqlite3_column_text(statement, 3);
+            const bool is_scan = strncmp(detail, "SCAN ", 5) == 0 && strstr(detail, " VIRTUAL TABLE INDEX ") == NULL;
+            if (is_scan || strncmp(detail, "USE TEMP B-TREE", 15) == 0) {
+                fprintf(stderr, "Query \"%s\" is not served by an index: %s\n", all_queries[i]->template, detail);
+                exit(EXIT_FAILURE);
+            }
+        }
+        sqlite3_finalize(statement);
+    }
+}
+
+/*
+ * A snapshot written by nostrfs-pack is served without SQLite: it is mapped
+ * and checked, and every function above answers from the mapping instead.
+ */
+void initialize_db(const char *path) {
+    db_file_path = strdup(path);
+    assert(db_file_path != NULL);
+    if (is_snapshot_file(path)) {
+        open_snapshot(path);
+        return;
+    }
+
+    num_queries = 0;
+    for (int i = 0; all_queries[i] != NULL; i++) {
+        all_queries[i]->index = num_queries++;
+        register_query_stats(all_queries[i]->index, all_queries[i]->template);
+    }
+
+    const bool key_created = pthread_key_create(&connection_key, close_connection) == 0;
+    assert(key_created);
+    for (int i = 0; i < NUM_EVENT_RECORD_LOCKS; i++) {
+        pthread_mutex_init(&event_record_locks[i], NULL);
+    }
+
+    /*
+     * Readers only see a consistent snapshot without blocking the writer when
+     * the database is in WAL mode, which read-only connections cannot enable
+     * themselves.  Validate every query template and its plan up front so
+     * that a broken schema fails at mount time rather than inside a worker
+     * thread.
+     */
+    sqlite3 *db = open_db(SQLITE_OPEN_READWRITE);
+    exec_or_exit(db, "PRAGMA journal_mode = WAL;", "enable WAL mode");
+    migrate_schema(db);
+    recreate_deferred_indexes(db);
+    for (int i = 0; all_queries[i] != NULL; i++) {
+        sqlite3_stmt *statement;
+        prepare_query(db, all_queries[i], &statement);
+        sqlite3_finalize(statement);
+    }
+    check_query_plans(db);
+    binary_keys = stores_binary_keys(db);
+    sqlite3_close(db);
+}
+
+void close_db(void) {
+    if (snapshot_is_open()) {
+        close_snapshot();
+        free(db_file_path);
+        db_file_path = NULL;
+        return;
+    }
+    Connection *connection = pthread_getspecific(connection_key);
+    if (connection != NULL) {
+        close_connection(connection);
+        pthread_setspecific(connection_key, NULL);
+    }
+    pthread_key_delete(connection_key);
+    forget_event_records();
+    for (int i = 0; i < NUM_EVENT_RECORD_LOCKS; i++) {
+        pthread_mutex_destroy(&event_record_locks[i]);
+    }
+    for (int i = 0; i < NUM_CACHED_CONTENTS; i++) {
+        free(content_cache[i].data);
+        content_cache[i].data = NULL;
+    }
+    for (int i = 0; i < num_dictionaries; i++) {
+        ZSTD_freeDDict(dictionaries[i].dictionary);
+    }
+    free(dictionaries);
+    dictionaries = NULL;
+    num_dictionaries = 0;
+    free(db_file_path);
+    db_file_path = NULL;
 }
@@ -1,25 +1,92 @@
 #ifndef NOSTRFS_DB
 #define NOSTRFS_DB
 
-#include <fuse.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sqlite3.h>
+
 #include "path.h"
+#include "synthetic_file.h"
+
+#define DEFAULT_SEARCH_LIMIT 100
+
+int fill_events_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int get_event_content_data(const PathCaptures *captures, char **ret_file_data);
+int get_event_kind_data(const PathCaptures *captures, char **ret_file_data);
+int get_event_pubkey_data(const PathCaptures *captures, char **ret_file_data);
+int get_event_content_size(const PathCaptures *captures, off_t *ret_size);
+int get_event_kind_size(const PathCaptures *captures, off_t *ret_size);
+int get_event_pubkey_size(const PathCaptures *captures, off_t *ret_size);
+int locate_event_content(const PathCaptures *captures, DataLocation *ret_location);
+int locate_event_pubkey(const PathCaptures *captures, DataLocation *ret_location);
+int get_event_json_data(const PathCaptures *captures, char **ret_file_data);
+int get_event_json_size(const PathCaptures *captures, off_t *ret_size);
+int locate_event_json(const PathCaptures *captures, DataLocation *ret_location);
+int event_creation_time(const char *event_id, time_t *ret_time);
+
+typedef struct {
+    const char *id;
+    const char *pubkey;
+    int64_t kind;
+    time_t created_at;
+} NewEvent;
+
+typedef void (* NewEventHandler)(const NewEvent *event, void *arg);
+typedef void (* IndexedTagHandler)(const char *key, const char *value, void *arg);
+
+int64_t database_version(void);
+int64_t latest_event_rowid(void);
+int read_new_events(int64_t *watermark, int max_events, NewEventHandler handler, void *arg);
+void read_indexed_tags(const char *event_id, IndexedTagHandler handler, void *arg);
+
+int fill_pubkeys_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_pubkey_events_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_pubkey_kinds_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_pubkey_kind_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+
+int fill_time_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_time_year_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_time_month_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_time_day_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_time_hour_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+void time_bucket_path(time_t created_at, char *ret_path, size_t size);
+
+int fill_tags_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_tag_key_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_tag_values_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_tag_index_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_tag_index_key_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_tag_index_value_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int get_tag_value(const PathCaptures *captures, char **ret_file_data);
+int get_tag_value_size(const PathCaptures *captures, off_t *ret_size);
+int locate_tag_value(const PathCaptures *captures, DataLocation *ret_location);
+
+void set_search_limit(unsigned int limit);
+int fill_search_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
 
+int read_data_location(
+    const DataLocation *location, off_t offset, size_t size, char *ret_buffer, size_t *ret_length
+);
 
-int fill_events_dir(Path path, void *buffer, fuse_fill_dir_t filler);
-int get_event_content_data(Path path, char **ret_file_data);
-int get_event_kind_data(Path path, char **ret_file_data);
-int get_event_pubkey_data(Path path, char **ret_file_data);
-long event_creation_time(const char *event_id);
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    /* Queries run for misses, the misses they answered, and misses that waited on another's fetch. */
+    unsigned long batches;
+    unsigned long batched;
+    unsigned long shared;
+} EventRecordStats;
 
-int fill_pubkeys_dir(Path path, void *buffer, fuse_fill_dir_t filler);
-int fill_pubkey_events_dir(Path path, void *buffer, fuse_fill_dir_t filler);
-int fill_pubkey_kinds_dir(Path path, void *buffer, fuse_fill_dir_t filler);
+void forget_event_records(void);
+EventRecordStats event_record_stats(void);
 
-int fill_tags_dir(Path path, void *buffer, fuse_fill_dir_t filler);
-int fill_tag_key_dir(Path path, void *buffer, fuse_fill_dir_t filler);
-int fill_tag_values_dir(Path path, void *buffer, fuse_fill_dir_t filler);
-int get_tag_value(Path path, char **ret_file_data);
+void statement_bind_key(sqlite3_stmt *statement, int index, const char *hex);
+void recreate_deferred_indexes(sqlite3 *db);
+void convert_keys(bool binary);
+bool uses_binary_keys(void);
 
-void initialize_db(char *db_file_path);
+void initialize_db(const char *db_file_path);
+void close_db(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,1266 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#include <sqlite3.h>
+#include <zstd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "db.h"
+#include "event.h"
+#include "hex.h"
+#include "json.h"
+#include "known_ids.h"
+#include "node.h"
+#include "path.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "synthetic_file.h"
+#include "watch.h"
+
+/*
+ * Stress test for the per-thread connection pool: many threads resolve random
+ * event files at once and every result is checked against the values the
+ * events were generated from.
+ */
+
+static const int k_num_events = 512;
+static const int k_num_pubkeys = 8;
+static const int k_num_threads = 8;
+static const int k_iterations_per_thread = 2000;
+
+static atomic_int num_mismatches;
+
+static void event_id(int event_number, char *ret_id) {
+    snprintf(ret_id, 65, "%064x", event_number);
+}
+
+static void event_pubkey(int event_number, char *ret_pubkey) {
+    snprintf(ret_pubkey, 65, "%064x", 0xabc000 + event_number % k_num_pubkeys);
+}
+
+static int event_kind(int event_number) {
+    return event_number % 5;
+}
+
+static long event_created_at(int event_number) {
+    return 1700000000L + event_number * 997L;
+}
+
+static void event_content(int event_number, char *ret_content, size_t size) {
+    snprintf(ret_content, size, "content of event %d %*s", event_number, event_number % 200, "");
+}
+
+/*
+ * The event as event.json renders it.  Events whose JSON was stored at
+ * import also carry a tag without values, which only stored JSON can keep.
+ */
+static void event_json(int event_number, char *ret_json, size_t size) {
+    char id[65], pubkey[65], reply_id[65], mentioned_pubkey[65], content[256];
+    event_id(event_number, id);
+    event_pubkey(event_number, pubkey);
+    event_id(event_number / 2, reply_id);
+    event_pubkey(event_number + 1, mentioned_pubkey);
+    event_content(event_number, content, sizeof(content));
+    snprintf(
+        ret_json,
+        size,
+        "{\"id\":\"%s\",\"pubkey\":\"%s\",\"created_at\":%ld,\"kind\":%d,\"tags\":"
+        "[[\"e\",\"%s\",\"wss://relay.example.com\"],[\"p\",\"%s\"],[\"subject\",\"x\"],[\"r\",\"https://example.com/%d\"]%s],"
+        "\"content\":\"%s\",\"sig\":\"\"}",
+        id,
+        pubkey,
+        event_created_at(event_number),
+        event_kind(event_number),
+        reply_id,
+        mentioned_pubkey,
+        event_number,
+        event_number % 4 == 0 ? ",[\"client\"]" : "",
+        content
+    );
+}
+
+static void exec_sql(sqlite3 *db, const char *sql) {
+    char *error_message;
+    if (sqlite3_exec(db, sql, NULL, NULL, &error_message) != SQLITE_OK) {
+        fprintf(stderr, "Error executing \"%s\": %s\n", sql, error_message);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static sqlite3 *open_test_db(const char *db_file_path) {
+    sqlite3 *db;
+    if (sqlite3_open(db_file_path, &db) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open test database: %s\n", sqlite3_errmsg(db));
+        exit(EXIT_FAILURE);
+    }
+    sqlite3_busy_timeout(db, 5000);
+    return db;
+}
+
+/*
+ * Every event replies to event n / 2 and mentions the next pubkey.  It also
+ * carries a multi-letter tag and a value that cannot be a filename, both of
+ * which the reverse tag index leaves out.
+ */
+static void insert_test_tags(sqlite3 *db, int event_number) {
+    char id[65], reply_id[65], mentioned_pubkey[65];
+    event_id(event_number, id);
+    event_id(event_number / 2, reply_id);
+    event_pubkey(event_number + 1, mentioned_pubkey);
+
+    char *sql = sqlite3_mprintf(
+        "INSERT INTO tags VALUES"
+        " (%Q, 'e', 0, 0, %Q), (%Q, 'e', 0, 1, 'wss://relay.example.com'), (%Q, 'p', 1, 0, %Q),"
+        " (%Q, 'subject', 2, 0, 'x'), (%Q, 'r', 3, 0, 'https://example.com/%d');",
+        id, reply_id, id, id, mentioned_pubkey, id, id, event_number
+    );
+    exec_sql(db, sql);
+    sqlite3_free(sql);
+}
+
+static void insert_test_events(sqlite3 *db, int first_event, int num_events) {
+    exec_sql(db, "BEGIN;");
+
+    sqlite3_stmt *insert_event;
+    sqlite3_prepare_v2(db, "INSERT INTO nostrEvents (id, pubkey, created_at, kind, content, sig) VALUES (?, ?, ?, ?, ?, '');", -1, &insert_event, NULL);
+    for (int i = first_event; i < first_event + num_events; i++) {
+        char id[65], pubkey[65], content[256];
+        event_id(i, id);
+        event_pubkey(i, pubkey);
+        event_content(i, content, sizeof(content));
+
+        sqlite3_bind_text(insert_event, 1, id, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insert_event, 2, pubkey, -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(insert_event, 3, event_created_at(i));
+        sqlite3_bind_int(insert_event, 4, event_kind(i));
+        sqlite3_bind_text(insert_event, 5, content, -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(insert_event) != SQLITE_DONE) {
+            fprintf(stderr, "Failed to insert test event: %s\n", sqlite3_errmsg(db));
+            exit(EXIT_FAILURE);
+        }
+        sqlite3_reset(insert_event);
+        insert_test_tags(db, i);
+    }
+    sqlite3_finalize(insert_event);
+
+    exec_sql(db, "COMMIT;");
+}
+
+static void create_test_db(const char *db_file_path) {
+    sqlite3 *db = open_test_db(db_file_path);
+    exec_sql(db,
+        "CREATE TABLE nostrEvents (id TEXT PRIMARY KEY, pubkey TEXT, created_at INTEGER, kind INTEGER, content TEXT, sig TEXT);"
+        "CREATE TABLE tags (id TEXT, key TEXT, tag_index INTEGER, value_index INTEGER, value TEXT, FOREIGN KEY(id) REFERENCES nostrEvents(id));"
+    );
+    insert_test_events(db, 0, k_num_events);
+    sqlite3_close(db);
+}
+
+static void expect(bool condition, const char *description, int event_number) {
+    if (!condition) {
+        fprintf(stderr, "Mismatch for event %d: %s\n", event_number, description);
+        atomic_fetch_add(&num_mismatches, 1);
+    }
+}
+
+/*
+ * Stores a third of the events compressed against a dictionary and another
+ * third compressed without one, the way nostrfs-compress leaves a database.
+ */
+static void compress_test_events(const char *db_file_path) {
+    static const char k_dictionary[] = "content of event ";
+
+    sqlite3 *db = open_test_db(db_file_path);
+    exec_sql(db, "BEGIN;");
+    sqlite3_stmt *statement;
+    sqlite3_prepare_v2(db, "INSERT INTO contentDictionaries (id, dictionary) VALUES (1, ?);", -1, &statement, NULL);
+    sqlite3_bind_blob(statement, 1, k_dictionary, sizeof(k_dictionary) - 1, SQLITE_STATIC);
+    expect(sqlite3_step(statement) == SQLITE_DONE, "insert dictionary", 0);
+    sqlite3_finalize(statement);
+
+    sqlite3_prepare_v2(
+        db,
+        "UPDATE nostrEvents SET content = NULL, content_zstd = ?, content_dictionary = ?, content_size = ? WHERE id = ?;",
+        -1,
+        &statement,
+        NULL
+    );
+    ZSTD_CCtx *compression = ZSTD_createCCtx();
+    for (int i = 0; i < k_num_events; i++) {
+        if (i % 3 == 0)
+            continue;
+        char id[65], content[256], compressed[512];
+        event_id(i, id);
+        event_content(i, content, sizeof(content));
+        const bool use_dictionary = i % 3 == 1;
+        const size_t compressed_size = ZSTD_compress_usingDict(
+            compression,
+            compressed,
+            sizeof(compressed),
+            content,
+            strlen(content),
+            use_dictionary ? k_dictionary : NULL,
+            use_dictionary ? sizeof(k_dictionary) - 1 : 0,
+            3
+        );
+        expect(!ZSTD_isError(compressed_size), "compress content", i);
+
+        sqlite3_bind_blob(statement, 1, compressed, compressed_size, SQLITE_TRANSIENT);
+        if (use_dictionary)
+            sqlite3_bind_int(statement, 2, 1);
+        else
+            sqlite3_bind_null(statement, 2);
+        sqlite3_bind_int64(statement, 3, strlen(content));
+        sqlite3_bind_text(statement, 4, id, -1, SQLITE_TRANSIENT);
+        expect(sqlite3_step(statement) == SQLITE_DONE, "store compressed content", i);
+        sqlite3_reset(statement);
+    }
+    ZSTD_freeCCtx(compression);
+    sqlite3_finalize(statement);
+    exec_sql(db, "COMMIT;");
+    sqlite3_close(db);
+}
+
+/* Backing storage for the strings of an Event built by test_event. */
+typedef struct {
+    char reply_id[65];
+    char mentioned_pubkey[65];
+    char content[256];
+    char url[64];
+    JsonString values[11];
+    Tag tags[5];
+} TestEventStrings;
+
+/* The event as nostrfs-import parses it, with the tag without values only when asked for. */
+static void test_event(int event_number, bool with_valueless_tag, Event *ret_event, TestEventStrings *strings) {
+    memset(ret_event, 0, sizeof(*ret_event));
+    event_id(event_number, ret_event->id);
+    event_pubkey(event_number, ret_event->pubkey);
+    ret_event->created_at = event_created_at(event_number);
+    ret_event->kind = event_kind(event_number);
+    event_content(event_number, strings->content, sizeof(strings->content));
+    ret_event->content = (JsonString) {strings->content, strlen(strings->content)};
+
+    event_id(event_number / 2, strings->reply_id);
+    event_pubkey(event_number + 1, strings->mentioned_pubkey);
+    snprintf(strings->url, sizeof(strings->url), "https://example.com/%d", event_number);
+    const char *values[] = {
+        "e", strings->reply_id, "wss://relay.example.com", "p", strings->mentioned_pubkey, "subject", "x", "r", strings->url, "client"
+    };
+    const int num_values[] = {3, 2, 2, 2, 1};
+    for (int i = 0; i < 10; i++) {
+        strings->values[i] = (JsonString) {(char *) values[i], strlen(values[i])};
+    }
+    ret_event->num_tags = with_valueless_tag ? 5 : 4;
+    for (int i = 0, first = 0; i < ret_event->num_tags; first += num_values[i], i++) {
+        strings->tags[i] = (Tag) {num_values[i], &strings->values[first]};
+    }
+    ret_event->tags = strings->tags;
+}
+
+/* Stores the JSON of every fourth event, serialized as nostrfs-import -J does. */
+static void store_test_event_json(const char *db_file_path) {
+    sqlite3 *db = open_test_db(db_file_path);
+    exec_sql(db, "BEGIN;");
+    sqlite3_stmt *statement;
+    sqlite3_prepare_v2(db, "UPDATE nostrEvents SET event_json = ? WHERE id = ?;", -1, &statement, NULL);
+    Buffer json = {0};
+    for (int i = 0; i < k_num_events; i += 4) {
+        Event event;
+        TestEventStrings strings;
+        test_event(i, true, &event, &strings);
+        json.length = 0;
+        serialize_event_json(&json, &event);
+        sqlite3_bind_text(statement, 1, json.data, json.length, SQLITE_TRANSIENT);
+        sqlite3_bind_text(statement, 2, event.id, -1, SQLITE_TRANSIENT);
+        expect(sqlite3_step(statement) == SQLITE_DONE, "store event json", i);
+        sqlite3_reset(statement);
+    }
+    free(json.data);
+    sqlite3_finalize(statement);
+    exec_sql(db, "COMMIT;");
+    sqlite3_close(db);
+}
+
+/*
+ * Checks that the importer's JSON holds no NUL and, for the events whose
+ * JSON was not stored, is byte for byte what event.json renders.
+ */
+static void check_stored_event_json(const char *db_file_path) {
+    sqlite3 *db = open_test_db(db_file_path);
+    sqlite3_stmt *statement;
+    sqlite3_prepare_v2(
+        db,
+        "SELECT count(*), sum(instr(CAST(event_json AS BLOB), x'00') > 0) FROM nostrEvents WHERE event_json IS NOT NULL;",
+        -1,
+        &statement,
+        NULL
+    );
+    expect(sqlite3_step(statement) == SQLITE_ROW, "count stored json", 0);
+    expect(sqlite3_column_int(statement, 0) == (k_num_events + 3) / 4, "stored json events", 0);
+    expect(sqlite3_column_int(statement, 1) == 0, "stored json without NUL", 0);
+    sqlite3_finalize(statement);
+    sqlite3_close(db);
+
+    Buffer json = {0};
+    for (int i = 1; i < k_num_events; i++) {
+        if (i % 4 == 0)
+            continue;
+        Event event;
+        TestEventStrings strings;
+        test_event(i, false, &event, &strings);
+        json.length = 0;
+        serialize_event_json(&json, &event);
+        const PathCaptures captures = {.event_id = event.id};
+        char *rendered = NULL;
+        expect(get_event_json_data(&captures, &rendered) == 0, "render event json", i);
+        expect(
+            rendered != NULL && strlen(rendered) == json.length && memcmp(rendered, json.data, json.length) == 0,
+            "stored json matches rendered",
+            i
+        );
+        free(rendered);
+    }
+    free(json.data);
+}
+
+static void check_file(int event_number, const char *filename, const char *expected) {
+    char id[65], raw_path[128];
+    event_id(event_number, id);
+    snprintf(raw_path, sizeof(raw_path), "/e/%s/%s", id, filename);
+
+    Path *path = parse_path(raw_path);
+    PathCaptures captures;
+    SyntheticFile *file = route_path(*path, &captures);
+    char *data = NULL;
+    const bool fetch_successful = file->type == DATA_FILE && file->fetch_data(&captures, &data) == 0;
+    expect(fetch_successful, filename, event_number);
+    if (fetch_successful) {
+        expect(strcmp(data, expected) == 0, filename, event_number);
+
+        off_t size;
+        expect(file->fetch_size(&captures, &size) == 0 && size == (off_t) strlen(expected), filename, event_number);
+    }
+    free(data);
+    free_path(path);
+}
+
+static int count_entry(void *buffer, const char *name) {
+    (void) name;
+
+    (*(int *) buffer)++;
+    return 0;
+}
+
+static void check_pubkey_events(int event_number) {
+    char pubkey[65], raw_path[128];
+    event_pubkey(event_number, pubkey);
+    snprintf(raw_path, sizeof(raw_path), "/p/%s/e", pubkey);
+
+    Path *path = parse_path(raw_path);
+    PathCaptures captures;
+    route_path(*path, &captures);
+    int num_entries = 0;
+    DirCursor cursor = {0};
+    expect(fill_pubkey_events_dir(&captures, &cursor, &num_entries, count_entry) == 0, "pubkey events dir", event_number);
+    expect(cursor.done, "pubkey events dir exhausted", event_number);
+    reset_dir_cursor(&cursor);
+    expect(num_entries == k_num_events / k_num_pubkeys, "pubkey events count", event_number);
+    free_path(path);
+}
+
+typedef struct {
+    int accepted_this_call;
+    int num_names;
+    char **names;
+} NameList;
+
+/* Accepts three names per call so that every listing has to resume. */
+static int collect_name(void *list_ptr, const char *name) {
+    NameList *list = list_ptr;
+    if (list->accepted_this_call == 3)
+        return 1;
+    list->accepted_this_call++;
+    list->names = realloc(list->names, (list->num_names + 1) * sizeof(char *));
+    assert(list->names != NULL);
+    list->names[list->num_names] = strdup(name);
+    assert(list->names[list->num_names] != NULL);
+    list->num_names++;
+    return 0;
+}
+
+static NameList list_dir(const char *raw_path) {
+    Path *path = parse_path(raw_path);
+    PathCaptures captures;
+    SyntheticFile *file = route_path(*path, &captures);
+    NameList list = {0};
+    DirCursor cursor = {0};
+    while (file->type == DIRECTORY_FILE && !cursor.done) {
+        list.accepted_this_call = 0;
+        expect(file->fill(&captures, &cursor, &list, collect_name) == 0, raw_path, 0);
+    }
+    reset_dir_cursor(&cursor);
+    free_path(path);
+    return list;
+}
+
+static void free_name_list(NameList *list) {
+    for (int i = 0; i < list->num_names; i++) {
+        free(list->names[i]);
+    }
+    free(list->names);
+}
+
+static int count_time_tree(const char *raw_path, int depth, int *ret_num_hours) {
+    NameList list = list_dir(raw_path);
+    int num_events = 0;
+    if (depth == 4) {
+        num_events = list.num_names;
+        (*ret_num_hours)++;
+    }
+    for (int i = 0; depth < 4 && i < list.num_names; i++) {
+        char child_raw_path[64];
+        snprintf(child_raw_path, sizeof(child_raw_path), "%s/%s", raw_path, list.names[i]);
+        num_events += count_time_tree(child_raw_path, depth + 1, ret_num_hours);
+    }
+    free_name_list(&list);
+    return num_events;
+}
+
+/* The newest event at or before event_number with the given pubkey and kind, or -1. */
+static int previous_event_of_kind(int event_number, int pubkey_number, int kind) {
+    while (event_number >= 0 && (event_number % k_num_pubkeys != pubkey_number || event_kind(event_number) != kind))
+        event_number--;
+    return event_number;
+}
+
+/* Checks /p/<pk>/kind/<k> against the generated events, newest first. */
+static void check_pubkey_kind_events(void) {
+    for (int pubkey_number = 0; pubkey_number < k_num_pubkeys; pubkey_number++) {
+        char pubkey[65];
+        event_pubkey(pubkey_number, pubkey);
+        for (int kind = 0; kind < 5; kind++) {
+            char raw_path[128];
+            snprintf(raw_path, sizeof(raw_path), "/p/%s/kind/%d", pubkey, kind);
+            NameList list = list_dir(raw_path);
+
+            int expected_event = k_num_events - 1;
+            for (int i = 0; i < list.num_names; i++) {
+                expected_event = previous_event_of_kind(expected_event, pubkey_number, kind);
+                char expected_id[65];
+                event_id(expected_event, expected_id);
+                expect(strcmp(list.names[i], expected_id) == 0, raw_path, expected_event);
+                expected_event--;
+            }
+            expect(previous_event_of_kind(expected_event, pubkey_number, kind) < 0, "pubkey kind events exhausted", pubkey_number);
+            free_name_list(&list);
+        }
+    }
+}
+
+static void check_tag_index(void) {
+    NameList keys = list_dir("/tag");
+    expect(
+        keys.num_names == 3 && strcmp(keys.names[0], "e") == 0 && strcmp(keys.names[1], "p") == 0 && strcmp(keys.names[2], "r") == 0,
+        "tag index keys",
+        0
+    );
+    free_name_list(&keys);
+
+    NameList mentioned = list_dir("/tag/p");
+    expect(mentioned.num_names == k_num_pubkeys, "mentioned pubkeys", 0);
+    free_name_list(&mentioned);
+
+    NameList urls = list_dir("/tag/r");
+    expect(urls.num_names == 0, "unlistable tag values", 0);
+    free_name_list(&urls);
+
+    NameList subjects = list_dir("/tag/subject/x");
+    expect(subjects.num_names == 0, "multi-letter tag", 0);
+    free_name_list(&subjects);
+
+    char raw_path[128], reply_ids[2][65];
+    event_id(5, raw_path + snprintf(raw_path, sizeof(raw_path), "/tag/e/"));
+    event_id(10, reply_ids[0]);
+    event_id(11, reply_ids[1]);
+    NameList replies = list_dir(raw_path);
+    expect(
+        replies.num_names == 2 && strcmp(replies.names[0], reply_ids[0]) == 0 && strcmp(replies.names[1], reply_ids[1]) == 0,
+        "replies",
+        5
+    );
+    free_name_list(&replies);
+}
+
+/* Searches the "content of event <n>" text every event was generated with. */
+static void check_search(void) {
+    char expected_id[65];
+    event_id(7, expected_id);
+    NameList matches = list_dir("/search/event 7");
+    expect(matches.num_names == 1 && strcmp(matches.names[0], expected_id) == 0, "search for one event", 7);
+    free_name_list(&matches);
+
+    NameList capped = list_dir("/search/content");
+    expect(capped.num_names == DEFAULT_SEARCH_LIMIT, "search limit", 0);
+    for (int i = 1; i < capped.num_names; i++) {
+        for (int j = 0; j < i; j++) {
+            expect(strcmp(capped.names[i], capped.names[j]) != 0, "search results are distinct", i);
+        }
+    }
+    free_name_list(&capped);
+
+    NameList punctuation = list_dir("/search/\"event\" AND-7");
+    expect(punctuation.num_names == 0, "search syntax is quoted", 0);
+    free_name_list(&punctuation);
+
+    NameList missing = list_dir("/search/nonexistent");
+    expect(missing.num_names == 0, "search without matches", 0);
+    free_name_list(&missing);
+}
+
+/* Walks /t and checks that every event sits in exactly one hour bucket. */
+static void check_time_tree(void) {
+    int expected_num_hours = 0;
+    char previous_hour[32] = "";
+    for (int i = 0; i < k_num_events; i++) {
+        const time_t created_at = event_created_at(i);
+        struct tm tm;
+        gmtime_r(&created_at, &tm);
+        char hour[32];
+        strftime(hour, sizeof(hour), "%Y/%m/%d/%H", &tm);
+        if (strcmp(hour, previous_hour) != 0)
+            expected_num_hours++;
+        strcpy(previous_hour, hour);
+    }
+
+    int num_hours = 0;
+    expect(count_time_tree("/t", 0, &num_hours) == k_num_events, "time tree events", 0);
+    expect(num_hours == expected_num_hours, "time tree hours", 0);
+
+    NameList unpadded = list_dir("/t/2023/1");
+    expect(unpadded.num_names == 0, "non-canonical time bucket", 0);
+    free_name_list(&unpadded);
+}
+
+static void check_node(int event_number, size_t expected_pubkey_size) {
+    char id[65];
+    event_id(event_number, id);
+
+    Node *events_dir = lookup_node(get_node(ROOT_NODE_INO), "e");
+    Node *event_dir = lookup_node(events_dir, id);
+    Node *pubkey_file = lookup_node(event_dir, "pubkey");
+    Node *repeated_lookup = lookup_node(event_dir, "pubkey");
+    expect(pubkey_file == repeated_lookup, "node identity", event_number);
+
+    struct stat st;
+    expect(node_stat(pubkey_file, &st) == 0, "node stat", event_number);
+    expect(st.st_ino == pubkey_file->ino, "node inode", event_number);
+    expect(st.st_size == (off_t) expected_pubkey_size, "node size", event_number);
+
+    forget_node(repeated_lookup->ino, 2);
+    forget_node(event_dir->ino, 1);
+    forget_node(events_dir->ino, 1);
+}
+
+/* Reads a file through an open handle in small slices, as a pager would. */
+static void check_read(int event_number, const char *filename, const char *expected) {
+    char id[65];
+    event_id(event_number, id);
+
+    Node *events_dir = lookup_node(get_node(ROOT_NODE_INO), "e");
+    Node *event_dir = lookup_node(events_dir, id);
+    Node *file = lookup_node(event_dir, filename);
+
+    NodeFileHandle *handle;
+    expect(open_node_file(file, &handle) == 0, filename, event_number);
+
+    char data[1024], *end = data;
+    size_t length;
+    do {
+        expect(read_node_file(handle, end - data, 7, end, &length) == 0, filename, event_number);
+        end += length;
+    } while (length > 0 && end + 7 < data + sizeof(data));
+    expect((size_t) (end - data) == strlen(expected) && memcmp(data, expected, end - data) == 0, filename, event_number);
+    close_node_file(handle);
+
+    forget_node(file->ino, 1);
+    forget_node(event_dir->ino, 1);
+    forget_node(events_dir->ino, 1);
+}
+
+static void check_event_json(void) {
+    for (int i = 0; i < k_num_events; i++) {
+        char expected[1024];
+        event_json(i, expected, sizeof(expected));
+        check_file(i, "event.json", expected);
+        check_read(i, "event.json", expected);
+    }
+}
+
+/* Checks the word-at-a-time escaper against escaping one byte at a time. */
+static void check_json_escaping(void) {
+    static const char k_specials[] = "\"\\\n\t\x01\x1f\xc3\xa9 ";
+    for (int offset = 0; offset < 20; offset++) {
+        for (size_t j = 0; j < sizeof(k_specials) - 1; j++) {
+            char value[24];
+            memset(value, 'a', sizeof(value));
+            value[offset] = k_specials[j];
+
+            char expected[sizeof(value) * 6 + 3], *end = expected;
+            *end++ = '"';
+            for (size_t k = 0; k < sizeof(value); k++) {
+                const unsigned char c = value[k];
+                if (c == '"' || c == '\\')
+                    end += sprintf(end, "\\%c", c);
+                else if (c == '\n')
+                    end += sprintf(end, "\\n");
+                else if (c == '\t')
+                    end += sprintf(end, "\\t");
+                else if (c < 0x20)
+                    end += sprintf(end, "\\u%04x", c);
+                else
+                    *end++ = c;
+            }
+            *end++ = '"';
+
+            Buffer json = {0};
+            buffer_append_json_string(&json, value, sizeof(value));
+            expect(json.length == (size_t) (end - expected) && memcmp(json.data, expected, json.length) == 0, "json escaping", offset);
+            free(json.data);
+        }
+    }
+}
+
+/* Reads a whole root file through an open handle. */
+static char *read_root_file(const char *filename) {
+    Node *file = lookup_node(get_node(ROOT_NODE_INO), filename);
+    expect(file != NULL, filename, 0);
+    if (file == NULL)
+        return NULL;
+
+    NodeFileHandle *handle;
+    expect(open_node_file(file, &handle) == 0, filename, 0);
+    Buffer data = {0};
+    char chunk[4096];
+    size_t length;
+    do {
+        expect(read_node_file(handle, data.length, sizeof(chunk), chunk, &length) == 0, filename, 0);
+        buffer_append(&data, chunk, length);
+    } while (length > 0);
+    buffer_append_char(&data, '\0');
+    close_node_file(handle);
+    forget_node(file->ino, 1);
+    return data.data;
+}
+
+/* Checks that the statistics files report the queries the stress threads ran. */
+static void check_stats(void) {
+    record_op(LOOKUP_OP, NULL_TAG, stats_clock_ns());
+
+    char *text = read_root_file(".stats");
+    if (text != NULL) {
+        expect(strstr(text, "# operations") != NULL, ".stats operations", 0);
+        expect(strstr(text, "lookup") != NULL, ".stats lookup", 0);
+        expect(strstr(text, "FROM nostrEvents") != NULL, ".stats queries", 0);
+        expect(strstr(text, "\n# cache\n") != NULL, ".stats cache", 0);
+        expect(strstr(text, "\nevent_mean_batch ") != NULL, ".stats record batches", 0);
+    }
+    free(text);
+
+    char *json = read_root_file(".stats.json");
+    if (json != NULL) {
+        expect(strncmp(json, "{\"ops\":[{", 9) == 0, ".stats.json ops", 0);
+        expect(strstr(json, "\"queries\":[{\"sql\":") != NULL, ".stats.json queries", 0);
+        expect(strcmp(json + strlen(json) - 3, "}}\n") == 0, ".stats.json end", 0);
+    }
+    free(json);
+}
+
+typedef struct {
+    int capacity;
+    int num_entries;
+    off_t last_offset;
+    char previous_name[65];
+    bool out_of_order;
+} PageBuffer;
+
+static int add_page_entry(void *buffer, const char *name, off_t next_offset) {
+    PageBuffer *page = buffer;
+    if (page->num_entries == page->capacity)
+        return 1;
+    if (next_offset != page->last_offset + 1 || (name[0] != '.' && strcmp(name, page->previous_name) <= 0))
+        page->out_of_order = true;
+    if (name[0] != '.')
+        snprintf(page->previous_name, sizeof(page->previous_name), "%s", name);
+    page->last_offset = next_offset;
+    page->num_entries++;
+    return 0;
+}
+
+/*
+ * Lists /e a few entries at a time, as the kernel does with a small buffer,
+ * and checks that every event appears exactly once and in order, including
+ * after a seek back into the middle of the listing.
+ */
+static void check_paged_listing(void) {
+    Node *events_dir = lookup_node(get_node(ROOT_NODE_INO), "e");
+    NodeDirHandle *handle = open_node_dir();
+
+    for (int pass = 0; pass < 2; pass++) {
+        PageBuffer page = {.capacity = 7, .last_offset = 0};
+        off_t offset = 0;
+        int total_entries = 0;
+        do {
+            page.num_entries = 0;
+            expect(read_node_dir(events_dir, handle, offset, &page, add_page_entry) == 0, "paged readdir", pass);
+            total_entries += page.num_entries;
+            offset = page.last_offset;
+        } while (page.num_entries > 0);
+        expect(!page.out_of_order, "paged listing order", pass);
+        expect(total_entries == k_num_events + 2, "paged listing count", pass);
+    }
+
+    PageBuffer page = {.capacity = 1, .last_offset = 100};
+    expect(read_node_dir(events_dir, handle, 100, &page, add_page_entry) == 0, "seek readdir", 100);
+    char expected_id[65];
+    event_id(100 - 2, expected_id);
+    expect(page.num_entries == 1 && strcmp(page.previous_name, expected_id) == 0, "seek readdir entry", 100);
+
+    close_node_dir(handle);
+    forget_node(events_dir->ino, 1);
+}
+
+typedef struct {
+    Node *dir;
+    int num_entries;
+} PlusBuffer;
+
+static int add_plus_entry(void *buffer, const char *name, off_t next_offset) {
+    (void) next_offset;
+    PlusBuffer *plus = buffer;
+    if (name[0] == '.')
+        return 0;
+    struct stat st;
+    Node *child = lookup_node(plus->dir, name);
+    if (child != NULL && node_stat(child, &st) == 0)
+        plus->num_entries++;
+    if (child != NULL)
+        forget_node(child->ino, 1);
+    return 0;
+}
+
+/*
+ * Lists event directories the way readdirplus does, looking up and stating
+ * each child from inside the filler, a second time from the cache.
+ */
+static void check_cached_listing_plus(void) {
+    Node *events_dir = lookup_node(get_node(ROOT_NODE_INO), "e");
+    for (int event_number = 0; event_number < 64; event_number++) {
+        char id[65];
+        event_id(event_number, id);
+        Node *event_dir = lookup_node(events_dir, id);
+        for (int pass = 0; pass < 2; pass++) {
+            PlusBuffer plus = {.dir = event_dir};
+            NodeDirHandle *handle = open_node_dir();
+            expect(read_node_dir(event_dir, handle, 0, &plus, add_plus_entry) == 0, "readdirplus", event_number);
+            close_node_dir(handle);
+            expect(plus.num_entries == 5, "readdirplus entries", event_number);
+        }
+        forget_node(event_dir->ino, 1);
+    }
+    forget_node(events_dir->ino, 1);
+}
+
+static int count_node_dir(Node *dir) {
+    NodeDirHandle *handle = open_node_dir();
+    PageBuffer page = {.capacity = k_num_events * 2, .last_offset = 0};
+    expect(read_node_dir(dir, handle, 0, &page, add_page_entry) == 0, "count readdir", 0);
+    close_node_dir(handle);
+    return page.num_entries - 2;
+}
+
+typedef struct {
+    uint64_t ino;
+    bool invalidated;
+} WatchedInode;
+
+/* Marks the invalidated inode in a list of watched inodes ending with inode 0. */
+static void record_invalidation(uint64_t ino, void *watched_ptr) {
+    for (WatchedInode *watched = watched_ptr; watched->ino != 0; watched++) {
+        if (ino == watched->ino)
+            watched->invalidated = true;
+    }
+}
+
+/*
+ * Adds an event behind the filesystem's back and checks that one poll makes
+ * it visible in listings that were already cached.
+ */
+static void check_live_update(const char *db_file_path) {
+    char pubkey[65];
+    event_pubkey(k_num_events, pubkey);
+
+    Node *events_dir = lookup_node(get_node(ROOT_NODE_INO), "e");
+    Node *pubkeys_dir = lookup_node(get_node(ROOT_NODE_INO), "p");
+    Node *pubkey_dir = lookup_node(pubkeys_dir, pubkey);
+    Node *pubkey_events_dir = lookup_node(pubkey_dir, "e");
+    char time_path[32];
+    time_bucket_path(event_created_at(k_num_events), time_path, sizeof(time_path));
+    time_path[strlen("/t/YYYY")] = '\0';
+    Node *times_dir = lookup_node(get_node(ROOT_NODE_INO), "t");
+    Node *year_dir = lookup_node(times_dir, time_path + strlen("/t/"));
+    expect(year_dir != NULL, "year dir", k_num_events);
+
+    WatchedInode watched[] = {{.ino = events_dir->ino}, {.ino = year_dir->ino}, {.ino = 0}};
+    initialize_watch(record_invalidation, watched);
+    expect(poll_new_events() == 0, "no new events", k_num_events);
+    expect(count_node_dir(events_dir) == k_num_events, "events before update", k_num_events);
+    char id[65];
+    event_id(k_num_events, id);
+    expect(lookup_node(events_dir, id) == NULL, "unknown event before update", k_num_events);
+    expect(count_node_dir(pubkey_events_dir) == k_num_events / k_num_pubkeys, "pubkey events before update", k_num_events);
+
+    sqlite3 *db = open_test_db(db_file_path);
+    insert_test_events(db, k_num_events, 1);
+    sqlite3_close(db);
+
+    expect(poll_new_events() == 1, "new event", k_num_events);
+    expect(watched[0].invalidated, "kernel invalidation", k_num_events);
+    expect(watched[1].invalidated, "year invalidation", k_num_events);
+    expect(count_node_dir(events_dir) == k_num_events + 1, "events after update", k_num_events);
+    expect(count_node_dir(pubkey_events_dir) == k_num_events / k_num_pubkeys + 1, "pubkey events after update", k_num_events);
+    expect(poll_new_events() == 0, "no further events", k_num_events);
+    Node *new_event_dir = lookup_node(events_dir, id);
+    expect(new_event_dir != NULL, "known event after update", k_num_events);
+    if (new_event_dir != NULL)
+        forget_node(new_event_dir->ino, 1);
+
+    forget_node(year_dir->ino, 1);
+    forget_node(times_dir->ino, 1);
+    forget_node(pubkey_events_dir->ino, 1);
+    forget_node(pubkey_dir->ino, 1);
+    forget_node(pubkeys_dir->ino, 1);
+    forget_node(events_dir->ino, 1);
+}
+
+/* Checks that arena allocations survive nested marks and that released space is reused. */
+static void check_arena(void) {
+    const ArenaMark outer = arena_mark();
+    char *first = arena_strdup("first");
+    const ArenaMark inner = arena_mark();
+    char *large = arena_alloc(1 << 20);
+    memset(large, 'x', 1 << 20);
+    arena_release(inner);
+    expect(arena_alloc(1 << 20) == large, "arena reuse", 0);
+    expect(strcmp(first, "first") == 0, "arena outer allocation", 0);
+    expect(((uintptr_t) arena_alloc(3) & 15) == 0, "arena alignment", 0);
+    arena_release(outer);
+    expect(arena_alloc(1) == first, "arena release", 0);
+    arena_release(outer);
+}
+
+static void check_known_ids(void) {
+    char id[65];
+    event_id(7, id);
+    expect(is_hex_id(id), "hex id", 7);
+    id[10] = 'A';
+    expect(!is_hex_id(id), "uppercase hex id", 7);
+    id[10] = 'g';
+    expect(!is_hex_id(id), "non-hex id", 7);
+    id[10] = (char) 0xc3;
+    expect(!is_hex_id(id), "non-ascii id", 7);
+    id[10] = '0';
+    id[63] = '\0';
+    expect(!is_hex_id(id), "short id", 7);
+    expect(!is_hex_id("0000000000000000000000000000000000000000000000000000000000000000a"), "long id", 7);
+    expect(!is_hex_id(".git"), "probe name", 7);
+
+    Node *events_dir = lookup_node(get_node(ROOT_NODE_INO), "e");
+    Node *pubkeys_dir = lookup_node(get_node(ROOT_NODE_INO), "p");
+    expect(lookup_node(events_dir, ".git") == NULL, "/e/.git", 0);
+    for (int i = k_num_events + 1; i < k_num_events + 64; i++) {
+        event_id(i, id);
+        expect(lookup_node(events_dir, id) == NULL, "unknown event", i);
+        snprintf(id, sizeof(id), "%064x", 0xdef000 + i);
+        expect(lookup_node(pubkeys_dir, id) == NULL, "unknown pubkey", i);
+    }
+
+    event_pubkey(0, id);
+    Node *pubkey_dir = lookup_node(pubkeys_dir, id);
+    expect(pubkey_dir != NULL, "known pubkey", 0);
+    if (pubkey_dir != NULL) {
+        expect(lookup_node(pubkey_dir, "desktop.ini") == NULL, "desktop.ini", 0);
+        forget_node(pubkey_dir->ino, 1);
+    }
+    forget_node(pubkeys_dir->ino, 1);
+    forget_node(events_dir->ino, 1);
+}
+
+/*
+ * Checks that one view of an event fetches its row once, that a commit by
+ * another connection is seen without the watcher, and that listing /e
+ * prefetches the records.
+ */
+static void check_event_records(const char *db_file_path) {
+    const int event_number = 5;
+    char id[65];
+    event_id(event_number, id);
+    const PathCaptures captures = {.event_id = id};
+
+    forget_event_records();
+    const EventRecordStats before = event_record_stats();
+    time_t created_at;
+    expect(event_creation_time(id, &created_at) == 0 && created_at == event_created_at(event_number), "record created_at", event_number);
+    char *kind = NULL, *pubkey = NULL;
+    char expected[65];
+    snprintf(expected, sizeof(expected), "%d", event_kind(event_number));
+    expect(get_event_kind_data(&captures, &kind) == 0 && strcmp(kind, expected) == 0, "record kind", event_number);
+    event_pubkey(event_number, expected);
+    expect(get_event_pubkey_data(&captures, &pubkey) == 0 && strcmp(pubkey, expected) == 0, "record pubkey", event_number);
+    free(kind);
+    free(pubkey);
+    off_t size;
+    char content[256];
+    event_content(event_number, content, sizeof(content));
+    expect(get_event_content_size(&captures, &size) == 0 && size == (off_t) strlen(content), "record content size", event_number);
+    const EventRecordStats after = event_record_stats();
+    expect(after.misses == before.misses + 1 && after.hits == before.hits + 3, "one fetch per event view", event_number);
+
+    sqlite3 *db = open_test_db(db_file_path);
+    char sql[256];
+    snprintf(sql, sizeof(sql), "UPDATE nostrEvents SET created_at = created_at + 1 WHERE id = '%s';", id);
+    expect(sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK, "rewrite created_at", event_number);
+    /* Threads check data_version at most once a millisecond. */
+    const struct timespec version_interval = {.tv_nsec = 2000000};
+    nanosleep(&version_interval, NULL);
+    expect(event_creation_time(id, &created_at) == 0 && created_at == event_created_at(event_number) + 1, "record after commit", event_number);
+    snprintf(sql, sizeof(sql), "UPDATE nostrEvents SET created_at = created_at - 1 WHERE id = '%s';", id);
+    expect(sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK, "restore created_at", event_number);
+    sqlite3_close(db);
+
+    forget_event_records();
+    NameList events = list_dir("/e");
+    expect(events.num_names == k_num_events, "listed events", 0);
+    const EventRecordStats listed = event_record_stats();
+    expect(event_creation_time(events.names[events.num_names - 1], &created_at) == 0, "prefetched created_at", k_num_events - 1);
+    expect(event_record_stats().misses == listed.misses, "listing prefetches records", k_num_events - 1);
+    free_name_list(&events);
+}
+
+static void *record_batch_thread(void *arg) {
+    (void) arg;
+    for (int i = 0; i < k_num_events; i++) {
+        char id[65];
+        event_id(i, id);
+        time_t created_at;
+        expect(event_creation_time(id, &created_at) == 0 && created_at == event_created_at(i), "batched created_at", i);
+    }
+    return NULL;
+}
+
+/* Checks that concurrent misses get their own records and are each answered by a batch or another's fetch. */
+static void check_record_batches(void) {
+    forget_event_records();
+    const EventRecordStats before = event_record_stats();
+    pthread_t threads[k_num_threads];
+    for (int i = 0; i < k_num_threads; i++) {
+        pthread_create(&threads[i], NULL, record_batch_thread, NULL);
+    }
+    for (int i = 0; i < k_num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    const EventRecordStats after = event_record_stats();
+    expect(after.misses - before.misses >= (unsigned long) k_num_events, "record misses", 0);
+    expect(
+        after.batched - before.batched + after.shared - before.shared == after.misses - before.misses,
+        "every miss fetched or shared",
+        0
+    );
+    expect(after.batches - before.batches <= after.batched - before.batched, "record batches", 0);
+}
+
+/* Checks the word-at-a-time hex conversions against printf, over every byte value. */
+static void check_hex_keys(void) {
+    for (int first = 0; first < 256; first += KEY_SIZE) {
+        unsigned char key[KEY_SIZE], decoded[KEY_SIZE];
+        char expected[KEY_HEX_LENGTH + 1], hex[KEY_HEX_LENGTH + 1];
+        for (int i = 0; i < KEY_SIZE; i++) {
+            key[i] = first + i;
+            snprintf(expected + 2 * i, 3, "%02x", key[i]);
+        }
+        key_to_hex(key, hex);
+        expect(strcmp(hex, expected) == 0, "key to hex", first);
+        expect(hex_to_key(expected, decoded) && memcmp(decoded, key, KEY_SIZE) == 0, "hex to key", first);
+        expected[first / KEY_SIZE] = 'A';
+        expect(!hex_to_key(expected, decoded), "uppercase hex key", first);
+    }
+    expect(!hex_to_key("abc", (unsigned char[KEY_SIZE]) {0}), "short hex key", 0);
+}
+
+/*
+ * Converts the database to binary keys and checks that every listing and
+ * file reads the same, then converts it back to hex text.
+ */
+static void check_binary_keys(const char *db_file_path) {
+    convert_keys(true);
+    expect(uses_binary_keys(), "binary keys", 0);
+    sqlite3 *db = open_test_db(db_file_path);
+    sqlite3_stmt *statement;
+    sqlite3_prepare_v2(
+        db,
+        "SELECT (SELECT count(*) FROM nostrEvents WHERE typeof(id) = 'blob' AND typeof(pubkey) = 'blob'),"
+        " (SELECT count(*) FROM tags WHERE typeof(id) = 'blob');",
+        -1,
+        &statement,
+        NULL
+    );
+    expect(sqlite3_step(statement) == SQLITE_ROW, "binary key count", 0);
+    expect(sqlite3_column_int(statement, 0) == k_num_events, "binary event keys", 0);
+    expect(sqlite3_column_int(statement, 1) == 5 * k_num_events, "binary tag keys", 0);
+    sqlite3_finalize(statement);
+    sqlite3_close(db);
+
+    check_paged_listing();
+    check_time_tree();
+    check_pubkey_kind_events();
+    check_tag_index();
+    check_search();
+    check_event_json();
+    for (int i = 0; i < k_num_events; i += 37) {
+        char pubkey[65];
+        event_pubkey(i, pubkey);
+        check_file(i, "pubkey", pubkey);
+        check_read(i, "pubkey", pubkey);
+        check_pubkey_events(i);
+    }
+
+    convert_keys(false);
+    expect(!uses_binary_keys(), "hex text keys", 0);
+    check_event_json();
+}
+
+static void *stress_thread(void *seed_ptr) {
+    unsigned int seed = *(unsigned int *) seed_ptr;
+
+    for (int i = 0; i < k_iterations_per_thread; i++) {
+        const int event_number = rand_r(&seed) % k_num_events;
+
+        char expected[256];
+        event_content(event_number, expected, sizeof(expected));
+        check_file(event_number, "content", expected);
+        check_read(event_number, "content", expected);
+
+        snprintf(expected, sizeof(expected), "%d", event_kind(event_number));
+        check_file(event_number, "kind", expected);
+        check_read(event_number, "kind", expected);
+
+        event_pubkey(event_number, expected);
+        check_file(event_number, "pubkey", expected);
+
+        char id[65];
+        event_id(event_number, id);
+        time_t created_at;
+        expect(
+            event_creation_time(id, &created_at) == 0 && created_at == event_created_at(event_number),
+            "created_at",
+            event_number
+        );
+
+        check_node(event_number, strlen(expected));
+
+        if (i % 50 == 0) {
+            check_pubkey_events(event_number);
+        }
+    }
+    return NULL;
+}
+
+static void run_stress_threads(void) {
+    pthread_t threads[k_num_threads];
+    unsigned int seeds[k_num_threads];
+    for (int i = 0; i < k_num_threads; i++) {
+        seeds[i] = i + 1;
+        pthread_create(&threads[i], NULL, stress_thread, &seeds[i]);
+    }
+    for (int i = 0; i < k_num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/* Leaves an index dropped as a killed bulk load would and checks that reopening recreates it. */
+static void check_deferred_indexes(const char *db_file_path) {
+    sqlite3 *db = open_test_db(db_file_path);
+    exec_sql(
+        db,
+        "BEGIN IMMEDIATE;"
+        "CREATE TABLE deferredIndexes (sql TEXT NOT NULL);"
+        "INSERT INTO deferredIndexes SELECT sql || ';' FROM sqlite_master WHERE name = 'nostrEvents_created_at';"
+        "DROP INDEX nostrEvents_created_at;"
+        "COMMIT;"
+    );
+
+    close_db();
+    initialize_db(db_file_path);
+    sqlite3_stmt *statement;
+    const bool prepared = sqlite3_prepare_v2(
+        db, "SELECT count(*) FROM sqlite_master WHERE name IN ('nostrEvents_created_at', 'deferredIndexes');", -1, &statement, NULL
+    ) == SQLITE_OK;
+    expect(prepared && sqlite3_step(statement) == SQLITE_ROW && sqlite3_column_int(statement, 0) == 1, "deferred index recreated", 0);
+    sqlite3_finalize(statement);
+    sqlite3_close(db);
+    check_time_tree();
+}
+
+/* Points the first event's content past the heap in a copy of the snapshot and checks that opening the copy fails. */
+static void check_corrupt_snapshot(const char *snapshot_path) {
+    FILE *file = fopen(snapshot_path, "rb");
+    expect(file != NULL, "snapshot reopened", 0);
+    fseek(file, 0, SEEK_END);
+    const long size = ftell(file);
+    rewind(file);
+    char *data = malloc(size);
+    expect(data != NULL && fread(data, 1, size, file) == (size_t) size, "snapshot read", 0);
+    fclose(file);
+
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    SnapshotEvent event;
+    memcpy(&event, data + header.events_offset, sizeof(event));
+    event.content = header.heap_size;
+    memcpy(data + header.events_offset, &event, sizeof(event));
+
+    char corrupt_path[] = "/tmp/nostrfs_corrupt_XXXXXX";
+    const int corrupt_fd = mkstemp(corrupt_path);
+    expect(corrupt_fd >= 0 && write(corrupt_fd, data, size) == size, "corrupt snapshot written", 0);
+    close(corrupt_fd);
+    free(data);
+
+    const pid_t child = fork();
+    if (child == 0) {
+        freopen("/dev/null", "w", stderr);
+        open_snapshot(corrupt_path);
+        _exit(EXIT_SUCCESS);
+    }
+    int status;
+    expect(child > 0 && waitpid(child, &status, 0) == child, "corrupt snapshot child", 0);
+    expect(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE, "corrupt snapshot rejected", 0);
+    unlink(corrupt_path);
+}
+
+/* Packs the database, serves the same checks from the snapshot, then reopens the database. */
+static void check_snapshot(const char *db_file_path) {
+    char snapshot_path[] = "/tmp/nostrfs_snapshot_XXXXXX";
+    const int snapshot_fd = mkstemp(snapshot_path);
+    expect(snapshot_fd >= 0, "snapshot file", 0);
+    close(snapshot_fd);
+
+    sqlite3 *db = open_test_db(db_file_path);
+    SnapshotStats stats;
+    write_snapshot(db, snapshot_path, &stats);
+    sqlite3_close(db);
+    expect(stats.num_events == (unsigned long) k_num_events && stats.num_skipped == 0, "snapshot events", 0);
+    expect(stats.num_tags == 5 * (unsigned long) k_num_events, "snapshot tags", 0);
+
+    close_db();
+    initialize_db(snapshot_path);
+    expect(snapshot_is_open() && uses_binary_keys(), "snapshot mounted", 0);
+    expect(latest_event_rowid() == k_num_events, "snapshot event count", 0);
+
+    check_paged_listing();
+    check_time_tree();
+    check_pubkey_kind_events();
+    check_tag_index();
+    check_event_json();
+    for (int i = 0; i < k_num_events; i += 37) {
+        char pubkey[65];
+        event_pubkey(i, pubkey);
+        check_file(i, "pubkey", pubkey);
+        check_read(i, "pubkey", pubkey);
+        check_pubkey_events(i);
+    }
+    NameList matches = list_dir("/search/event 7");
+    expect(matches.num_names == 0, "snapshot search", 0);
+    free_name_list(&matches);
+    run_stress_threads();
+
+    close_db();
+    initialize_db(db_file_path);
+    expect(!snapshot_is_open(), "database reopened", 0);
+    check_corrupt_snapshot(snapshot_path);
+    unlink(snapshot_path);
+}
+
+int main(void) {
+    char db_file_path[] = "/tmp/nostrfs_test_XXXXXX";
+    const int db_fd = mkstemp(db_file_path);
+    if (db_fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(db_fd);
+
+    create_test_db(db_file_path);
+    initialize_db(db_file_path);
+    compress_test_events(db_file_path);
+    store_test_event_json(db_file_path);
+    initialize_known_ids();
+    initialize_cache(k_num_events);
+    link_files();
+    initialize_nodes();
+
+    check_paged_listing();
+    check_cached_listing_plus();
+    check_time_tree();
+    check_pubkey_kind_events();
+    check_tag_index();
+    check_search();
+    check_event_json();
+    check_stored_event_json(db_file_path);
+    check_json_escaping();
+    check_arena();
+    check_known_ids();
+    check_event_records(db_file_path);
+    check_record_batches();
+
+    run_stress_threads();
+    check_stats();
+
+    check_hex_keys();
+    check_binary_keys(db_file_path);
+    check_snapshot(db_file_path);
+    check_deferred_indexes(db_file_path);
+    check_live_update(db_file_path);
+
+    free_nodes();
+    free_cache();
+    free_known_ids();
+    close_db();
+    free_thread_arena();
+
+    char sidecar_path[sizeof(db_file_path) + 8];
+    snprintf(sidecar_path, sizeof(sidecar_path), "%s-wal", db_file_path);
+    unlink(sidecar_path);
+    snprintf(sidecar_path, sizeof(sidecar_path), "%s-shm", db_file_path);
+    unlink(sidecar_path);
+    unlink(db_file_path);
+
+    const int mismatches = atomic_load(&num_mismatches);
+    printf(
+        "%d threads x %d iterations: %d mismatches\n",
+        k_num_threads,
+        k_iterations_per_thread,
+        mismatches
+    );
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "event.h"
+#include "json.h"
+
+/*
+ * Serializations of a parsed event: the NIP-01 array its id is the hash of,
+ * and the event object nostrfs-import -J stores for event.json.
+ */
+
+static void serialize_string(Buffer *buffer, const JsonString *string) {
+    buffer_append_json_string(buffer, string->value, string->length);
+}
+
+static void serialize_tags(Buffer *buffer, const Event *event) {
+    buffer_append_char(buffer, '[');
+    for (int i = 0; i < event->num_tags; i++) {
+        if (i > 0)
+            buffer_append_char(buffer, ',');
+        buffer_append_char(buffer, '[');
+        for (int j = 0; j < event->tags[i].num_values; j++) {
+            if (j > 0)
+                buffer_append_char(buffer, ',');
+            serialize_string(buffer, &event->tags[i].values[j]);
+        }
+        buffer_append_char(buffer, ']');
+    }
+    buffer_append_char(buffer, ']');
+}
+
+/* The array an event id is the SHA-256 of, replacing the buffer's contents. */
+void serialize_event(Buffer *buffer, const Event *event) {
+    char numbers[64];
+    buffer->length = 0;
+
+    BUFFER_APPEND_LITERAL(buffer, "[0,\"");
+    buffer_append(buffer, event->pubkey, 64);
+    const int numbers_length = snprintf(
+        numbers, sizeof(numbers), "\",%lld,%lld,", (long long) event->created_at, (long long) event->kind
+    );
+    buffer_append(buffer, numbers, numbers_length);
+    serialize_tags(buffer, event);
+    buffer_append_char(buffer, ',');
+    serialize_string(buffer, &event->content);
+    buffer_append_char(buffer, ']');
+}
+
+/*
+ * The event object as /e/<id>/event.json serves it.  Apart from tags without
+ * values, which the tags table cannot hold, this is the same text db.c
+ * renders from the event's row and tags.
+ */
+void serialize_event_json(Buffer *buffer, const Event *event) {
+    char numbers[96];
+    BUFFER_APPEND_LITERAL(buffer, "{\"id\":\"");
+    buffer_append(buffer, event->id, strlen(event->id));
+    BUFFER_APPEND_LITERAL(buffer, "\",\"pubkey\":\"");
+    buffer_append(buffer, event->pubkey, strlen(event->pubkey));
+    const int numbers_length = snprintf(
+        numbers, sizeof(numbers), "\",\"created_at\":%lld,\"kind\":%lld,\"tags\":", (long long) event->created_at, (long long) event->kind
+    );
+    buffer_append(buffer, numbers, numbers_length);
+    serialize_tags(buffer, event);
+    BUFFER_APPEND_LITERAL(buffer, ",\"content\":");
+    serialize_string(buffer, &event->content);
+    BUFFER_APPEND_LITERAL(buffer, ",\"sig\":\"");
+    buffer_append(buffer, event->sig, strlen(event->sig));
+    BUFFER_APPEND_LITERAL(buffer, "\"}");
+}
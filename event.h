@@ -0,0 +1,36 @@
+#ifndef NOSTRFS_EVENT
+#define NOSTRFS_EVENT
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "json.h"
+
+typedef struct {
+    char *value;
+    size_t length;
+} JsonString;
+
+/* values[0] is the tag key, the rest are its values. */
+typedef struct {
+    int num_values;
+    JsonString *values;
+} Tag;
+
+/* A parsed event.  json holds the event object to store, when one is kept. */
+typedef struct {
+    char id[65];
+    char pubkey[65];
+    char sig[129];
+    int64_t created_at;
+    int64_t kind;
+    JsonString content;
+    int num_tags;
+    Tag *tags;
+    JsonString json;
+} Event;
+
+void serialize_event(Buffer *buffer, const Event *event);
+void serialize_event_json(Buffer *buffer, const Event *event);
+
+#endif
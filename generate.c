@@ -0,0 +1,90 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "corpus.h"
+#include "db.h"
+
+/*
+ * Synthetic database generator.
+ *
+ *     nostrfs-generate [-n events] [-a authors] [-s seed] <db file>
+ *
+ * fills a new database with a deterministic corpus of events: power-law
+ * authors, a mix of notes, reactions, reposts, zaps, direct messages,
+ * metadata, contact lists and long-form posts, reply threads and mentions,
+ * and heavy-tailed content lengths.  The same options always produce the
+ * same events, so results measured on one machine can be reproduced on
+ * another without sharing relay data.
+ */
+
+static const long k_default_num_events = 1000000;
+static const uint64_t k_default_seed = 1;
+
+int main(int argc, char *argv[]) {
+    CorpusOptions options = {
+        .num_events = k_default_num_events,
+        .num_authors = DEFAULT_CORPUS_AUTHORS,
+        .seed = k_default_seed
+    };
+    int option;
+    while ((option = getopt(argc, argv, "n:a:s:")) != -1) {
+        if (option == 'n') {
+            options.num_events = atol(optarg);
+        }
+        else if (option == 'a') {
+            options.num_authors = atol(optarg);
+        }
+        else if (option == 's') {
+            options.seed = strtoull(optarg, NULL, 10);
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 1 != argc || options.num_events < 1 || options.num_authors < 1) {
+        fprintf(stderr, "usage: %s [-n events] [-a authors] [-s seed] <db file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *db_file_path = argv[optind];
+
+    sqlite3 *db;
+    if (sqlite3_open_v2(db_file_path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open database file \"%s\": %s\n", db_file_path, sqlite3_errmsg(db));
+        return EXIT_FAILURE;
+    }
+    initialize_db(db_file_path);
+    if (latest_event_rowid() != 0) {
+        fprintf(stderr, "%s already has events; generate into a new database\n", db_file_path);
+        sqlite3_close(db);
+        close_db();
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CorpusStats stats;
+    generate_corpus(db, &options, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    const double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(
+        stderr,
+        "%ld events, %ld tags, %llu content bytes in %.1f s (%.0f events/s)\n",
+        stats.num_events,
+        stats.num_tags,
+        stats.content_bytes,
+        seconds,
+        stats.num_events / seconds
+    );
+
+    sqlite3_close(db);
+    close_db();
+    return EXIT_SUCCESS;
+}
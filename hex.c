@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "hex.h"
+
+/*
+ * Event ids and pubkeys are 32-byte keys that paths and JSON spell as 64
+ * lowercase hex digits.  Conversions work on eight digits at a time in a
+ * 64-bit word, so checking, decoding and encoding a key are each a handful
+ * of arithmetic steps per word with no table lookups or per-digit branches.
+ */
+
+_Static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "hex conversion assumes little-endian words");
+
+static const uint64_t k_ones = 0x0101010101010101ULL;
+static const uint64_t k_highs = 0x8080808080808080ULL;
+static const uint64_t k_low_nibbles = 0x0f0f0f0f0f0f0f0fULL;
+
+/* Sets the high bit of each byte of word that is at least lower.  Every byte must be below 0x80. */
+static uint64_t bytes_at_least(uint64_t word, unsigned char lower) {
+    return (word + k_ones * (0x80 - lower)) & k_highs;
+}
+
+static bool is_hex_word(uint64_t word) {
+    if ((word & k_highs) != 0)
+        return false;
+    const uint64_t digits = bytes_at_least(word, '0') & ~bytes_at_least(word, '9' + 1);
+    const uint64_t letters = bytes_at_least(word, 'a') & ~bytes_at_least(word, 'f' + 1);
+    return (digits | letters) == k_highs;
+}
+
+/* Whether name is exactly 64 lowercase hex digits. */
+bool is_hex_id(const char *name) {
+    if (strnlen(name, KEY_HEX_LENGTH + 1) != KEY_HEX_LENGTH)
+        return false;
+
+    for (int i = 0; i < KEY_HEX_LENGTH; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, name + i, sizeof(word));
+        if (!is_hex_word(word))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Decodes a 64-digit lowercase hex id.  Returns false, leaving ret_key
+ * undefined, when hex is anything else.
+ */
+bool hex_to_key(const char *hex, unsigned char ret_key[KEY_SIZE]) {
+    if (strnlen(hex, KEY_HEX_LENGTH + 1) != KEY_HEX_LENGTH)
+        return false;
+
+    for (int i = 0; i < KEY_HEX_LENGTH; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, hex + i, sizeof(word));
+        if (!is_hex_word(word))
+            return false;
+
+        /* '0'-'9' keep their low nibble; 'a'-'f' have bit 6 set and gain 9. */
+        const uint64_t nibbles = (word & k_low_nibbles) + 9 * ((word >> 6) & k_ones);
+        uint64_t bytes = ((nibbles << 4) | (nibbles >> 8)) & 0x00ff00ff00ff00ffULL;
+        bytes = (bytes | (bytes >> 8)) & 0x0000ffff0000ffffULL;
+        bytes = (bytes | (bytes >> 16)) & 0x00000000ffffffffULL;
+        const uint32_t packed = (uint32_t) bytes;
+        memcpy(ret_key + i / 2, &packed, sizeof(packed));
+    }
+    return true;
+}
+
+/* Encodes a key as 64 lowercase hex digits and a terminating NUL. */
+void key_to_hex(const unsigned char key[KEY_SIZE], char ret_hex[KEY_HEX_LENGTH + 1]) {
+    for (int i = 0; i < KEY_SIZE; i += sizeof(uint32_t)) {
+        uint32_t packed;
+        memcpy(&packed, key + i, sizeof(packed));
+
+        uint64_t bytes = packed;
+        bytes = (bytes | (bytes << 16)) & 0x0000ffff0000ffffULL;
+        bytes = (bytes | (bytes << 8)) & 0x00ff00ff00ff00ffULL;
+        const uint64_t nibbles = ((bytes >> 4) & 0x000f000f000f000fULL) | ((bytes & 0x000f000f000f000fULL) << 8);
+        const uint64_t letters = bytes_at_least(nibbles, 10) >> 7;
+        const uint64_t word = nibbles + k_ones * '0' + letters * ('a' - '0' - 10);
+        memcpy(ret_hex + 2 * i, &word, sizeof(word));
+    }
+    ret_hex[KEY_HEX_LENGTH] = '\0';
+}
@@ -0,0 +1,13 @@
+#ifndef NOSTRFS_HEX
+#define NOSTRFS_HEX
+
+#include <stdbool.h>
+
+#define KEY_SIZE 32
+#define KEY_HEX_LENGTH 64
+
+bool is_hex_id(const char *name);
+bool hex_to_key(const char *hex, unsigned char ret_key[KEY_SIZE]);
+void key_to_hex(const unsigned char key[KEY_SIZE], char ret_hex[KEY_HEX_LENGTH + 1]);
+
+#endif
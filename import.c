@@ -0,0 +1,782 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sqlite3.h>
+#include <secp256k1.h>
+#include <secp256k1_extrakeys.h>
+#include <secp256k1_schnorrsig.h>
+#include <openssl/sha.h>
+
+#include "db.h"
+#include "event.h"
+#include "json.h"
+
+/*
+ * Bulk loader for nostr events.
+ *
+ *     nostrfs-import [-j threads] [-J] <db file> [jsonl file...]
+ *
+ * reads one event per line from the named files, or from stdin when none are
+ * given.  Worker threads parse each event and check its id and Schnorr
+ * signature; a single writer inserts the accepted events in large
+ * transactions through statements prepared once.  Events already in the
+ * database are skipped, so an interrupted import can simply be rerun.  With
+ * -J each event's JSON is also stored, so event.json is read rather than
+ * rendered and keeps tags that have no values.  Ids and pubkeys are written
+ * in the database's key format, hex or binary (see nostrfs-rekey).
+ */
+
+#define LINES_PER_BATCH 512
+
+static const int k_events_per_transaction = 50000;
+static const int k_batches_per_worker = 4;
+static const int k_max_json_depth = 64;
+static const double k_progress_interval_s = 2.0;
+
+typedef enum {
+    EVENT_VALID,
+    EVENT_MALFORMED,
+    EVENT_BAD_ID,
+    EVENT_BAD_SIGNATURE
+} EventStatus;
+
+typedef struct Batch Batch;
+
+struct Batch {
+    Batch *next;
+    int num_lines;
+    char *lines[LINES_PER_BATCH];
+    EventStatus statuses[LINES_PER_BATCH];
+    Event events[LINES_PER_BATCH];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    Batch *head;
+    Batch *tail;
+    int length;
+    int capacity;
+    bool closed;
+} BatchQueue;
+
+typedef struct {
+    unsigned long num_lines;
+    unsigned long num_imported;
+    unsigned long num_duplicates;
+    unsigned long num_malformed;
+    unsigned long num_bad_ids;
+    unsigned long num_bad_signatures;
+} ImportStats;
+
+typedef struct {
+    const char *at;
+} JsonReader;
+
+static secp256k1_context *verify_context;
+static bool store_event_json;
+static BatchQueue parse_queue;
+static BatchQueue insert_queue;
+
+static void initialize_queue(BatchQueue *queue, int capacity) {
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->length = 0;
+    queue->capacity = capacity;
+    queue->closed = false;
+}
+
+static void destroy_queue(BatchQueue *queue) {
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+}
+
+static void queue_push(BatchQueue *queue, Batch *batch) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->length >= queue->capacity)
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    batch->next = NULL;
+    if (queue->tail != NULL)
+        queue->tail->next = batch;
+    else
+        queue->head = batch;
+    queue->tail = batch;
+    queue->length++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Returns NULL once the queue is closed and drained. */
+static Batch *queue_pop(BatchQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->head == NULL && !queue->closed)
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    Batch *batch = queue->head;
+    if (batch != NULL) {
+        queue->head = batch->next;
+        if (queue->head == NULL)
+            queue->tail = NULL;
+        queue->length--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return batch;
+}
+
+static void queue_close(BatchQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = true;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void skip_whitespace(JsonReader *reader) {
+    while (*reader->at == ' ' || *reader->at == '\t' || *reader->at == '\n' || *reader->at == '\r')
+        reader->at++;
+}
+
+static bool consume(JsonReader *reader, char c) {
+    skip_whitespace(reader);
+    if (*reader->at != c)
+        return false;
+    reader->at++;
+    return true;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static bool parse_hex4(JsonReader *reader, unsigned *ret_code_unit) {
+    unsigned code_unit = 0;
+    for (int i = 0; i < 4; i++) {
+        const int digit = hex_digit(reader->at[i]);
+        if (digit < 0)
+            return false;
+        code_unit = code_unit << 4 | digit;
+    }
+    reader->at += 4;
+    *ret_code_unit = code_unit;
+    return true;
+}
+
+static size_t encode_utf8(unsigned code_point, char *ret_bytes) {
+    if (code_point < 0x80) {
+        ret_bytes[0] = code_point;
+        return 1;
+    }
+    if (code_point < 0x800) {
+        ret_bytes[0] = 0xc0 | code_point >> 6;
+        ret_bytes[1] = 0x80 | (code_point & 0x3f);
+        return 2;
+    }
+    if (code_point < 0x10000) {
+        ret_bytes[0] = 0xe0 | code_point >> 12;
+        ret_bytes[1] = 0x80 | (code_point >> 6 & 0x3f);
+        ret_bytes[2] = 0x80 | (code_point & 0x3f);
+        return 3;
+    }
+    ret_bytes[0] = 0xf0 | code_point >> 18;
+    ret_bytes[1] = 0x80 | (code_point >> 12 & 0x3f);
+    ret_bytes[2] = 0x80 | (code_point >> 6 & 0x3f);
+    ret_bytes[3] = 0x80 | (code_point & 0x3f);
+    return 4;
+}
+
+/*
+ * Decodes a JSON string into UTF-8.  Lone surrogates are rejected: they have
+ * no UTF-8 form, so the event id could not be recomputed from the stored
+ * content.
+ */
+static bool parse_string(JsonReader *reader, JsonString *ret_string) {
+    if (!consume(reader, '"'))
+        return false;
+
+    const char *raw_end = reader->at;
+    while (*raw_end != '"') {
+        if (*raw_end == '\0')
+            return false;
+        if (*raw_end == '\\' && raw_end[1] != '\0')
+            raw_end++;
+        raw_end++;
+    }
+
+    /* Escapes never decode to more bytes than they occupy. */
+    char *value = malloc(raw_end - reader->at + 1);
+    assert(value != NULL);
+    size_t length = 0;
+    while (reader->at < raw_end) {
+        const char c = *reader->at++;
+        if ((unsigned char) c < 0x20)
+            goto malformed;
+        if (c != '\\') {
+            value[length++] = c;
+            continue;
+        }
+        switch (*reader->at++) {
+            case '"': value[length++] = '"'; break;
+            case '\\': value[length++] = '\\'; break;
+            case '/': value[length++] = '/'; break;
+            case 'b': value[length++] = '\b'; break;
+            case 'f': value[length++] = '\f'; break;
+            case 'n': value[length++] = '\n'; break;
+            case 'r': value[length++] = '\r'; break;
+            case 't': value[length++] = '\t'; break;
+            case 'u': {
+                unsigned code_point;
+                if (!parse_hex4(reader, &code_point) || (code_point >= 0xdc00 && code_point < 0xe000))
+                    goto malformed;
+                if (code_point >= 0xd800 && code_point < 0xdc00) {
+                    unsigned low_surrogate;
+                    if (reader->at[0] != '\\' || reader->at[1] != 'u')
+                        goto malformed;
+                    reader->at += 2;
+                    if (!parse_hex4(reader, &low_surrogate) || low_surrogate < 0xdc00 || low_surrogate >= 0xe000)
+                        goto malformed;
+                    code_point = 0x10000 + ((code_point - 0xd800) << 10) + (low_surrogate - 0xdc00);
+                }
+                length += encode_utf8(code_point, value + length);
+                break;
+            }
+            default:
+                goto malformed;
+        }
+    }
+    reader->at = raw_end + 1;
+    value[length] = '\0';
+    ret_string->value = value;
+    ret_string->length = length;
+    return true;
+
+malformed:
+    free(value);
+    return false;
+}
+
+static bool parse_integer(JsonReader *reader, int64_t *ret_integer) {
+    skip_whitespace(reader);
+    const char *start = reader->at;
+    if (*reader->at == '-')
+        reader->at++;
+    if (*reader->at < '0' || *reader->at > '9')
+        return false;
+    while (*reader->at >= '0' && *reader->at <= '9')
+        reader->at++;
+    if (*reader->at == '.' || *reader->at == 'e' || *reader->at == 'E')
+        return false;
+
+    char *end;
+    *ret_integer = strtoll(start, &end, 10);
+    return end == reader->at;
+}
+
+static bool parse_hex_string(JsonReader *reader, char *ret_hex, size_t hex_length) {
+    JsonString string;
+    if (!parse_string(reader, &string))
+        return false;
+
+    bool is_hex = string.length == hex_length;
+    for (size_t i = 0; is_hex && i < hex_length; i++) {
+        is_hex = (string.value[i] >= '0' && string.value[i] <= '9') || (string.value[i] >= 'a' && string.value[i] <= 'f');
+    }
+    if (is_hex)
+        memcpy(ret_hex, string.value, hex_length + 1);
+    free(string.value);
+    return is_hex;
+}
+
+static bool skip_value(JsonReader *reader, int depth) {
+    if (depth > k_max_json_depth)
+        return false;
+
+    skip_whitespace(reader);
+    switch (*reader->at) {
+        case '"': {
+            JsonString string;
+            if (!parse_string(reader, &string))
+                return false;
+            free(string.value);
+            return true;
+        }
+        case '[':
+        case '{': {
+            const char close = *reader->at == '[' ? ']' : '}';
+            const bool is_object = close == '}';
+            reader->at++;
+            if (consume(reader, close))
+                return true;
+            do {
+                if (is_object) {
+                    JsonString key;
+                    if (!parse_string(reader, &key))
+                        return false;
+                    free(key.value);
+                    if (!consume(reader, ':'))
+                        return false;
+                }
+                if (!skip_value(reader, depth + 1))
+                    return false;
+            } while (consume(reader, ','));
+            return consume(reader, close);
+        }
+        default: {
+            const char *start = reader->at;
+            while (*reader->at != '\0' && strchr(",]} \t\r\n", *reader->at) == NULL)
+                reader->at++;
+            return reader->at > start;
+        }
+    }
+}
+
+static void free_tag(Tag *tag) {
+    for (int i = 0; i < tag->num_values; i++) {
+        free(tag->values[i].value);
+    }
+    free(tag->values);
+}
+
+static void free_event(Event *event) {
+    free(event->content.value);
+    free(event->json.value);
+    for (int i = 0; i < event->num_tags; i++) {
+        free_tag(&event->tags[i]);
+    }
+    free(event->tags);
+    memset(event, 0, sizeof(Event));
+}
+
+static bool parse_tag(JsonReader *reader, Tag *ret_tag) {
+    int capacity = 0;
+    ret_tag->num_values = 0;
+    ret_tag->values = NULL;
+    if (!consume(reader, '['))
+        return false;
+    if (consume(reader, ']'))
+        return true;
+    do {
+        if (ret_tag->num_values == capacity) {
+            capacity = capacity == 0 ? 4 : capacity * 2;
+            ret_tag->values = realloc(ret_tag->values, capacity * sizeof(JsonString));
+            assert(ret_tag->values != NULL);
+        }
+        if (!parse_string(reader, &ret_tag->values[ret_tag->num_values]))
+            return false;
+        ret_tag->num_values++;
+    } while (consume(reader, ','));
+    return consume(reader, ']');
+}
+
+static bool parse_tags(JsonReader *reader, Event *event) {
+    int capacity = 0;
+    if (!consume(reader, '['))
+        return false;
+    if (consume(reader, ']'))
+        return true;
+    do {
+        if (event->num_tags == capacity) {
+            capacity = capacity == 0 ? 4 : capacity * 2;
+            event->tags = realloc(event->tags, capacity * sizeof(Tag));
+            assert(event->tags != NULL);
+        }
+        const bool tag_parsed = parse_tag(reader, &event->tags[event->num_tags]);
+        event->num_tags++;
+        if (!tag_parsed)
+            return false;
+    } while (consume(reader, ','));
+    return consume(reader, ']');
+}
+
+enum {
+    ID_FIELD = 1 << 0,
+    PUBKEY_FIELD = 1 << 1,
+    CREATED_AT_FIELD = 1 << 2,
+    KIND_FIELD = 1 << 3,
+    TAGS_FIELD = 1 << 4,
+    CONTENT_FIELD = 1 << 5,
+    SIG_FIELD = 1 << 6,
+    ALL_FIELDS = (1 << 7) - 1
+};
+
+static bool parse_field(JsonReader *reader, const char *key, Event *event, unsigned *seen_fields) {
+    static const struct {
+        const char *key;
+        unsigned field;
+    } k_fields[] = {
+        {"id", ID_FIELD},
+        {"pubkey", PUBKEY_FIELD},
+        {"created_at", CREATED_AT_FIELD},
+        {"kind", KIND_FIELD},
+        {"tags", TAGS_FIELD},
+        {"content", CONTENT_FIELD},
+        {"sig", SIG_FIELD}
+    };
+
+    unsigned field = 0;
+    for (size_t i = 0; i < sizeof(k_fields) / sizeof(k_fields[0]); i++) {
+        if (strcmp(key, k_fields[i].key) == 0)
+            field = k_fields[i].field;
+    }
+    if (field & *seen_fields)
+        return false;
+    *seen_fields |= field;
+
+    switch (field) {
+        case ID_FIELD: return parse_hex_string(reader, event->id, 64);
+        case PUBKEY_FIELD: return parse_hex_string(reader, event->pubkey, 64);
+        case CREATED_AT_FIELD: return parse_integer(reader, &event->created_at);
+        case KIND_FIELD: return parse_integer(reader, &event->kind);
+        case TAGS_FIELD: return parse_tags(reader, event);
+        case CONTENT_FIELD: return parse_string(reader, &event->content);
+        case SIG_FIELD: return parse_hex_string(reader, event->sig, 128);
+        default: return skip_value(reader, 1);
+    }
+}
+
+static bool parse_event(const char *line, Event *event) {
+    JsonReader reader = {line};
+    unsigned seen_fields = 0;
+
+    memset(event, 0, sizeof(Event));
+    if (!consume(&reader, '{'))
+        return false;
+    do {
+        JsonString key;
+        if (!parse_string(&reader, &key))
+            return false;
+        const bool field_parsed = consume(&reader, ':') && parse_field(&reader, key.value, event, &seen_fields);
+        free(key.value);
+        if (!field_parsed)
+            return false;
+    } while (consume(&reader, ','));
+    if (!consume(&reader, '}'))
+        return false;
+    skip_whitespace(&reader);
+    return *reader.at == '\0' && seen_fields == ALL_FIELDS;
+}
+
+static void hex_to_bytes(const char *hex, unsigned char *ret_bytes, size_t num_bytes) {
+    for (size_t i = 0; i < num_bytes; i++) {
+        ret_bytes[i] = hex_digit(hex[2 * i]) << 4 | hex_digit(hex[2 * i + 1]);
+    }
+}
+
+static EventStatus verify_event(const Event *event, Buffer *scratch) {
+    unsigned char id[32], hash[SHA256_DIGEST_LENGTH];
+    serialize_event(scratch, event);
+    SHA256((const unsigned char *) scratch->data, scratch->length, hash);
+    hex_to_bytes(event->id, id, sizeof(id));
+    if (memcmp(id, hash, sizeof(id)) != 0)
+        return EVENT_BAD_ID;
+
+    unsigned char pubkey_bytes[32], sig[64];
+    secp256k1_xonly_pubkey pubkey;
+    hex_to_bytes(event->pubkey, pubkey_bytes, sizeof(pubkey_bytes));
+    hex_to_bytes(event->sig, sig, sizeof(sig));
+    if (!secp256k1_xonly_pubkey_parse(verify_context, &pubkey, pubkey_bytes))
+        return EVENT_BAD_SIGNATURE;
+    if (!secp256k1_schnorrsig_verify(verify_context, sig, id, sizeof(id), &pubkey))
+        return EVENT_BAD_SIGNATURE;
+    return EVENT_VALID;
+}
+
+static void *verify_thread(void *arg) {
+    (void) arg;
+
+    Buffer scratch = {0};
+    Batch *batch;
+    while ((batch = queue_pop(&parse_queue)) != NULL) {
+        for (int i = 0; i < batch->num_lines; i++) {
+            Event *event = &batch->events[i];
+            if (parse_event(batch->lines[i], event)) {
+                batch->statuses[i] = verify_event(event, &scratch);
+                if (batch->statuses[i] == EVENT_VALID && store_event_json) {
+                    Buffer json = {0};
+                    serialize_event_json(&json, event);
+                    event->json = (JsonString) {.value = json.data, .length = json.length};
+                }
+            }
+            else {
+                batch->statuses[i] = EVENT_MALFORMED;
+            }
+            if (batch->statuses[i] != EVENT_VALID)
+                free_event(event);
+            free(batch->lines[i]);
+            batch->lines[i] = NULL;
+        }
+        queue_push(&insert_queue, batch);
+    }
+    free(scratch.data);
+    return NULL;
+}
+
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *insert_event;
+    sqlite3_stmt *insert_tag;
+    int events_in_transaction;
+    ImportStats stats;
+    struct timespec start;
+} Writer;
+
+static void writer_exec(Writer *writer, const char *sql) {
+    char *errmsg = NULL;
+    if (sqlite3_exec(writer->db, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+        fprintf(stderr, "Error executing \"%s\": %s\n", sql, errmsg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void writer_prepare(Writer *writer, const char *sql, sqlite3_stmt **ret_statement) {
+    if (sqlite3_prepare_v3(writer->db, sql, -1, SQLITE_PREPARE_PERSISTENT, ret_statement, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Error preparing statement: \"%s\" error message: \"%s\"\n", sql, sqlite3_errmsg(writer->db));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void writer_step(Writer *writer, sqlite3_stmt *statement) {
+    if (sqlite3_step(statement) != SQLITE_DONE) {
+        fprintf(stderr, "Error inserting event: %s\n", sqlite3_errmsg(writer->db));
+        exit(EXIT_FAILURE);
+    }
+    sqlite3_reset(statement);
+}
+
+/* Inserts an event and, if it was new, its tag values. */
+static void insert_event(Writer *writer, const Event *event) {
+    if (writer->events_in_transaction == 0)
+        writer_exec(writer, "BEGIN;");
+
+    sqlite3_stmt *statement = writer->insert_event;
+    statement_bind_key(statement, 1, event->id);
+    statement_bind_key(statement, 2, event->pubkey);
+    sqlite3_bind_int64(statement, 3, event->created_at);
+    sqlite3_bind_int64(statement, 4, event->kind);
+    sqlite3_bind_text(statement, 5, event->content.value, event->content.length, SQLITE_STATIC);
+    sqlite3_bind_text(statement, 6, event->sig, 128, SQLITE_STATIC);
+    if (event->json.value != NULL)
+        sqlite3_bind_text(statement, 7, event->json.value, event->json.length, SQLITE_STATIC);
+    else
+        sqlite3_bind_null(statement, 7);
+    writer_step(writer, statement);
+
+    if (sqlite3_changes(writer->db) == 0) {
+        writer->stats.num_duplicates++;
+    }
+    else {
+        statement = writer->insert_tag;
+        statement_bind_key(statement, 1, event->id);
+        for (int i = 0; i < event->num_tags; i++) {
+            const Tag *tag = &event->tags[i];
+            for (int j = 1; j < tag->num_values; j++) {
+                sqlite3_bind_text(statement, 2, tag->values[0].value, tag->values[0].length, SQLITE_STATIC);
+                sqlite3_bind_int(statement, 3, i);
+                sqlite3_bind_int(statement, 4, j - 1);
+                sqlite3_bind_text(statement, 5, tag->values[j].value, tag->values[j].length, SQLITE_STATIC);
+                writer_step(writer, statement);
+            }
+        }
+        writer->stats.num_imported++;
+    }
+
+    if (++writer->events_in_transaction >= k_events_per_transaction) {
+        writer_exec(writer, "COMMIT;");
+        writer->events_in_transaction = 0;
+    }
+}
+
+static double seconds_since(struct timespec start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static void print_stats(const ImportStats *stats, double elapsed_s) {
+    fprintf(
+        stderr,
+        "%lu lines, %lu imported, %lu duplicate, %lu malformed, %lu bad id, %lu bad signature"
+        " in %.1f s (%.0f lines/s, %.0f events/s)\n",
+        stats->num_lines,
+        stats->num_imported,
+        stats->num_duplicates,
+        stats->num_malformed,
+        stats->num_bad_ids,
+        stats->num_bad_signatures,
+        elapsed_s,
+        elapsed_s > 0 ? stats->num_lines / elapsed_s : 0,
+        elapsed_s > 0 ? stats->num_imported / elapsed_s : 0
+    );
+}
+
+static void *writer_thread(void *writer_ptr) {
+    Writer *writer = writer_ptr;
+    double last_progress_s = 0;
+
+    Batch *batch;
+    while ((batch = queue_pop(&insert_queue)) != NULL) {
+        writer->stats.num_lines += batch->num_lines;
+        for (int i = 0; i < batch->num_lines; i++) {
+            switch (batch->statuses[i]) {
+                case EVENT_VALID:
+                    insert_event(writer, &batch->events[i]);
+                    free_event(&batch->events[i]);
+                    break;
+                case EVENT_MALFORMED:
+                    writer->stats.num_malformed++;
+                    break;
+                case EVENT_BAD_ID:
+                    writer->stats.num_bad_ids++;
+                    break;
+                case EVENT_BAD_SIGNATURE:
+                    writer->stats.num_bad_signatures++;
+                    break;
+            }
+        }
+        free(batch);
+
+        const double elapsed_s = seconds_since(writer->start);
+        if (elapsed_s - last_progress_s >= k_progress_interval_s) {
+            print_stats(&writer->stats, elapsed_s);
+            last_progress_s = elapsed_s;
+        }
+    }
+    if (writer->events_in_transaction > 0)
+        writer_exec(writer, "COMMIT;");
+    return NULL;
+}
+
+static bool is_blank(const char *line) {
+    return line[strspn(line, " \t\r\n")] == '\0';
+}
+
+static Batch *read_lines(FILE *input, Batch *batch) {
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, input) != -1) {
+        if (is_blank(line))
+            continue;
+        if (batch == NULL) {
+            batch = calloc(1, sizeof(Batch));
+            assert(batch != NULL);
+        }
+        batch->lines[batch->num_lines++] = line;
+        line = NULL;
+        line_capacity = 0;
+        if (batch->num_lines == LINES_PER_BATCH) {
+            queue_push(&parse_queue, batch);
+            batch = NULL;
+        }
+    }
+    free(line);
+    return batch;
+}
+
+int main(int argc, char *argv[]) {
+    long num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int option;
+    while ((option = getopt(argc, argv, "j:J")) != -1) {
+        if (option == 'j') {
+            num_workers = atol(optarg);
+        }
+        else if (option == 'J') {
+            store_event_json = true;
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind >= argc || num_workers < 1) {
+        fprintf(stderr, "usage: %s [-j threads] [-J] <db file> [jsonl file...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *db_file_path = argv[optind];
+
+    Writer writer = {0};
+    if (sqlite3_open_v2(db_file_path, &writer.db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open database file \"%s\": %s\n", db_file_path, sqlite3_errmsg(writer.db));
+        return EXIT_FAILURE;
+    }
+    initialize_db(db_file_path);
+    sqlite3_busy_timeout(writer.db, 5000);
+    writer_exec(&writer, "PRAGMA synchronous = NORMAL;");
+    writer_prepare(
+        &writer,
+        "INSERT OR IGNORE INTO nostrEvents (id, pubkey, created_at, kind, content, sig, event_json) VALUES (?, ?, ?, ?, ?, ?, ?);",
+        &writer.insert_event
+    );
+    writer_prepare(
+        &writer,
+        "INSERT INTO tags (id, key, tag_index, value_index, value) VALUES (?, ?, ?, ?, ?);",
+        &writer.insert_tag
+    );
+
+    verify_context = secp256k1_context_create(SECP256K1_CONTEXT_NONE);
+    assert(verify_context != NULL);
+    initialize_queue(&parse_queue, num_workers * k_batches_per_worker);
+    initialize_queue(&insert_queue, num_workers * k_batches_per_worker);
+
+    clock_gettime(CLOCK_MONOTONIC, &writer.start);
+    pthread_t writer_id;
+    pthread_t *worker_ids = calloc(num_workers, sizeof(pthread_t));
+    assert(worker_ids != NULL);
+    pthread_create(&writer_id, NULL, writer_thread, &writer);
+    for (long i = 0; i < num_workers; i++) {
+        pthread_create(&worker_ids[i], NULL, verify_thread, NULL);
+    }
+
+    int exit_status = EXIT_SUCCESS;
+    Batch *batch = NULL;
+    if (optind + 1 == argc) {
+        batch = read_lines(stdin, batch);
+    }
+    for (int i = optind + 1; i < argc; i++) {
+        FILE *input = fopen(argv[i], "r");
+        if (input == NULL) {
+            perror(argv[i]);
+            exit_status = EXIT_FAILURE;
+            continue;
+        }
+        batch = read_lines(input, batch);
+        fclose(input);
+    }
+    if (batch != NULL)
+        queue_push(&parse_queue, batch);
+
+    queue_close(&parse_queue);
+    for (long i = 0; i < num_workers; i++) {
+        pthread_join(worker_ids[i], NULL);
+    }
+    queue_close(&insert_queue);
+    pthread_join(writer_id, NULL);
+    print_stats(&writer.stats, seconds_since(writer.start));
+
+    free(worker_ids);
+    destroy_queue(&insert_queue);
+    destroy_queue(&parse_queue);
+    secp256k1_context_destroy(verify_context);
+    sqlite3_finalize(writer.insert_tag);
+    sqlite3_finalize(writer.insert_event);
+    sqlite3_close(writer.db);
+    close_db();
+    return exit_status;
+}
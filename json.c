@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "arena.h"
+#include "json.h"
+
+static const uint64_t k_ones = 0x0101010101010101ULL;
+static const uint64_t k_highs = 0x8080808080808080ULL;
+
+void buffer_append(Buffer *buffer, const char *data, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        buffer->capacity = (buffer->length + length) * 2;
+        if (buffer->in_arena) {
+            char *data = arena_alloc(buffer->capacity);
+            if (buffer->length > 0)
+                memcpy(data, buffer->data, buffer->length);
+            buffer->data = data;
+        }
+        else {
+            buffer->data = realloc(buffer->data, buffer->capacity);
+            assert(buffer->data != NULL);
+        }
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void buffer_append_char(Buffer *buffer, char c) {
+    buffer_append(buffer, &c, 1);
+}
+
+/*
+ * Whether any of the eight bytes in word needs escaping: a control character,
+ * a quote or a backslash.  Bytes of multi-byte UTF-8 sequences never do.  A
+ * false positive only sends the word down the bytewise path.
+ */
+static bool word_needs_escaping(uint64_t word) {
+    const uint64_t quotes = word ^ (k_ones * '"');
+    const uint64_t backslashes = word ^ (k_ones * '\\');
+    const uint64_t special =
+        (word - k_ones * 0x20) |
+        (quotes - k_ones) |
+        (backslashes - k_ones);
+    return (special & ~word & k_highs) != 0;
+}
+
+/* Appends the escape sequence for a quote, backslash or control character. */
+static void append_escaped_char(Buffer *buffer, unsigned char c) {
+    switch (c) {
+        case '"': buffer_append(buffer, "\\\"", 2); break;
+        case '\\': buffer_append(buffer, "\\\\", 2); break;
+        case '\b': buffer_append(buffer, "\\b", 2); break;
+        case '\f': buffer_append(buffer, "\\f", 2); break;
+        case '\n': buffer_append(buffer, "\\n", 2); break;
+        case '\r': buffer_append(buffer, "\\r", 2); break;
+        case '\t': buffer_append(buffer, "\\t", 2); break;
+        default: {
+            char escape[7];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            buffer_append(buffer, escape, 6);
+        }
+    }
+}
+
+/*
+ * Appends value as a JSON string, escaped the way NIP-01 serializes events
+ * for hashing.  Note text rarely needs escaping, so the value is scanned a
+ * word at a time and clean runs are copied whole.
+ */
+void buffer_append_json_string(Buffer *buffer, const char *value, size_t length) {
+    buffer_append_char(buffer, '"');
+    size_t run_start = 0;
+    size_t i = 0;
+    while (i < length) {
+        uint64_t word;
+        if (i + sizeof(word) <= length) {
+            memcpy(&word, value + i, sizeof(word));
+            if (!word_needs_escaping(word)) {
+                i += sizeof(word);
+                continue;
+            }
+        }
+
+        const size_t word_end = i + sizeof(word) < length ? i + sizeof(word) : length;
+        for (; i < word_end; i++) {
+            const unsigned char c = value[i];
+            if (c < 0x20 || c == '"' || c == '\\') {
+                buffer_append(buffer, value + run_start, i - run_start);
+                append_escaped_char(buffer, c);
+                run_start = i + 1;
+            }
+        }
+    }
+    buffer_append(buffer, value + run_start, length - run_start);
+    buffer_append_char(buffer, '"');
+}
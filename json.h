@@ -0,0 +1,21 @@
+#ifndef NOSTRFS_JSON
+#define NOSTRFS_JSON
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A growable byte string.  One in_arena grows in the calling thread's arena and is never freed. */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool in_arena;
+} Buffer;
+
+void buffer_append(Buffer *buffer, const char *data, size_t length);
+/* Appends a string literal without its terminating NUL. */
+#define BUFFER_APPEND_LITERAL(buffer, literal) buffer_append(buffer, literal, sizeof(literal) - 1)
+void buffer_append_char(Buffer *buffer, char c);
+void buffer_append_json_string(Buffer *buffer, const char *value, size_t length);
+
+#endif
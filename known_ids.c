@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <stdatomic.h>
+
+#include "db.h"
+#include "hex.h"
+#include "known_ids.h"
+#include "snapshot.h"
+
+/*
+ * Negative lookups: shells, file managers and backup tools keep probing
+ * names that do not exist, like /e/.git or /p/<pubkey>/desktop.ini.  A
+ * component that stands for an event id or pubkey must be 64 lowercase hex
+ * digits and must pass a Bloom filter over the ids and pubkeys in the
+ * database, so most misses are answered without a query.  Only the watcher
+ * extends the filters, so they must only be built when it runs: nostrfs
+ * builds them for live mounts, once initialize_watch has set the watermark,
+ * so that every event is either in the filters or still to be ingested.
+ * Bits are only ever set, so readers take no lock; until
+ * initialize_known_ids has run, every well-formed id may be known.
+ */
+
+#define BLOCK_WORDS 8
+
+/* About 1% false positives at capacity, with the probes of a key in one cache line. */
+static const unsigned long k_bits_per_id = 12;
+static const int k_num_probes = 6;
+static const unsigned long k_min_capacity = 1 << 16;
+
+typedef struct {
+    _Atomic uint64_t *words;
+    uint64_t num_blocks;
+} BloomFilter;
+
+static BloomFilter event_ids;
+static BloomFilter pubkeys;
+static bool filtering = false;
+
+static uint64_t mix(uint64_t hash) {
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+static uint64_t hash_id(const char *id) {
+    uint64_t hash = 0;
+    for (int i = 0; i < KEY_HEX_LENGTH; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, id + i, sizeof(word));
+        hash = mix(hash ^ word);
+    }
+    return hash;
+}
+
+static void create_filter(BloomFilter *filter, unsigned long capacity) {
+    filter->num_blocks = 1;
+    while (filter->num_blocks * BLOCK_WORDS * 64 < capacity * k_bits_per_id) {
+        filter->num_blocks *= 2;
+    }
+    filter->words = calloc(filter->num_blocks * BLOCK_WORDS, sizeof(uint64_t));
+    assert(filter->words != NULL);
+}
+
+static void free_filter(BloomFilter *filter) {
+    free(filter->words);
+    filter->words = NULL;
+    filter->num_blocks = 0;
+}
+
+/* The low bits of the hash pick a 512-bit block, and nine bits of its remix each probe within it. */
+static _Atomic uint64_t *filter_block(const BloomFilter *filter, uint64_t hash) {
+    return filter->words + (hash & (filter->num_blocks - 1)) * BLOCK_WORDS;
+}
+
+static void filter_add(BloomFilter *filter, const char *id) {
+    const uint64_t hash = hash_id(id);
+    _Atomic uint64_t *block = filter_block(filter, hash);
+    uint64_t probes = mix(hash);
+    for (int i = 0; i < k_num_probes; i++, probes >>= 9) {
+        atomic_fetch_or_explicit(&block[(probes >> 6) % BLOCK_WORDS], 1ULL << (probes & 63), memory_order_relaxed);
+    }
+}
+
+static bool filter_may_contain(const BloomFilter *filter, const char *id) {
+    const uint64_t hash = hash_id(id);
+    _Atomic uint64_t *block = filter_block(filter, hash);
+    uint64_t probes = mix(hash);
+    for (int i = 0; i < k_num_probes; i++, probes >>= 9) {
+        const uint64_t word = atomic_load_explicit(&block[(probes >> 6) % BLOCK_WORDS], memory_order_relaxed);
+        if ((word & (1ULL << (probes & 63))) == 0)
+            return false;
+    }
+    return true;
+}
+
+static int add_listed_id(void *filter_ptr, const char *name) {
+    if (is_hex_id(name))
+        filter_add(filter_ptr, name);
+    return 0;
+}
+
+static void add_listed_ids(DirFiller fill, BloomFilter *filter) {
+    const PathCaptures captures = {0};
+    DirCursor cursor = {0};
+    const int fill_status = fill(&captures, &cursor, filter, add_listed_id);
+    assert(fill_status == 0 && cursor.done);
+    reset_dir_cursor(&cursor);
+}
+
+/*
+ * Sized for twice the events at mount.  Ingesting more only raises the
+ * false positive rate, and a false positive only costs the query a lookup
+ * would have made anyway.  A snapshot gets no filters: its lookups are
+ * binary searches no dearer than a probe, and building the filters would
+ * cost the mount a pass over every key.
+ */
+void initialize_known_ids(void) {
+    if (snapshot_is_open())
+        return;
+
+    unsigned long capacity = 2 * (unsigned long) latest_event_rowid();
+    if (capacity < k_min_capacity)
+        capacity = k_min_capacity;
+    create_filter(&event_ids, capacity);
+    create_filter(&pubkeys, capacity);
+    add_listed_ids(fill_events_dir, &event_ids);
+    add_listed_ids(fill_pubkeys_dir, &pubkeys);
+    filtering = true;
+}
+
+void free_known_ids(void) {
+    filtering = false;
+    free_filter(&event_ids);
+    free_filter(&pubkeys);
+}
+
+void add_known_event(const char *event_id, const char *pubkey) {
+    if (!filtering)
+        return;
+    if (is_hex_id(event_id))
+        filter_add(&event_ids, event_id);
+    if (is_hex_id(pubkey))
+        filter_add(&pubkeys, pubkey);
+}
+
+static bool may_be_known_id(const BloomFilter *filter, const char *id) {
+    if (id == NULL)
+        return true;
+    if (!is_hex_id(id))
+        return false;
+    return !filtering || filter_may_contain(filter, id);
+}
+
+/* False when the event or pubkey captured from a path certainly does not exist. */
+bool may_be_known(const PathCaptures *captures) {
+    return may_be_known_id(&event_ids, captures->event_id) && may_be_known_id(&pubkeys, captures->pubkey);
+}
@@ -0,0 +1,13 @@
+#ifndef NOSTRFS_KNOWN_IDS
+#define NOSTRFS_KNOWN_IDS
+
+#include <stdbool.h>
+
+#include "synthetic_file.h"
+
+void initialize_known_ids(void);
+void free_known_ids(void);
+void add_known_event(const char *event_id, const char *pubkey);
+bool may_be_known(const PathCaptures *captures);
+
+#endif
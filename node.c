@@ -0,0 +1,510 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "db.h"
+#include "known_ids.h"
+#include "node.h"
+#include "path.h"
+#include "synthetic_file.h"
+
+static const unsigned long k_initial_num_buckets = 1024;
+
+static pthread_mutex_t nodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static Node **buckets;
+static unsigned long num_buckets;
+static unsigned long num_nodes;
+static Node *root;
+
+static uint64_t hash_bytes(uint64_t hash, const char *bytes) {
+    if (bytes == NULL)
+        bytes = "";
+    for (const char *c = bytes; *c != '\0'; c++) {
+        hash ^= (unsigned char) *c;
+        hash *= 1099511628211ULL;
+    }
+    /* Separate fields so ("ab", "c") and ("a", "bc") differ. */
+    hash ^= 0xff;
+    hash *= 1099511628211ULL;
+    return hash;
+}
+
+static uint64_t node_ino(const SyntheticFile *file, const PathCaptures *captures) {
+    if (file->tag == ROOT_DIR_TAG)
+        return ROOT_NODE_INO;
+
+    uint64_t hash = 14695981039346656037ULL ^ file->tag;
+    hash = hash_bytes(hash, captures->event_id);
+    hash = hash_bytes(hash, captures->pubkey);
+    hash = hash_bytes(hash, captures->kind);
+    hash = hash_bytes(hash, captures->tag_key);
+    hash = hash_bytes(hash, captures->tag_index);
+    hash = hash_bytes(hash, captures->tag_value_index);
+    hash = hash_bytes(hash, captures->indexed_key);
+    hash = hash_bytes(hash, captures->indexed_value);
+    hash = hash_bytes(hash, captures->year);
+    hash = hash_bytes(hash, captures->month);
+    hash = hash_bytes(hash, captures->day);
+    hash = hash_bytes(hash, captures->hour);
+    hash = hash_bytes(hash, captures->search_query);
+    return hash <= ROOT_NODE_INO ? hash + ROOT_NODE_INO + 1 : hash;
+}
+
+static char *child_raw_path(const char *parent_raw_path, const char *name) {
+    const bool parent_is_root = strcmp(parent_raw_path, "/") == 0;
+    const size_t parent_length = parent_is_root ? 0 : strlen(parent_raw_path);
+    const size_t name_size = strlen(name) + 1;
+
+    char *raw_path = arena_alloc(parent_length + 1 + name_size);
+    memcpy(raw_path, parent_raw_path, parent_length);
+    raw_path[parent_length] = '/';
+    memcpy(raw_path + parent_length + 1, name, name_size);
+    return raw_path;
+}
+
+/* A node and its parsed path and raw path share one block of node_size bytes. */
+static size_t node_size(const char *raw_path) {
+    return sizeof(Node) + path_storage_size(raw_path) + strlen(raw_path) + 1;
+}
+
+static Node *build_node(void *block, const char *raw_path) {
+    Node *node = block;
+    memset(node, 0, sizeof(Node));
+    node->path = parse_path_into(node + 1, raw_path);
+    node->raw_path = (char *) node->path + path_storage_size(raw_path);
+    strcpy(node->raw_path, raw_path);
+    node->file = route_path(*node->path, &node->captures);
+    return node;
+}
+
+static Node *new_node(const char *raw_path) {
+    void *block = malloc(node_size(raw_path));
+    assert(block != NULL);
+    return build_node(block, raw_path);
+}
+
+/*
+ * A node that lives in the calling thread's arena, for callers that only
+ * need to look at it.  Only nodes handed to the kernel go on the heap.
+ */
+static Node *transient_node(const char *raw_path) {
+    return build_node(arena_alloc(node_size(raw_path)), raw_path);
+}
+
+static void free_node(Node *node) {
+    free(node);
+}
+
+static Node **find_slot(uint64_t ino) {
+    Node **slot = &buckets[ino % num_buckets];
+    while (*slot != NULL && (*slot)->ino != ino)
+        slot = &(*slot)->hash_next;
+    return slot;
+}
+
+static void grow_buckets(void) {
+    Node **old_buckets = buckets;
+    const unsigned long old_num_buckets = num_buckets;
+
+    num_buckets *= 2;
+    buckets = calloc(num_buckets, sizeof(Node *));
+    assert(buckets != NULL);
+    for (unsigned long i = 0; i < old_num_buckets; i++) {
+        Node *node = old_buckets[i];
+        while (node != NULL) {
+            Node *next = node->hash_next;
+            Node **slot = &buckets[node->ino % num_buckets];
+            node->hash_next = *slot;
+            *slot = node;
+            node = next;
+        }
+    }
+    free(old_buckets);
+}
+
+static void insert_node(Node *node) {
+    if (num_nodes >= num_buckets)
+        grow_buckets();
+    Node **slot = &buckets[node->ino % num_buckets];
+    node->hash_next = *slot;
+    *slot = node;
+    num_nodes++;
+}
+
+void initialize_nodes(void) {
+    num_buckets = k_initial_num_buckets;
+    buckets = calloc(num_buckets, sizeof(Node *));
+    assert(buckets != NULL);
+    num_nodes = 0;
+
+    root = new_node("/");
+    assert(root->file->tag == ROOT_DIR_TAG);
+    root->ino = ROOT_NODE_INO;
+    root->nlookup = 1;
+    insert_node(root);
+}
+
+void free_nodes(void) {
+    for (unsigned long i = 0; i < num_buckets; i++) {
+        Node *node = buckets[i];
+        while (node != NULL) {
+            Node *next = node->hash_next;
+            free_node(node);
+            node = next;
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    root = NULL;
+}
+
+Node *get_node(uint64_t ino) {
+    pthread_mutex_lock(&nodes_lock);
+    Node *node = *find_slot(ino);
+    pthread_mutex_unlock(&nodes_lock);
+    return node;
+}
+
+/* Finds the node for raw_path, or the free slot for it, starting from its derived inode. */
+static Node *probe_nodes(const char *raw_path, uint64_t *ino) {
+    Node *node;
+    while ((node = *find_slot(*ino)) != NULL && strcmp(node->raw_path, raw_path) != 0) {
+        *ino = *ino + 1 > ROOT_NODE_INO ? *ino + 1 : ROOT_NODE_INO + 1;
+    }
+    return node;
+}
+
+/*
+ * Resolves name inside parent and takes one lookup reference on the result.
+ * Two different files hashing to the same inode are separated by probing, so
+ * only the first of them keeps its derived number.  Names for events and
+ * pubkeys the database certainly lacks fail here, before any query.  Looking
+ * up a node the kernel already holds allocates nothing from the heap.
+ */
+Node *lookup_node(Node *parent, const char *name) {
+    const ArenaMark mark = arena_mark();
+    Node *candidate = transient_node(child_raw_path(parent->raw_path, name));
+    if (candidate->file->type == NULL_FILE_TYPE || !may_be_known(&candidate->captures)) {
+        arena_release(mark);
+        return NULL;
+    }
+
+    const uint64_t derived_ino = node_ino(candidate->file, &candidate->captures);
+    uint64_t ino = derived_ino;
+    pthread_mutex_lock(&nodes_lock);
+    Node *node = probe_nodes(candidate->raw_path, &ino);
+    if (node == NULL) {
+        pthread_mutex_unlock(&nodes_lock);
+        Node *created = new_node(candidate->raw_path);
+        ino = derived_ino;
+        pthread_mutex_lock(&nodes_lock);
+        node = probe_nodes(candidate->raw_path, &ino);
+        if (node == NULL) {
+            created->ino = ino;
+            insert_node(created);
+            node = created;
+            created = NULL;
+        }
+        node->nlookup++;
+        pthread_mutex_unlock(&nodes_lock);
+        if (created != NULL)
+            free_node(created);
+    }
+    else {
+        node->nlookup++;
+        pthread_mutex_unlock(&nodes_lock);
+    }
+
+    arena_release(mark);
+    return node;
+}
+
+void forget_node(uint64_t ino, unsigned long nlookup) {
+    if (ino == ROOT_NODE_INO)
+        return;
+
+    pthread_mutex_lock(&nodes_lock);
+    Node **slot = find_slot(ino);
+    Node *node = *slot;
+    if (node != NULL) {
+        assert(node->nlookup >= nlookup);
+        node->nlookup -= nlookup;
+        if (node->nlookup == 0) {
+            *slot = node->hash_next;
+            num_nodes--;
+        }
+        else {
+            node = NULL;
+        }
+    }
+    pthread_mutex_unlock(&nodes_lock);
+
+    if (node != NULL)
+        free_node(node);
+}
+
+/*
+ * Fills in the inode number and file type of a child without registering it,
+ * which is all a plain readdir entry carries.
+ */
+int peek_child(const Node *parent, const char *name, struct stat *ret_st) {
+    const ArenaMark mark = arena_mark();
+    Node *child = transient_node(child_raw_path(parent->raw_path, name));
+
+    int peek_status = 0;
+    switch (child->file->type) {
+        case DIRECTORY_FILE:
+            ret_st->st_mode = S_IFDIR;
+            break;
+        case DATA_FILE:
+            ret_st->st_mode = S_IFREG;
+            break;
+        case NULL_FILE_TYPE:
+            peek_status = ENOENT;
+            break;
+        default:
+            assert(false);
+    }
+    if (peek_status == 0)
+        ret_st->st_ino = node_ino(child->file, &child->captures);
+
+    arena_release(mark);
+    return peek_status;
+}
+
+/* Returns the inode of raw_path if the kernel currently holds it, or 0. */
+uint64_t tracked_node_ino(const char *raw_path) {
+    const ArenaMark mark = arena_mark();
+    Node *candidate = transient_node(raw_path);
+    if (candidate->file->type == NULL_FILE_TYPE) {
+        arena_release(mark);
+        return 0;
+    }
+
+    uint64_t ino = node_ino(candidate->file, &candidate->captures);
+    pthread_mutex_lock(&nodes_lock);
+    Node *node = probe_nodes(candidate->raw_path, &ino);
+    pthread_mutex_unlock(&nodes_lock);
+
+    arena_release(mark);
+    return node != NULL ? ino : 0;
+}
+
+int node_stat(const Node *node, struct stat *st) {
+    if (cache_get_attr(node->raw_path, st)) {
+        st->st_atime = time( NULL );
+        return 0;
+    }
+
+    memset(st, 0, sizeof(struct stat));
+    st->st_ino = node->ino;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = time( NULL );
+
+    if (node->captures.event_id != NULL) {
+        time_t file_created_at;
+        const int time_status = event_creation_time(node->captures.event_id, &file_created_at);
+        if (time_status != 0)
+            return time_status;
+        st->st_mtime = file_created_at;
+        st->st_ctime = file_created_at;
+    }
+
+    switch (node->file->type) {
+        case DATA_FILE: {
+            off_t file_size;
+            const int size_status = node->file->fetch_size(&node->captures, &file_size);
+            if (size_status != 0)
+                return size_status;
+
+            st->st_mode = S_IFREG | S_IRUSR;
+            st->st_nlink = 1;
+            st->st_size = file_size;
+            break;
+        }
+        case DIRECTORY_FILE:
+            st->st_nlink = 2;
+            st->st_mode = S_IFDIR | S_IRUSR | S_IXUSR;
+            break;
+        default:
+            return ENOENT;
+    }
+
+    if (!node->file->is_dynamic)
+        cache_put_attr(node->raw_path, st);
+    return 0;
+}
+
+/*
+ * An open directory streams its listing: each readdir call resumes the
+ * filler's cursor and does work proportional to the entries it returns.
+ * Offsets count entries from the start of the listing, with "." and ".."
+ * at 0 and 1.
+ */
+struct NodeDirHandle {
+    DirCursor cursor;
+    off_t next_offset;
+    DirListing *recording;
+    void *buffer;
+    NodeDirEntryFiller filler;
+};
+
+NodeDirHandle *open_node_dir(void) {
+    NodeDirHandle *handle = calloc(1, sizeof(NodeDirHandle));
+    assert(handle != NULL);
+    handle->recording = start_dir_listing(NULL, NULL);
+    return handle;
+}
+
+static void rewind_node_dir(NodeDirHandle *handle) {
+    reset_dir_cursor(&handle->cursor);
+    handle->next_offset = 0;
+    if (handle->recording != NULL)
+        finish_dir_listing(NULL, handle->recording, false);
+    handle->recording = start_dir_listing(NULL, NULL);
+}
+
+static int add_handle_entry(void *handle_ptr, const char *name) {
+    NodeDirHandle *handle = handle_ptr;
+    const int fill_status = handle->filler(handle->buffer, name, handle->next_offset + 1);
+    if (fill_status == 0)
+        handle->next_offset++;
+    return fill_status;
+}
+
+static int skip_entry(void *buffer, const char *name, off_t next_offset) {
+    (void) name;
+
+    return next_offset > *(off_t *) buffer;
+}
+
+/*
+ * Search results change whenever a matching event arrives and live updates
+ * cannot tell which queries it matches, so they are never kept.
+ */
+static bool is_cacheable_listing(const SyntheticFile *file) {
+    return file->tag != SEARCH_QUERY_DIR_TAG;
+}
+
+static int continue_node_dir(const Node *node, NodeDirHandle *handle) {
+    if (handle->next_offset == 0 && add_handle_entry(handle, ".") != 0)
+        return 0;
+    if (handle->next_offset == 1 && add_handle_entry(handle, "..") != 0)
+        return 0;
+    if (handle->cursor.done)
+        return 0;
+
+    if (cache_fill_dir(node->raw_path, &handle->cursor, handle, add_handle_entry))
+        return 0;
+
+    if (handle->recording != NULL) {
+        set_dir_listing_target(handle->recording, handle, add_handle_entry);
+        const int fill_status = node->file->fill(&node->captures, &handle->cursor, handle->recording, record_dir_entry);
+        if (fill_status != 0 || handle->cursor.done) {
+            finish_dir_listing(node->raw_path, handle->recording, fill_status == 0 && is_cacheable_listing(node->file));
+            handle->recording = NULL;
+        }
+        return fill_status;
+    }
+    return node->file->fill(&node->captures, &handle->cursor, handle, add_handle_entry);
+}
+
+/*
+ * Emits entries starting at offset until filler reports a full buffer.
+ * Sequential reads resume the cursor directly; any other offset rewinds and
+ * skips forward, which only happens after seekdir.
+ */
+int read_node_dir(
+    const Node *node, NodeDirHandle *handle, off_t offset, void *buffer, NodeDirEntryFiller filler
+) {
+    assert(node->file->type == DIRECTORY_FILE);
+
+    if (offset != handle->next_offset) {
+        rewind_node_dir(handle);
+        if (offset > 0) {
+            handle->buffer = &offset;
+            handle->filler = skip_entry;
+            const int skip_status = continue_node_dir(node, handle);
+            if (skip_status != 0)
+                return skip_status;
+            if (handle->next_offset < offset)
+                return 0;
+        }
+    }
+
+    handle->buffer = buffer;
+    handle->filler = filler;
+    return continue_node_dir(node, handle);
+}
+
+void close_node_dir(NodeDirHandle *handle) {
+    if (handle->recording != NULL)
+        finish_dir_listing(NULL, handle->recording, false);
+    reset_dir_cursor(&handle->cursor);
+    free(handle);
+}
+
+/*
+ * An open data file.  Stored values are read slice by slice from their
+ * location, so an open file costs the same whatever its size; values that
+ * are rendered rather than stored, such as kind, are small and held whole,
+ * as are compressed values, which have no location to read slices from.
+ */
+struct NodeFileHandle {
+    FileTag tag;
+    DataLocation location;
+    char *data;
+};
+
+int open_node_file(const Node *node, NodeFileHandle **ret_handle) {
+    assert(node->file->type == DATA_FILE);
+
+    NodeFileHandle *handle = calloc(1, sizeof(NodeFileHandle));
+    assert(handle != NULL);
+    handle->tag = node->file->tag;
+
+    int open_status = ENOENT;
+    if (node->file->locate != NULL)
+        open_status = node->file->locate(&node->captures, &handle->location);
+    if (open_status == ENOENT) {
+        open_status = node->file->fetch_data(&node->captures, &handle->data);
+        if (open_status == 0)
+            handle->location.size = strlen(handle->data);
+    }
+    if (open_status != 0) {
+        free(handle);
+        return open_status;
+    }
+    *ret_handle = handle;
+    return 0;
+}
+
+int read_node_file(
+    const NodeFileHandle *handle, off_t offset, size_t size, char *ret_buffer, size_t *ret_length
+) {
+    if (handle->data == NULL)
+        return read_data_location(&handle->location, offset, size, ret_buffer, ret_length);
+
+    *ret_length = 0;
+    if (offset < handle->location.size) {
+        *ret_length = (size_t) (handle->location.size - offset) < size ? (size_t) (handle->location.size - offset) : size;
+        memcpy(ret_buffer, handle->data + offset, *ret_length);
+    }
+    return 0;
+}
+
+FileTag node_file_tag(const NodeFileHandle *handle) {
+    return handle->tag;
+}
+
+void close_node_file(NodeFileHandle *handle) {
+    free(handle->data);
+    free(handle);
+}
@@ -0,0 +1,61 @@
+#ifndef NOSTRFS_NODE
+#define NOSTRFS_NODE
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "path.h"
+#include "synthetic_file.h"
+
+#define ROOT_NODE_INO 1
+
+typedef struct Node Node;
+
+/*
+ * A file the kernel has looked up.  The inode number is derived from the
+ * file's tag and captured identifiers, so the same event file gets the same
+ * inode on every lookup and every mount.
+ */
+struct Node {
+    uint64_t ino;
+    unsigned long nlookup;
+    char *raw_path;
+    Path *path;
+    PathCaptures captures;
+    SyntheticFile *file;
+    Node *hash_next;
+};
+
+/*
+ * Adds one readdir entry whose successor starts at next_offset.  Returns
+ * nonzero once the reply buffer is full.
+ */
+typedef int (* NodeDirEntryFiller)(void *buffer, const char *name, off_t next_offset);
+
+typedef struct NodeDirHandle NodeDirHandle;
+typedef struct NodeFileHandle NodeFileHandle;
+
+void initialize_nodes(void);
+void free_nodes(void);
+
+Node *get_node(uint64_t ino);
+Node *lookup_node(Node *parent, const char *name);
+void forget_node(uint64_t ino, unsigned long nlookup);
+int peek_child(const Node *parent, const char *name, struct stat *ret_st);
+uint64_t tracked_node_ino(const char *raw_path);
+
+int node_stat(const Node *node, struct stat *ret_st);
+NodeDirHandle *open_node_dir(void);
+int read_node_dir(
+    const Node *node, NodeDirHandle *handle, off_t offset, void *buffer, NodeDirEntryFiller filler
+);
+void close_node_dir(NodeDirHandle *handle);
+
+int open_node_file(const Node *node, NodeFileHandle **ret_handle);
+int read_node_file(
+    const NodeFileHandle *handle, off_t offset, size_t size, char *ret_buffer, size_t *ret_length
+);
+FileTag node_file_tag(const NodeFileHandle *handle);
+void close_node_file(NodeFileHandle *handle);
+
+#endif
@@ -1,11 +1,11 @@
 #define _XOPEN_SOURCE 500
 #define _POSIX_C_SOURCE 200809L
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 34
 
-#include <libgen.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
 
 #include <sys/stat.h>
 #include <unistd.h>
@@ -15,201 +15,459 @@
 #include <stdio.h>
 #include <assert.h>
 
+#include <fuse_lowlevel.h>
+
+#include "arena.h"
+#include "cache.h"
 #include "db.h"
+#include "known_ids.h"
+#include "node.h"
 #include "path.h"
+#include "stats.h"
 #include "synthetic_file.h"
+#include "watch.h"
+
+/* Event data never changes, so the kernel may keep names and attributes. */
+static const double k_entry_timeout = 86400.0;
+static const double k_attr_timeout = 86400.0;
+
+static const unsigned long k_cache_max_entries = 65536;
+static const unsigned int k_default_live_interval_ms = 1000;
+
+typedef struct {
+    char *db_file_path;
+    int live;
+    unsigned int live_interval_ms;
+    unsigned int search_limit;
+} NostrfsOptions;
+
+static const struct fuse_opt k_option_spec[] = {
+    {"db=%s", offsetof(NostrfsOptions, db_file_path), 0},
+    {"live", offsetof(NostrfsOptions, live), 1},
+    {"live_interval=%u", offsetof(NostrfsOptions, live_interval_ms), 0},
+    {"search_limit=%u", offsetof(NostrfsOptions, search_limit), 0},
+    FUSE_OPT_END
+};
 
-static int nostrfs_getattr(const char *path, struct stat *st);
-static int nostrfs_readdir(
-    const char *path, 
-    void *buffer, 
-    fuse_fill_dir_t filler, 
-    off_t offset, 
-    struct fuse_file_info *fi
+static void nostrfs_init(void *userdata, struct fuse_conn_info *conn);
+static void nostrfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+static void nostrfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+static void nostrfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
+static void nostrfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void nostrfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void nostrfs_readdir(
+    fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi
 );
-static int nostrfs_open(const char *path, struct fuse_file_info *fi);
-static int nostrfs_read(
-    const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi
+static void nostrfs_readdirplus(
+    fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi
 );
-static int nostrfs_release(const char *path, struct fuse_file_info *fi);
+static void nostrfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void nostrfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+static void nostrfs_read(
+    fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi
+);
+static void nostrfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
-static struct fuse_operations operations = {
+static const struct fuse_lowlevel_ops operations = {
+    .init = nostrfs_init,
+    .lookup = nostrfs_lookup,
+    .forget = nostrfs_forget,
+    .forget_multi = nostrfs_forget_multi,
     .getattr = nostrfs_getattr,
+    .opendir = nostrfs_opendir,
     .readdir = nostrfs_readdir,
-    .read = nostrfs_read,
+    .readdirplus = nostrfs_readdirplus,
+    .releasedir = nostrfs_releasedir,
     .open = nostrfs_open,
+    .read = nostrfs_read,
     .release = nostrfs_release
 };
 
 
-static int nostrfs_getattr(const char *raw_path, struct stat *st) {
+static void nostrfs_init(void *userdata, struct fuse_conn_info *conn) {
+    (void)(userdata);
 
-    Path *path = parse_path(raw_path);
-    assert(path != NULL);
+    /* Always answer listings with readdirplus rather than letting the kernel guess. */
+    if (conn->capable & FUSE_CAP_READDIRPLUS) {
+        conn->want |= FUSE_CAP_READDIRPLUS;
+        conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+    }
+}
 
-    SyntheticFile *file = path_to_file(*path);
+/* Files whose contents change on every read, like /.stats, are never cached by the kernel. */
+static double attr_timeout(const Node *node) {
+    return node->file->is_dynamic ? 0.0 : k_attr_timeout;
+}
 
-    int return_code = 0;
-    if (file->type == NULL_FILE_TYPE) {
-        free_path(path);
-        return -ENOENT;
-    }
+static void fill_entry_param(const Node *node, const struct stat *st, struct fuse_entry_param *entry) {
+    memset(entry, 0, sizeof(struct fuse_entry_param));
+    entry->ino = node->ino;
+    entry->attr = *st;
+    entry->attr_timeout = attr_timeout(node);
+    entry->entry_timeout = k_entry_timeout;
+}
 
-    st->st_uid = getuid();
-    st->st_gid = getgid();
-    st->st_atime = time( NULL );
+/* Looks up name in parent, returning a referenced node and its attributes. */
+static int lookup_child(Node *parent, const char *name, Node **ret_node, struct stat *ret_st) {
+    Node *node = lookup_node(parent, name);
+    if (node == NULL)
+        return ENOENT;
 
-    const char *event_id = event_id_from_path(*path);
-    if (event_id != NULL) {
-        time_t file_created_at = event_creation_time(event_id);
-        st->st_mtime = file_created_at;
-        st->st_ctime = file_created_at;
+    const int stat_status = node_stat(node, ret_st);
+    if (stat_status != 0) {
+        forget_node(node->ino, 1);
+        return stat_status;
     }
+    *ret_node = node;
+    return 0;
+}
 
-    if (file->type == DATA_FILE) {
-        char *event_data;
-        const bool data_exists = file->fetch_data(*path, &event_data) == 0;
-        assert(data_exists);
+static void nostrfs_lookup(fuse_req_t req, fuse_ino_t parent_ino, const char *name) {
+    const uint64_t start_ns = stats_clock_ns();
+    Node *parent = get_node(parent_ino);
+    if (parent == NULL) {
+        fuse_reply_err(req, ENOENT);
+        record_op(LOOKUP_OP, NULL_TAG, start_ns);
+        return;
+    }
 
+    Node *node;
+    struct stat st;
+    const int lookup_status = lookup_child(parent, name, &node, &st);
+    if (lookup_status != 0) {
+        fuse_reply_err(req, lookup_status);
+        record_op(LOOKUP_OP, NULL_TAG, start_ns);
+        return;
+    }
 
-        st->st_mode = S_IFREG | S_IRUSR;
-        st->st_nlink = 1;
-        st->st_size = 1;
+    struct fuse_entry_param entry;
+    fill_entry_param(node, &st, &entry);
+    const FileTag tag = node->file->tag;
+    fuse_reply_entry(req, &entry);
+    record_op(LOOKUP_OP, tag, start_ns);
+}
 
-        assert(event_data != NULL);
-        st->st_size = strlen(event_data);
+static void nostrfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+    forget_node(ino, nlookup);
+    fuse_reply_none(req);
+}
 
-        free(event_data);
+static void nostrfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        forget_node(forgets[i].ino, forgets[i].nlookup);
     }
-    else {
-        st->st_nlink = 2;
-        st->st_mode = S_IFDIR | S_IRUSR;
-    }
-
-    free_path(path);
-    return return_code;
+    fuse_reply_none(req);
 }
 
-static int nostrfs_readdir(const char *raw_path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-
+static void nostrfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
     (void)(fi);
-    (void)(offset);
 
-    Path *path = parse_path(raw_path);
-    assert(path != NULL);
+    const uint64_t start_ns = stats_clock_ns();
+    Node *node = get_node(ino);
+    if (node == NULL) {
+        fuse_reply_err(req, ENOENT);
+        record_op(GETATTR_OP, NULL_TAG, start_ns);
+        return;
+    }
 
-    SyntheticFile *file = path_to_file(*path);
+    struct stat st;
+    const int stat_status = node_stat(node, &st);
+    if (stat_status != 0) {
+        fuse_reply_err(req, stat_status);
+        record_op(GETATTR_OP, node->file->tag, start_ns);
+        return;
+    }
+    fuse_reply_attr(req, &st, attr_timeout(node));
+    record_op(GETATTR_OP, node->file->tag, start_ns);
+}
 
-    int read_dir_status;
+static void nostrfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    Node *node = get_node(ino);
+    if (node == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (node->file->type != DIRECTORY_FILE) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
 
-    switch (file->type) {
-        case NULL_FILE_TYPE:
-            read_dir_status = -ENOENT;
-            break;
-        case DIRECTORY_FILE:
-            read_dir_status = 0;
-            file->fill(*path, buffer, filler);
+    fi->fh = (uint64_t) open_node_dir();
+    fuse_reply_open(req, fi);
+}
 
-            filler(buffer, ".", NULL, 0);
-            filler(buffer, "..", NULL, 0);
-            break;
-        case DATA_FILE:
-            read_dir_status = -ENOTDIR;
-            break;
-        default:
-            assert(false);
+typedef struct {
+    fuse_req_t req;
+    Node *node;
+    char *buffer;
+    size_t size;
+    size_t used;
+} DirReply;
+
+static int add_dir_entry(void *reply_ptr, const char *name, off_t next_offset) {
+    DirReply *reply = reply_ptr;
+
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        st.st_ino = reply->node->ino;
+        st.st_mode = S_IFDIR;
+    }
+    else if (peek_child(reply->node, name, &st) != 0) {
+        return 0;
     }
 
-    free_path(path);
-
-    return read_dir_status;
+    const size_t remaining = reply->size - reply->used;
+    const size_t entry_size = fuse_add_direntry(
+        reply->req, reply->buffer + reply->used, remaining, name, &st, next_offset
+    );
+    if (entry_size > remaining)
+        return 1;
+    reply->used += entry_size;
+    return 0;
 }
 
-static int nostrfs_open(const char *raw_path, struct fuse_file_info *fi) {
+/*
+ * Adds name with its attributes.  Every entry other than "." and ".." counts
+ * as a lookup, which is dropped again if the entry does not fit.
+ */
+static int add_dir_entry_plus(void *reply_ptr, const char *name, off_t next_offset) {
+    DirReply *reply = reply_ptr;
+
+    struct fuse_entry_param entry;
+    Node *child = NULL;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        memset(&entry, 0, sizeof(struct fuse_entry_param));
+        entry.attr.st_ino = reply->node->ino;
+        entry.attr.st_mode = S_IFDIR;
+    }
+    else {
+        struct stat st;
+        if (lookup_child(reply->node, name, &child, &st) != 0)
+            return 0;
+        fill_entry_param(child, &st, &entry);
+    }
 
-    Path *path = parse_path(raw_path);
-    assert(path != NULL);
-    SyntheticFile *file = path_to_file(*path);
+    const size_t remaining = reply->size - reply->used;
+    const size_t entry_size = fuse_add_direntry_plus(
+        reply->req, reply->buffer + reply->used, remaining, name, &entry, next_offset
+    );
+    if (entry_size > remaining) {
+        if (child != NULL)
+            forget_node(child->ino, 1);
+        return 1;
+    }
+    reply->used += entry_size;
+    return 0;
+}
 
-    int open_status;
-    switch (file->type) {
-        case DIRECTORY_FILE:
-            open_status = -EISDIR;
-            break;
-        case DATA_FILE:
-            fi->keep_cache = true;
-            const bool data_exists = file->fetch_data(*path, (char **) &fi->fh) == 0;
-            assert(data_exists);
-            open_status = 0;
-            break;
-        case NULL_FILE_TYPE:
-            open_status = -ENOENT;
-            break;
-        default:
-            assert(false);
+static void read_dir(
+    fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi, bool plus
+) {
+    const uint64_t start_ns = stats_clock_ns();
+    const StatsOp op = plus ? READDIRPLUS_OP : READDIR_OP;
+    Node *node = get_node(ino);
+    if (node == NULL) {
+        fuse_reply_err(req, ENOENT);
+        record_op(op, NULL_TAG, start_ns);
+        return;
     }
 
-    free_path(path);
-    return open_status;
+    const ArenaMark mark = arena_mark();
+    DirReply reply = {.req = req, .node = node, .buffer = arena_alloc(size), .size = size, .used = 0};
+
+    const int read_status = read_node_dir(
+        node,
+        (NodeDirHandle *) fi->fh,
+        offset,
+        &reply,
+        plus ? add_dir_entry_plus : add_dir_entry
+    );
+    if (read_status != 0)
+        fuse_reply_err(req, -read_status);
+    else
+        fuse_reply_buf(req, reply.buffer, reply.used);
+    arena_release(mark);
+    record_op(op, node->file->tag, start_ns);
 }
 
-static int nostrfs_read(
-    const char *raw_path, 
-    char *buffer, 
-    size_t size, 
-    off_t offset, 
-    struct fuse_file_info *fi
+static void nostrfs_readdir(
+    fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi
+) {
+    read_dir(req, ino, size, offset, fi, false);
+}
+
+static void nostrfs_readdirplus(
+    fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi
 ) {
+    read_dir(req, ino, size, offset, fi, true);
+}
+
+static void nostrfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)(ino);
 
-    Path *path = parse_path(raw_path);
-    assert(path != NULL);
-    SyntheticFile *file = path_to_file(*path);
+    close_node_dir((NodeDirHandle *) fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void nostrfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    const uint64_t start_ns = stats_clock_ns();
+    Node *node = get_node(ino);
+    if (node == NULL) {
+        fuse_reply_err(req, ENOENT);
+        record_op(OPEN_OP, NULL_TAG, start_ns);
+        return;
+    }
 
-    int read_length;
-    switch (file->type) {
+    switch (node->file->type) {
         case DIRECTORY_FILE:
-            read_length = -EISDIR;
+            fuse_reply_err(req, EISDIR);
             break;
         case DATA_FILE: {
-            size_t file_length = strlen((char *) fi->fh);
-            if (offset < (off_t) file_length) {
-                if (offset + size > file_length) {
-                    size = file_length - offset;
-                }
-                memcpy(buffer, (char *) fi->fh + offset, size);
+            NodeFileHandle *handle;
+            const int open_status = open_node_file(node, &handle);
+            if (open_status != 0) {
+                fuse_reply_err(req, open_status);
+                break;
             }
-            else {
-                size = 0;
-            }
-            read_length = size;
+            fi->fh = (uint64_t) handle;
+            fi->keep_cache = !node->file->is_dynamic;
+            fi->direct_io = node->file->is_dynamic;
+            fuse_reply_open(req, fi);
             break;
         }
         case NULL_FILE_TYPE:
-            read_length = -ENOENT;
+            fuse_reply_err(req, ENOENT);
             break;
         default:
             assert(false);
     }
-
-    free_path(path);
-    return read_length;
+    record_op(OPEN_OP, node->file->tag, start_ns);
 }
 
-static int nostrfs_release(const char *path, struct fuse_file_info *fi) {
-    (void)(path);
-
-    free((char *) fi->fh);
-    return 0;
+static void nostrfs_read(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    size_t size,
+    off_t offset,
+    struct fuse_file_info *fi
+) {
+    (void)(ino);
+
+    const uint64_t start_ns = stats_clock_ns();
+    const ArenaMark mark = arena_mark();
+    char *buffer = arena_alloc(size);
+    size_t length;
+    const int read_status = read_node_file((NodeFileHandle *) fi->fh, offset, size, buffer, &length);
+    if (read_status != 0)
+        fuse_reply_err(req, read_status);
+    else
+        fuse_reply_buf(req, buffer, length);
+    arena_release(mark);
+    record_op(READ_OP, node_file_tag((NodeFileHandle *) fi->fh), start_ns);
 }
 
+static void nostrfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)(ino);
 
-int main(int argc, char *argv[]) {
-    initialize_db("./test.sqlite3");
-    link_files();
-    return fuse_main(argc, argv, &operations, NULL);
+    close_node_file((NodeFileHandle *) fi->fh);
+    fuse_reply_err(req, 0);
 }
 
 
+static void invalidate_kernel_inode(uint64_t ino, void *session) {
+    /* ENOENT only means the kernel already dropped the inode. */
+    const int notify_status = fuse_lowlevel_notify_inval_inode(session, ino, 0, 0);
+    if (notify_status != 0 && notify_status != -ENOENT)
+        fprintf(stderr, "Failed to invalidate inode %llu: %s\n", (unsigned long long) ino, strerror(-notify_status));
+}
 
+int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_cmdline_opts opts;
+    NostrfsOptions options = {
+        .db_file_path = NULL,
+        .live = 0,
+        .live_interval_ms = k_default_live_interval_ms,
+        .search_limit = DEFAULT_SEARCH_LIMIT
+    };
+    int exit_status = EXIT_FAILURE;
+
+    if (fuse_parse_cmdline(&args, &opts) != 0)
+        return EXIT_FAILURE;
+    if (opts.show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", argv[0]);
+        printf("    -o db=<file>           nostr event database (default: ./test.sqlite3)\n");
+        printf("    -o live                pick up events added while mounted\n");
+        printf("    -o live_interval=<ms>  how often to check for new events (default: %u)\n", k_default_live_interval_ms);
+        printf("    -o search_limit=<n>    most events listed per /search query (default: %d)\n", DEFAULT_SEARCH_LIMIT);
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+        exit_status = EXIT_SUCCESS;
+        goto cmdline_done;
+    }
+    if (opts.show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        exit_status = EXIT_SUCCESS;
+        goto cmdline_done;
+    }
+    if (opts.mountpoint == NULL) {
+        fprintf(stderr, "usage: %s [options] <mountpoint>\n", argv[0]);
+        goto cmdline_done;
+    }
+    if (fuse_opt_parse(&args, &options, k_option_spec, NULL) != 0)
+        goto cmdline_done;
 
+    initialize_db(options.db_file_path != NULL ? options.db_file_path : "./test.sqlite3");
+    set_search_limit(options.search_limit);
+    initialize_cache(k_cache_max_entries);
+    link_files();
+    initialize_nodes();
+
+    struct fuse_session *session = fuse_session_new(&args, &operations, sizeof(operations), NULL);
+    if (session == NULL)
+        goto session_failure;
+    if (fuse_set_signal_handlers(session) != 0)
+        goto signal_handlers_failure;
+    if (fuse_session_mount(session, opts.mountpoint) != 0)
+        goto mount_failure;
+
+    fuse_daemonize(opts.foreground);
+
+    if (options.live) {
+        initialize_watch(invalidate_kernel_inode, session);
+        initialize_known_ids();
+        start_watching(options.live_interval_ms);
+    }
 
+    if (opts.singlethread) {
+        exit_status = fuse_session_loop(session);
+    }
+    else {
+        struct fuse_loop_config config = {
+            .clone_fd = opts.clone_fd,
+            .max_idle_threads = opts.max_idle_threads
+        };
+        exit_status = fuse_session_loop_mt(session, &config);
+    }
+    exit_status = exit_status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    stop_watching();
+    fuse_session_unmount(session);
+    mount_failure:
+        fuse_remove_signal_handlers(session);
+    signal_handlers_failure:
+        fuse_session_destroy(session);
+    session_failure:
+        free_nodes();
+        free_cache();
+        free_known_ids();
+        close_db();
+        free_thread_arena();
+    cmdline_done:
+        free(options.db_file_path);
+        free(opts.mountpoint);
+        fuse_opt_free_args(&args);
+        return exit_status;
+}
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <sqlite3.h>
+
+#include "db.h"
+#include "snapshot.h"
+
+/*
+ * Compiles a database into a read-only snapshot.
+ *
+ *     nostrfs-pack <db file> <snapshot file>
+ *
+ * writes every event with its content, event.json and tags into one file of
+ * sorted fixed-width arrays over a string heap.  nostrfs mounts a snapshot
+ * by mapping it, without opening SQLite, and answers every lookup and
+ * listing by binary search over the mapping.  Snapshots never change: to
+ * serve new events, pack the database again.
+ */
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <db file> <snapshot file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *db_file_path = argv[1];
+    const char *snapshot_path = argv[2];
+    if (is_snapshot_file(db_file_path)) {
+        fprintf(stderr, "\"%s\" is already a snapshot\n", db_file_path);
+        return EXIT_FAILURE;
+    }
+
+    initialize_db(db_file_path);
+    sqlite3 *db;
+    if (sqlite3_open_v2(db_file_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open database file \"%s\": %s\n", db_file_path, sqlite3_errmsg(db));
+        return EXIT_FAILURE;
+    }
+
+    SnapshotStats stats;
+    write_snapshot(db, snapshot_path, &stats);
+    fprintf(
+        stderr,
+        "Packed %lu events and %lu tag values into %llu bytes, skipped %lu events\n",
+        stats.num_events,
+        stats.num_tags,
+        stats.size,
+        stats.num_skipped
+    );
+    sqlite3_close(db);
+    close_db();
+    return EXIT_SUCCESS;
+}
@@ -3,65 +3,62 @@
 #include <string.h>
 #include <assert.h>
 
-#include <fuse.h>
-
 #include "path.h"
 
 
-static const size_t k_initial_num_path_components = 20;
-
 bool is_valid_path(Path path);
 
-Path *parse_path(const char *raw_path) {
-
-    Path *parsed_path = malloc(sizeof(Path));
-    if (parsed_path == NULL)
-        goto parsed_path_alloc_failure;
-
-    size_t raw_path_size = sizeof(char) * (strlen(raw_path) + 1);
-    parsed_path->raw_path = malloc(raw_path_size);
-    if (parsed_path->raw_path == NULL)
-        goto raw_path_alloc_failure;
-
-    memcpy(parsed_path->raw_path, raw_path, raw_path_size);
-    parsed_path->max_num_components = k_initial_num_path_components;
-
-    parsed_path->path_components = malloc(sizeof(char *) * parsed_path->max_num_components);
-    if (parsed_path->path_components == NULL)
-        goto components_alloc_failure;
+/* Room for every component raw_path could have, plus the terminating NULL. */
+static int max_path_components(const char *raw_path) {
+    int num_separators = 0;
+    for (const char *c = raw_path; *c != '\0'; c++) {
+        num_separators += *c == '/';
+    }
+    return num_separators + 2;
+}
 
+static void split_path(Path *path) {
     char *saveptr;
     for (int i = 0;; i++) {
-        if (i + 1 > parsed_path->max_num_components) {
-            parsed_path->max_num_components *= 2;
-            parsed_path->path_components = realloc(
-                parsed_path->path_components, 
-                sizeof(char *) * parsed_path->max_num_components
-            );
-            if (parsed_path->path_components == NULL)
-                goto enlarge_components_failure;
-        }
-        parsed_path->path_components[i] = strtok_r(i == 0 ? parsed_path->raw_path : NULL, "/", &saveptr);
-        if (parsed_path->path_components[i] == NULL) {
-            parsed_path->num_components = i;
-            return parsed_path;
+        assert(i < path->max_num_components);
+        path->path_components[i] = strtok_r(i == 0 ? path->raw_path : NULL, "/", &saveptr);
+        if (path->path_components[i] == NULL) {
+            path->num_components = i;
+            return;
         }
     }
+}
+
+/*
+ * Bytes parse_path_into needs for raw_path: the Path, its component array
+ * and the copy of raw_path the components point into, rounded up so that
+ * whatever follows is pointer-aligned.
+ */
+size_t path_storage_size(const char *raw_path) {
+    const size_t size = sizeof(Path) + sizeof(char *) * max_path_components(raw_path) + strlen(raw_path) + 1;
+    return (size + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+}
+
+/* Parses raw_path into storage of path_storage_size(raw_path) bytes, which the Path lives at the start of. */
+Path *parse_path_into(void *storage, const char *raw_path) {
+    Path *parsed_path = storage;
+    parsed_path->max_num_components = max_path_components(raw_path);
+    parsed_path->path_components = (char **) (parsed_path + 1);
+    parsed_path->raw_path = (char *) (parsed_path->path_components + parsed_path->max_num_components);
+    strcpy(parsed_path->raw_path, raw_path);
+    split_path(parsed_path);
+    return parsed_path;
+}
 
-    enlarge_components_failure:
-        free(parsed_path->path_components);
-    components_alloc_failure:
-        free(parsed_path->raw_path);
-    raw_path_alloc_failure:
-        free(parsed_path);
-    parsed_path_alloc_failure:
+Path *parse_path(const char *raw_path) {
+    void *storage = malloc(path_storage_size(raw_path));
+    if (storage == NULL)
         return NULL;
+    return parse_path_into(storage, raw_path);
 }
 
 void free_path(Path *path) {
     assert(is_valid_path(*path));
-    free(path->path_components);
-    free(path->raw_path);
     free(path);
 }
 
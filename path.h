@@ -12,6 +12,8 @@ typedef struct {
 } Path;
 
 Path *parse_path(const char *raw_path);
+size_t path_storage_size(const char *raw_path);
+Path *parse_path_into(void *storage, const char *raw_path);
 void free_path(Path *path);
 bool is_root_path(Path path);
 
@@ -0,0 +1,58 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "db.h"
+
+/*
+ * Converts the key format of a database in place.
+ *
+ *     nostrfs-rekey [-t] <db file>
+ *
+ * stores every event id and pubkey as a 32-byte blob instead of the 64 hex
+ * digits db.js writes, which halves the size of every index on them, or with
+ * -t converts a database back to hex text for db.js.  nostrfs and
+ * nostrfs-import detect the format when they open a database, so the
+ * database must not be mounted while it is converted.
+ */
+
+static long long file_size(const char *path) {
+    struct stat file_stat;
+    return stat(path, &file_stat) == 0 ? (long long) file_stat.st_size : -1;
+}
+
+int main(int argc, char *argv[]) {
+    bool binary = true;
+    int option;
+    while ((option = getopt(argc, argv, "t")) != -1) {
+        if (option == 't') {
+            binary = false;
+        }
+        else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-t] <db file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *db_file_path = argv[optind];
+
+    initialize_db(db_file_path);
+    const long long size_before = file_size(db_file_path);
+    convert_keys(binary);
+    fprintf(
+        stderr,
+        "Keys stored as %s, database %lld to %lld bytes\n",
+        uses_binary_keys() ? "binary" : "hex text",
+        size_before,
+        file_size(db_file_path)
+    );
+    close_db();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,645 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "hex.h"
+#include "snapshot.h"
+
+/*
+ * Read-only backend over a snapshot written by nostrfs-pack.  The file is
+ * mapped once at mount and never changes, so every lookup is a binary search
+ * over the mapping that takes no lock, and file data is read straight out of
+ * the heap.  Opening checks every offset, size and index in the file against
+ * the sections they point into, so a truncated or corrupt snapshot is
+ * rejected at mount rather than read out of bounds; the heap itself is only
+ * faulted in as it is touched.
+ */
+
+typedef struct {
+    const char *data;
+    size_t size;
+    const SnapshotHeader *header;
+    const char *heap;
+    const unsigned char *event_ids;
+    const SnapshotEvent *events;
+    const unsigned char *pubkeys;
+    const uint32_t *pubkey_runs;
+    const uint32_t *pubkey_events;
+    const uint32_t *pubkey_kind_events;
+    const uint32_t *time_events;
+    const SnapshotTag *tags;
+    const uint32_t *indexed_tags;
+} Snapshot;
+
+static Snapshot snapshot;
+
+static const char k_heap_table[] = "snapshot";
+static const char k_heap_column[] = "heap";
+
+/* Whether the file at path starts with the snapshot magic. */
+bool is_snapshot_file(const char *path) {
+    char magic[sizeof(SNAPSHOT_MAGIC) - 1];
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    const bool is_snapshot = fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return is_snapshot;
+}
+
+static void fail_open(const char *path, const char *reason) {
+    fprintf(stderr, "Invalid snapshot \"%s\": %s\n", path, reason);
+    exit(EXIT_FAILURE);
+}
+
+/* Returns the section at offset, after checking that count elements of size fit in the file. */
+static const void *section(const char *path, uint64_t offset, uint64_t count, size_t size) {
+    if (offset % 8 != 0 || offset > snapshot.size || count > (snapshot.size - offset) / size)
+        fail_open(path, "section out of bounds");
+    return snapshot.data + offset;
+}
+
+static bool heap_value_fits(uint64_t offset, uint64_t size) {
+    const uint64_t heap_size = snapshot.header->heap_size;
+    return offset < heap_size && size < heap_size - offset;
+}
+
+static bool indices_below(const uint32_t *indices, uint64_t count, uint64_t limit) {
+    for (uint64_t i = 0; i < count; i++) {
+        if (indices[i] >= limit)
+            return false;
+    }
+    return true;
+}
+
+/* Checks everything the lookups follow without bounds checks of their own. */
+static void check_elements(const char *path) {
+    const SnapshotHeader *header = snapshot.header;
+    uint32_t previous_first_tag = 0;
+    for (uint32_t i = 0; i < header->num_events; i++) {
+        const SnapshotEvent *event = &snapshot.events[i];
+        if (event->pubkey >= header->num_pubkeys || event->first_tag < previous_first_tag || event->first_tag > header->num_tags)
+            fail_open(path, "event index out of bounds");
+        if (!heap_value_fits(event->content, event->content_size) || !heap_value_fits(event->event_json, event->event_json_size))
+            fail_open(path, "event data out of bounds");
+        previous_first_tag = event->first_tag;
+    }
+    for (uint32_t i = 0; i < header->num_tags; i++) {
+        const SnapshotTag *tag = &snapshot.tags[i];
+        if (tag->event >= header->num_events || !heap_value_fits(tag->key, 0) || !heap_value_fits(tag->value, tag->value_size))
+            fail_open(path, "tag out of bounds");
+    }
+    for (uint32_t i = 0; i < header->num_pubkeys; i++) {
+        if (snapshot.pubkey_runs[i] > snapshot.pubkey_runs[i + 1])
+            fail_open(path, "pubkey runs out of order");
+    }
+    if (snapshot.pubkey_runs[0] != 0 || snapshot.pubkey_runs[header->num_pubkeys] != header->num_events)
+        fail_open(path, "pubkey runs out of bounds");
+    if (
+        !indices_below(snapshot.pubkey_events, header->num_events, header->num_events) ||
+        !indices_below(snapshot.pubkey_kind_events, header->num_events, header->num_events) ||
+        !indices_below(snapshot.time_events, header->num_events, header->num_events) ||
+        !indices_below(snapshot.indexed_tags, header->num_indexed_tags, header->num_tags)
+    )
+        fail_open(path, "event list index out of bounds");
+}
+
+void open_snapshot(const char *path) {
+    const int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        fprintf(stderr, "Failed to open snapshot \"%s\": %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    snapshot.size = file_stat.st_size;
+    if (snapshot.size < sizeof(SnapshotHeader))
+        fail_open(path, "truncated header");
+    snapshot.data = mmap(NULL, snapshot.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (snapshot.data == MAP_FAILED) {
+        fprintf(stderr, "Failed to map snapshot \"%s\": %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader *) snapshot.data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->version != SNAPSHOT_VERSION)
+        fail_open(path, "unsupported format");
+    snapshot.header = header;
+    snapshot.heap = section(path, header->heap_offset, header->heap_size, 1);
+    if (header->heap_size == 0 || snapshot.heap[header->heap_size - 1] != '\0')
+        fail_open(path, "unterminated heap");
+    snapshot.event_ids = section(path, header->event_ids_offset, header->num_events, KEY_SIZE);
+    snapshot.events = section(path, header->events_offset, header->num_events, sizeof(SnapshotEvent));
+    snapshot.pubkeys = section(path, header->pubkeys_offset, header->num_pubkeys, KEY_SIZE);
+    snapshot.pubkey_runs = section(path, header->pubkey_runs_offset, header->num_pubkeys + 1ULL, sizeof(uint32_t));
+    snapshot.pubkey_events = section(path, header->pubkey_events_offset, header->num_events, sizeof(uint32_t));
+    snapshot.pubkey_kind_events = section(path, header->pubkey_kind_events_offset, header->num_events, sizeof(uint32_t));
+    snapshot.time_events = section(path, header->time_events_offset, header->num_events, sizeof(uint32_t));
+    snapshot.tags = section(path, header->tags_offset, header->num_tags, sizeof(SnapshotTag));
+    snapshot.indexed_tags = section(path, header->indexed_tags_offset, header->num_indexed_tags, sizeof(uint32_t));
+    check_elements(path);
+}
+
+void close_snapshot(void) {
+    if (snapshot.data != NULL)
+        munmap((void *) snapshot.data, snapshot.size);
+    memset(&snapshot, 0, sizeof(snapshot));
+}
+
+bool snapshot_is_open(void) {
+    return snapshot.data != NULL;
+}
+
+int64_t snapshot_num_events(void) {
+    return snapshot.header->num_events;
+}
+
+static const char *heap_string(uint64_t offset) {
+    return snapshot.heap + offset;
+}
+
+/*
+ * The first position in [first, last) at which before no longer holds.
+ * before must hold for some prefix of the range and for nothing after it.
+ */
+static uint32_t partition_point(uint32_t first, uint32_t last, bool (* before)(uint32_t position, const void *arg), const void *arg) {
+    uint32_t count = last - first;
+    while (count > 0) {
+        const uint32_t half = count / 2;
+        if (before(first + half, arg)) {
+            first += half + 1;
+            count -= half + 1;
+        }
+        else {
+            count = half;
+        }
+    }
+    return first;
+}
+
+/* The position of the first of count sorted keys that is not less than key. */
+static uint32_t lower_bound_key(const unsigned char *keys, uint32_t count, const unsigned char *key) {
+    uint32_t first = 0;
+    while (count > 0) {
+        const uint32_t half = count / 2;
+        if (memcmp(keys + (size_t) (first + half) * KEY_SIZE, key, KEY_SIZE) < 0) {
+            first += half + 1;
+            count -= half + 1;
+        }
+        else {
+            count = half;
+        }
+    }
+    return first;
+}
+
+static bool find_key(const unsigned char *keys, uint32_t count, const char *hex, uint32_t *ret_position) {
+    unsigned char key[KEY_SIZE];
+    if (hex == NULL || !hex_to_key(hex, key))
+        return false;
+    *ret_position = lower_bound_key(keys, count, key);
+    return *ret_position < count && memcmp(keys + (size_t) *ret_position * KEY_SIZE, key, KEY_SIZE) == 0;
+}
+
+static bool find_event(const char *event_id, uint32_t *ret_event) {
+    return find_key(snapshot.event_ids, snapshot.header->num_events, event_id, ret_event);
+}
+
+static bool find_pubkey(const char *pubkey, uint32_t *ret_pubkey) {
+    return find_key(snapshot.pubkeys, snapshot.header->num_pubkeys, pubkey, ret_pubkey);
+}
+
+/* The position just after the key a listing last emitted, or 0 to start from the beginning. */
+static uint32_t key_resume_position(const unsigned char *keys, uint32_t count, const char *last_key) {
+    unsigned char key[KEY_SIZE];
+    if (last_key == NULL)
+        return 0;
+    if (!hex_to_key(last_key, key))
+        return count;
+    const uint32_t position = lower_bound_key(keys, count, key);
+    return position < count && memcmp(keys + (size_t) position * KEY_SIZE, key, KEY_SIZE) == 0 ? position + 1 : position;
+}
+
+static uint32_t event_tags_end(uint32_t event) {
+    return event + 1 < snapshot.header->num_events ? snapshot.events[event + 1].first_tag : snapshot.header->num_tags;
+}
+
+/* Passes a name to filler and advances the cursor past it.  Returns false once the buffer is full. */
+static bool emit(DirCursor *cursor, void *buffer, DirEntryFiller filler, const char *name) {
+    if (filler(buffer, name) != 0)
+        return false;
+    advance_dir_cursor(cursor, name);
+    return true;
+}
+
+static bool emit_event(DirCursor *cursor, void *buffer, DirEntryFiller filler, uint32_t event) {
+    char hex[KEY_HEX_LENGTH + 1];
+    key_to_hex(snapshot.event_ids + (size_t) event * KEY_SIZE, hex);
+    return emit(cursor, buffer, filler, hex);
+}
+
+static bool emit_number(DirCursor *cursor, void *buffer, DirEntryFiller filler, long long number) {
+    char name[24];
+    snprintf(name, sizeof(name), "%lld", number);
+    return emit(cursor, buffer, filler, name);
+}
+
+/* Lists the events of run[first..last), skipping repeats of the same event. */
+static int fill_event_run(const uint32_t *run, uint32_t first, uint32_t last, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    for (uint32_t position = first; position < last; position++) {
+        if (position > first && run[position] == run[position - 1])
+            continue;
+        if (!emit_event(cursor, buffer, filler, run[position]))
+            return 0;
+    }
+    cursor->done = true;
+    return 0;
+}
+
+int snapshot_event_creation_time(const char *event_id, time_t *ret_time) {
+    uint32_t event;
+    if (!find_event(event_id, &event))
+        return ENOENT;
+    *ret_time = snapshot.events[event].created_at;
+    return 0;
+}
+
+int snapshot_event_kind(const char *event_id, int64_t *ret_kind) {
+    uint32_t event;
+    if (!find_event(event_id, &event))
+        return ENOENT;
+    *ret_kind = snapshot.events[event].kind;
+    return 0;
+}
+
+/* Writes the event's pubkey as 64 hex digits and a NUL. */
+int snapshot_event_pubkey(const char *event_id, char *ret_pubkey) {
+    uint32_t event;
+    if (!find_event(event_id, &event))
+        return ENOENT;
+    key_to_hex(snapshot.pubkeys + (size_t) snapshot.events[event].pubkey * KEY_SIZE, ret_pubkey);
+    return 0;
+}
+
+void snapshot_read_indexed_tags(const char *event_id, IndexedTagHandler handler, void *arg) {
+    uint32_t event;
+    if (!find_event(event_id, &event))
+        return;
+    for (uint32_t i = snapshot.events[event].first_tag; i < event_tags_end(event); i++) {
+        const char *key = heap_string(snapshot.tags[i].key);
+        if (snapshot.tags[i].value_index == 0 && strlen(key) == 1)
+            handler(key, heap_string(snapshot.tags[i].value), arg);
+    }
+}
+
+static void heap_location(uint64_t offset, uint32_t size, DataLocation *ret_location) {
+    ret_location->table = k_heap_table;
+    ret_location->column = k_heap_column;
+    ret_location->rowid = offset;
+    ret_location->size = size;
+}
+
+int snapshot_locate_content(const char *event_id, DataLocation *ret_location) {
+    uint32_t event;
+    if (!find_event(event_id, &event))
+        return ENOENT;
+    heap_location(snapshot.events[event].content, snapshot.events[event].content_size, ret_location);
+    return 0;
+}
+
+int snapshot_locate_event_json(const char *event_id, DataLocation *ret_location) {
+    uint32_t event;
+    if (!find_event(event_id, &event))
+        return ENOENT;
+    heap_location(snapshot.events[event].event_json, snapshot.events[event].event_json_size, ret_location);
+    return 0;
+}
+
+int snapshot_locate_tag_value(const char *event_id, const char *tag_index, const char *value_index, DataLocation *ret_location) {
+    uint32_t event;
+    if (!find_event(event_id, &event))
+        return ENOENT;
+    const long long wanted_tag_index = atoll(tag_index);
+    const long long wanted_value_index = atoll(value_index);
+    for (uint32_t i = snapshot.events[event].first_tag; i < event_tags_end(event); i++) {
+        const SnapshotTag *tag = &snapshot.tags[i];
+        if (tag->tag_index == wanted_tag_index && tag->value_index == wanted_value_index) {
+            heap_location(tag->value, tag->value_size, ret_location);
+            return 0;
+        }
+    }
+    return ENOENT;
+}
+
+/* Copies a slice of a located value out of the mapping. */
+int snapshot_read(const DataLocation *location, off_t offset, size_t size, char *ret_buffer, size_t *ret_length) {
+    assert(location->table == k_heap_table);
+    *ret_length = 0;
+    if (offset < location->size) {
+        *ret_length = (size_t) (location->size - offset) < size ? (size_t) (location->size - offset) : size;
+        memcpy(ret_buffer, heap_string(location->rowid) + offset, *ret_length);
+    }
+    return 0;
+}
+
+int snapshot_fill_events_dir(DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    const uint32_t num_events = snapshot.header->num_events;
+    for (uint32_t event = key_resume_position(snapshot.event_ids, num_events, cursor->last_key); event < num_events; event++) {
+        if (!emit_event(cursor, buffer, filler, event))
+            return 0;
+    }
+    cursor->done = true;
+    return 0;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char * const *) a, *(const char * const *) b);
+}
+
+/* Lists the distinct tag keys of an event in order, sorting them in the arena. */
+int snapshot_fill_tags_dir(const char *event_id, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    uint32_t event;
+    if (!find_event(event_id, &event)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    const uint32_t first = snapshot.events[event].first_tag;
+    const uint32_t last = event_tags_end(event);
+    const ArenaMark mark = arena_mark();
+    const char **keys = arena_alloc((last - first) * sizeof(char *) + 1);
+    size_t num_keys = 0;
+    for (uint32_t i = first; i < last; i++) {
+        const char *key = heap_string(snapshot.tags[i].key);
+        if (cursor->last_key == NULL || strcmp(key, cursor->last_key) > 0)
+            keys[num_keys++] = key;
+    }
+    qsort(keys, num_keys, sizeof(char *), compare_strings);
+
+    bool full = false;
+    for (size_t i = 0; i < num_keys && !full; i++) {
+        if (i == 0 || strcmp(keys[i], keys[i - 1]) != 0)
+            full = !emit(cursor, buffer, filler, keys[i]);
+    }
+    cursor->done = !full;
+    arena_release(mark);
+    return 0;
+}
+
+int snapshot_fill_tag_key_dir(const char *event_id, const char *key, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    uint32_t event;
+    if (!find_event(event_id, &event)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    const long long last_tag_index = cursor->last_key != NULL ? atoll(cursor->last_key) : -1;
+    long long previous = -1;
+    for (uint32_t i = snapshot.events[event].first_tag; i < event_tags_end(event); i++) {
+        const SnapshotTag *tag = &snapshot.tags[i];
+        if (tag->tag_index <= last_tag_index || tag->tag_index == previous || strcmp(heap_string(tag->key), key) != 0)
+            continue;
+        if (!emit_number(cursor, buffer, filler, tag->tag_index))
+            return 0;
+        previous = tag->tag_index;
+    }
+    cursor->done = true;
+    return 0;
+}
+
+int snapshot_fill_tag_values_dir(const char *event_id, const char *tag_index, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    uint32_t event;
+    if (!find_event(event_id, &event)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    const long long wanted_tag_index = atoll(tag_index);
+    const long long last_value_index = cursor->last_key != NULL ? atoll(cursor->last_key) : -1;
+    for (uint32_t i = snapshot.events[event].first_tag; i < event_tags_end(event); i++) {
+        const SnapshotTag *tag = &snapshot.tags[i];
+        if (tag->tag_index != wanted_tag_index || tag->value_index <= last_value_index)
+            continue;
+        if (!emit_number(cursor, buffer, filler, tag->value_index))
+            return 0;
+    }
+    cursor->done = true;
+    return 0;
+}
+
+int snapshot_fill_pubkeys_dir(DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    const uint32_t num_pubkeys = snapshot.header->num_pubkeys;
+    for (uint32_t pubkey = key_resume_position(snapshot.pubkeys, num_pubkeys, cursor->last_key); pubkey < num_pubkeys; pubkey++) {
+        char hex[KEY_HEX_LENGTH + 1];
+        key_to_hex(snapshot.pubkeys + (size_t) pubkey * KEY_SIZE, hex);
+        if (!emit(cursor, buffer, filler, hex))
+            return 0;
+    }
+    cursor->done = true;
+    return 0;
+}
+
+static bool event_at_or_before(uint32_t position, const void *event_ptr) {
+    return snapshot.pubkey_events[position] <= *(const uint32_t *) event_ptr;
+}
+
+int snapshot_fill_pubkey_events_dir(const char *pubkey, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    uint32_t pubkey_index;
+    if (!find_pubkey(pubkey, &pubkey_index)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    uint32_t first = snapshot.pubkey_runs[pubkey_index];
+    const uint32_t last = snapshot.pubkey_runs[pubkey_index + 1];
+    uint32_t last_event;
+    if (cursor->last_key != NULL && find_event(cursor->last_key, &last_event))
+        first = partition_point(first, last, event_at_or_before, &last_event);
+    return fill_event_run(snapshot.pubkey_events, first, last, cursor, buffer, filler);
+}
+
+static int64_t kind_at(uint32_t position) {
+    return snapshot.events[snapshot.pubkey_kind_events[position]].kind;
+}
+
+static bool kind_at_most(uint32_t position, const void *kind_ptr) {
+    return kind_at(position) <= *(const int64_t *) kind_ptr;
+}
+
+static bool kind_below(uint32_t position, const void *kind_ptr) {
+    return kind_at(position) < *(const int64_t *) kind_ptr;
+}
+
+int snapshot_fill_pubkey_kinds_dir(const char *pubkey, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    uint32_t pubkey_index;
+    if (!find_pubkey(pubkey, &pubkey_index)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    uint32_t position = snapshot.pubkey_runs[pubkey_index];
+    const uint32_t last = snapshot.pubkey_runs[pubkey_index + 1];
+    if (cursor->last_key != NULL) {
+        const int64_t last_kind = atoll(cursor->last_key);
+        position = partition_point(position, last, kind_at_most, &last_kind);
+    }
+    while (position < last) {
+        const int64_t kind = kind_at(position);
+        if (!emit_number(cursor, buffer, filler, kind))
+            return 0;
+        position = partition_point(position, last, kind_at_most, &kind);
+    }
+    cursor->done = true;
+    return 0;
+}
+
+/* Whether the event at position is newer than, or the same as, the given one. */
+static bool newer_or_same(uint32_t position, const void *event_ptr) {
+    const uint32_t event = *(const uint32_t *) event_ptr;
+    const uint32_t other = snapshot.pubkey_kind_events[position];
+    const int64_t created_at = snapshot.events[event].created_at;
+    const int64_t other_created_at = snapshot.events[other].created_at;
+    return other_created_at > created_at || (other_created_at == created_at && other >= event);
+}
+
+/* Lists one author's events of one kind, newest first. */
+int snapshot_fill_pubkey_kind_dir(const char *pubkey, const char *kind, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    uint32_t pubkey_index;
+    if (!find_pubkey(pubkey, &pubkey_index)) {
+        cursor->done = true;
+        return 0;
+    }
+
+    const int64_t wanted_kind = atoll(kind);
+    const uint32_t run_first = snapshot.pubkey_runs[pubkey_index];
+    const uint32_t run_last = snapshot.pubkey_runs[pubkey_index + 1];
+    uint32_t first = partition_point(run_first, run_last, kind_below, &wanted_kind);
+    const uint32_t last = partition_point(first, run_last, kind_at_most, &wanted_kind);
+    uint32_t last_event;
+    if (cursor->last_key != NULL && find_event(cursor->last_key, &last_event))
+        first = partition_point(first, last, newer_or_same, &last_event);
+    return fill_event_run(snapshot.pubkey_kind_events, first, last, cursor, buffer, filler);
+}
+
+static int64_t created_at_at(uint32_t position) {
+    return snapshot.events[snapshot.time_events[position]].created_at;
+}
+
+static bool created_before(uint32_t position, const void *time_ptr) {
+    return created_at_at(position) < *(const int64_t *) time_ptr;
+}
+
+/* Whether the event at position sorts before the given one by (created_at, id), or is the same. */
+static bool older_or_same(uint32_t position, const void *event_ptr) {
+    const uint32_t event = *(const uint32_t *) event_ptr;
+    const int64_t created_at = snapshot.events[event].created_at;
+    const int64_t other_created_at = created_at_at(position);
+    return other_created_at < created_at || (other_created_at == created_at && snapshot.time_events[position] <= event);
+}
+
+bool snapshot_first_event_time(time_t start, time_t end, time_t *ret_time) {
+    const int64_t start_time = start;
+    const uint32_t position = partition_point(0, snapshot.header->num_events, created_before, &start_time);
+    if (position == snapshot.header->num_events || created_at_at(position) >= end)
+        return false;
+    *ret_time = created_at_at(position);
+    return true;
+}
+
+/* Lists the events created in [start, end) in creation order. */
+int snapshot_fill_time_range(time_t start, time_t end, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    const uint32_t num_events = snapshot.header->num_events;
+    const int64_t start_time = start;
+    uint32_t position;
+    uint32_t last_event;
+    if (cursor->last_key != NULL && find_event(cursor->last_key, &last_event))
+        position = partition_point(0, num_events, older_or_same, &last_event);
+    else
+        position = partition_point(0, num_events, created_before, &start_time);
+
+    const int64_t end_time = end;
+    const uint32_t last = partition_point(position, num_events, created_before, &end_time);
+    return fill_event_run(snapshot.time_events, position, last, cursor, buffer, filler);
+}
+
+static const SnapshotTag *indexed_tag_at(uint32_t position) {
+    return &snapshot.tags[snapshot.indexed_tags[position]];
+}
+
+static bool key_at_most(uint32_t position, const void *key) {
+    return strcmp(heap_string(indexed_tag_at(position)->key), key) <= 0;
+}
+
+static bool key_below(uint32_t position, const void *key) {
+    return strcmp(heap_string(indexed_tag_at(position)->key), key) < 0;
+}
+
+static bool value_at_most(uint32_t position, const void *value) {
+    return strcmp(heap_string(indexed_tag_at(position)->value), value) <= 0;
+}
+
+static bool value_below(uint32_t position, const void *value) {
+    return strcmp(heap_string(indexed_tag_at(position)->value), value) < 0;
+}
+
+/*
+ * Lists the distinct keys of the indexed tags when key is NULL, else the
+ * distinct first values of tags with that key, stepping over names that
+ * is_listed rejects.
+ */
+int snapshot_fill_indexed_tags(
+    const char *key, DirCursor *cursor, void *buffer, DirEntryFiller filler, bool (* is_listed)(const char *name)
+) {
+    uint32_t position = 0;
+    uint32_t last = snapshot.header->num_indexed_tags;
+    if (key != NULL) {
+        position = partition_point(position, last, key_below, key);
+        last = partition_point(position, last, key_at_most, key);
+    }
+    bool (* at_most)(uint32_t, const void *) = key != NULL ? value_at_most : key_at_most;
+
+    if (cursor->last_key != NULL)
+        position = partition_point(position, last, at_most, cursor->last_key);
+    while (position < last) {
+        const SnapshotTag *tag = indexed_tag_at(position);
+        const char *name = heap_string(key != NULL ? tag->value : tag->key);
+        if (is_listed(name) && !emit(cursor, buffer, filler, name))
+            return 0;
+        position = partition_point(position, last, at_most, name);
+    }
+    cursor->done = true;
+    return 0;
+}
+
+static bool tagged_event_at_or_before(uint32_t position, const void *event_ptr) {
+    return indexed_tag_at(position)->event <= *(const uint32_t *) event_ptr;
+}
+
+int snapshot_fill_tagged_events(const char *key, const char *value, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    uint32_t first = partition_point(0, snapshot.header->num_indexed_tags, key_below, key);
+    uint32_t last = partition_point(first, snapshot.header->num_indexed_tags, key_at_most, key);
+    first = partition_point(first, last, value_below, value);
+    last = partition_point(first, last, value_at_most, value);
+    uint32_t last_event;
+    if (cursor->last_key != NULL && find_event(cursor->last_key, &last_event))
+        first = partition_point(first, last, tagged_event_at_or_before, &last_event);
+
+    for (uint32_t position = first; position < last; position++) {
+        const uint32_t event = indexed_tag_at(position)->event;
+        if (position > first && event == indexed_tag_at(position - 1)->event)
+            continue;
+        if (!emit_event(cursor, buffer, filler, event))
+            return 0;
+    }
+    cursor->done = true;
+    return 0;
+}
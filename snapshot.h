@@ -0,0 +1,112 @@
+#ifndef NOSTRFS_SNAPSHOT
+#define NOSTRFS_SNAPSHOT
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "db.h"
+#include "synthetic_file.h"
+
+/*
+ * A snapshot file is a header followed by a heap of NUL-terminated strings
+ * and then fixed-width sections, each 8-byte aligned and little-endian.
+ * Events are numbered by the position of their id in the sorted id array,
+ * so every other section refers to an event by a 32-bit index and lists
+ * sorted by id are lists sorted by index.
+ */
+
+#define SNAPSHOT_MAGIC "NOSTRSNP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_events;
+    uint32_t num_pubkeys;
+    uint32_t num_tags;
+    uint32_t num_indexed_tags;
+    uint32_t reserved;
+    uint64_t heap_offset;
+    uint64_t heap_size;
+    /* num_events 32-byte ids, sorted. */
+    uint64_t event_ids_offset;
+    /* num_events SnapshotEvents, in id order. */
+    uint64_t events_offset;
+    /* num_pubkeys 32-byte pubkeys, sorted. */
+    uint64_t pubkeys_offset;
+    /* num_pubkeys + 1 uint32s: where each pubkey's run starts in the two arrays below. */
+    uint64_t pubkey_runs_offset;
+    /* num_events event indices ordered by (pubkey, id). */
+    uint64_t pubkey_events_offset;
+    /* num_events event indices ordered by (pubkey, kind, created_at descending, id descending). */
+    uint64_t pubkey_kind_events_offset;
+    /* num_events event indices ordered by (created_at, id). */
+    uint64_t time_events_offset;
+    /* num_tags SnapshotTags ordered by (event, tag_index, value_index). */
+    uint64_t tags_offset;
+    /* num_indexed_tags tag indices with value_index 0, ordered by (key, value, event). */
+    uint64_t indexed_tags_offset;
+} SnapshotHeader;
+
+/* Heap offsets are from the start of the heap.  An event's tags run up to the next event's first_tag. */
+typedef struct {
+    int64_t created_at;
+    int64_t kind;
+    uint64_t content;
+    uint64_t event_json;
+    uint32_t content_size;
+    uint32_t event_json_size;
+    uint32_t pubkey;
+    uint32_t first_tag;
+} SnapshotEvent;
+
+typedef struct {
+    uint64_t key;
+    uint64_t value;
+    uint32_t event;
+    uint32_t tag_index;
+    uint32_t value_index;
+    uint32_t value_size;
+} SnapshotTag;
+
+bool is_snapshot_file(const char *path);
+void open_snapshot(const char *path);
+void close_snapshot(void);
+bool snapshot_is_open(void);
+int64_t snapshot_num_events(void);
+
+int snapshot_event_creation_time(const char *event_id, time_t *ret_time);
+int snapshot_event_kind(const char *event_id, int64_t *ret_kind);
+int snapshot_event_pubkey(const char *event_id, char *ret_pubkey);
+void snapshot_read_indexed_tags(const char *event_id, IndexedTagHandler handler, void *arg);
+int snapshot_locate_content(const char *event_id, DataLocation *ret_location);
+int snapshot_locate_event_json(const char *event_id, DataLocation *ret_location);
+int snapshot_locate_tag_value(const char *event_id, const char *tag_index, const char *value_index, DataLocation *ret_location);
+int snapshot_read(const DataLocation *location, off_t offset, size_t size, char *ret_buffer, size_t *ret_length);
+
+int snapshot_fill_events_dir(DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int snapshot_fill_tags_dir(const char *event_id, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int snapshot_fill_tag_key_dir(const char *event_id, const char *key, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int snapshot_fill_tag_values_dir(const char *event_id, const char *tag_index, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int snapshot_fill_pubkeys_dir(DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int snapshot_fill_pubkey_events_dir(const char *pubkey, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int snapshot_fill_pubkey_kinds_dir(const char *pubkey, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int snapshot_fill_pubkey_kind_dir(const char *pubkey, const char *kind, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+bool snapshot_first_event_time(time_t start, time_t end, time_t *ret_time);
+int snapshot_fill_time_range(time_t start, time_t end, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int snapshot_fill_indexed_tags(
+    const char *key, DirCursor *cursor, void *buffer, DirEntryFiller filler, bool (* is_listed)(const char *name)
+);
+int snapshot_fill_tagged_events(const char *key, const char *value, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+
+typedef struct {
+    unsigned long num_events;
+    unsigned long num_skipped;
+    unsigned long num_tags;
+    unsigned long long size;
+} SnapshotStats;
+
+void write_snapshot(sqlite3 *db, const char *snapshot_path, SnapshotStats *ret_stats);
+
+#endif
@@ -0,0 +1,334 @@
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <sqlite3.h>
+
+#include "hex.h"
+#include "snapshot.h"
+
+/*
+ * Compiles the open database into a snapshot.  Events are read in id order
+ * and their content and event.json are taken through the same functions
+ * nostrfs serves them with, so compressed content comes out decompressed and
+ * events without stored JSON are rendered once, here.  The heap is streamed
+ * to the file as events are read; the fixed-width sections are built in
+ * memory and written after it, and the header last.
+ */
+
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *select_tags;
+    FILE *file;
+    const char *path;
+    uint64_t heap_size;
+    uint32_t num_events;
+    uint32_t events_capacity;
+    unsigned char *event_ids;
+    unsigned char *event_pubkeys;
+    SnapshotEvent *events;
+    uint32_t num_tags;
+    uint32_t tags_capacity;
+    SnapshotTag *tags;
+    SnapshotStats stats;
+} SnapshotWriter;
+
+/* What the qsort comparators below order by; writing is single-threaded. */
+static const SnapshotEvent *sorted_events;
+static const SnapshotTag *sorted_tags;
+static const char *sorted_heap;
+
+static void writer_fail(const SnapshotWriter *writer, const char *action) {
+    fprintf(stderr, "Failed to %s snapshot \"%s\"\n", action, writer->path);
+    exit(EXIT_FAILURE);
+}
+
+static void write_bytes(SnapshotWriter *writer, const void *data, size_t size) {
+    if (size > 0 && fwrite(data, 1, size, writer->file) != size)
+        writer_fail(writer, "write");
+}
+
+/* Appends a string and its NUL to the heap, returning its offset there. */
+static uint64_t write_heap_string(SnapshotWriter *writer, const char *string, size_t length) {
+    const uint64_t offset = writer->heap_size;
+    write_bytes(writer, string, length);
+    write_bytes(writer, "", 1);
+    writer->heap_size += length + 1;
+    return offset;
+}
+
+static void pad_to_alignment(SnapshotWriter *writer) {
+    static const char k_padding[8] = {0};
+    const long position = ftell(writer->file);
+    if (position < 0)
+        writer_fail(writer, "write");
+    write_bytes(writer, k_padding, (8 - position % 8) % 8);
+}
+
+/* Writes a fixed-width section at the next aligned offset and returns that offset. */
+static uint64_t write_section(SnapshotWriter *writer, const void *data, size_t size) {
+    pad_to_alignment(writer);
+    const long offset = ftell(writer->file);
+    write_bytes(writer, data, size);
+    return offset;
+}
+
+static bool column_key(sqlite3_stmt *statement, int column, unsigned char ret_key[KEY_SIZE]) {
+    if (sqlite3_column_type(statement, column) == SQLITE_BLOB && sqlite3_column_bytes(statement, column) == KEY_SIZE) {
+        memcpy(ret_key, sqlite3_column_blob(statement, column), KEY_SIZE);
+        return true;
+    }
+    return sqlite3_column_type(statement, column) == SQLITE_TEXT && hex_to_key((const char *) sqlite3_column_text(statement, column), ret_key);
+}
+
+static const char *column_string(sqlite3_stmt *statement, int column) {
+    const char *string = (const char *) sqlite3_column_text(statement, column);
+    return string != NULL ? string : "";
+}
+
+static void add_event_tags(SnapshotWriter *writer, const char *event_id, uint32_t event) {
+    sqlite3_stmt *statement = writer->select_tags;
+    statement_bind_key(statement, 1, event_id);
+    while (sqlite3_step(statement) == SQLITE_ROW) {
+        const int64_t tag_index = sqlite3_column_int64(statement, 0);
+        const int64_t value_index = sqlite3_column_int64(statement, 1);
+        if (tag_index < 0 || tag_index > UINT32_MAX || value_index < 0 || value_index > UINT32_MAX)
+            continue;
+
+        if (writer->num_tags == writer->tags_capacity) {
+            writer->tags_capacity = writer->tags_capacity > 0 ? 2 * writer->tags_capacity : 1024;
+            writer->tags = realloc(writer->tags, writer->tags_capacity * sizeof(SnapshotTag));
+            assert(writer->tags != NULL);
+        }
+        const char *key = column_string(statement, 2);
+        const char *value = column_string(statement, 3);
+        const size_t value_size = strlen(value);
+        writer->tags[writer->num_tags++] = (SnapshotTag) {
+            .key = write_heap_string(writer, key, strlen(key)),
+            .value = write_heap_string(writer, value, value_size),
+            .event = event,
+            .tag_index = tag_index,
+            .value_index = value_index,
+            .value_size = value_size
+        };
+    }
+    sqlite3_reset(statement);
+}
+
+/* Adds the event in the current row of statement, unless it cannot be served. */
+static void add_event(SnapshotWriter *writer, sqlite3_stmt *statement) {
+    unsigned char id[KEY_SIZE], pubkey[KEY_SIZE];
+    if (!column_key(statement, 0, id) || !column_key(statement, 1, pubkey) ||
+        (writer->num_events > 0 && memcmp(id, writer->event_ids + (size_t) (writer->num_events - 1) * KEY_SIZE, KEY_SIZE) <= 0)) {
+        writer->stats.num_skipped++;
+        return;
+    }
+
+    char event_id[KEY_HEX_LENGTH + 1];
+    key_to_hex(id, event_id);
+    const PathCaptures captures = {.event_id = event_id};
+    char *content = NULL, *event_json = NULL;
+    if (get_event_content_data(&captures, &content) != 0 || get_event_json_data(&captures, &event_json) != 0 ||
+        strlen(content) > UINT32_MAX || strlen(event_json) > UINT32_MAX) {
+        free(content);
+        free(event_json);
+        writer->stats.num_skipped++;
+        return;
+    }
+
+    if (writer->num_events == writer->events_capacity) {
+        writer->events_capacity = writer->events_capacity > 0 ? 2 * writer->events_capacity : 1024;
+        writer->event_ids = realloc(writer->event_ids, (size_t) writer->events_capacity * KEY_SIZE);
+        writer->event_pubkeys = realloc(writer->event_pubkeys, (size_t) writer->events_capacity * KEY_SIZE);
+        writer->events = realloc(writer->events, writer->events_capacity * sizeof(SnapshotEvent));
+        assert(writer->event_ids != NULL && writer->event_pubkeys != NULL && writer->events != NULL);
+    }
+    const uint32_t event = writer->num_events++;
+    memcpy(writer->event_ids + (size_t) event * KEY_SIZE, id, KEY_SIZE);
+    memcpy(writer->event_pubkeys + (size_t) event * KEY_SIZE, pubkey, KEY_SIZE);
+    const size_t content_size = strlen(content);
+    const size_t event_json_size = strlen(event_json);
+    writer->events[event] = (SnapshotEvent) {
+        .created_at = sqlite3_column_int64(statement, 2),
+        .kind = sqlite3_column_int64(statement, 3),
+        .content = write_heap_string(writer, content, content_size),
+        .event_json = write_heap_string(writer, event_json, event_json_size),
+        .content_size = content_size,
+        .event_json_size = event_json_size,
+        .first_tag = writer->num_tags
+    };
+    free(content);
+    free(event_json);
+    add_event_tags(writer, event_id, event);
+}
+
+static int compare_keys(const void *a, const void *b) {
+    return memcmp(a, b, KEY_SIZE);
+}
+
+static int compare_numbers(int64_t a, int64_t b) {
+    return (a > b) - (a < b);
+}
+
+static int compare_pubkey_kind_events(const void *a_ptr, const void *b_ptr) {
+    const uint32_t a = *(const uint32_t *) a_ptr, b = *(const uint32_t *) b_ptr;
+    const SnapshotEvent *event_a = &sorted_events[a], *event_b = &sorted_events[b];
+    int order = compare_numbers(event_a->pubkey, event_b->pubkey);
+    if (order == 0)
+        order = compare_numbers(event_a->kind, event_b->kind);
+    if (order == 0)
+        order = compare_numbers(event_b->created_at, event_a->created_at);
+    return order != 0 ? order : compare_numbers(b, a);
+}
+
+static int compare_time_events(const void *a_ptr, const void *b_ptr) {
+    const uint32_t a = *(const uint32_t *) a_ptr, b = *(const uint32_t *) b_ptr;
+    const int order = compare_numbers(sorted_events[a].created_at, sorted_events[b].created_at);
+    return order != 0 ? order : compare_numbers(a, b);
+}
+
+static int compare_indexed_tags(const void *a_ptr, const void *b_ptr) {
+    const SnapshotTag *a = &sorted_tags[*(const uint32_t *) a_ptr], *b = &sorted_tags[*(const uint32_t *) b_ptr];
+    int order = strcmp(sorted_heap + a->key, sorted_heap + b->key);
+    if (order == 0)
+        order = strcmp(sorted_heap + a->value, sorted_heap + b->value);
+    return order != 0 ? order : compare_numbers(a->event, b->event);
+}
+
+/* Writes the sections that index the events read so far, filling in their offsets in header. */
+static void write_sections(SnapshotWriter *writer, SnapshotHeader *header) {
+    const uint32_t num_events = writer->num_events;
+
+    unsigned char *pubkeys = malloc((size_t) num_events * KEY_SIZE + 1);
+    assert(pubkeys != NULL);
+    memcpy(pubkeys, writer->event_pubkeys, (size_t) num_events * KEY_SIZE);
+    qsort(pubkeys, num_events, KEY_SIZE, compare_keys);
+    uint32_t num_pubkeys = 0;
+    for (uint32_t i = 0; i < num_events; i++) {
+        if (num_pubkeys == 0 || memcmp(pubkeys + (size_t) i * KEY_SIZE, pubkeys + (size_t) (num_pubkeys - 1) * KEY_SIZE, KEY_SIZE) != 0)
+            memmove(pubkeys + (size_t) num_pubkeys++ * KEY_SIZE, pubkeys + (size_t) i * KEY_SIZE, KEY_SIZE);
+    }
+
+    uint32_t *pubkey_runs = calloc(num_pubkeys + 1, sizeof(uint32_t));
+    uint32_t *pubkey_events = malloc((size_t) num_events * sizeof(uint32_t) + 1);
+    uint32_t *pubkey_kind_events = malloc((size_t) num_events * sizeof(uint32_t) + 1);
+    uint32_t *time_events = malloc((size_t) num_events * sizeof(uint32_t) + 1);
+    assert(pubkey_runs != NULL && pubkey_events != NULL && pubkey_kind_events != NULL && time_events != NULL);
+    for (uint32_t event = 0; event < num_events; event++) {
+        const unsigned char *pubkey = bsearch(writer->event_pubkeys + (size_t) event * KEY_SIZE, pubkeys, num_pubkeys, KEY_SIZE, compare_keys);
+        assert(pubkey != NULL);
+        writer->events[event].pubkey = (pubkey - pubkeys) / KEY_SIZE;
+        pubkey_runs[writer->events[event].pubkey + 1]++;
+        time_events[event] = event;
+    }
+    for (uint32_t i = 0; i < num_pubkeys; i++) {
+        pubkey_runs[i + 1] += pubkey_runs[i];
+    }
+    uint32_t *run_ends = malloc((num_pubkeys + 1) * sizeof(uint32_t));
+    assert(run_ends != NULL);
+    memcpy(run_ends, pubkey_runs, (num_pubkeys + 1) * sizeof(uint32_t));
+    for (uint32_t event = 0; event < num_events; event++) {
+        pubkey_events[run_ends[writer->events[event].pubkey]++] = event;
+    }
+    free(run_ends);
+    memcpy(pubkey_kind_events, pubkey_events, (size_t) num_events * sizeof(uint32_t));
+    sorted_events = writer->events;
+    qsort(pubkey_kind_events, num_events, sizeof(uint32_t), compare_pubkey_kind_events);
+    qsort(time_events, num_events, sizeof(uint32_t), compare_time_events);
+
+    uint32_t num_indexed_tags = 0;
+    uint32_t *indexed_tags = malloc((size_t) writer->num_tags * sizeof(uint32_t) + 1);
+    assert(indexed_tags != NULL);
+    for (uint32_t i = 0; i < writer->num_tags; i++) {
+        if (writer->tags[i].value_index == 0)
+            indexed_tags[num_indexed_tags++] = i;
+    }
+    if (fflush(writer->file) != 0)
+        writer_fail(writer, "write");
+    const size_t mapped_size = header->heap_offset + writer->heap_size;
+    char *mapping = mmap(NULL, mapped_size, PROT_READ, MAP_SHARED, fileno(writer->file), 0);
+    if (mapping == MAP_FAILED)
+        writer_fail(writer, "map");
+    sorted_heap = mapping + header->heap_offset;
+    sorted_tags = writer->tags;
+    qsort(indexed_tags, num_indexed_tags, sizeof(uint32_t), compare_indexed_tags);
+    munmap(mapping, mapped_size);
+
+    header->num_events = num_events;
+    header->num_pubkeys = num_pubkeys;
+    header->num_tags = writer->num_tags;
+    header->num_indexed_tags = num_indexed_tags;
+    header->event_ids_offset = write_section(writer, writer->event_ids, (size_t) num_events * KEY_SIZE);
+    header->events_offset = write_section(writer, writer->events, num_events * sizeof(SnapshotEvent));
+    header->pubkeys_offset = write_section(writer, pubkeys, (size_t) num_pubkeys * KEY_SIZE);
+    header->pubkey_runs_offset = write_section(writer, pubkey_runs, (num_pubkeys + 1) * sizeof(uint32_t));
+    header->pubkey_events_offset = write_section(writer, pubkey_events, num_events * sizeof(uint32_t));
+    header->pubkey_kind_events_offset = write_section(writer, pubkey_kind_events, num_events * sizeof(uint32_t));
+    header->time_events_offset = write_section(writer, time_events, num_events * sizeof(uint32_t));
+    header->tags_offset = write_section(writer, writer->tags, writer->num_tags * sizeof(SnapshotTag));
+    header->indexed_tags_offset = write_section(writer, indexed_tags, num_indexed_tags * sizeof(uint32_t));
+
+    free(indexed_tags);
+    free(time_events);
+    free(pubkey_kind_events);
+    free(pubkey_events);
+    free(pubkey_runs);
+    free(pubkeys);
+}
+
+void write_snapshot(sqlite3 *db, const char *snapshot_path, SnapshotStats *ret_stats) {
+    SnapshotWriter writer = {.db = db, .path = snapshot_path};
+    writer.file = fopen(snapshot_path, "w+b");
+    if (writer.file == NULL)
+        writer_fail(&writer, "create");
+
+    SnapshotHeader header = {.version = SNAPSHOT_VERSION};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    write_bytes(&writer, &header, sizeof(header));
+    pad_to_alignment(&writer);
+    header.heap_offset = ftell(writer.file);
+    write_heap_string(&writer, "", 0);
+
+    sqlite3_stmt *select_events;
+    if (sqlite3_prepare_v2(db, "SELECT id, pubkey, created_at, kind FROM nostrEvents ORDER BY id;", -1, &select_events, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(
+            db, "SELECT tag_index, value_index, key, value FROM tags WHERE id = ? ORDER BY tag_index, value_index;", -1, &writer.select_tags, NULL
+        ) != SQLITE_OK) {
+        fprintf(stderr, "Error preparing snapshot queries: %s\n", sqlite3_errmsg(db));
+        exit(EXIT_FAILURE);
+    }
+    int stepstatus;
+    while ((stepstatus = sqlite3_step(select_events)) == SQLITE_ROW && writer.num_events < UINT32_MAX) {
+        add_event(&writer, select_events);
+    }
+    if (stepstatus != SQLITE_DONE && stepstatus != SQLITE_ROW) {
+        fprintf(stderr, "Error reading events: %s\n", sqlite3_errmsg(db));
+        exit(EXIT_FAILURE);
+    }
+    sqlite3_finalize(select_events);
+    sqlite3_finalize(writer.select_tags);
+
+    header.heap_size = writer.heap_size;
+    write_sections(&writer, &header);
+    pad_to_alignment(&writer);
+    writer.stats.size = ftell(writer.file);
+    if (fseek(writer.file, 0, SEEK_SET) != 0)
+        writer_fail(&writer, "write");
+    write_bytes(&writer, &header, sizeof(header));
+    if (fclose(writer.file) != 0)
+        writer_fail(&writer, "write");
+
+    writer.stats.num_events = writer.num_events;
+    writer.stats.num_tags = writer.num_tags;
+    free(writer.tags);
+    free(writer.events);
+    free(writer.event_pubkeys);
+    free(writer.event_ids);
+    *ret_stats = writer.stats;
+}
@@ -0,0 +1,452 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "cache.h"
+#include "db.h"
+#include "json.h"
+#include "stats.h"
+
+/*
+ * Latency histograms for filesystem operations, per operation and file, and
+ * for database queries, together with the counters SQLite keeps for each
+ * statement.  Every thread records into its own counters, which only it
+ * writes, so recording takes no lock and no read-modify-write instruction;
+ * readers merge all threads' counters, so a snapshot may be a few samples
+ * behind.  A thread's counters are folded into a shared total when it
+ * exits, since FUSE retires idle worker threads.
+ *
+ * Histogram buckets split each power of two into four, so percentiles are
+ * accurate to within a quarter octave.
+ */
+
+#define MAX_STATS_QUERIES 64
+#define NUM_LATENCY_BUCKETS 140
+
+typedef struct {
+    atomic_ulong count;
+    atomic_ulong total_ns;
+    atomic_ulong max_ns;
+    atomic_ulong buckets[NUM_LATENCY_BUCKETS];
+} Histogram;
+
+typedef struct {
+    Histogram latency;
+    atomic_ulong full_scan_steps;
+    atomic_ulong sorts;
+    atomic_ulong vm_steps;
+} QueryStats;
+
+typedef struct ThreadStats ThreadStats;
+
+struct ThreadStats {
+    ThreadStats *next;
+    Histogram ops[NUM_STATS_OPS][NUM_FILE_TAGS];
+    QueryStats queries[MAX_STATS_QUERIES];
+};
+
+static const char *k_op_names[NUM_STATS_OPS] = {
+    [LOOKUP_OP] = "lookup",
+    [GETATTR_OP] = "getattr",
+    [READDIR_OP] = "readdir",
+    [READDIRPLUS_OP] = "readdirplus",
+    [OPEN_OP] = "open",
+    [READ_OP] = "read"
+};
+
+static const char *k_file_tag_names[NUM_FILE_TAGS] = {
+    [NULL_TAG] = "none",
+    [CONTENT_FILE_TAG] = "content",
+    [KIND_FILE_TAG] = "kind",
+    [TAG_VALUE_FILE_TAG] = "tag_value",
+    [EVENT_DIR_TAG] = "event",
+    [EVENTS_DIR_TAG] = "events",
+    [PUBKEY_FILE_TAG] = "pubkey",
+    [EVENT_JSON_FILE_TAG] = "event.json",
+    [ROOT_DIR_TAG] = "root",
+    [TAGS_DIR_TAG] = "tags",
+    [TAG_KEY_DIR_TAG] = "tag_key",
+    [TAG_DIR_TAG] = "tag",
+    [PUBKEYS_DIR_TAG] = "pubkeys",
+    [PUBKEY_DIR_TAG] = "author",
+    [PUBKEY_EVENTS_DIR_TAG] = "author_events",
+    [PUBKEY_KINDS_DIR_TAG] = "author_kinds",
+    [PUBKEY_KIND_DIR_TAG] = "author_kind",
+    [TAG_INDEX_DIR_TAG] = "tag_index",
+    [TAG_INDEX_KEY_DIR_TAG] = "tag_index_key",
+    [TAG_INDEX_VALUE_DIR_TAG] = "tag_index_value",
+    [TIME_DIR_TAG] = "time",
+    [TIME_YEAR_DIR_TAG] = "time_year",
+    [TIME_MONTH_DIR_TAG] = "time_month",
+    [TIME_DAY_DIR_TAG] = "time_day",
+    [TIME_HOUR_DIR_TAG] = "time_hour",
+    [SEARCH_DIR_TAG] = "search",
+    [SEARCH_QUERY_DIR_TAG] = "search_query",
+    [STATS_FILE_TAG] = "stats",
+    [STATS_JSON_FILE_TAG] = "stats.json"
+};
+
+static const double k_percentiles[] = {0.5, 0.9, 0.99};
+
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static ThreadStats *live_stats;
+static ThreadStats retired_stats;
+
+static const char *query_sql[MAX_STATS_QUERIES];
+static int num_stats_queries;
+
+uint64_t stats_clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Only the owning thread writes its counters, so a plain load and store suffice. */
+static void add_count(atomic_ulong *counter, unsigned long amount) {
+    atomic_store_explicit(
+        counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed
+    );
+}
+
+static unsigned long load_count(atomic_ulong *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static int latency_bucket(uint64_t ns) {
+    if (ns < 4)
+        return ns;
+    const int octave = 63 - __builtin_clzll(ns);
+    const int bucket = 4 * (octave - 1) + ((ns >> (octave - 2)) & 3);
+    return bucket < NUM_LATENCY_BUCKETS ? bucket : NUM_LATENCY_BUCKETS - 1;
+}
+
+/* The smallest latency that falls into bucket. */
+static uint64_t bucket_floor_ns(int bucket) {
+    if (bucket < 4)
+        return bucket;
+    const int octave = bucket / 4 + 1;
+    return (uint64_t) (4 + bucket % 4) << (octave - 2);
+}
+
+static void record_latency(Histogram *histogram, uint64_t ns) {
+    add_count(&histogram->count, 1);
+    add_count(&histogram->total_ns, ns);
+    if (ns > load_count(&histogram->max_ns))
+        atomic_store_explicit(&histogram->max_ns, ns, memory_order_relaxed);
+    add_count(&histogram->buckets[latency_bucket(ns)], 1);
+}
+
+static void merge_histogram(Histogram *total, Histogram *histogram) {
+    add_count(&total->count, load_count(&histogram->count));
+    add_count(&total->total_ns, load_count(&histogram->total_ns));
+    if (load_count(&histogram->max_ns) > load_count(&total->max_ns))
+        atomic_store_explicit(&total->max_ns, load_count(&histogram->max_ns), memory_order_relaxed);
+    for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        add_count(&total->buckets[i], load_count(&histogram->buckets[i]));
+    }
+}
+
+static void merge_stats(ThreadStats *total, ThreadStats *stats) {
+    for (int op = 0; op < NUM_STATS_OPS; op++) {
+        for (int tag = 0; tag < NUM_FILE_TAGS; tag++) {
+            merge_histogram(&total->ops[op][tag], &stats->ops[op][tag]);
+        }
+    }
+    for (int i = 0; i < num_stats_queries; i++) {
+        merge_histogram(&total->queries[i].latency, &stats->queries[i].latency);
+        add_count(&total->queries[i].full_scan_steps, load_count(&stats->queries[i].full_scan_steps));
+        add_count(&total->queries[i].sorts, load_count(&stats->queries[i].sorts));
+        add_count(&total->queries[i].vm_steps, load_count(&stats->queries[i].vm_steps));
+    }
+}
+
+static void retire_thread_stats(void *stats_ptr) {
+    ThreadStats *stats = stats_ptr;
+
+    pthread_mutex_lock(&stats_lock);
+    ThreadStats **link = &live_stats;
+    while (*link != stats) {
+        link = &(*link)->next;
+    }
+    *link = stats->next;
+    merge_stats(&retired_stats, stats);
+    pthread_mutex_unlock(&stats_lock);
+    free(stats);
+}
+
+static void create_stats_key(void) {
+    const bool key_created = pthread_key_create(&stats_key, retire_thread_stats) == 0;
+    assert(key_created);
+}
+
+static ThreadStats *thread_stats(void) {
+    pthread_once(&stats_once, create_stats_key);
+    ThreadStats *stats = pthread_getspecific(stats_key);
+    if (stats == NULL) {
+        stats = calloc(1, sizeof(ThreadStats));
+        assert(stats != NULL);
+        pthread_mutex_lock(&stats_lock);
+        stats->next = live_stats;
+        live_stats = stats;
+        pthread_mutex_unlock(&stats_lock);
+        const bool set_successful = pthread_setspecific(stats_key, stats) == 0;
+        assert(set_successful);
+    }
+    return stats;
+}
+
+void record_op(StatsOp op, FileTag tag, uint64_t start_ns) {
+    assert(op < NUM_STATS_OPS && tag < NUM_FILE_TAGS);
+    record_latency(&thread_stats()->ops[op][tag], stats_clock_ns() - start_ns);
+}
+
+/* Names a query in the statistics; called once per query before any is run. */
+void register_query_stats(int query_index, const char *sql) {
+    assert(query_index >= 0 && query_index < MAX_STATS_QUERIES);
+    query_sql[query_index] = sql;
+    if (query_index >= num_stats_queries)
+        num_stats_queries = query_index + 1;
+}
+
+void record_query(int query_index, uint64_t start_ns, const StatementCounters *counters) {
+    assert(query_index >= 0 && query_index < num_stats_queries);
+    QueryStats *stats = &thread_stats()->queries[query_index];
+    record_latency(&stats->latency, stats_clock_ns() - start_ns);
+    add_count(&stats->full_scan_steps, counters->full_scan_steps);
+    add_count(&stats->sorts, counters->sorts);
+    add_count(&stats->vm_steps, counters->vm_steps);
+}
+
+static ThreadStats *snapshot_stats(void) {
+    ThreadStats *total = calloc(1, sizeof(ThreadStats));
+    assert(total != NULL);
+    pthread_mutex_lock(&stats_lock);
+    merge_stats(total, &retired_stats);
+    for (ThreadStats *stats = live_stats; stats != NULL; stats = stats->next) {
+        merge_stats(total, stats);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    return total;
+}
+
+/* The upper edge of the bucket holding the given fraction of samples, capped at the maximum. */
+static double percentile_us(Histogram *histogram, double fraction) {
+    const unsigned long count = load_count(&histogram->count);
+    const unsigned long rank = (unsigned long) (fraction * (count - 1)) + 1;
+    unsigned long seen = 0;
+    int bucket = 0;
+    while (bucket < NUM_LATENCY_BUCKETS - 1 && (seen += load_count(&histogram->buckets[bucket])) < rank) {
+        bucket++;
+    }
+    const uint64_t max_ns = load_count(&histogram->max_ns);
+    const uint64_t upper_ns = bucket < NUM_LATENCY_BUCKETS - 1 ? bucket_floor_ns(bucket + 1) : max_ns;
+    return (upper_ns < max_ns ? upper_ns : max_ns) / 1e3;
+}
+
+static double mean_us(Histogram *histogram) {
+    return load_count(&histogram->total_ns) / 1e3 / load_count(&histogram->count);
+}
+
+static void append_format(Buffer *buffer, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    const int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    assert(length >= 0 && (size_t) length < sizeof(line));
+    buffer_append(buffer, line, length);
+}
+
+static double hit_rate(unsigned long hits, unsigned long misses) {
+    return hits + misses > 0 ? (double) hits / (hits + misses) : 0.0;
+}
+
+static double mean_batch(unsigned long batched, unsigned long batches) {
+    return batches > 0 ? (double) batched / batches : 0.0;
+}
+
+static void append_histogram_text(Buffer *buffer, Histogram *histogram) {
+    append_format(buffer, " %9lu %9.1f", load_count(&histogram->count), mean_us(histogram));
+    for (size_t i = 0; i < sizeof(k_percentiles) / sizeof(k_percentiles[0]); i++) {
+        append_format(buffer, " %9.1f", percentile_us(histogram, k_percentiles[i]));
+    }
+    append_format(buffer, " %9.1f", load_count(&histogram->max_ns) / 1e3);
+}
+
+static char *render_stats_text(void) {
+    ThreadStats *stats = snapshot_stats();
+    Buffer buffer = {0};
+
+    append_format(&buffer, "# operations, latencies in microseconds\n");
+    append_format(&buffer, "%-12s %-16s %9s %9s %9s %9s %9s %9s\n", "op", "file", "count", "mean", "p50", "p90", "p99", "max");
+    for (int op = 0; op < NUM_STATS_OPS; op++) {
+        for (int tag = 0; tag < NUM_FILE_TAGS; tag++) {
+            Histogram *histogram = &stats->ops[op][tag];
+            if (load_count(&histogram->count) == 0)
+                continue;
+            append_format(&buffer, "%-12s %-16s", k_op_names[op], k_file_tag_names[tag]);
+            append_histogram_text(&buffer, histogram);
+            buffer_append_char(&buffer, '\n');
+        }
+    }
+
+    append_format(&buffer, "\n# queries, latencies in microseconds\n");
+    append_format(
+        &buffer, "%9s %9s %9s %9s %9s %9s %12s %9s %12s  %s\n",
+        "count", "mean", "p50", "p90", "p99", "max", "full_scans", "sorts", "vm_steps", "sql"
+    );
+    for (int i = 0; i < num_stats_queries; i++) {
+        QueryStats *query = &stats->queries[i];
+        if (load_count(&query->latency.count) == 0)
+            continue;
+        append_histogram_text(&buffer, &query->latency);
+        append_format(
+            &buffer, " %12lu %9lu %12lu  ",
+            load_count(&query->full_scan_steps), load_count(&query->sorts), load_count(&query->vm_steps)
+        );
+        buffer_append(&buffer, query_sql[i], strlen(query_sql[i]));
+        buffer_append_char(&buffer, '\n');
+    }
+
+    const CacheStats cache = cache_stats();
+    append_format(&buffer, "\n# cache\n");
+    append_format(&buffer, "attr_hits %lu\nattr_misses %lu\nattr_hit_rate %.4f\n", cache.attr_hits, cache.attr_misses, hit_rate(cache.attr_hits, cache.attr_misses));
+    append_format(&buffer, "dir_hits %lu\ndir_misses %lu\ndir_hit_rate %.4f\n", cache.dir_hits, cache.dir_misses, hit_rate(cache.dir_hits, cache.dir_misses));
+    append_format(&buffer, "evictions %lu\nentries %lu\n", cache.evictions, cache.num_entries);
+    const EventRecordStats records = event_record_stats();
+    append_format(&buffer, "event_hits %lu\nevent_misses %lu\nevent_hit_rate %.4f\n", records.hits, records.misses, hit_rate(records.hits, records.misses));
+    append_format(
+        &buffer, "event_batches %lu\nevent_batched %lu\nevent_shared %lu\nevent_mean_batch %.2f\n",
+        records.batches, records.batched, records.shared, mean_batch(records.batched, records.batches)
+    );
+    buffer_append_char(&buffer, '\0');
+
+    free(stats);
+    return buffer.data;
+}
+
+static void append_histogram_json(Buffer *buffer, Histogram *histogram) {
+    append_format(
+        buffer, "\"count\":%lu,\"total_ns\":%lu,\"max_ns\":%lu,\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"buckets\":[",
+        load_count(&histogram->count),
+        load_count(&histogram->total_ns),
+        load_count(&histogram->max_ns),
+        percentile_us(histogram, 0.5),
+        percentile_us(histogram, 0.9),
+        percentile_us(histogram, 0.99)
+    );
+    bool first = true;
+    for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+        const unsigned long count = load_count(&histogram->buckets[i]);
+        if (count == 0)
+            continue;
+        append_format(buffer, "%s[%llu,%lu]", first ? "" : ",", (unsigned long long) bucket_floor_ns(i), count);
+        first = false;
+    }
+    buffer_append_char(buffer, ']');
+}
+
+/*
+ * The JSON form carries each histogram's nonempty buckets as
+ * [lower bound in ns, count] pairs so that scrapers can merge and requantize
+ * them.
+ */
+static char *render_stats_json(void) {
+    ThreadStats *stats = snapshot_stats();
+    Buffer buffer = {0};
+
+    append_format(&buffer, "{\"ops\":[");
+    bool first = true;
+    for (int op = 0; op < NUM_STATS_OPS; op++) {
+        for (int tag = 0; tag < NUM_FILE_TAGS; tag++) {
+            Histogram *histogram = &stats->ops[op][tag];
+            if (load_count(&histogram->count) == 0)
+                continue;
+            append_format(&buffer, "%s{\"op\":\"%s\",\"file\":\"%s\",", first ? "" : ",", k_op_names[op], k_file_tag_names[tag]);
+            append_histogram_json(&buffer, histogram);
+            buffer_append_char(&buffer, '}');
+            first = false;
+        }
+    }
+
+    append_format(&buffer, "],\"queries\":[");
+    first = true;
+    for (int i = 0; i < num_stats_queries; i++) {
+        QueryStats *query = &stats->queries[i];
+        if (load_count(&query->latency.count) == 0)
+            continue;
+        append_format(&buffer, "%s{\"sql\":", first ? "" : ",");
+        buffer_append_json_string(&buffer, query_sql[i], strlen(query_sql[i]));
+        append_format(
+            &buffer, ",\"full_scan_steps\":%lu,\"sorts\":%lu,\"vm_steps\":%lu,",
+            load_count(&query->full_scan_steps), load_count(&query->sorts), load_count(&query->vm_steps)
+        );
+        append_histogram_json(&buffer, &query->latency);
+        buffer_append_char(&buffer, '}');
+        first = false;
+    }
+
+    const CacheStats cache = cache_stats();
+    append_format(
+        &buffer, "],\"cache\":{\"attr_hits\":%lu,\"attr_misses\":%lu,\"attr_hit_rate\":%.4f,",
+        cache.attr_hits, cache.attr_misses, hit_rate(cache.attr_hits, cache.attr_misses)
+    );
+    append_format(
+        &buffer, "\"dir_hits\":%lu,\"dir_misses\":%lu,\"dir_hit_rate\":%.4f,\"evictions\":%lu,\"entries\":%lu,",
+        cache.dir_hits, cache.dir_misses, hit_rate(cache.dir_hits, cache.dir_misses), cache.evictions, cache.num_entries
+    );
+    const EventRecordStats records = event_record_stats();
+    append_format(
+        &buffer,
+        "\"event_hits\":%lu,\"event_misses\":%lu,\"event_hit_rate\":%.4f,"
+        "\"event_batches\":%lu,\"event_batched\":%lu,\"event_shared\":%lu,\"event_mean_batch\":%.2f}}\n",
+        records.hits, records.misses, hit_rate(records.hits, records.misses),
+        records.batches, records.batched, records.shared, mean_batch(records.batched, records.batches)
+    );
+    buffer_append_char(&buffer, '\0');
+
+    free(stats);
+    return buffer.data;
+}
+
+int get_stats_text(const PathCaptures *captures, char **ret_file_data) {
+    (void) captures;
+
+    *ret_file_data = render_stats_text();
+    return 0;
+}
+
+int get_stats_text_size(const PathCaptures *captures, off_t *ret_size) {
+    (void) captures;
+
+    char *text = render_stats_text();
+    *ret_size = strlen(text);
+    free(text);
+    return 0;
+}
+
+int get_stats_json(const PathCaptures *captures, char **ret_file_data) {
+    (void) captures;
+
+    *ret_file_data = render_stats_json();
+    return 0;
+}
+
+int get_stats_json_size(const PathCaptures *captures, off_t *ret_size) {
+    (void) captures;
+
+    char *json = render_stats_json();
+    *ret_size = strlen(json);
+    free(json);
+    return 0;
+}
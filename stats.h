@@ -0,0 +1,35 @@
+#ifndef NOSTRFS_STATS
+#define NOSTRFS_STATS
+
+#include <stdint.h>
+
+#include "synthetic_file.h"
+
+typedef enum {
+    LOOKUP_OP,
+    GETATTR_OP,
+    READDIR_OP,
+    READDIRPLUS_OP,
+    OPEN_OP,
+    READ_OP,
+    NUM_STATS_OPS
+} StatsOp;
+
+/* The counters sqlite3_stmt_status keeps for one run of a statement. */
+typedef struct {
+    int full_scan_steps;
+    int sorts;
+    int vm_steps;
+} StatementCounters;
+
+uint64_t stats_clock_ns(void);
+void record_op(StatsOp op, FileTag tag, uint64_t start_ns);
+void register_query_stats(int query_index, const char *sql);
+void record_query(int query_index, uint64_t start_ns, const StatementCounters *counters);
+
+int get_stats_text(const PathCaptures *captures, char **ret_file_data);
+int get_stats_text_size(const PathCaptures *captures, off_t *ret_size);
+int get_stats_json(const PathCaptures *captures, char **ret_file_data);
+int get_stats_json_size(const PathCaptures *captures, off_t *ret_size);
+
+#endif
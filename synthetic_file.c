@@ -1,10 +1,11 @@
 
-#include <fuse.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 
 #include "db.h"
 #include "path.h"
+#include "stats.h"
 #include "synthetic_file.h"
 
 const char * const k_events_dir_name = "e";
@@ -12,12 +13,14 @@ const char * const k_tags_dir_name = "tags";
 const char * const k_content_filename = "content";
 const char * const k_kind_filename = "kind";
 const char * const k_pubkey_filename = "pubkey";
+const char * const k_event_json_filename = "event.json";
 
 static const char *k_event_dir_contents_filenames[] = {
     k_tags_dir_name,
     k_content_filename,
     k_kind_filename,
     k_pubkey_filename,
+    k_event_json_filename,
     NULL
 };
 
@@ -31,9 +34,25 @@ static const char *k_pubkey_dir_contents_filenames[] = {
     NULL
 };
 
+const char * const k_time_dir_name = "t";
+const char * const k_tag_index_dir_name = "tag";
+const char * const k_search_dir_name = "search";
+const char * const k_stats_filename = ".stats";
+const char * const k_stats_json_filename = ".stats.json";
+
 static const char *k_root_dir_contents_filenames[] = {
     k_events_dir_name,
     k_pubkeys_dir_name,
+    k_time_dir_name,
+    k_tag_index_dir_name,
+    k_search_dir_name,
+    k_stats_filename,
+    k_stats_json_filename,
+    NULL
+};
+
+/* Queries are looked up by name, never listed. */
+static const char *k_search_dir_contents_filenames[] = {
     NULL
 };
 
@@ -45,9 +64,10 @@ SyntheticFile k_null_file = NULL_FILE;
 
 const SyntheticFile *find_file(FileTag tag);
 
-int fill_pubkey_dir(Path path, void *buffer, fuse_fill_dir_t filler);
-int fill_event_dir(Path path, void *buffer, fuse_fill_dir_t filler);
-int fill_root_dir(Path path, void *buffer, fuse_fill_dir_t filler);
+int fill_pubkey_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_event_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_root_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
+int fill_search_root_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
 
 //@todo add creation time fields
 SyntheticFile files[] = {
@@ -56,26 +76,64 @@ SyntheticFile files[] = {
     {.tag = EVENTS_DIR_TAG, .parent_tags = TAGS(ROOT_DIR_TAG), .filename = k_events_dir_name, .fill = fill_events_dir, .type = DIRECTORY_FILE},
     {.tag = PUBKEYS_DIR_TAG, .parent_tags = TAGS(ROOT_DIR_TAG), .filename = k_pubkeys_dir_name, .fill = fill_pubkeys_dir, .type = DIRECTORY_FILE},
 
-    {.tag = EVENT_DIR_TAG, .parent_tags = TAGS(EVENTS_DIR_TAG, PUBKEY_EVENTS_DIR_TAG), .fill = fill_event_dir, .type = DIRECTORY_FILE},
+    {.tag = EVENT_DIR_TAG, .parent_tags = TAGS(EVENTS_DIR_TAG, PUBKEY_EVENTS_DIR_TAG, PUBKEY_KIND_DIR_TAG, TIME_HOUR_DIR_TAG, TAG_INDEX_VALUE_DIR_TAG, SEARCH_QUERY_DIR_TAG), .fill = fill_event_dir, .type = DIRECTORY_FILE},
 
-    {.tag = CONTENT_FILE_TAG, .parent_tags = TAGS(EVENT_DIR_TAG), .filename = k_content_filename, .fetch_data = get_event_content_data, .type = DATA_FILE},
-    {.tag = KIND_FILE_TAG, .parent_tags = TAGS(EVENT_DIR_TAG), .filename = k_kind_filename, .fetch_data = get_event_kind_data, .type = DATA_FILE},
-    {.tag = PUBKEY_FILE_TAG, .parent_tags = TAGS(EVENT_DIR_TAG), .filename = k_pubkey_filename, .fetch_data = get_event_pubkey_data, .type = DATA_FILE},
+    {.tag = CONTENT_FILE_TAG, .parent_tags = TAGS(EVENT_DIR_TAG), .filename = k_content_filename, .fetch_data = get_event_content_data, .fetch_size = get_event_content_size, .locate = locate_event_content, .type = DATA_FILE},
+    {.tag = KIND_FILE_TAG, .parent_tags = TAGS(EVENT_DIR_TAG), .filename = k_kind_filename, .fetch_data = get_event_kind_data, .fetch_size = get_event_kind_size, .type = DATA_FILE},
+    {.tag = PUBKEY_FILE_TAG, .parent_tags = TAGS(EVENT_DIR_TAG), .filename = k_pubkey_filename, .fetch_data = get_event_pubkey_data, .fetch_size = get_event_pubkey_size, .locate = locate_event_pubkey, .type = DATA_FILE},
+    {.tag = EVENT_JSON_FILE_TAG, .parent_tags = TAGS(EVENT_DIR_TAG), .filename = k_event_json_filename, .fetch_data = get_event_json_data, .fetch_size = get_event_json_size, .locate = locate_event_json, .type = DATA_FILE},
     {.tag = TAGS_DIR_TAG, .parent_tags = TAGS(EVENT_DIR_TAG), .filename = k_tags_dir_name, .fill = fill_tags_dir, .type = DIRECTORY_FILE},
 
     {.tag = TAG_KEY_DIR_TAG, .parent_tags = TAGS(TAGS_DIR_TAG), .fill = fill_tag_key_dir, .type = DIRECTORY_FILE},
 
     {.tag = TAG_DIR_TAG, .parent_tags = TAGS(TAG_KEY_DIR_TAG), .fill = fill_tag_values_dir, .type = DIRECTORY_FILE},
 
-    {.tag = TAG_VALUE_FILE_TAG, .parent_tags = TAGS(TAG_DIR_TAG), .fetch_data = get_tag_value, .type = DATA_FILE},
+    {.tag = TAG_VALUE_FILE_TAG, .parent_tags = TAGS(TAG_DIR_TAG), .fetch_data = get_tag_value, .fetch_size = get_tag_value_size, .locate = locate_tag_value, .type = DATA_FILE},
 
     {.tag = PUBKEY_DIR_TAG, .parent_tags = TAGS(PUBKEYS_DIR_TAG), .fill = fill_pubkey_dir, .type = DIRECTORY_FILE},
 
     {.tag = PUBKEY_EVENTS_DIR_TAG, .parent_tags = TAGS(PUBKEY_DIR_TAG), .filename = k_pubkeys_events_dir_name, .fill = fill_pubkey_events_dir, .type = DIRECTORY_FILE},
     {.tag = PUBKEY_KINDS_DIR_TAG, .parent_tags = TAGS(PUBKEY_DIR_TAG), .filename = k_pubkey_kinds_dir_name, .fill = fill_pubkey_kinds_dir, .type = DIRECTORY_FILE},
+    {.tag = PUBKEY_KIND_DIR_TAG, .parent_tags = TAGS(PUBKEY_KINDS_DIR_TAG), .fill = fill_pubkey_kind_dir, .type = DIRECTORY_FILE},
+
+    {.tag = TAG_INDEX_DIR_TAG, .parent_tags = TAGS(ROOT_DIR_TAG), .filename = k_tag_index_dir_name, .fill = fill_tag_index_dir, .type = DIRECTORY_FILE},
+    {.tag = TAG_INDEX_KEY_DIR_TAG, .parent_tags = TAGS(TAG_INDEX_DIR_TAG), .fill = fill_tag_index_key_dir, .type = DIRECTORY_FILE},
+    {.tag = TAG_INDEX_VALUE_DIR_TAG, .parent_tags = TAGS(TAG_INDEX_KEY_DIR_TAG), .fill = fill_tag_index_value_dir, .type = DIRECTORY_FILE},
+
+    {.tag = TIME_DIR_TAG, .parent_tags = TAGS(ROOT_DIR_TAG), .filename = k_time_dir_name, .fill = fill_time_dir, .type = DIRECTORY_FILE},
+    {.tag = TIME_YEAR_DIR_TAG, .parent_tags = TAGS(TIME_DIR_TAG), .fill = fill_time_year_dir, .type = DIRECTORY_FILE},
+    {.tag = TIME_MONTH_DIR_TAG, .parent_tags = TAGS(TIME_YEAR_DIR_TAG), .fill = fill_time_month_dir, .type = DIRECTORY_FILE},
+    {.tag = TIME_DAY_DIR_TAG, .parent_tags = TAGS(TIME_MONTH_DIR_TAG), .fill = fill_time_day_dir, .type = DIRECTORY_FILE},
+    {.tag = TIME_HOUR_DIR_TAG, .parent_tags = TAGS(TIME_DAY_DIR_TAG), .fill = fill_time_hour_dir, .type = DIRECTORY_FILE},
+
+    {.tag = SEARCH_DIR_TAG, .parent_tags = TAGS(ROOT_DIR_TAG), .filename = k_search_dir_name, .fill = fill_search_root_dir, .type = DIRECTORY_FILE},
+    {.tag = SEARCH_QUERY_DIR_TAG, .parent_tags = TAGS(SEARCH_DIR_TAG), .fill = fill_search_dir, .type = DIRECTORY_FILE},
+
+    {.tag = STATS_FILE_TAG, .parent_tags = TAGS(ROOT_DIR_TAG), .filename = k_stats_filename, .fetch_data = get_stats_text, .fetch_size = get_stats_text_size, .type = DATA_FILE, .is_dynamic = true},
+    {.tag = STATS_JSON_FILE_TAG, .parent_tags = TAGS(ROOT_DIR_TAG), .filename = k_stats_json_filename, .fetch_data = get_stats_json, .fetch_size = get_stats_json_size, .type = DATA_FILE, .is_dynamic = true},
     NULL_FILE
 };
 
+static void add_child(SyntheticFile *parent, const SyntheticFile *child) {
+    if (child->filename == NULL) {
+        assert(parent->wildcard_child == NULL);
+        parent->wildcard_child = child;
+    }
+    else {
+        parent->literal_children = realloc(
+            parent->literal_children,
+            sizeof(SyntheticFile *) * (parent->num_literal_children + 1)
+        );
+        assert(parent->literal_children != NULL);
+        parent->literal_children[parent->num_literal_children++] = child;
+    }
+}
+
+/*
+ * Links every file to its parents and compiles the inverse edges into a
+ * routing automaton: each file is a state whose transitions are its named
+ * children, with at most one wildcard child taken when no name matches.
+ */
 void link_files(void) {
     for (int i = 0; files[i].type != NULL_FILE_TYPE; i++) {
         int tags_count = 0;
@@ -91,6 +149,7 @@ void link_files(void) {
             for (int j = 0; j < tags_count; j++) {
                 parent_files[j] = find_file(parent_tags[j]);
                 assert(parent_files[j] != NULL);
+                add_child((SyntheticFile *) parent_files[j], &files[i]);
             }
             files[i].parents = parent_files;
         }
@@ -100,24 +159,6 @@ void link_files(void) {
     }
 }
 
-bool file_matches_path(const SyntheticFile *file, Path path) {
-    if (file->parents == NULL) {
-        if (is_root_path(path)) {
-            return true;
-        }
-        else {
-            return false;
-        }
-    }
-    bool has_expected_parent = false;
-    for (int i = 0; i < file->num_parents && has_expected_parent == false; i++) {
-        has_expected_parent = file_matches_path(file->parents[i], dirpath(path));
-    }
-    return 
-        has_expected_parent && 
-        ((file->filename == NULL) ? true : (strcmp(path_filename(path), file->filename) == 0));
-}
-
 const SyntheticFile *find_file(FileTag tag) {
     for (int i = 0; files[i].type != NULL_FILE_TYPE; i++) {
         if (files[i].tag == tag)
@@ -126,69 +167,117 @@ const SyntheticFile *find_file(FileTag tag) {
     return NULL;
 }
 
-SyntheticFile *path_to_file(Path path) {
-    for (int i = 0; files[i].type != NULL_FILE_TYPE; i++) {
-        if (file_matches_path(&files[i], path)) {
-            return &files[i];
-        }
+static const char **capture_slot(PathCaptures *captures, FileTag tag) {
+    switch (tag) {
+        case EVENT_DIR_TAG:
+            return &captures->event_id;
+        case PUBKEY_DIR_TAG:
+            return &captures->pubkey;
+        case PUBKEY_KIND_DIR_TAG:
+            return &captures->kind;
+        case TAG_KEY_DIR_TAG:
+            return &captures->tag_key;
+        case TAG_DIR_TAG:
+            return &captures->tag_index;
+        case TAG_VALUE_FILE_TAG:
+            return &captures->tag_value_index;
+        case TAG_INDEX_KEY_DIR_TAG:
+            return &captures->indexed_key;
+        case TAG_INDEX_VALUE_DIR_TAG:
+            return &captures->indexed_value;
+        case TIME_YEAR_DIR_TAG:
+            return &captures->year;
+        case TIME_MONTH_DIR_TAG:
+            return &captures->month;
+        case TIME_DAY_DIR_TAG:
+            return &captures->day;
+        case TIME_HOUR_DIR_TAG:
+            return &captures->hour;
+        case SEARCH_QUERY_DIR_TAG:
+            return &captures->search_query;
+        default:
+            return NULL;
     }
-    return &k_null_file;
 }
 
-char *filename_from_path(FileTag tag, Path path) {
-    const SyntheticFile *file = find_file(tag);
-    if (is_root_path(path)) {
-        return NULL;
+static const SyntheticFile *route_step(const SyntheticFile *state, const char *component, PathCaptures *captures) {
+    for (int i = 0; i < state->num_literal_children; i++) {
+        if (strcmp(state->literal_children[i]->filename, component) == 0)
+            return state->literal_children[i];
     }
-    if (file_matches_path(file, path)) {
-        return path_filename(path);
-    }
-    else {
-        return filename_from_path(tag, dirpath(path));
+
+    const SyntheticFile *wildcard = state->wildcard_child;
+    if (wildcard != NULL) {
+        const char **slot = capture_slot(captures, wildcard->tag);
+        if (slot != NULL)
+            *slot = component;
     }
+    return wildcard;
 }
 
-char *pubkey_from_path(Path path) {
-    return filename_from_path(PUBKEY_DIR_TAG, path);
-}
+SyntheticFile *route_path(Path path, PathCaptures *ret_captures) {
+    PathCaptures captures = {0};
+    const SyntheticFile *state = &files[0];
+    assert(state->tag == ROOT_DIR_TAG);
 
-char *event_id_from_path(Path path) {
-    return filename_from_path(EVENT_DIR_TAG, path);
-}
+    for (int i = 0; i < path.num_components && state != NULL; i++) {
+        state = route_step(state, path.path_components[i], &captures);
+    }
 
-char *tag_key_from_path(Path path) {
-    return filename_from_path(TAG_KEY_DIR_TAG, path);
+    if (ret_captures != NULL)
+        *ret_captures = captures;
+    return state == NULL ? &k_null_file : (SyntheticFile *) state;
 }
 
-char *tag_index_from_path(Path path) {
-    return filename_from_path(TAG_DIR_TAG, path);
+void advance_dir_cursor(DirCursor *cursor, const char *name) {
+    const size_t name_size = strlen(name) + 1;
+    if (name_size > cursor->last_key_capacity) {
+        cursor->last_key_capacity = name_size * 2;
+        cursor->last_key = realloc(cursor->last_key, cursor->last_key_capacity);
+        assert(cursor->last_key != NULL);
+    }
+    memcpy(cursor->last_key, name, name_size);
+    cursor->position++;
 }
 
-char *tag_value_index_from_path(Path path) {
-    return filename_from_path(TAG_VALUE_FILE_TAG, path);
+void reset_dir_cursor(DirCursor *cursor) {
+    free(cursor->last_key);
+    cursor->last_key = NULL;
+    cursor->last_key_capacity = 0;
+    cursor->position = 0;
+    cursor->done = false;
 }
 
-static int fill_constant_dir(const char *dirnames[], void *buffer, fuse_fill_dir_t filler) {
-    for (int i = 0; dirnames[i] != NULL; i++) {
-        filler(buffer, dirnames[i], NULL, 0);
+static int fill_constant_dir(const char *dirnames[], DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    for (int i = cursor->position; dirnames[i] != NULL; i++) {
+        if (filler(buffer, dirnames[i]) != 0)
+            return 0;
+        advance_dir_cursor(cursor, dirnames[i]);
     }
+    cursor->done = true;
     return 0;
 }
 
-int fill_pubkey_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    (void) path;
+int fill_pubkey_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    (void) captures;
+
+    return fill_constant_dir(k_pubkey_dir_contents_filenames, cursor, buffer, filler);
+}
+
+int fill_event_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    (void) captures;
 
-    return fill_constant_dir(k_pubkey_dir_contents_filenames, buffer, filler);
+    return fill_constant_dir(k_event_dir_contents_filenames, cursor, buffer, filler);
 }
 
-int fill_event_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    (void) path;
+int fill_root_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    (void) captures;
 
-    return fill_constant_dir(k_event_dir_contents_filenames, buffer, filler);
+    return fill_constant_dir(k_root_dir_contents_filenames, cursor, buffer, filler);
 }
 
-int fill_root_dir(Path path, void *buffer, fuse_fill_dir_t filler) {
-    (void) path;
+int fill_search_root_dir(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler) {
+    (void) captures;
 
-    return fill_constant_dir(k_root_dir_contents_filenames, buffer, filler);
+    return fill_constant_dir(k_search_dir_contents_filenames, cursor, buffer, filler);
 }
@@ -1,15 +1,70 @@
 #ifndef NOSTRFS_SYNTHETIC_FILE
 #define NOSTRFS_SYNTHETIC_FILE
 
-#include <fuse.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
 
 #include "path.h"
 
 #define MAX_PARENT_TAGS 8
 
-typedef int (* DirFiller)(Path path, void *buffer, fuse_fill_dir_t filler);
+/*
+ * Identifiers captured from the wildcard components of a path while it is
+ * routed, e.g. the event id in /e/<id>/content.  They point into the Path's
+ * components and are only valid while the Path is.
+ */
+typedef struct {
+    const char *event_id;
+    const char *pubkey;
+    const char *kind;
+    const char *tag_key;
+    const char *tag_index;
+    const char *tag_value_index;
+    const char *indexed_key;
+    const char *indexed_value;
+    const char *year;
+    const char *month;
+    const char *day;
+    const char *hour;
+    const char *search_query;
+} PathCaptures;
+
+/*
+ * Adds one directory entry to buffer.  Returns nonzero once the buffer is
+ * full, in which case the entry was not added.
+ */
+typedef int (* DirEntryFiller)(void *buffer, const char *name);
+
+/*
+ * Where a directory listing left off between readdir calls.  SQL-backed
+ * fillers resume after last_key, constant ones after the first position
+ * entries; done is set once the listing has been exhausted.
+ */
+typedef struct {
+    char *last_key;
+    size_t last_key_capacity;
+    long position;
+    bool done;
+} DirCursor;
+
+/*
+ * Where a data file's bytes are stored: a text column of one row.  Files
+ * with a location are read in slices on demand rather than copied whole.
+ */
+typedef struct {
+    const char *table;
+    const char *column;
+    int64_t rowid;
+    off_t size;
+} DataLocation;
+
+typedef int (* DirFiller)(const PathCaptures *captures, DirCursor *cursor, void *buffer, DirEntryFiller filler);
 typedef bool (* FileDetector)(Path path);
-typedef int (* FileDataFetcher)(Path path, char **out_data);
+typedef int (* FileDataFetcher)(const PathCaptures *captures, char **out_data);
+typedef int (* FileSizeFetcher)(const PathCaptures *captures, off_t *out_size);
+typedef int (* DataLocator)(const PathCaptures *captures, DataLocation *out_location);
 typedef time_t (* CreationTime)(Path path);
 
 typedef enum {
@@ -26,6 +81,7 @@ typedef enum {
     EVENT_DIR_TAG,
     EVENTS_DIR_TAG,
     PUBKEY_FILE_TAG,
+    EVENT_JSON_FILE_TAG,
     ROOT_DIR_TAG,
     TAGS_DIR_TAG,
     TAG_KEY_DIR_TAG,
@@ -33,7 +89,21 @@ typedef enum {
     PUBKEYS_DIR_TAG,
     PUBKEY_DIR_TAG,
     PUBKEY_EVENTS_DIR_TAG,
-    PUBKEY_KINDS_DIR_TAG
+    PUBKEY_KINDS_DIR_TAG,
+    PUBKEY_KIND_DIR_TAG,
+    TAG_INDEX_DIR_TAG,
+    TAG_INDEX_KEY_DIR_TAG,
+    TAG_INDEX_VALUE_DIR_TAG,
+    TIME_DIR_TAG,
+    TIME_YEAR_DIR_TAG,
+    TIME_MONTH_DIR_TAG,
+    TIME_DAY_DIR_TAG,
+    TIME_HOUR_DIR_TAG,
+    SEARCH_DIR_TAG,
+    SEARCH_QUERY_DIR_TAG,
+    STATS_FILE_TAG,
+    STATS_JSON_FILE_TAG,
+    NUM_FILE_TAGS
 } FileTag;
 
 typedef struct SyntheticFile SyntheticFile;
@@ -43,19 +113,24 @@ typedef struct SyntheticFile {
     const FileTag tag;
     const SyntheticFile **parents;
     int num_parents;
+    const SyntheticFile **literal_children;
+    int num_literal_children;
+    const SyntheticFile *wildcard_child;
     const FileType type;
     const FileDataFetcher fetch_data;
+    const FileSizeFetcher fetch_size;
+    const DataLocator locate;
     const DirFiller fill;
     const FileTag parent_tags[MAX_PARENT_TAGS];
+    /* The data changes between reads, so neither nostrfs nor the kernel may cache it. */
+    const bool is_dynamic;
 } SyntheticFile;
 
 void link_files(void);
 
-SyntheticFile *path_to_file(Path path);
-char *event_id_from_path(Path path);
-char *tag_key_from_path(Path path);
-char *tag_index_from_path(Path path);
-char *pubkey_from_path(Path path);
-char *tag_value_index_from_path(Path path);
+SyntheticFile *route_path(Path path, PathCaptures *ret_captures);
+
+void advance_dir_cursor(DirCursor *cursor, const char *name);
+void reset_dir_cursor(DirCursor *cursor);
 
 #endif
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cache.h"
+#include "db.h"
+#include "known_ids.h"
+#include "node.h"
+#include "watch.h"
+
+/*
+ * Live updates: a background thread notices commits by other connections
+ * through PRAGMA data_version, reads the events added since the last rowid it
+ * saw, and invalidates only the directories those events appear in, both in
+ * our cache and in the kernel's.  Events are never modified once written, so
+ * nothing below a directory needs invalidating.
+ */
+
+static const int k_max_events_per_poll = 1024;
+
+typedef struct {
+    int num_paths;
+    int capacity;
+    char **paths;
+} PathBatch;
+
+static InodeInvalidator invalidate_inode_hook;
+static void *invalidate_inode_arg;
+static int64_t watermark;
+static int64_t last_version;
+static bool have_version;
+
+static pthread_t watch_thread_id;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_wakeup = PTHREAD_COND_INITIALIZER;
+static unsigned int watch_interval_ms;
+static bool watching;
+static bool stopping;
+
+void initialize_watch(InodeInvalidator invalidate_inode, void *arg) {
+    invalidate_inode_hook = invalidate_inode;
+    invalidate_inode_arg = arg;
+    watermark = latest_event_rowid();
+    have_version = false;
+}
+
+static void invalidate_path(const char *raw_path) {
+    cache_invalidate(raw_path);
+    if (invalidate_inode_hook == NULL)
+        return;
+    const uint64_t ino = tracked_node_ino(raw_path);
+    if (ino != 0)
+        invalidate_inode_hook(ino, invalidate_inode_arg);
+}
+
+static void add_path(PathBatch *batch, const char *raw_path) {
+    if (batch->num_paths == batch->capacity) {
+        batch->capacity = batch->capacity == 0 ? 64 : batch->capacity * 2;
+        batch->paths = realloc(batch->paths, batch->capacity * sizeof(char *));
+        assert(batch->paths != NULL);
+    }
+    batch->paths[batch->num_paths] = strdup(raw_path);
+    assert(batch->paths[batch->num_paths] != NULL);
+    batch->num_paths++;
+}
+
+static void add_tag_dirs(const char *key, const char *value, void *batch_ptr) {
+    PathBatch *batch = batch_ptr;
+
+    char raw_path[512];
+    const int path_length = snprintf(raw_path, sizeof(raw_path), "/tag/%s/%s", key, value);
+    if (path_length < (int) sizeof(raw_path) && strchr(value, '/') == NULL) {
+        add_path(batch, raw_path);
+        *strrchr(raw_path, '/') = '\0';
+        add_path(batch, raw_path);
+    }
+}
+
+/*
+ * Makes the new event known and collects every directory that lists it,
+ * below /e, /p, /t and /tag.
+ */
+static void add_event_dirs(const NewEvent *event, void *batch_ptr) {
+    static const char *k_pubkey_dirs[] = {"", "/e", "/kind", NULL};
+    PathBatch *batch = batch_ptr;
+
+    add_known_event(event->id, event->pubkey);
+
+    char raw_path[256];
+    for (int i = 0; k_pubkey_dirs[i] != NULL; i++) {
+        const int path_length = snprintf(raw_path, sizeof(raw_path), "/p/%s%s", event->pubkey, k_pubkey_dirs[i]);
+        if (path_length < (int) sizeof(raw_path))
+            add_path(batch, raw_path);
+    }
+    const int path_length = snprintf(raw_path, sizeof(raw_path), "/p/%s/kind/%lld", event->pubkey, (long long) event->kind);
+    if (path_length < (int) sizeof(raw_path))
+        add_path(batch, raw_path);
+
+    read_indexed_tags(event->id, add_tag_dirs, batch);
+
+    /* The hour bucket and each enclosing bucket up to and including /t/YYYY. */
+    time_bucket_path(event->created_at, raw_path, sizeof(raw_path));
+    char *separator;
+    do {
+        add_path(batch, raw_path);
+        separator = strrchr(raw_path, '/');
+        *separator = '\0';
+    } while (separator != raw_path + 2);
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Checks for events committed since the last poll and invalidates the
+ * directories listing them.  Any commit also drops the cached event
+ * records, since it may have rewritten rows.  Returns the number of new
+ * events.  Must always be called from the same thread, since data_version
+ * is per connection.
+ */
+int poll_new_events(void) {
+    const int64_t version = database_version();
+    if (have_version && version == last_version)
+        return 0;
+    last_version = version;
+    have_version = true;
+    forget_event_records();
+
+    PathBatch batch = {0};
+    int num_new_events = 0;
+    int num_read;
+    do {
+        batch.num_paths = 0;
+        num_read = read_new_events(&watermark, k_max_events_per_poll, add_event_dirs, &batch);
+        num_new_events += num_read;
+
+        if (batch.num_paths > 0)
+            qsort(batch.paths, batch.num_paths, sizeof(char *), compare_paths);
+        for (int i = 0; i < batch.num_paths; i++) {
+            if (i == 0 || strcmp(batch.paths[i], batch.paths[i - 1]) != 0)
+                invalidate_path(batch.paths[i]);
+        }
+        for (int i = 0; i < batch.num_paths; i++) {
+            free(batch.paths[i]);
+        }
+    } while (num_read == k_max_events_per_poll);
+    free(batch.paths);
+
+    if (num_new_events > 0) {
+        invalidate_path("/e");
+        invalidate_path("/p");
+        invalidate_path("/t");
+        invalidate_path("/tag");
+    }
+    return num_new_events;
+}
+
+static void *watch_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&watch_lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += watch_interval_ms / 1000;
+        deadline.tv_nsec += (long) (watch_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&watch_wakeup, &watch_lock, &deadline);
+        if (stopping)
+            break;
+
+        pthread_mutex_unlock(&watch_lock);
+        poll_new_events();
+        pthread_mutex_lock(&watch_lock);
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return NULL;
+}
+
+/* New events become visible within about interval_ms of being committed. */
+void start_watching(unsigned int interval_ms) {
+    assert(!watching);
+    watch_interval_ms = interval_ms;
+    stopping = false;
+    const bool thread_created = pthread_create(&watch_thread_id, NULL, watch_thread, NULL) == 0;
+    assert(thread_created);
+    watching = true;
+}
+
+void stop_watching(void) {
+    if (!watching)
+        return;
+    pthread_mutex_lock(&watch_lock);
+    stopping = true;
+    pthread_cond_signal(&watch_wakeup);
+    pthread_mutex_unlock(&watch_lock);
+    pthread_join(watch_thread_id, NULL);
+    watching = false;
+}
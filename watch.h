@@ -0,0 +1,14 @@
+#ifndef NOSTRFS_WATCH
+#define NOSTRFS_WATCH
+
+#include <stdint.h>
+
+/* Tells the kernel to drop what it has cached for an inode. */
+typedef void (* InodeInvalidator)(uint64_t ino, void *arg);
+
+void initialize_watch(InodeInvalidator invalidate_inode, void *arg);
+int poll_new_events(void);
+void start_watching(unsigned int interval_ms);
+void stop_watching(void);
+
+#endif